@@ -33,16 +33,23 @@
 #include "libdex/DexFile.h"
 
 #include "libdex/CmdUtils.h"
+#include "libdex/DexApi.h"
 #include "libdex/DexCatch.h"
 #include "libdex/DexClass.h"
+#include "libdex/DexCodeStats.h"
 #include "libdex/DexDebugInfo.h"
 #include "libdex/DexOpcodes.h"
 #include "libdex/DexProto.h"
+#include "libdex/DexRegisterMap.h"
+#include "libdex/DexSizeStats.h"
 #include "libdex/InstrUtils.h"
 #include "libdex/SysUtil.h"
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <pthread.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
@@ -50,12 +57,21 @@
 #include <errno.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <time.h>
+#include <sys/stat.h>
 
 static const char* gProgName = "dexdump";
 
 enum OutputFormat {
     OUTPUT_PLAIN = 0,               /* default */
     OUTPUT_XML,                     /* fancy */
+    OUTPUT_JSONL,                   /* one JSON record per line */
+};
+
+enum StatsFormat {
+    STATS_NONE = 0,                 /* default; normal dump */
+    STATS_CSV,
+    STATS_JSON,
 };
 
 /* command-line options */
@@ -70,32 +86,276 @@ struct Options {
     const char* tempFileName;
     bool exportsOnly;
     bool verbose;
+    StatsFormat statsFormat;
+    bool sizeStats;
+    bool sortClasses;               /* -s: by package, then name */
+    bool apiDiff;                   /* -a: compare two files' APIs */
+    int numThreads;
+    const char** classFilters;      /* -C descriptors or prefixes */
+    int numClassFilters;
+    const char* methodFilter;       /* -M method name */
+    const char* batchManifest;      /* -B file list, "-" for stdin */
+    const char* batchOutDir;        /* -o directory for batch output */
+    int numBatchThreads;
 };
 
 struct Options gOptions;
 
-/* basic info about a field or method */
-struct FieldMethodInfo {
-    const char* classDescriptor;
-    const char* name;
-    const char* signature;
-};
+/* instruction statistics, accumulated across all files */
+DexCodeStats gCodeStats;
+static pthread_mutex_t gCodeStatsLock = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * All output is formatted into an OutputBuffer.  The main thread's buffer
+ * is written to stdout whenever it fills past "flushAt"; the buffers used
+ * by worker threads (see dumpClassesParallel()) just grow, and are copied
+ * to stdout by the main thread.
+ *
+ * Formatting through printf() dominates the run time of a full
+ * disassembly, so the hot paths use the outHex() / outDec() helpers
+ * below instead.
+ */
+struct OutputBuffer {
+    char*   data;
+    size_t  len;
+    size_t  cap;
+
+    FILE*   fp;             /* where to flush to, or NULL to just grow */
+    size_t  flushAt;
 
-/* basic info about a prototype */
-struct ProtoInfo {
-    char* parameterTypes;  // dynamically allocated with malloc
-    const char* returnType;
+    /* set for the -j slots that dumpClassesParallel() formats into */
+    bool    parallelSlot;
+
+    /*
+     * XML package of the class, and the offset in "data" where it was
+     * determined.  The package change (if any) can only be decided once
+     * the previous class has been written, so dumpClass() leaves it to
+     * the writer.
+     */
+    char*   package;
+    size_t  packagePos;
 };
 
+/* size of the stdout buffer */
+static const size_t kStdoutBufferSize = 256 * 1024;
+
+static OutputBuffer gStdoutBuf;
+
+/* output target for this thread */
+static thread_local OutputBuffer* gOutBuf = &gStdoutBuf;
+
+static const char kHexDigits[] = "0123456789abcdef";
+
+/*
+ * Write out everything in a buffer that has a file.
+ */
+static void outBufFlush(OutputBuffer* pBuf)
+{
+    if (pBuf->fp != NULL && pBuf->len != 0) {
+        fwrite(pBuf->data, 1, pBuf->len, pBuf->fp);
+        pBuf->len = 0;
+    }
+}
+
+/*
+ * Make sure there's room for "len" more bytes, flushing or growing the
+ * buffer as needed.
+ */
+static void outBufMakeRoom(OutputBuffer* pBuf, size_t len)
+{
+    if (pBuf->cap - pBuf->len >= len)
+        return;
+
+    outBufFlush(pBuf);
+    if (pBuf->cap - pBuf->len >= len)
+        return;
+
+    size_t newCap = pBuf->cap * 2;
+    if (newCap < pBuf->len + len)
+        newCap = pBuf->len + len;
+    if (newCap < 256)
+        newCap = 256;
+
+    char* newData = (char*) realloc(pBuf->data, newCap);
+    if (newData == NULL) {
+        fprintf(stderr, "ERROR: out of memory formatting output\n");
+        exit(1);
+    }
+    pBuf->data = newData;
+    pBuf->cap = newCap;
+}
+
+/*
+ * Get a pointer to room for at least "len" bytes at the end of the
+ * current output buffer.  Finish with outCommit().
+ */
+static inline char* outReserve(size_t len)
+{
+    OutputBuffer* pBuf = gOutBuf;
+
+    if (pBuf->cap - pBuf->len < len)
+        outBufMakeRoom(pBuf, len);
+    return pBuf->data + pBuf->len;
+}
+
+/*
+ * Mark everything up to "end" as written.
+ */
+static inline void outCommit(char* end)
+{
+    OutputBuffer* pBuf = gOutBuf;
+
+    pBuf->len = end - pBuf->data;
+    if (pBuf->len >= pBuf->flushAt)
+        outBufFlush(pBuf);
+}
+
+/*
+ * Set up the stdout buffer.  If stdout is a terminal, flush after every
+ * write so output still interleaves sensibly with stderr.
+ */
+static void outInit(void)
+{
+    gStdoutBuf.data = (char*) malloc(kStdoutBufferSize);
+    gStdoutBuf.cap = (gStdoutBuf.data != NULL) ? kStdoutBufferSize : 0;
+    gStdoutBuf.fp = stdout;
+    gStdoutBuf.flushAt = isatty(fileno(stdout)) ? 1 : kStdoutBufferSize / 2;
+}
+
+/*
+ * Write "len" bytes to the current output target.
+ */
+static void outWrite(const char* data, size_t len)
+{
+    OutputBuffer* pBuf = gOutBuf;
+
+    if (pBuf->fp != NULL && len >= pBuf->cap / 2) {
+        /* big block; skip the copy */
+        outBufFlush(pBuf);
+        fwrite(data, 1, len, pBuf->fp);
+        return;
+    }
+
+    char* cp = outReserve(len);
+    memcpy(cp, data, len);
+    outCommit(cp + len);
+}
+
+/*
+ * Print to the current output target.
+ */
+static void outPrintf(const char* format, ...)
+    __attribute__((format(printf, 1, 2)));
+static void outPrintf(const char* format, ...)
+{
+    OutputBuffer* pBuf = gOutBuf;
+    va_list args;
+    size_t room;
+    int len;
+
+    /* most lines fit in this much; if not, try again with the real size */
+    room = 256;
+    outReserve(room);
+
+    va_start(args, format);
+    len = vsnprintf(pBuf->data + pBuf->len, pBuf->cap - pBuf->len, format,
+            args);
+    va_end(args);
+    if (len < 0) {
+        fprintf(stderr, "ERROR: output formatting failed\n");
+        return;
+    }
+
+    if ((size_t) len >= pBuf->cap - pBuf->len) {
+        outReserve(len + 1);
+        va_start(args, format);
+        vsnprintf(pBuf->data + pBuf->len, pBuf->cap - pBuf->len, format,
+            args);
+        va_end(args);
+    }
+
+    outCommit(pBuf->data + pBuf->len + len);
+}
+
+/*
+ * Write a string to the current output target.
+ */
+static inline void outPuts(const char* str)
+{
+    outWrite(str, strlen(str));
+}
+
+/*
+ * Write a character to the current output target.
+ */
+static inline void outPutc(char c)
+{
+    char* cp = outReserve(1);
+    *cp++ = c;
+    outCommit(cp);
+}
+
+/*
+ * Write a value in lower-case hex, zero-padded to at least "minDigits"
+ * digits (like "%0*x").
+ */
+static void outHex(u8 value, int minDigits)
+{
+    char tmp[16];
+    int count = 0;
+
+    do {
+        tmp[count++] = kHexDigits[value & 0x0f];
+        value >>= 4;
+    } while (value != 0);
+    while (count < minDigits)
+        tmp[count++] = '0';
+
+    char* cp = outReserve(count);
+    while (count > 0)
+        *cp++ = tmp[--count];
+    outCommit(cp);
+}
+
+/*
+ * Write a value in decimal (like "%d").
+ */
+static void outDec(s8 value)
+{
+    char tmp[20];
+    int count = 0;
+    u8 mag = (value < 0) ? -(u8) value : (u8) value;
+
+    do {
+        tmp[count++] = '0' + (mag % 10);
+        mag /= 10;
+    } while (mag != 0);
+
+    char* cp = outReserve(count + 1);
+    if (value < 0)
+        *cp++ = '-';
+    while (count > 0)
+        *cp++ = tmp[--count];
+    outCommit(cp);
+}
+
 /*
- * Get 2 little-endian bytes.
+ * Write a register name, " v<reg>", preceded by "prefix".
  */
-static inline u2 get2LE(unsigned char const* pSrc)
+static inline void outReg(const char* prefix, u4 reg)
 {
-    return pSrc[0] | (pSrc[1] << 8);
+    outPuts(prefix);
+    outDec((s4) reg);
 }
 
+/* basic info about a field or method */
+struct FieldMethodInfo {
+    const char* classDescriptor;
+    const char* name;
+    const char* signature;
+};
+
+
 /*
  * Get 4 little-endian bytes.
  */
@@ -209,6 +469,151 @@ static char* descriptorClassToDot(const char* str)
     return newStr;
 }
 
+/*
+ * Block of memory for DottedNames strings.
+ */
+struct NameArenaChunk {
+    NameArenaChunk* next;
+    size_t          used;
+    size_t          size;
+    char            data[1];
+};
+
+/* usual size of the data area of a NameArenaChunk */
+static const size_t kNameArenaChunkSize = 64 * 1024 - sizeof(NameArenaChunk);
+
+/*
+ * Dotted forms of the type descriptors in the file being dumped, filled
+ * in the first time each type_idx is asked for.  The strings live in an
+ * arena that's freed along with the table.
+ *
+ * Each thread works on the table that gDottedNames points at.  With -j
+ * the threads formatting the classes of a file share its table.  Entries
+ * are published with release stores after the string is complete, so a
+ * non-NULL entry can be used without taking the lock.
+ */
+struct DottedNames {
+    const DexFile*  pDexFile;
+    const char**    typeNames;      /* descriptorToDot() forms */
+    const char**    classNames;     /* descriptorClassToDot() forms */
+    NameArenaChunk* pArena;
+    pthread_mutex_t lock;
+};
+
+static thread_local DottedNames* gDottedNames;
+
+/*
+ * Set up a dotted-name table for a file, and make it this thread's
+ * current table.
+ */
+static bool dottedNamesInit(DottedNames* pNames, const DexFile* pDexFile)
+{
+    u4 count = pDexFile->pHeader->typeIdsSize;
+
+    gDottedNames = pNames;
+    gDottedNames->pDexFile = pDexFile;
+    gDottedNames->typeNames = (const char**) calloc(count, sizeof(char*));
+    gDottedNames->classNames = (const char**) calloc(count, sizeof(char*));
+    gDottedNames->pArena = NULL;
+    pthread_mutex_init(&gDottedNames->lock, NULL);
+
+    return (gDottedNames->typeNames != NULL && gDottedNames->classNames != NULL)
+        || count == 0;
+}
+
+/*
+ * Free this thread's dotted-name table and its strings.
+ */
+static void dottedNamesFree(void)
+{
+    NameArenaChunk* pChunk = gDottedNames->pArena;
+
+    while (pChunk != NULL) {
+        NameArenaChunk* pNext = pChunk->next;
+        free(pChunk);
+        pChunk = pNext;
+    }
+
+    free(gDottedNames->typeNames);
+    free(gDottedNames->classNames);
+    pthread_mutex_destroy(&gDottedNames->lock);
+    gDottedNames = NULL;
+}
+
+/*
+ * Copy a string into the arena.  Call with the lock held.
+ */
+static const char* dottedNamesSave(const char* str)
+{
+    NameArenaChunk* pChunk = gDottedNames->pArena;
+    size_t len = strlen(str) + 1;
+
+    if (pChunk == NULL || pChunk->size - pChunk->used < len) {
+        size_t size = (len > kNameArenaChunkSize) ? len : kNameArenaChunkSize;
+
+        pChunk = (NameArenaChunk*) malloc(offsetof(NameArenaChunk, data) + size);
+        if (pChunk == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(1);
+        }
+        pChunk->next = gDottedNames->pArena;
+        pChunk->used = 0;
+        pChunk->size = size;
+        gDottedNames->pArena = pChunk;
+    }
+
+    char* result = pChunk->data + pChunk->used;
+    memcpy(result, str, len);
+    pChunk->used += len;
+    return result;
+}
+
+/*
+ * Look up (or compute and remember) one entry of a dotted-name table.
+ */
+static const char* dottedNamesGet(const char** table, u4 typeIdx,
+    char* (*convert)(const char*))
+{
+    const char* result = __atomic_load_n(&table[typeIdx], __ATOMIC_ACQUIRE);
+    if (result != NULL)
+        return result;
+
+    pthread_mutex_lock(&gDottedNames->lock);
+    result = table[typeIdx];
+    if (result == NULL) {
+        char* tmp = (*convert)(
+            dexStringByTypeIdx(gDottedNames->pDexFile, typeIdx));
+        result = dottedNamesSave(tmp);
+        free(tmp);
+        __atomic_store_n(&table[typeIdx], result, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&gDottedNames->lock);
+
+    return result;
+}
+
+/*
+ * Get the dotted form of a type, e.g. "java.lang.String[]" (see
+ * descriptorToDot()).  The result lives until the file is closed.
+ */
+static const char* dottedTypeName(const DexFile* pDexFile, u4 typeIdx)
+{
+    assert(pDexFile == gDottedNames->pDexFile);
+    return dottedNamesGet(gDottedNames->typeNames, typeIdx, descriptorToDot);
+}
+
+/*
+ * Get the dotted class-name-only form of a class type, e.g. "Map.Entry"
+ * (see descriptorClassToDot()).  The result lives until the file is
+ * closed.
+ */
+static const char* dottedClassName(const DexFile* pDexFile, u4 typeIdx)
+{
+    assert(pDexFile == gDottedNames->pDexFile);
+    return dottedNamesGet(gDottedNames->classNames, typeIdx,
+        descriptorClassToDot);
+}
+
 /*
  * Returns a quoted string representing the boolean value.
  */
@@ -232,6 +637,124 @@ static const char* quotedVisibility(u4 accessFlags)
         return "\"package\"";
 }
 
+/*
+ * Write the characters of "str" as the body of a JSON string, escaping
+ * quotes, backslashes and control characters.  DEX strings are MUTF-8,
+ * which differs from UTF-8 in two ways: U+0000 is encoded as C0 80, and
+ * characters outside the BMP as a pair of 3-byte encoded surrogates.
+ * Neither is valid UTF-8, so both are written as \u escapes (a pair of
+ * them for a surrogate pair); everything else is passed through as-is.
+ */
+static void outJsonChars(const char* str)
+{
+    const char* start = str;
+
+    while (true) {
+        const u1* bytes = (const u1*) str;
+        u1 c = bytes[0];
+        u4 unit;
+        int seqLen = 1;
+
+        if (c == 0xc0 && bytes[1] == 0x80) {
+            unit = 0;
+            seqLen = 2;
+        } else if (c == 0xed && (bytes[1] & 0xe0) == 0xa0 &&
+                (bytes[2] & 0xc0) == 0x80) {
+            unit = 0xd000 | ((bytes[1] & 0x3f) << 6) | (bytes[2] & 0x3f);
+            seqLen = 3;
+        } else if (c >= 0x20 && c != '"' && c != '\\') {
+            str++;
+            continue;
+        } else {
+            unit = c;
+        }
+
+        if (str != start)
+            outWrite(start, str - start);
+        if (c == '\0')
+            break;
+        str += seqLen;
+        start = str;
+
+        char* cp = outReserve(6);
+        *cp++ = '\\';
+        switch (unit) {
+        case '"':   *cp++ = '"';    break;
+        case '\\':  *cp++ = '\\';   break;
+        case '\n':  *cp++ = 'n';    break;
+        case '\r':  *cp++ = 'r';    break;
+        case '\t':  *cp++ = 't';    break;
+        default:
+            *cp++ = 'u';
+            *cp++ = kHexDigits[unit >> 12];
+            *cp++ = kHexDigits[(unit >> 8) & 0x0f];
+            *cp++ = kHexDigits[(unit >> 4) & 0x0f];
+            *cp++ = kHexDigits[unit & 0x0f];
+            break;
+        }
+        outCommit(cp);
+    }
+}
+
+/*
+ * Start a JSON-lines record of the given kind.  Members are added with
+ * the outJson*() helpers below, each preceded by a comma, and the
+ * record is ended with outJsonEnd().
+ */
+static inline void outJsonStart(const char* kind)
+{
+    outPuts("{\"record\":\"");
+    outPuts(kind);
+    outPutc('"');
+}
+
+static inline void outJsonEnd(void)
+{
+    outWrite("}\n", 2);
+}
+
+/*
+ * Write the ",\"key\":" that starts a member.
+ */
+static inline void outJsonKey(const char* key)
+{
+    outWrite(",\"", 2);
+    outPuts(key);
+    outWrite("\":", 2);
+}
+
+static void outJsonInt(const char* key, s8 value)
+{
+    outJsonKey(key);
+    outDec(value);
+}
+
+static void outJsonBool(const char* key, bool value)
+{
+    outJsonKey(key);
+    outPuts(value ? "true" : "false");
+}
+
+static void outJsonStr(const char* key, const char* str)
+{
+    outJsonKey(key);
+    outPutc('"');
+    outJsonChars(str);
+    outPutc('"');
+}
+
+/*
+ * Write an index member, or null if it's kDexNoIndex.
+ */
+static void outJsonIndex(const char* key, u4 index)
+{
+    outJsonKey(key);
+    if (index == kDexNoIndex)
+        outPuts("null");
+    else
+        outDec(index);
+}
+
 /*
  * Count the number of '1' bits in a word.
  */
@@ -406,59 +929,59 @@ void dumpFileHeader(const DexFile* pDexFile)
     assert(sizeof(pHeader->magic) == sizeof(pOptHeader->magic));
 
     if (pOptHeader != NULL) {
-        printf("Optimized DEX file header:\n");
+        outPrintf("Optimized DEX file header:\n");
 
         asciify(sanitized, pOptHeader->magic, sizeof(pOptHeader->magic));
-        printf("magic               : '%s'\n", sanitized);
-        printf("dex_offset          : %d (0x%06x)\n",
+        outPrintf("magic               : '%s'\n", sanitized);
+        outPrintf("dex_offset          : %d (0x%06x)\n",
             pOptHeader->dexOffset, pOptHeader->dexOffset);
-        printf("dex_length          : %d\n", pOptHeader->dexLength);
-        printf("deps_offset         : %d (0x%06x)\n",
+        outPrintf("dex_length          : %d\n", pOptHeader->dexLength);
+        outPrintf("deps_offset         : %d (0x%06x)\n",
             pOptHeader->depsOffset, pOptHeader->depsOffset);
-        printf("deps_length         : %d\n", pOptHeader->depsLength);
-        printf("opt_offset          : %d (0x%06x)\n",
+        outPrintf("deps_length         : %d\n", pOptHeader->depsLength);
+        outPrintf("opt_offset          : %d (0x%06x)\n",
             pOptHeader->optOffset, pOptHeader->optOffset);
-        printf("opt_length          : %d\n", pOptHeader->optLength);
-        printf("flags               : %08x\n", pOptHeader->flags);
-        printf("checksum            : %08x\n", pOptHeader->checksum);
-        printf("\n");
+        outPrintf("opt_length          : %d\n", pOptHeader->optLength);
+        outPrintf("flags               : %08x\n", pOptHeader->flags);
+        outPrintf("checksum            : %08x\n", pOptHeader->checksum);
+        outPrintf("\n");
     }
 
-    printf("DEX file header:\n");
+    outPrintf("DEX file header:\n");
     asciify(sanitized, pHeader->magic, sizeof(pHeader->magic));
-    printf("magic               : '%s'\n", sanitized);
-    printf("checksum            : %08x\n", pHeader->checksum);
-    printf("signature           : %02x%02x...%02x%02x\n",
+    outPrintf("magic               : '%s'\n", sanitized);
+    outPrintf("checksum            : %08x\n", pHeader->checksum);
+    outPrintf("signature           : %02x%02x...%02x%02x\n",
         pHeader->signature[0], pHeader->signature[1],
         pHeader->signature[kSHA1DigestLen-2],
         pHeader->signature[kSHA1DigestLen-1]);
-    printf("file_size           : %d\n", pHeader->fileSize);
-    printf("header_size         : %d\n", pHeader->headerSize);
-    printf("link_size           : %d\n", pHeader->linkSize);
-    printf("link_off            : %d (0x%06x)\n",
+    outPrintf("file_size           : %d\n", pHeader->fileSize);
+    outPrintf("header_size         : %d\n", pHeader->headerSize);
+    outPrintf("link_size           : %d\n", pHeader->linkSize);
+    outPrintf("link_off            : %d (0x%06x)\n",
         pHeader->linkOff, pHeader->linkOff);
-    printf("string_ids_size     : %d\n", pHeader->stringIdsSize);
-    printf("string_ids_off      : %d (0x%06x)\n",
+    outPrintf("string_ids_size     : %d\n", pHeader->stringIdsSize);
+    outPrintf("string_ids_off      : %d (0x%06x)\n",
         pHeader->stringIdsOff, pHeader->stringIdsOff);
-    printf("type_ids_size       : %d\n", pHeader->typeIdsSize);
-    printf("type_ids_off        : %d (0x%06x)\n",
+    outPrintf("type_ids_size       : %d\n", pHeader->typeIdsSize);
+    outPrintf("type_ids_off        : %d (0x%06x)\n",
         pHeader->typeIdsOff, pHeader->typeIdsOff);
-    printf("proto_ids_size       : %d\n", pHeader->protoIdsSize);
-    printf("proto_ids_off        : %d (0x%06x)\n",
+    outPrintf("proto_ids_size       : %d\n", pHeader->protoIdsSize);
+    outPrintf("proto_ids_off        : %d (0x%06x)\n",
         pHeader->protoIdsOff, pHeader->protoIdsOff);
-    printf("field_ids_size      : %d\n", pHeader->fieldIdsSize);
-    printf("field_ids_off       : %d (0x%06x)\n",
+    outPrintf("field_ids_size      : %d\n", pHeader->fieldIdsSize);
+    outPrintf("field_ids_off       : %d (0x%06x)\n",
         pHeader->fieldIdsOff, pHeader->fieldIdsOff);
-    printf("method_ids_size     : %d\n", pHeader->methodIdsSize);
-    printf("method_ids_off      : %d (0x%06x)\n",
+    outPrintf("method_ids_size     : %d\n", pHeader->methodIdsSize);
+    outPrintf("method_ids_off      : %d (0x%06x)\n",
         pHeader->methodIdsOff, pHeader->methodIdsOff);
-    printf("class_defs_size     : %d\n", pHeader->classDefsSize);
-    printf("class_defs_off      : %d (0x%06x)\n",
+    outPrintf("class_defs_size     : %d\n", pHeader->classDefsSize);
+    outPrintf("class_defs_off      : %d (0x%06x)\n",
         pHeader->classDefsOff, pHeader->classDefsOff);
-    printf("data_size           : %d\n", pHeader->dataSize);
-    printf("data_off            : %d (0x%06x)\n",
+    outPrintf("data_size           : %d\n", pHeader->dataSize);
+    outPrintf("data_off            : %d (0x%06x)\n",
         pHeader->dataOff, pHeader->dataOff);
-    printf("\n");
+    outPrintf("\n");
 }
 
 /*
@@ -470,12 +993,12 @@ void dumpOptDirectory(const DexFile* pDexFile)
     if (pOptHeader == NULL)
         return;
 
-    printf("OPT section contents:\n");
+    outPrintf("OPT section contents:\n");
 
     const u4* pOpt = (const u4*) ((u1*) pOptHeader + pOptHeader->optOffset);
 
     if (*pOpt == 0) {
-        printf("(1.0 format, only class lookup table is present)\n\n");
+        outPrintf("(1.0 format, only class lookup table is present)\n\n");
         return;
     }
 
@@ -500,14 +1023,14 @@ void dumpOptDirectory(const DexFile* pDexFile)
             break;
         }
 
-        printf("Chunk %08x (%c%c%c%c) - %s (%d bytes)\n", *pOpt,
+        outPrintf("Chunk %08x (%c%c%c%c) - %s (%d bytes)\n", *pOpt,
             *pOpt >> 24, (char)(*pOpt >> 16), (char)(*pOpt >> 8), (char)*pOpt,
             verboseStr, size);
 
         size = (size + 8 + 7) & ~7;
         pOpt += size / sizeof(u4);
     }
-    printf("\n");
+    outPrintf("\n");
 }
 
 /*
@@ -528,25 +1051,25 @@ void dumpClassDef(DexFile* pDexFile, int idx)
         return;
     }
 
-    printf("Class #%d header:\n", idx);
-    printf("class_idx           : %d\n", pClassDef->classIdx);
-    printf("access_flags        : %d (0x%04x)\n",
+    outPrintf("Class #%d header:\n", idx);
+    outPrintf("class_idx           : %d\n", pClassDef->classIdx);
+    outPrintf("access_flags        : %d (0x%04x)\n",
         pClassDef->accessFlags, pClassDef->accessFlags);
-    printf("superclass_idx      : %d\n", pClassDef->superclassIdx);
-    printf("interfaces_off      : %d (0x%06x)\n",
+    outPrintf("superclass_idx      : %d\n", pClassDef->superclassIdx);
+    outPrintf("interfaces_off      : %d (0x%06x)\n",
         pClassDef->interfacesOff, pClassDef->interfacesOff);
-    printf("source_file_idx     : %d\n", pClassDef->sourceFileIdx);
-    printf("annotations_off     : %d (0x%06x)\n",
+    outPrintf("source_file_idx     : %d\n", pClassDef->sourceFileIdx);
+    outPrintf("annotations_off     : %d (0x%06x)\n",
         pClassDef->annotationsOff, pClassDef->annotationsOff);
-    printf("class_data_off      : %d (0x%06x)\n",
+    outPrintf("class_data_off      : %d (0x%06x)\n",
         pClassDef->classDataOff, pClassDef->classDataOff);
-    printf("static_fields_size  : %d\n", pClassData->header.staticFieldsSize);
-    printf("instance_fields_size: %d\n",
+    outPrintf("static_fields_size  : %d\n", pClassData->header.staticFieldsSize);
+    outPrintf("instance_fields_size: %d\n",
             pClassData->header.instanceFieldsSize);
-    printf("direct_methods_size : %d\n", pClassData->header.directMethodsSize);
-    printf("virtual_methods_size: %d\n",
+    outPrintf("direct_methods_size : %d\n", pClassData->header.directMethodsSize);
+    outPrintf("virtual_methods_size: %d\n",
             pClassData->header.virtualMethodsSize);
-    printf("\n");
+    outPrintf("\n");
 
     free(pClassData);
 }
@@ -561,11 +1084,10 @@ void dumpInterface(const DexFile* pDexFile, const DexTypeItem* pTypeItem,
         dexStringByTypeIdx(pDexFile, pTypeItem->typeIdx);
 
     if (gOptions.outputFormat == OUTPUT_PLAIN) {
-        printf("    #%d              : '%s'\n", i, interfaceName);
-    } else {
-        char* dotted = descriptorToDot(interfaceName);
-        printf("<implements name=\"%s\">\n</implements>\n", dotted);
-        free(dotted);
+        outPrintf("    #%d              : '%s'\n", i, interfaceName);
+    } else if (gOptions.outputFormat == OUTPUT_XML) {
+        outPrintf("<implements name=\"%s\">\n</implements>\n",
+            dottedTypeName(pDexFile, pTypeItem->typeIdx));
     }
 }
 
@@ -577,11 +1099,11 @@ void dumpCatches(DexFile* pDexFile, const DexCode* pCode)
     u4 triesSize = pCode->triesSize;
 
     if (triesSize == 0) {
-        printf("      catches       : (none)\n");
+        outPrintf("      catches       : (none)\n");
         return;
     }
 
-    printf("      catches       : %d\n", triesSize);
+    outPrintf("      catches       : %d\n", triesSize);
 
     const DexTry* pTries = dexGetTries(pCode);
     u4 i;
@@ -592,7 +1114,7 @@ void dumpCatches(DexFile* pDexFile, const DexCode* pCode)
         u4 end = start + pTry->insnCount;
         DexCatchIterator iterator;
 
-        printf("        0x%04x - 0x%04x\n", start, end);
+        outPrintf("        0x%04x - 0x%04x\n", start, end);
 
         dexCatchIteratorInit(&iterator, pCode, pTry->handlerOff);
 
@@ -607,7 +1129,7 @@ void dumpCatches(DexFile* pDexFile, const DexCode* pCode)
             descriptor = (handler->typeIdx == kDexNoIndex) ? "<any>" :
                 dexStringByTypeIdx(pDexFile, handler->typeIdx);
 
-            printf("          %s -> 0x%04x\n", descriptor,
+            outPrintf("          %s -> 0x%04x\n", descriptor,
                     handler->address);
         }
     }
@@ -615,7 +1137,11 @@ void dumpCatches(DexFile* pDexFile, const DexCode* pCode)
 
 static int dumpPositionsCb(void * /* cnxt */, u4 address, u4 lineNum)
 {
-    printf("        0x%04x line=%d\n", address, lineNum);
+    outPuts("        0x");
+    outHex(address, 4);
+    outPuts(" line=");
+    outDec((s4) lineNum);
+    outPutc('\n');
     return 0;
 }
 
@@ -625,7 +1151,7 @@ static int dumpPositionsCb(void * /* cnxt */, u4 address, u4 lineNum)
 void dumpPositions(DexFile* pDexFile, const DexCode* pCode,
         const DexMethod *pDexMethod)
 {
-    printf("      positions     : \n");
+    outPrintf("      positions     : \n");
     const DexMethodId *pMethodId
             = dexGetMethodId(pDexFile, pDexMethod->methodIdx);
     const char *classDescriptor
@@ -639,7 +1165,7 @@ static void dumpLocalsCb(void * /* cnxt */, u2 reg, u4 startAddress,
         u4 endAddress, const char *name, const char *descriptor,
         const char *signature)
 {
-    printf("        0x%04x - 0x%04x reg=%d %s %s %s\n",
+    outPrintf("        0x%04x - 0x%04x reg=%d %s %s %s\n",
             startAddress, endAddress, reg, name, descriptor,
             signature);
 }
@@ -650,7 +1176,7 @@ static void dumpLocalsCb(void * /* cnxt */, u2 reg, u4 startAddress,
 void dumpLocals(DexFile* pDexFile, const DexCode* pCode,
         const DexMethod *pDexMethod)
 {
-    printf("      locals        : \n");
+    outPrintf("      locals        : \n");
 
     const DexMethodId *pMethodId
             = dexGetMethodId(pDexFile, pDexMethod->methodIdx);
@@ -699,62 +1225,75 @@ bool getFieldInfo(DexFile* pDexFile, u4 fieldIdx, FieldMethodInfo* pFieldInfo)
 }
 
 /*
- * Get information about a ProtoId.
+ * Per-thread scratch space for operand formatting.  The descriptor
+ * strings built for method and proto references live here, so
+ * disassembly doesn't allocate anything per instruction once the
+ * buffers have grown to fit.
+ */
+struct OperandScratch {
+    bool            initialized;
+    DexStringCache  methodDesc;
+    DexStringCache  protoDesc;
+};
+
+static thread_local OperandScratch gOperandScratch;
+
+/*
+ * Get this thread's operand scratch space, setting it up if needed.
  */
-bool getProtoInfo(DexFile* pDexFile, u4 protoIdx, ProtoInfo* pProtoInfo)
+static OperandScratch* getOperandScratch(void)
 {
-    if (protoIdx >= pDexFile->pHeader->protoIdsSize) {
-        return false;
+    OperandScratch* pScratch = &gOperandScratch;
+
+    if (!pScratch->initialized) {
+        dexStringCacheInit(&pScratch->methodDesc);
+        dexStringCacheInit(&pScratch->protoDesc);
+        pScratch->initialized = true;
     }
+    return pScratch;
+}
 
-    const DexProtoId* protoId = dexGetProtoId(pDexFile, protoIdx);
+/*
+ * Release this thread's operand scratch space.
+ */
+static void releaseOperandScratch(void)
+{
+    OperandScratch* pScratch = &gOperandScratch;
 
-    // Get string for return type.
-    if (protoId->returnTypeIdx >= pDexFile->pHeader->typeIdsSize) {
-        return false;
+    if (pScratch->initialized) {
+        dexStringCacheRelease(&pScratch->methodDesc);
+        dexStringCacheRelease(&pScratch->protoDesc);
+        pScratch->initialized = false;
     }
-    pProtoInfo->returnType = dexStringByTypeIdx(pDexFile, protoId->returnTypeIdx);
+}
 
-    // Build string for parameter types.
-    size_t bufSize = 1;
-    char* buf = (char*)malloc(bufSize);
-    if (buf == NULL) {
-        return false;
-    }
+/*
+ * Get the method descriptor, e.g. "(ILjava/lang/String;)V", for a
+ * ProtoId.  The result is only valid until "pCache" is next used.
+ * Returns NULL if the proto or any of its types are out of range.
+ */
+static const char* getProtoDescriptor(DexFile* pDexFile, u4 protoIdx,
+    DexStringCache* pCache)
+{
+    if (protoIdx >= pDexFile->pHeader->protoIdsSize)
+        return NULL;
 
-    buf[0] = '\0';
-    size_t bufUsed = 1;
+    const DexProtoId* protoId = dexGetProtoId(pDexFile, protoIdx);
+    if (protoId->returnTypeIdx >= pDexFile->pHeader->typeIdsSize)
+        return NULL;
 
     const DexTypeList* paramTypes = dexGetProtoParameters(pDexFile, protoId);
-    if (paramTypes == NULL) {
-        // No parameters.
-        pProtoInfo->parameterTypes = buf;
-        return true;
-    }
-
-    for (u4 i = 0; i < paramTypes->size; ++i) {
-        if (paramTypes->list[i].typeIdx >= pDexFile->pHeader->typeIdsSize) {
-            free(buf);
-            return false;
+    if (paramTypes != NULL) {
+        for (u4 i = 0; i < paramTypes->size; ++i) {
+            if (paramTypes->list[i].typeIdx >= pDexFile->pHeader->typeIdsSize)
+                return NULL;
         }
-        const char* param = dexStringByTypeIdx(pDexFile, paramTypes->list[i].typeIdx);
-        size_t paramLen = strlen(param);
-        size_t newUsed = bufUsed + paramLen;
-        if (newUsed > bufSize) {
-            char* newBuf = (char*)realloc(buf, newUsed);
-            if (newBuf == NULL) {
-                free(buf);
-                return false;
-            }
-            buf = newBuf;
-            bufSize = newUsed;
-        }
-        memcpy(buf + bufUsed - 1, param, paramLen + 1);
-        bufUsed = newUsed;
     }
 
-    pProtoInfo->parameterTypes = buf;
-    return true;
+    DexProto proto;
+    proto.dexFile = pDexFile;
+    proto.protoIdx = protoIdx;
+    return dexProtoGetMethodDescriptor(&proto, pCache);
 }
 
 /*
@@ -766,25 +1305,15 @@ const char* getClassDescriptor(DexFile* pDexFile, u4 classIdx)
 }
 
 /*
- * Helper for dumpInstruction(), which builds the string
- * representation for the index in the given instruction. This will
- * first try to use the given buffer, but if the result won't fit,
- * then this will allocate a new buffer to hold the result. A pointer
- * to the buffer which holds the full result is always returned, and
- * this can be compared with the one passed in, to see if the result
- * needs to be free()d.
+ * Get the index in the given instruction, plus the secondary (proto)
+ * index for the formats that have one.  "*pWidth" is set to the number
+ * of hex digits the index is shown with.
  */
-static char* indexString(DexFile* pDexFile, const DecodedInstruction* pDecInsn, size_t bufSize)
+static u4 getInsnIndex(const DecodedInstruction* pDecInsn,
+    u4* pSecondaryIndex, u4* pWidth)
 {
-    char* buf = (char*)malloc(bufSize);
-    if (buf == NULL) {
-      return NULL;
-    }
-
-    int outSize;
-    u4 index;
-    u4 secondaryIndex = 0;
-    u4 width;
+    *pSecondaryIndex = 0;
+    *pWidth = 4;
 
     /* TODO: Make the index *always* be in field B, to simplify this code. */
     switch (dexGetFormatFromOpcode(pDecInsn->opcode)) {
@@ -796,29 +1325,33 @@ static char* indexString(DexFile* pDexFile, const DecodedInstruction* pDecInsn,
     case kFmt3rms:
     case kFmt35mi:
     case kFmt3rmi:
-        index = pDecInsn->vB;
-        width = 4;
-        break;
+        return pDecInsn->vB;
     case kFmt31c:
-        index = pDecInsn->vB;
-        width = 8;
-        break;
+        *pWidth = 8;
+        return pDecInsn->vB;
     case kFmt22c:
     case kFmt22cs:
-        index = pDecInsn->vC;
-        width = 4;
-        break;
+        return pDecInsn->vC;
     case kFmt45cc:
     case kFmt4rcc:
-        index = pDecInsn->vB;  // method index
-        secondaryIndex = pDecInsn->arg[4];  // proto index
-        width = 4;
-        break;
+        *pSecondaryIndex = pDecInsn->arg[4];  // proto index
+        return pDecInsn->vB;  // method index
     default:
-        index = 0;
-        width = 4;
-        break;
+        return 0;
     }
+}
+
+/*
+ * Helper for dumpInstruction(), which prints the index in the given
+ * instruction: a string, type, field, method, etc. reference, followed
+ * by the raw index.
+ */
+static void dumpIndex(DexFile* pDexFile, const DecodedInstruction* pDecInsn)
+{
+    OperandScratch* pScratch = getOperandScratch();
+    u4 secondaryIndex;
+    u4 width;
+    u4 index = getInsnIndex(pDecInsn, &secondaryIndex, &width);
 
     switch (pDecInsn->indexType) {
     case kIndexUnknown:
@@ -826,137 +1359,154 @@ static char* indexString(DexFile* pDexFile, const DecodedInstruction* pDecInsn,
          * This function shouldn't ever get called for this type, but do
          * something sensible here, just to help with debugging.
          */
-        outSize = snprintf(buf, bufSize, "<unknown-index>");
+        outPuts("<unknown-index>");
         break;
     case kIndexNone:
         /*
          * This function shouldn't ever get called for this type, but do
          * something sensible here, just to help with debugging.
          */
-        outSize = snprintf(buf, bufSize, "<no-index>");
+        outPuts("<no-index>");
         break;
     case kIndexVaries:
         /*
          * This one should never show up in a dexdump, so no need to try
          * to get fancy here.
          */
-        outSize = snprintf(buf, bufSize, "<index-varies> // thing@%0*x",
-                width, index);
+        outPuts("<index-varies> // thing@");
+        outHex(index, width);
         break;
     case kIndexTypeRef:
         if (index < pDexFile->pHeader->typeIdsSize) {
-            outSize = snprintf(buf, bufSize, "%s // type@%0*x",
-                               getClassDescriptor(pDexFile, index), width, index);
+            outPuts(getClassDescriptor(pDexFile, index));
+            outPuts(" // type@");
         } else {
-            outSize = snprintf(buf, bufSize, "<type?> // type@%0*x", width, index);
+            outPuts("<type?> // type@");
         }
+        outHex(index, width);
         break;
     case kIndexStringRef:
         if (index < pDexFile->pHeader->stringIdsSize) {
-            outSize = snprintf(buf, bufSize, "\"%s\" // string@%0*x",
-                               dexStringById(pDexFile, index), width, index);
+            outPutc('"');
+            outPuts(dexStringById(pDexFile, index));
+            outPuts("\" // string@");
         } else {
-            outSize = snprintf(buf, bufSize, "<string?> // string@%0*x",
-                               width, index);
+            outPuts("<string?> // string@");
         }
+        outHex(index, width);
         break;
     case kIndexMethodRef:
-        {
-            FieldMethodInfo methInfo;
-            if (getMethodInfo(pDexFile, index, &methInfo)) {
-                outSize = snprintf(buf, bufSize, "%s.%s:%s // method@%0*x",
-                        methInfo.classDescriptor, methInfo.name,
-                        methInfo.signature, width, index);
-                free((void *) methInfo.signature);
-            } else {
-                outSize = snprintf(buf, bufSize, "<method?> // method@%0*x",
-                        width, index);
-            }
+        if (index < pDexFile->pHeader->methodIdsSize) {
+            const DexMethodId* pMethodId = dexGetMethodId(pDexFile, index);
+            outPuts(dexStringByTypeIdx(pDexFile, pMethodId->classIdx));
+            outPutc('.');
+            outPuts(dexStringById(pDexFile, pMethodId->nameIdx));
+            outPutc(':');
+            outPuts(dexGetDescriptorFromMethodId(pDexFile, pMethodId,
+                    &pScratch->methodDesc));
+            outPuts(" // method@");
+        } else {
+            outPuts("<method?> // method@");
         }
+        outHex(index, width);
         break;
     case kIndexFieldRef:
         {
             FieldMethodInfo fieldInfo;
             if (getFieldInfo(pDexFile, index, &fieldInfo)) {
-                outSize = snprintf(buf, bufSize, "%s.%s:%s // field@%0*x",
-                        fieldInfo.classDescriptor, fieldInfo.name,
-                        fieldInfo.signature, width, index);
+                outPuts(fieldInfo.classDescriptor);
+                outPutc('.');
+                outPuts(fieldInfo.name);
+                outPutc(':');
+                outPuts(fieldInfo.signature);
+                outPuts(" // field@");
             } else {
-                outSize = snprintf(buf, bufSize, "<field?> // field@%0*x",
-                        width, index);
+                outPuts("<field?> // field@");
             }
+            outHex(index, width);
         }
         break;
     case kIndexInlineMethod:
-        outSize = snprintf(buf, bufSize, "[%0*x] // inline #%0*x",
-                width, index, width, index);
+        outPutc('[');
+        outHex(index, width);
+        outPuts("] // inline #");
+        outHex(index, width);
         break;
     case kIndexVtableOffset:
-        outSize = snprintf(buf, bufSize, "[%0*x] // vtable #%0*x",
-                width, index, width, index);
+        outPutc('[');
+        outHex(index, width);
+        outPuts("] // vtable #");
+        outHex(index, width);
         break;
     case kIndexFieldOffset:
-        outSize = snprintf(buf, bufSize, "[obj+%0*x]", width, index);
+        outPuts("[obj+");
+        outHex(index, width);
+        outPutc(']');
         break;
     case kIndexMethodAndProtoRef:
         {
-            FieldMethodInfo methInfo;
-            ProtoInfo protoInfo;
-            protoInfo.parameterTypes = NULL;
-            if (getMethodInfo(pDexFile, index, &methInfo) &&
-                getProtoInfo(pDexFile, secondaryIndex, &protoInfo)) {
-                outSize = snprintf(buf, bufSize, "%s.%s:%s, (%s)%s // method@%0*x, proto@%0*x",
-                                   methInfo.classDescriptor, methInfo.name, methInfo.signature,
-                                   protoInfo.parameterTypes, protoInfo.returnType,
-                                   width, index, width, secondaryIndex);
+            const char* protoDesc = getProtoDescriptor(pDexFile,
+                    secondaryIndex, &pScratch->protoDesc);
+            if (index < pDexFile->pHeader->methodIdsSize && protoDesc != NULL) {
+                const DexMethodId* pMethodId = dexGetMethodId(pDexFile, index);
+                outPuts(dexStringByTypeIdx(pDexFile, pMethodId->classIdx));
+                outPutc('.');
+                outPuts(dexStringById(pDexFile, pMethodId->nameIdx));
+                outPutc(':');
+                outPuts(dexGetDescriptorFromMethodId(pDexFile, pMethodId,
+                        &pScratch->methodDesc));
+                outPuts(", ");
+                outPuts(protoDesc);
+                outPuts(" // method@");
             } else {
-                outSize = snprintf(buf, bufSize, "<method?>, <proto?> // method@%0*x, proto@%0*x",
-                                   width, index, width, secondaryIndex);
+                outPuts("<method?>, <proto?> // method@");
             }
-            free(protoInfo.parameterTypes);
+            outHex(index, width);
+            outPuts(", proto@");
+            outHex(secondaryIndex, width);
         }
         break;
     case kIndexCallSiteRef:
-        outSize = snprintf(buf, bufSize, "call_site@%0*x", width, index);
+        outPuts("call_site@");
+        outHex(index, width);
         break;
     case kIndexMethodHandleRef:
-        outSize = snprintf(buf, bufSize, "methodhandle@%0*x", width, index);
+        outPuts("methodhandle@");
+        outHex(index, width);
         break;
     case kIndexProtoRef:
         {
-            ProtoInfo protoInfo;
-            if (getProtoInfo(pDexFile, index, &protoInfo)) {
-                outSize = snprintf(buf, bufSize, "(%s)%s // proto@%0*x",
-                                   protoInfo.parameterTypes, protoInfo.returnType,
-                                   width, index);
-
+            const char* protoDesc = getProtoDescriptor(pDexFile, index,
+                    &pScratch->protoDesc);
+            if (protoDesc != NULL) {
+                outPuts(protoDesc);
+                outPuts(" // proto@");
+                outHex(index, width);
             } else {
-                outSize = snprintf(buf, bufSize, "<proto?> // proto@%0*x",
-                                   width, secondaryIndex);
+                outPuts("<proto?> // proto@");
+                outHex(secondaryIndex, width);
             }
-            free(protoInfo.parameterTypes);
         }
         break;
     default:
-        outSize = snprintf(buf, bufSize, "<?>");
+        outPuts("<?>");
         break;
     }
-
-    if (outSize >= (int) bufSize) {
-        /*
-         * The buffer wasn't big enough; allocate and retry. Note:
-         * snprintf() doesn't count the '\0' as part of its returned
-         * size, so we add explicit space for it here.
-         */
-        free(buf);
-        return indexString(pDexFile, pDecInsn, outSize + 1);
-    } else {
-        return buf;
-    }
 }
 
 /*
- * Dump a single instruction.
+ * Print a branch target and its offset, as "%04x // %c%04x".
+ */
+static void dumpBranchTarget(int insnIdx, s4 targ)
+{
+    outHex((u4) (insnIdx + targ), 4);
+    outPuts(" // ");
+    outPutc((targ < 0) ? '-' : '+');
+    outHex((u4) ((targ < 0) ? -targ : targ), 4);
+}
+
+/*
+ * Dump a single instruction.
  */
 void dumpInstruction(DexFile* pDexFile, const DexCode* pCode, int insnIdx,
     int insnWidth, const DecodedInstruction* pDecInsn)
@@ -965,128 +1515,127 @@ void dumpInstruction(DexFile* pDexFile, const DexCode* pCode, int insnIdx,
     int i;
 
     // Address of instruction (expressed as byte offset).
-    printf("%06zx:", ((u1*)insns - pDexFile->baseAddr) + insnIdx*2);
+    outHex(((u1*)insns - pDexFile->baseAddr) + insnIdx*2, 6);
+    outPutc(':');
 
+    /* code units, then the index; always 8 * 5 + 7 bytes */
+    char* cp = outReserve(8 * 5 + 7);
     for (i = 0; i < 8; i++) {
         if (i < insnWidth) {
             if (i == 7) {
-                printf(" ... ");
+                memcpy(cp, " ... ", 5);
             } else {
                 /* print 16-bit value in little-endian order */
                 const u1* bytePtr = (const u1*) &insns[insnIdx+i];
-                printf(" %02x%02x", bytePtr[0], bytePtr[1]);
+                cp[0] = ' ';
+                cp[1] = kHexDigits[bytePtr[0] >> 4];
+                cp[2] = kHexDigits[bytePtr[0] & 0x0f];
+                cp[3] = kHexDigits[bytePtr[1] >> 4];
+                cp[4] = kHexDigits[bytePtr[1] & 0x0f];
             }
         } else {
-            fputs("     ", stdout);
+            memset(cp, ' ', 5);
         }
+        cp += 5;
     }
+    *cp++ = '|';
+    outCommit(cp);
+    outHex(insnIdx, 4);
 
     if (pDecInsn->opcode == OP_NOP) {
-        u2 instr = get2LE((const u1*) &insns[insnIdx]);
+        u2 instr = insns[insnIdx];
         if (instr == kPackedSwitchSignature) {
-            printf("|%04x: packed-switch-data (%d units)",
-                insnIdx, insnWidth);
+            outPrintf(": packed-switch-data (%d units)", insnWidth);
         } else if (instr == kSparseSwitchSignature) {
-            printf("|%04x: sparse-switch-data (%d units)",
-                insnIdx, insnWidth);
+            outPrintf(": sparse-switch-data (%d units)", insnWidth);
         } else if (instr == kArrayDataSignature) {
-            printf("|%04x: array-data (%d units)",
-                insnIdx, insnWidth);
+            outPrintf(": array-data (%d units)", insnWidth);
         } else {
-            printf("|%04x: nop // spacer", insnIdx);
+            outPuts(": nop // spacer");
         }
     } else {
-        printf("|%04x: %s", insnIdx, dexGetOpcodeName(pDecInsn->opcode));
-    }
-
-    // Provide an initial buffer that usually suffices, although indexString()
-    // may reallocate the buffer if more space is needed.
-    char* indexBuf = NULL;
-    if (pDecInsn->indexType != kIndexNone) {
-        indexBuf = indexString(pDexFile, pDecInsn, 200);
+        outPuts(": ");
+        outPuts(dexGetOpcodeName(pDecInsn->opcode));
     }
 
     switch (dexGetFormatFromOpcode(pDecInsn->opcode)) {
     case kFmt10x:        // op
         break;
     case kFmt12x:        // op vA, vB
-        printf(" v%d, v%d", pDecInsn->vA, pDecInsn->vB);
+        outReg(" v", pDecInsn->vA);
+        outReg(", v", pDecInsn->vB);
         break;
     case kFmt11n:        // op vA, #+B
-        printf(" v%d, #int %d // #%x",
+        outPrintf(" v%d, #int %d // #%x",
             pDecInsn->vA, (s4)pDecInsn->vB, (u1)pDecInsn->vB);
         break;
     case kFmt11x:        // op vAA
-        printf(" v%d", pDecInsn->vA);
+        outReg(" v", pDecInsn->vA);
         break;
     case kFmt10t:        // op +AA
     case kFmt20t:        // op +AAAA
-        {
-            s4 targ = (s4) pDecInsn->vA;
-            printf(" %04x // %c%04x",
-                insnIdx + targ,
-                (targ < 0) ? '-' : '+',
-                (targ < 0) ? -targ : targ);
-        }
+        outPutc(' ');
+        dumpBranchTarget(insnIdx, (s4) pDecInsn->vA);
         break;
     case kFmt22x:        // op vAA, vBBBB
-        printf(" v%d, v%d", pDecInsn->vA, pDecInsn->vB);
+        outReg(" v", pDecInsn->vA);
+        outReg(", v", pDecInsn->vB);
         break;
     case kFmt21t:        // op vAA, +BBBB
-        {
-            s4 targ = (s4) pDecInsn->vB;
-            printf(" v%d, %04x // %c%04x", pDecInsn->vA,
-                insnIdx + targ,
-                (targ < 0) ? '-' : '+',
-                (targ < 0) ? -targ : targ);
-        }
+        outReg(" v", pDecInsn->vA);
+        outPuts(", ");
+        dumpBranchTarget(insnIdx, (s4) pDecInsn->vB);
         break;
     case kFmt21s:        // op vAA, #+BBBB
-        printf(" v%d, #int %d // #%x",
+        outPrintf(" v%d, #int %d // #%x",
             pDecInsn->vA, (s4)pDecInsn->vB, (u2)pDecInsn->vB);
         break;
     case kFmt21h:        // op vAA, #+BBBB0000[00000000]
         // The printed format varies a bit based on the actual opcode.
         if (pDecInsn->opcode == OP_CONST_HIGH16) {
             s4 value = pDecInsn->vB << 16;
-            printf(" v%d, #int %d // #%x",
+            outPrintf(" v%d, #int %d // #%x",
                 pDecInsn->vA, value, (u2)pDecInsn->vB);
         } else {
             s8 value = ((s8) pDecInsn->vB) << 48;
-            printf(" v%d, #long %" PRId64 " // #%x",
+            outPrintf(" v%d, #long %" PRId64 " // #%x",
                 pDecInsn->vA, value, (u2)pDecInsn->vB);
         }
         break;
     case kFmt21c:        // op vAA, thing@BBBB
     case kFmt31c:        // op vAA, thing@BBBBBBBB
-        printf(" v%d, %s", pDecInsn->vA, indexBuf);
+        outReg(" v", pDecInsn->vA);
+        outPuts(", ");
+        dumpIndex(pDexFile, pDecInsn);
         break;
     case kFmt23x:        // op vAA, vBB, vCC
-        printf(" v%d, v%d, v%d", pDecInsn->vA, pDecInsn->vB, pDecInsn->vC);
+        outReg(" v", pDecInsn->vA);
+        outReg(", v", pDecInsn->vB);
+        outReg(", v", pDecInsn->vC);
         break;
     case kFmt22b:        // op vAA, vBB, #+CC
-        printf(" v%d, v%d, #int %d // #%02x",
+        outPrintf(" v%d, v%d, #int %d // #%02x",
             pDecInsn->vA, pDecInsn->vB, (s4)pDecInsn->vC, (u1)pDecInsn->vC);
         break;
     case kFmt22t:        // op vA, vB, +CCCC
-        {
-            s4 targ = (s4) pDecInsn->vC;
-            printf(" v%d, v%d, %04x // %c%04x", pDecInsn->vA, pDecInsn->vB,
-                insnIdx + targ,
-                (targ < 0) ? '-' : '+',
-                (targ < 0) ? -targ : targ);
-        }
+        outReg(" v", pDecInsn->vA);
+        outReg(", v", pDecInsn->vB);
+        outPuts(", ");
+        dumpBranchTarget(insnIdx, (s4) pDecInsn->vC);
         break;
     case kFmt22s:        // op vA, vB, #+CCCC
-        printf(" v%d, v%d, #int %d // #%04x",
+        outPrintf(" v%d, v%d, #int %d // #%04x",
             pDecInsn->vA, pDecInsn->vB, (s4)pDecInsn->vC, (u2)pDecInsn->vC);
         break;
     case kFmt22c:        // op vA, vB, thing@CCCC
     case kFmt22cs:       // [opt] op vA, vB, field offset CCCC
-        printf(" v%d, v%d, %s", pDecInsn->vA, pDecInsn->vB, indexBuf);
+        outReg(" v", pDecInsn->vA);
+        outReg(", v", pDecInsn->vB);
+        outPuts(", ");
+        dumpIndex(pDexFile, pDecInsn);
         break;
     case kFmt30t:
-        printf(" #%08x", pDecInsn->vA);
+        outPrintf(" #%08x", pDecInsn->vA);
         break;
     case kFmt31i:        // op vAA, #+BBBBBBBB
         {
@@ -1096,29 +1645,27 @@ void dumpInstruction(DexFile* pDexFile, const DexCode* pCode, int insnIdx,
                 u4 i;
             } conv;
             conv.i = pDecInsn->vB;
-            printf(" v%d, #float %f // #%08x",
+            outPrintf(" v%d, #float %f // #%08x",
                 pDecInsn->vA, conv.f, pDecInsn->vB);
         }
         break;
     case kFmt31t:       // op vAA, offset +BBBBBBBB
-        printf(" v%d, %08x // +%08x",
+        outPrintf(" v%d, %08x // +%08x",
             pDecInsn->vA, insnIdx + pDecInsn->vB, pDecInsn->vB);
         break;
     case kFmt32x:        // op vAAAA, vBBBB
-        printf(" v%d, v%d", pDecInsn->vA, pDecInsn->vB);
+        outReg(" v", pDecInsn->vA);
+        outReg(", v", pDecInsn->vB);
         break;
     case kFmt35c:        // op {vC, vD, vE, vF, vG}, thing@BBBB
     case kFmt35ms:       // [opt] invoke-virtual+super
     case kFmt35mi:       // [opt] inline invoke
         {
-            fputs(" {", stdout);
-            for (i = 0; i < (int) pDecInsn->vA; i++) {
-                if (i == 0)
-                    printf("v%d", pDecInsn->arg[i]);
-                else
-                    printf(", v%d", pDecInsn->arg[i]);
-            }
-            printf("}, %s", indexBuf);
+            outPuts(" {");
+            for (i = 0; i < (int) pDecInsn->vA; i++)
+                outReg((i == 0) ? "v" : ", v", pDecInsn->arg[i]);
+            outPuts("}, ");
+            dumpIndex(pDexFile, pDecInsn);
         }
         break;
     case kFmt3rc:        // op {vCCCC .. v(CCCC+AA-1)}, thing@BBBB
@@ -1129,14 +1676,11 @@ void dumpInstruction(DexFile* pDexFile, const DexCode* pCode, int insnIdx,
              * This doesn't match the "dx" output when some of the args are
              * 64-bit values -- dx only shows the first register.
              */
-            fputs(" {", stdout);
-            for (i = 0; i < (int) pDecInsn->vA; i++) {
-                if (i == 0)
-                    printf("v%d", pDecInsn->vC + i);
-                else
-                    printf(", v%d", pDecInsn->vC + i);
-            }
-            printf("}, %s", indexBuf);
+            outPuts(" {");
+            for (i = 0; i < (int) pDecInsn->vA; i++)
+                outReg((i == 0) ? "v" : ", v", pDecInsn->vC + i);
+            outPuts("}, ");
+            dumpIndex(pDexFile, pDecInsn);
         }
         break;
     case kFmt51l:        // op vAA, #+BBBBBBBBBBBBBBBB
@@ -1147,7 +1691,7 @@ void dumpInstruction(DexFile* pDexFile, const DexCode* pCode, int insnIdx,
                 u8 j;
             } conv;
             conv.j = pDecInsn->vB_wide;
-            printf(" v%d, #double %f // #%016" PRIx64,
+            outPrintf(" v%d, #double %f // #%016" PRIx64,
                 pDecInsn->vA, conv.d, pDecInsn->vB_wide);
         }
         break;
@@ -1155,32 +1699,286 @@ void dumpInstruction(DexFile* pDexFile, const DexCode* pCode, int insnIdx,
         break;
     case kFmt45cc:
         {
-            fputs("  {", stdout);
-            printf("v%d", pDecInsn->vC);
+            outPuts("  {");
+            outPrintf("v%d", pDecInsn->vC);
             for (int i = 0; i < (int) pDecInsn->vA - 1; ++i) {
-                printf(", v%d", pDecInsn->arg[i]);
+                outPrintf(", v%d", pDecInsn->arg[i]);
             }
-            printf("}, %s", indexBuf);
+            outPuts("}, ");
+            dumpIndex(pDexFile, pDecInsn);
         }
         break;
     case kFmt4rcc:
         {
-            fputs("  {", stdout);
-            printf("v%d", pDecInsn->vC);
+            outPuts("  {");
+            outPrintf("v%d", pDecInsn->vC);
             for (int i = 1; i < (int) pDecInsn->vA; ++i) {
-                printf(", v%d", pDecInsn->vC + i);
+                outPrintf(", v%d", pDecInsn->vC + i);
+            }
+            outPuts("}, ");
+            dumpIndex(pDexFile, pDecInsn);
+        }
+        break;
+    default:
+        outPrintf(" ???");
+        break;
+    }
+
+    outPutc('\n');
+}
+
+/*
+ * Write the "regs" member of an instruction record: the first "count"
+ * of "regs", or, if "regs" is NULL, the range starting at "first".
+ */
+static void outJsonRegs(const u4* regs, u4 first, int count)
+{
+    int i;
+
+    outJsonKey("regs");
+    outPutc('[');
+    for (i = 0; i < count; i++) {
+        if (i != 0)
+            outPutc(',');
+        outDec((regs != NULL) ? regs[i] : first + i);
+    }
+    outPutc(']');
+}
+
+/*
+ * Helper for dumpInstructionJson(), which writes the members describing
+ * the index in the given instruction: "index" and "index_kind", plus
+ * "proto_idx" for invoke-polymorphic, and "ref", the referenced string,
+ * type, field, method or proto, when it can be resolved.
+ */
+static void dumpIndexJson(DexFile* pDexFile,
+    const DecodedInstruction* pDecInsn)
+{
+    OperandScratch* pScratch = getOperandScratch();
+    u4 secondaryIndex;
+    u4 width;
+    u4 index = getInsnIndex(pDecInsn, &secondaryIndex, &width);
+    const char* kind;
+
+    switch (pDecInsn->indexType) {
+    case kIndexVaries:              kind = "varies";        break;
+    case kIndexTypeRef:             kind = "type";          break;
+    case kIndexStringRef:           kind = "string";        break;
+    case kIndexMethodRef:           kind = "method";        break;
+    case kIndexFieldRef:            kind = "field";         break;
+    case kIndexInlineMethod:        kind = "inline";        break;
+    case kIndexVtableOffset:        kind = "vtable";        break;
+    case kIndexFieldOffset:         kind = "field_offset";  break;
+    case kIndexMethodAndProtoRef:   kind = "method";        break;
+    case kIndexCallSiteRef:         kind = "call_site";     break;
+    case kIndexMethodHandleRef:     kind = "method_handle"; break;
+    case kIndexProtoRef:            kind = "proto";         break;
+    default:
+        return;
+    }
+
+    outJsonInt("index", index);
+    outJsonStr("index_kind", kind);
+
+    switch (pDecInsn->indexType) {
+    case kIndexTypeRef:
+        if (index < pDexFile->pHeader->typeIdsSize)
+            outJsonStr("ref", dexStringByTypeIdx(pDexFile, index));
+        break;
+    case kIndexStringRef:
+        if (index < pDexFile->pHeader->stringIdsSize)
+            outJsonStr("ref", dexStringById(pDexFile, index));
+        break;
+    case kIndexMethodAndProtoRef:
+        outJsonInt("proto_idx", secondaryIndex);
+        /* fall through */
+    case kIndexMethodRef:
+        if (index < pDexFile->pHeader->methodIdsSize) {
+            const DexMethodId* pMethodId = dexGetMethodId(pDexFile, index);
+            outJsonKey("ref");
+            outPutc('"');
+            outJsonChars(dexStringByTypeIdx(pDexFile, pMethodId->classIdx));
+            outPutc('.');
+            outJsonChars(dexStringById(pDexFile, pMethodId->nameIdx));
+            outPutc(':');
+            outJsonChars(dexGetDescriptorFromMethodId(pDexFile, pMethodId,
+                    &pScratch->methodDesc));
+            outPutc('"');
+        }
+        break;
+    case kIndexFieldRef:
+        {
+            FieldMethodInfo fieldInfo;
+            if (getFieldInfo(pDexFile, index, &fieldInfo)) {
+                outJsonKey("ref");
+                outPutc('"');
+                outJsonChars(fieldInfo.classDescriptor);
+                outPutc('.');
+                outJsonChars(fieldInfo.name);
+                outPutc(':');
+                outJsonChars(fieldInfo.signature);
+                outPutc('"');
             }
-            printf("}, %s", indexBuf);
+        }
+        break;
+    case kIndexProtoRef:
+        {
+            const char* protoDesc = getProtoDescriptor(pDexFile, index,
+                    &pScratch->protoDesc);
+            if (protoDesc != NULL)
+                outJsonStr("ref", protoDesc);
         }
         break;
     default:
-        printf(" ???");
         break;
     }
+}
+
+/*
+ * Dump a single instruction as a JSON-lines record.  "addr" is in code
+ * units from the start of the method and "offset" is the byte offset in
+ * the file.  Register operands are listed in "regs"; depending on the
+ * format there may also be a "literal", a branch or payload "target"
+ * (as an address), or an index (see dumpIndexJson()).
+ */
+static void dumpInstructionJson(DexFile* pDexFile, const DexCode* pCode,
+    u4 methodIdx, int insnIdx, int insnWidth,
+    const DecodedInstruction* pDecInsn)
+{
+    const u2* insns = pCode->insns;
+    InstructionFormat format = dexGetFormatFromOpcode(pDecInsn->opcode);
+    u4 regs[3];
+
+    outJsonStart("insn");
+    outJsonInt("method_idx", methodIdx);
+    outJsonInt("addr", insnIdx);
+    outJsonInt("offset", ((u1*)insns - pDexFile->baseAddr) + insnIdx*2);
+    outJsonInt("width", insnWidth);
+    outJsonInt("opcode", pDecInsn->opcode);
+
+    if (pDecInsn->opcode == OP_NOP) {
+        u2 instr = insns[insnIdx];
+        if (instr == kPackedSwitchSignature) {
+            outJsonStr("op", "packed-switch-data");
+        } else if (instr == kSparseSwitchSignature) {
+            outJsonStr("op", "sparse-switch-data");
+        } else if (instr == kArrayDataSignature) {
+            outJsonStr("op", "array-data");
+        } else {
+            outJsonStr("op", "nop");
+        }
+        outJsonEnd();
+        return;
+    }
+
+    outJsonStr("op", dexGetOpcodeName(pDecInsn->opcode));
+    outJsonStr("format", dexGetFormatName(format));
 
-    putchar('\n');
+    switch (format) {
+    case kFmt11x:        // op vAA
+        outJsonRegs(&pDecInsn->vA, 0, 1);
+        break;
+    case kFmt12x:        // op vA, vB
+    case kFmt22x:        // op vAA, vBBBB
+    case kFmt32x:        // op vAAAA, vBBBB
+        regs[0] = pDecInsn->vA;
+        regs[1] = pDecInsn->vB;
+        outJsonRegs(regs, 0, 2);
+        break;
+    case kFmt23x:        // op vAA, vBB, vCC
+        regs[0] = pDecInsn->vA;
+        regs[1] = pDecInsn->vB;
+        regs[2] = pDecInsn->vC;
+        outJsonRegs(regs, 0, 3);
+        break;
+    case kFmt11n:        // op vA, #+B
+    case kFmt21s:        // op vAA, #+BBBB
+    case kFmt31i:        // op vAA, #+BBBBBBBB
+        outJsonRegs(&pDecInsn->vA, 0, 1);
+        outJsonInt("literal", (s4) pDecInsn->vB);
+        break;
+    case kFmt21h:        // op vAA, #+BBBB0000[00000000]
+        outJsonRegs(&pDecInsn->vA, 0, 1);
+        if (pDecInsn->opcode == OP_CONST_HIGH16)
+            outJsonInt("literal", (s4) (pDecInsn->vB << 16));
+        else
+            outJsonInt("literal", ((s8) pDecInsn->vB) << 48);
+        break;
+    case kFmt51l:        // op vAA, #+BBBBBBBBBBBBBBBB
+        outJsonRegs(&pDecInsn->vA, 0, 1);
+        outJsonInt("literal", (s8) pDecInsn->vB_wide);
+        break;
+    case kFmt22b:        // op vAA, vBB, #+CC
+    case kFmt22s:        // op vA, vB, #+CCCC
+        regs[0] = pDecInsn->vA;
+        regs[1] = pDecInsn->vB;
+        outJsonRegs(regs, 0, 2);
+        outJsonInt("literal", (s4) pDecInsn->vC);
+        break;
+    case kFmt10t:        // op +AA
+    case kFmt20t:        // op +AAAA
+    case kFmt30t:        // op +AAAAAAAA
+        outJsonInt("target", insnIdx + (s4) pDecInsn->vA);
+        break;
+    case kFmt21t:        // op vAA, +BBBB
+    case kFmt31t:        // op vAA, +BBBBBBBB
+        outJsonRegs(&pDecInsn->vA, 0, 1);
+        outJsonInt("target", insnIdx + (s4) pDecInsn->vB);
+        break;
+    case kFmt22t:        // op vA, vB, +CCCC
+        regs[0] = pDecInsn->vA;
+        regs[1] = pDecInsn->vB;
+        outJsonRegs(regs, 0, 2);
+        outJsonInt("target", insnIdx + (s4) pDecInsn->vC);
+        break;
+    case kFmt21c:        // op vAA, thing@BBBB
+    case kFmt31c:        // op vAA, thing@BBBBBBBB
+        outJsonRegs(&pDecInsn->vA, 0, 1);
+        dumpIndexJson(pDexFile, pDecInsn);
+        break;
+    case kFmt22c:        // op vA, vB, thing@CCCC
+    case kFmt22cs:       // [opt] op vA, vB, field offset CCCC
+        regs[0] = pDecInsn->vA;
+        regs[1] = pDecInsn->vB;
+        outJsonRegs(regs, 0, 2);
+        dumpIndexJson(pDexFile, pDecInsn);
+        break;
+    case kFmt35c:        // op {vC, vD, vE, vF, vG}, thing@BBBB
+    case kFmt35ms:       // [opt] invoke-virtual+super
+    case kFmt35mi:       // [opt] inline invoke
+        outJsonRegs(pDecInsn->arg, 0, pDecInsn->vA);
+        dumpIndexJson(pDexFile, pDecInsn);
+        break;
+    case kFmt3rc:        // op {vCCCC .. v(CCCC+AA-1)}, thing@BBBB
+    case kFmt3rms:       // [opt] invoke-virtual+super/range
+    case kFmt3rmi:       // [opt] execute-inline/range
+    case kFmt4rcc:       // op {vCCCC .. v(CCCC+AA-1)}, meth@BBBB, proto@HHHH
+        outJsonRegs(NULL, pDecInsn->vC, pDecInsn->vA);
+        dumpIndexJson(pDexFile, pDecInsn);
+        break;
+    case kFmt45cc:       // op {vC, vD, vE, vF, vG}, meth@BBBB, proto@HHHH
+        {
+            u4 args[5];
+            u4 count = pDecInsn->vA;
+
+            /* vC is held separately; the rest are in arg[0..3] */
+            if (count > 5)
+                count = 5;
+            args[0] = pDecInsn->vC;
+            if (count > 1)
+                memcpy(&args[1], pDecInsn->arg, (count - 1) * sizeof(u4));
+            outJsonRegs(args, 0, count);
+            dumpIndexJson(pDexFile, pDecInsn);
+        }
+        break;
+    case kFmt20bc:       // [opt] op AA, thing@BBBB
+        dumpIndexJson(pDexFile, pDecInsn);
+        break;
+    default:             // kFmt10x, kFmt00x
+        break;
+    }
 
-    free(indexBuf);
+    outJsonEnd();
 }
 
 /*
@@ -1193,7 +1991,7 @@ void dumpBytecodes(DexFile* pDexFile, const DexMethod* pDexMethod)
     int insnIdx;
     FieldMethodInfo methInfo;
     int startAddr;
-    char* className = NULL;
+    const char* className;
 
     assert(pCode->insnsSize > 0);
     insns = pCode->insns;
@@ -1202,58 +2000,41 @@ void dumpBytecodes(DexFile* pDexFile, const DexMethod* pDexMethod)
     methInfo.name =
     methInfo.signature = NULL;
 
-    getMethodInfo(pDexFile, pDexMethod->methodIdx, &methInfo);
-    startAddr = ((u1*)pCode - pDexFile->baseAddr);
-    className = descriptorToDot(methInfo.classDescriptor);
+    if (gOptions.outputFormat != OUTPUT_JSONL) {
+        getMethodInfo(pDexFile, pDexMethod->methodIdx, &methInfo);
+        startAddr = ((u1*)pCode - pDexFile->baseAddr);
+        className = dottedTypeName(pDexFile,
+            dexGetMethodId(pDexFile, pDexMethod->methodIdx)->classIdx);
 
-    printf("%06x:                                        |[%06x] %s.%s:%s\n",
-        startAddr, startAddr,
-        className, methInfo.name, methInfo.signature);
-    free((void *) methInfo.signature);
+        outPrintf("%06x:                                        |[%06x] %s.%s:%s\n",
+            startAddr, startAddr,
+            className, methInfo.name, methInfo.signature);
+        free((void *) methInfo.signature);
+    }
 
     insnIdx = 0;
     while (insnIdx < (int) pCode->insnsSize) {
         int insnWidth;
         DecodedInstruction decInsn;
-        u2 instr;
 
-        /*
-         * Note: This code parallels the function
-         * dexGetWidthFromInstruction() in InstrUtils.c, but this version
-         * can deal with data in either endianness.
-         *
-         * TODO: Figure out if this really matters, and possibly change
-         * this to just use dexGetWidthFromInstruction().
-         */
-        instr = get2LE((const u1*)insns);
-        if (instr == kPackedSwitchSignature) {
-            insnWidth = 4 + get2LE((const u1*)(insns+1)) * 2;
-        } else if (instr == kSparseSwitchSignature) {
-            insnWidth = 2 + get2LE((const u1*)(insns+1)) * 4;
-        } else if (instr == kArrayDataSignature) {
-            int width = get2LE((const u1*)(insns+1));
-            int size = get2LE((const u1*)(insns+2)) |
-                       (get2LE((const u1*)(insns+3))<<16);
-            // The plus 1 is to round up for odd size and width.
-            insnWidth = 4 + ((size * width) + 1) / 2;
-        } else {
-            Opcode opcode = dexOpcodeFromCodeUnit(instr);
-            insnWidth = dexGetWidthFromOpcode(opcode);
-            if (insnWidth == 0) {
-                fprintf(stderr,
-                    "GLITCH: zero-width instruction at idx=0x%04x\n", insnIdx);
-                break;
-            }
+        insnWidth = dexGetWidthFromInstruction(insns);
+        if (insnWidth == 0) {
+            fprintf(stderr,
+                "GLITCH: zero-width instruction at idx=0x%04x\n", insnIdx);
+            break;
         }
 
         dexDecodeInstruction(insns, &decInsn);
-        dumpInstruction(pDexFile, pCode, insnIdx, insnWidth, &decInsn);
+        if (gOptions.outputFormat == OUTPUT_JSONL) {
+            dumpInstructionJson(pDexFile, pCode, pDexMethod->methodIdx,
+                insnIdx, insnWidth, &decInsn);
+        } else {
+            dumpInstruction(pDexFile, pCode, insnIdx, insnWidth, &decInsn);
+        }
 
         insns += insnWidth;
         insnIdx += insnWidth;
     }
-
-    free(className);
 }
 
 /*
@@ -1263,10 +2044,10 @@ void dumpCode(DexFile* pDexFile, const DexMethod* pDexMethod)
 {
     const DexCode* pCode = dexGetCode(pDexFile, pDexMethod);
 
-    printf("      registers     : %d\n", pCode->registersSize);
-    printf("      ins           : %d\n", pCode->insSize);
-    printf("      outs          : %d\n", pCode->outsSize);
-    printf("      insns size    : %d 16-bit code units\n", pCode->insnsSize);
+    outPrintf("      registers     : %d\n", pCode->registersSize);
+    outPrintf("      ins           : %d\n", pCode->insSize);
+    outPrintf("      outs          : %d\n", pCode->outsSize);
+    outPrintf("      insns size    : %d 16-bit code units\n", pCode->insnsSize);
 
     if (gOptions.disassemble)
         dumpBytecodes(pDexFile, pDexMethod);
@@ -1288,14 +2069,16 @@ void dumpMethod(DexFile* pDexFile, const DexMethod* pDexMethod, int i)
     char* typeDescriptor = NULL;
     char* accessStr = NULL;
 
-    if (gOptions.exportsOnly &&
-        (pDexMethod->accessFlags & (ACC_PUBLIC | ACC_PROTECTED)) == 0)
-    {
+    if (gOptions.exportsOnly && !dexIsExportedMember(pDexMethod->accessFlags))
         return;
-    }
 
     pMethodId = dexGetMethodId(pDexFile, pDexMethod->methodIdx);
     name = dexStringById(pDexFile, pMethodId->nameIdx);
+    if (gOptions.methodFilter != NULL &&
+        strcmp(name, gOptions.methodFilter) != 0)
+    {
+        return;
+    }
     typeDescriptor = dexCopyDescriptorFromMethodId(pDexFile, pMethodId);
 
     backDescriptor = dexStringByTypeIdx(pDexFile, pMethodId->classIdx);
@@ -1304,68 +2087,55 @@ void dumpMethod(DexFile* pDexFile, const DexMethod* pDexMethod, int i)
                     kAccessForMethod);
 
     if (gOptions.outputFormat == OUTPUT_PLAIN) {
-        printf("    #%d              : (in %s)\n", i, backDescriptor);
-        printf("      name          : '%s'\n", name);
-        printf("      type          : '%s'\n", typeDescriptor);
-        printf("      access        : 0x%04x (%s)\n",
+        outPrintf("    #%d              : (in %s)\n", i, backDescriptor);
+        outPrintf("      name          : '%s'\n", name);
+        outPrintf("      type          : '%s'\n", typeDescriptor);
+        outPrintf("      access        : 0x%04x (%s)\n",
             pDexMethod->accessFlags, accessStr);
 
         if (pDexMethod->codeOff == 0) {
-            printf("      code          : (none)\n");
+            outPrintf("      code          : (none)\n");
         } else {
-            printf("      code          -\n");
+            outPrintf("      code          -\n");
             dumpCode(pDexFile, pDexMethod);
         }
 
         if (gOptions.disassemble)
-            putchar('\n');
+            outPutc('\n');
     } else if (gOptions.outputFormat == OUTPUT_XML) {
         bool constructor = (name[0] == '<');
 
         if (constructor) {
-            char* tmp;
-
-            tmp = descriptorClassToDot(backDescriptor);
-            printf("<constructor name=\"%s\"\n", tmp);
-            free(tmp);
-
-            tmp = descriptorToDot(backDescriptor);
-            printf(" type=\"%s\"\n", tmp);
-            free(tmp);
+            outPrintf("<constructor name=\"%s\"\n",
+                dottedClassName(pDexFile, pMethodId->classIdx));
+            outPrintf(" type=\"%s\"\n",
+                dottedTypeName(pDexFile, pMethodId->classIdx));
         } else {
-            printf("<method name=\"%s\"\n", name);
-
-            const char* returnType = strrchr(typeDescriptor, ')');
-            if (returnType == NULL) {
-                fprintf(stderr, "bad method type descriptor '%s'\n",
-                    typeDescriptor);
-                goto bail;
-            }
+            outPrintf("<method name=\"%s\"\n", name);
 
-            char* tmp = descriptorToDot(returnType+1);
-            printf(" return=\"%s\"\n", tmp);
-            free(tmp);
+            outPrintf(" return=\"%s\"\n", dottedTypeName(pDexFile,
+                dexGetProtoId(pDexFile, pMethodId->protoIdx)->returnTypeIdx));
 
-            printf(" abstract=%s\n",
+            outPrintf(" abstract=%s\n",
                 quotedBool((pDexMethod->accessFlags & ACC_ABSTRACT) != 0));
-            printf(" native=%s\n",
+            outPrintf(" native=%s\n",
                 quotedBool((pDexMethod->accessFlags & ACC_NATIVE) != 0));
 
             bool isSync =
                 (pDexMethod->accessFlags & ACC_SYNCHRONIZED) != 0 ||
                 (pDexMethod->accessFlags & ACC_DECLARED_SYNCHRONIZED) != 0;
-            printf(" synchronized=%s\n", quotedBool(isSync));
+            outPrintf(" synchronized=%s\n", quotedBool(isSync));
         }
 
-        printf(" static=%s\n",
+        outPrintf(" static=%s\n",
             quotedBool((pDexMethod->accessFlags & ACC_STATIC) != 0));
-        printf(" final=%s\n",
+        outPrintf(" final=%s\n",
             quotedBool((pDexMethod->accessFlags & ACC_FINAL) != 0));
         // "deprecated=" not knowable w/o parsing annotations
-        printf(" visibility=%s\n",
+        outPrintf(" visibility=%s\n",
             quotedVisibility(pDexMethod->accessFlags));
 
-        printf(">\n");
+        outPrintf(">\n");
 
         /*
          * Parameters.
@@ -1375,44 +2145,47 @@ void dumpMethod(DexFile* pDexFile, const DexMethod* pDexMethod, int i)
             goto bail;
         }
 
-        char tmpBuf[strlen(typeDescriptor)+1];      /* more than big enough */
-        int argNum = 0;
-
-        const char* base = typeDescriptor+1;
-
-        while (*base != ')') {
-            char* cp = tmpBuf;
-
-            while (*base == '[')
-                *cp++ = *base++;
+        const DexTypeList* pParams = dexGetProtoParameters(pDexFile,
+            dexGetProtoId(pDexFile, pMethodId->protoIdx));
+        u4 numParams = (pParams != NULL) ? pParams->size : 0;
 
-            if (*base == 'L') {
-                /* copy through ';' */
-                do {
-                    *cp = *base++;
-                } while (*cp++ != ';');
-            } else {
-                /* primitive char, copy it */
-                if (strchr("ZBCSIFJD", *base) == NULL) {
-                    fprintf(stderr, "ERROR: bad method signature '%s'\n", base);
-                    goto bail;
-                }
-                *cp++ = *base++;
-            }
-
-            /* null terminate and display */
-            *cp++ = '\0';
-
-            char* tmp = descriptorToDot(tmpBuf);
-            printf("<parameter name=\"arg%d\" type=\"%s\">\n</parameter>\n",
-                argNum++, tmp);
-            free(tmp);
+        for (u4 argNum = 0; argNum < numParams; argNum++) {
+            outPrintf("<parameter name=\"arg%u\" type=\"%s\">\n</parameter>\n",
+                argNum, dottedTypeName(pDexFile,
+                    dexTypeListGetIdx(pParams, argNum)));
         }
 
         if (constructor)
-            printf("</constructor>\n");
+            outPrintf("</constructor>\n");
         else
-            printf("</method>\n");
+            outPrintf("</method>\n");
+    } else if (gOptions.outputFormat == OUTPUT_JSONL) {
+        outJsonStart("method");
+        outJsonInt("method_idx", pDexMethod->methodIdx);
+        outJsonInt("class_idx", pMethodId->classIdx);
+        outJsonStr("class", backDescriptor);
+        outJsonStr("name", name);
+        outJsonInt("proto_idx", pMethodId->protoIdx);
+        outJsonStr("descriptor", typeDescriptor);
+        outJsonInt("access_flags", pDexMethod->accessFlags);
+        outJsonInt("code_off", pDexMethod->codeOff);
+
+        if (pDexMethod->codeOff != 0) {
+            const DexCode* pCode = dexGetCode(pDexFile, pDexMethod);
+
+            outJsonInt("registers", pCode->registersSize);
+            outJsonInt("ins", pCode->insSize);
+            outJsonInt("outs", pCode->outsSize);
+            outJsonInt("insns_size", pCode->insnsSize);
+            outJsonInt("tries", pCode->triesSize);
+            outJsonInt("debug_info_off", pCode->debugInfoOff);
+            outJsonEnd();
+
+            if (gOptions.disassemble && pCode->insnsSize > 0)
+                dumpBytecodes(pDexFile, pDexMethod);
+        } else {
+            outJsonEnd();
+        }
     }
 
 bail:
@@ -1431,11 +2204,8 @@ void dumpSField(const DexFile* pDexFile, const DexField* pSField, int i)
     const char* typeDescriptor;
     char* accessStr;
 
-    if (gOptions.exportsOnly &&
-        (pSField->accessFlags & (ACC_PUBLIC | ACC_PROTECTED)) == 0)
-    {
+    if (gOptions.exportsOnly && !dexIsExportedMember(pSField->accessFlags))
         return;
-    }
 
     pFieldId = dexGetFieldId(pDexFile, pSField->fieldIdx);
     name = dexStringById(pDexFile, pFieldId->nameIdx);
@@ -1445,33 +2215,40 @@ void dumpSField(const DexFile* pDexFile, const DexField* pSField, int i)
     accessStr = createAccessFlagStr(pSField->accessFlags, kAccessForField);
 
     if (gOptions.outputFormat == OUTPUT_PLAIN) {
-        printf("    #%d              : (in %s)\n", i, backDescriptor);
-        printf("      name          : '%s'\n", name);
-        printf("      type          : '%s'\n", typeDescriptor);
-        printf("      access        : 0x%04x (%s)\n",
+        outPrintf("    #%d              : (in %s)\n", i, backDescriptor);
+        outPrintf("      name          : '%s'\n", name);
+        outPrintf("      type          : '%s'\n", typeDescriptor);
+        outPrintf("      access        : 0x%04x (%s)\n",
             pSField->accessFlags, accessStr);
     } else if (gOptions.outputFormat == OUTPUT_XML) {
-        char* tmp;
-
-        printf("<field name=\"%s\"\n", name);
-
-        tmp = descriptorToDot(typeDescriptor);
-        printf(" type=\"%s\"\n", tmp);
-        free(tmp);
+        outPrintf("<field name=\"%s\"\n", name);
+        outPrintf(" type=\"%s\"\n",
+            dottedTypeName(pDexFile, pFieldId->typeIdx));
 
-        printf(" transient=%s\n",
+        outPrintf(" transient=%s\n",
             quotedBool((pSField->accessFlags & ACC_TRANSIENT) != 0));
-        printf(" volatile=%s\n",
+        outPrintf(" volatile=%s\n",
             quotedBool((pSField->accessFlags & ACC_VOLATILE) != 0));
         // "value=" not knowable w/o parsing annotations
-        printf(" static=%s\n",
+        outPrintf(" static=%s\n",
             quotedBool((pSField->accessFlags & ACC_STATIC) != 0));
-        printf(" final=%s\n",
+        outPrintf(" final=%s\n",
             quotedBool((pSField->accessFlags & ACC_FINAL) != 0));
         // "deprecated=" not knowable w/o parsing annotations
-        printf(" visibility=%s\n",
+        outPrintf(" visibility=%s\n",
             quotedVisibility(pSField->accessFlags));
-        printf(">\n</field>\n");
+        outPrintf(">\n</field>\n");
+    } else if (gOptions.outputFormat == OUTPUT_JSONL) {
+        outJsonStart("field");
+        outJsonInt("field_idx", pSField->fieldIdx);
+        outJsonInt("class_idx", pFieldId->classIdx);
+        outJsonStr("class", backDescriptor);
+        outJsonStr("name", name);
+        outJsonInt("type_idx", pFieldId->typeIdx);
+        outJsonStr("type", typeDescriptor);
+        outJsonInt("access_flags", pSField->accessFlags);
+        outJsonBool("static", (pSField->accessFlags & ACC_STATIC) != 0);
+        outJsonEnd();
     }
 
     free(accessStr);
@@ -1485,13 +2262,90 @@ void dumpIField(const DexFile* pDexFile, const DexField* pIField, int i)
     dumpSField(pDexFile, pIField, i);
 }
 
+/*
+ * Switch the XML output to a class in package "package", which must be
+ * newly-allocated.  If "*pLastPackage" is NULL or doesn't match, this
+ * starts a new package and takes ownership of "package"; otherwise
+ * "package" is freed.
+ */
+static void changePackage(char** pLastPackage, char* package)
+{
+    if (*pLastPackage == NULL || strcmp(package, *pLastPackage) != 0) {
+        /* start of a new package */
+        if (*pLastPackage != NULL)
+            outPrintf("</package>\n");
+        outPrintf("<package name=\"%s\"\n>\n", package);
+        free(*pLastPackage);
+        *pLastPackage = package;
+    } else {
+        free(package);
+    }
+}
+
+/*
+ * Write the JSON-lines record for a class.  The class' fields and methods
+ * follow in records of their own.
+ */
+static void dumpClassJson(const DexFile* pDexFile, int idx,
+    const DexClassDef* pClassDef, const DexClassData* pClassData)
+{
+    const DexTypeList* pInterfaces;
+    int i;
+
+    outJsonStart("class");
+    outJsonInt("class_def_idx", idx);
+    outJsonInt("class_idx", pClassDef->classIdx);
+    outJsonStr("descriptor", dexStringByTypeIdx(pDexFile, pClassDef->classIdx));
+    outJsonStr("name", dottedTypeName(pDexFile, pClassDef->classIdx));
+    outJsonInt("access_flags", pClassDef->accessFlags);
+
+    outJsonIndex("superclass_idx", pClassDef->superclassIdx);
+    if (pClassDef->superclassIdx != kDexNoIndex) {
+        outJsonStr("superclass",
+            dexStringByTypeIdx(pDexFile, pClassDef->superclassIdx));
+    } else {
+        outJsonKey("superclass");
+        outPuts("null");
+    }
+
+    outJsonKey("interfaces");
+    outPutc('[');
+    pInterfaces = dexGetInterfacesList(pDexFile, pClassDef);
+    if (pInterfaces != NULL) {
+        for (i = 0; i < (int) pInterfaces->size; i++) {
+            if (i != 0)
+                outPutc(',');
+            outDec(dexTypeListGetIdx(pInterfaces, i));
+        }
+    }
+    outPutc(']');
+
+    outJsonIndex("source_file_idx", pClassDef->sourceFileIdx);
+    if (pClassDef->sourceFileIdx != kDexNoIndex) {
+        outJsonStr("source_file",
+            dexStringById(pDexFile, pClassDef->sourceFileIdx));
+    } else {
+        outJsonKey("source_file");
+        outPuts("null");
+    }
+
+    outJsonInt("class_data_off", pClassDef->classDataOff);
+    outJsonInt("static_fields", pClassData->header.staticFieldsSize);
+    outJsonInt("instance_fields", pClassData->header.instanceFieldsSize);
+    outJsonInt("direct_methods", pClassData->header.directMethodsSize);
+    outJsonInt("virtual_methods", pClassData->header.virtualMethodsSize);
+    outJsonEnd();
+}
+
 /*
  * Dump the class.
  *
  * Note "idx" is a DexClassDef index, not a DexTypeId index.
  *
  * If "*pLastPackage" is NULL or does not match the current class' package,
- * the value will be replaced with a newly-allocated string.
+ * the value will be replaced with a newly-allocated string.  When
+ * formatting into an OutputBuffer, the package is recorded in the buffer
+ * instead and "pLastPackage" is not used.
  */
 void dumpClass(DexFile* pDexFile, int idx, char** pLastPackage)
 {
@@ -1507,7 +2361,7 @@ void dumpClass(DexFile* pDexFile, int idx, char** pLastPackage)
 
     pClassDef = dexGetClassDef(pDexFile, idx);
 
-    if (gOptions.exportsOnly && (pClassDef->accessFlags & ACC_PUBLIC) == 0) {
+    if (gOptions.exportsOnly && !dexIsExportedClass(pClassDef->accessFlags)) {
         //printf("<!-- omitting non-public class %s -->\n",
         //    classDescriptor);
         goto bail;
@@ -1517,17 +2371,19 @@ void dumpClass(DexFile* pDexFile, int idx, char** pLastPackage)
     pClassData = dexReadAndVerifyClassData(&pEncodedData, NULL);
 
     if (pClassData == NULL) {
-        printf("Trouble reading class data (#%d)\n", idx);
+        if (gOptions.outputFormat == OUTPUT_JSONL)
+            fprintf(stderr, "Trouble reading class data (#%d)\n", idx);
+        else
+            outPrintf("Trouble reading class data (#%d)\n", idx);
         goto bail;
     }
 
     classDescriptor = dexStringByTypeIdx(pDexFile, pClassDef->classIdx);
 
     /*
-     * For the XML output, show the package name.  Ideally we'd gather
-     * up the classes, sort them, and dump them alphabetically so the
-     * package name wouldn't jump around, but that's not a great plan
-     * for something that needs to run on the device.
+     * For the XML output, show the package name.  Unless the classes
+     * were sorted with -s (see sortClasses()) the package name may jump
+     * around, in which case the package is closed and reopened.
      */
     if (!(classDescriptor[0] == 'L' &&
           classDescriptor[strlen(classDescriptor)-1] == ';'))
@@ -1556,15 +2412,12 @@ void dumpClass(DexFile* pDexFile, int idx, char** pLastPackage)
                 *cp = '.';
         }
 
-        if (*pLastPackage == NULL || strcmp(mangle, *pLastPackage) != 0) {
-            /* start of a new package */
-            if (*pLastPackage != NULL)
-                printf("</package>\n");
-            printf("<package name=\"%s\"\n>\n", mangle);
-            free(*pLastPackage);
-            *pLastPackage = mangle;
+        if (gOutBuf->parallelSlot) {
+            /* formatting in parallel; the writer handles the change */
+            gOutBuf->package = mangle;
+            gOutBuf->packagePos = gOutBuf->len;
         } else {
-            free(mangle);
+            changePackage(pLastPackage, mangle);
         }
     }
 
@@ -1578,37 +2431,35 @@ void dumpClass(DexFile* pDexFile, int idx, char** pLastPackage)
     }
 
     if (gOptions.outputFormat == OUTPUT_PLAIN) {
-        printf("Class #%d            -\n", idx);
-        printf("  Class descriptor  : '%s'\n", classDescriptor);
-        printf("  Access flags      : 0x%04x (%s)\n",
+        outPrintf("Class #%d            -\n", idx);
+        outPrintf("  Class descriptor  : '%s'\n", classDescriptor);
+        outPrintf("  Access flags      : 0x%04x (%s)\n",
             pClassDef->accessFlags, accessStr);
 
         if (superclassDescriptor != NULL)
-            printf("  Superclass        : '%s'\n", superclassDescriptor);
-
-        printf("  Interfaces        -\n");
-    } else {
-        char* tmp;
+            outPrintf("  Superclass        : '%s'\n", superclassDescriptor);
 
-        tmp = descriptorClassToDot(classDescriptor);
-        printf("<class name=\"%s\"\n", tmp);
-        free(tmp);
+        outPrintf("  Interfaces        -\n");
+    } else if (gOptions.outputFormat == OUTPUT_XML) {
+        outPrintf("<class name=\"%s\"\n",
+            dottedClassName(pDexFile, pClassDef->classIdx));
 
         if (superclassDescriptor != NULL) {
-            tmp = descriptorToDot(superclassDescriptor);
-            printf(" extends=\"%s\"\n", tmp);
-            free(tmp);
+            outPrintf(" extends=\"%s\"\n",
+                dottedTypeName(pDexFile, pClassDef->superclassIdx));
         }
-        printf(" abstract=%s\n",
+        outPrintf(" abstract=%s\n",
             quotedBool((pClassDef->accessFlags & ACC_ABSTRACT) != 0));
-        printf(" static=%s\n",
+        outPrintf(" static=%s\n",
             quotedBool((pClassDef->accessFlags & ACC_STATIC) != 0));
-        printf(" final=%s\n",
+        outPrintf(" final=%s\n",
             quotedBool((pClassDef->accessFlags & ACC_FINAL) != 0));
         // "deprecated=" not knowable w/o parsing annotations
-        printf(" visibility=%s\n",
+        outPrintf(" visibility=%s\n",
             quotedVisibility(pClassDef->accessFlags));
-        printf(">\n");
+        outPrintf(">\n");
+    } else if (gOptions.outputFormat == OUTPUT_JSONL) {
+        dumpClassJson(pDexFile, idx, pClassDef, pClassData);
     }
     pInterfaces = dexGetInterfacesList(pDexFile, pClassDef);
     if (pInterfaces != NULL) {
@@ -1617,25 +2468,25 @@ void dumpClass(DexFile* pDexFile, int idx, char** pLastPackage)
     }
 
     if (gOptions.outputFormat == OUTPUT_PLAIN)
-        printf("  Static fields     -\n");
+        outPrintf("  Static fields     -\n");
     for (i = 0; i < (int) pClassData->header.staticFieldsSize; i++) {
         dumpSField(pDexFile, &pClassData->staticFields[i], i);
     }
 
     if (gOptions.outputFormat == OUTPUT_PLAIN)
-        printf("  Instance fields   -\n");
+        outPrintf("  Instance fields   -\n");
     for (i = 0; i < (int) pClassData->header.instanceFieldsSize; i++) {
         dumpIField(pDexFile, &pClassData->instanceFields[i], i);
     }
 
     if (gOptions.outputFormat == OUTPUT_PLAIN)
-        printf("  Direct methods    -\n");
+        outPrintf("  Direct methods    -\n");
     for (i = 0; i < (int) pClassData->header.directMethodsSize; i++) {
         dumpMethod(pDexFile, &pClassData->directMethods[i], i);
     }
 
     if (gOptions.outputFormat == OUTPUT_PLAIN)
-        printf("  Virtual methods   -\n");
+        outPrintf("  Virtual methods   -\n");
     for (i = 0; i < (int) pClassData->header.virtualMethodsSize; i++) {
         dumpMethod(pDexFile, &pClassData->virtualMethods[i], i);
     }
@@ -1648,13 +2499,13 @@ void dumpClass(DexFile* pDexFile, int idx, char** pLastPackage)
         fileName = "unknown";
 
     if (gOptions.outputFormat == OUTPUT_PLAIN) {
-        printf("  source_file_idx   : %d (%s)\n",
+        outPrintf("  source_file_idx   : %d (%s)\n",
             pClassDef->sourceFileIdx, fileName);
-        printf("\n");
+        outPrintf("\n");
     }
 
     if (gOptions.outputFormat == OUTPUT_XML) {
-        printf("</class>\n");
+        outPrintf("</class>\n");
     }
 
 bail:
@@ -1691,7 +2542,7 @@ void dumpDifferentialCompressedMap(const u1** pData)
     int origLen = 4 + (addrWidth + regWidth) * numEntries;
     int compLen = (data - dataStart) + compressedLen;
 
-    printf("        (differential compression %d -> %d [%d -> %d])\n",
+    outPrintf("        (differential compression %d -> %d [%d -> %d])\n",
         origLen, compLen,
         (addrWidth + regWidth) * numEntries, compressedLen);
 
@@ -1717,25 +2568,26 @@ void dumpMethodMap(DexFile* pDexFile, const DexMethod* pDexMethod, int idx,
 
     pMethodId = dexGetMethodId(pDexFile, pDexMethod->methodIdx);
     name = dexStringById(pDexFile, pMethodId->nameIdx);
-    printf("      #%d: 0x%08x %s\n", idx, offset, name);
+    outPrintf("      #%d: 0x%08x %s\n", idx, offset, name);
 
     u1 format;
     int addrWidth;
 
-    format = *data++;
-    if (format == 1) {              /* kRegMapFormatNone */
+    format = dexRegisterMapGetFormat(data);
+    data++;
+    if (format == kDexRegMapFormatNone) {
         /* no map */
-        printf("        (no map)\n");
+        outPrintf("        (no map)\n");
         addrWidth = 0;
-    } else if (format == 2) {       /* kRegMapFormatCompact8 */
+    } else if (format == kDexRegMapFormatCompact8) {
         addrWidth = 1;
-    } else if (format == 3) {       /* kRegMapFormatCompact16 */
+    } else if (format == kDexRegMapFormatCompact16) {
         addrWidth = 2;
-    } else if (format == 4) {       /* kRegMapFormatDifferential */
+    } else if (format == kDexRegMapFormatDifferential) {
         dumpDifferentialCompressedMap(&data);
         goto bail;
     } else {
-        printf("        (unknown format %d!)\n", format);
+        outPrintf("        (unknown format %d!)\n", format);
         /* don't know how to skip data; failure will cascade to end of class */
         goto bail;
     }
@@ -1754,11 +2606,11 @@ void dumpMethodMap(DexFile* pDexFile, const DexMethod* pDexMethod, int idx,
             if (addrWidth > 1)
                 addr |= (*data++) << 8;
 
-            printf("        %4x:", addr);
+            outPrintf("        %4x:", addr);
             for (byte = 0; byte < regWidth; byte++) {
-                printf(" %02x", *data++);
+                outPrintf(" %02x", *data++);
             }
-            printf("\n");
+            outPrintf("\n");
         }
     }
 
@@ -1771,10 +2623,9 @@ bail:
 /*
  * Dump the contents of the register map area.
  *
- * These are only present in optimized DEX files, and the structure is
- * not really exposed to other parts of the VM itself.  We're going to
- * dig through them here, but this is pretty fragile.  DO NOT rely on
- * this or derive other code from it.
+ * These are only present in optimized DEX files.  This walks the whole
+ * area sequentially; code that wants the map for a single method should
+ * use dexFindRegisterMap() and dexRegisterMapGetLine() instead.
  */
 void dumpRegisterMaps(DexFile* pDexFile)
 {
@@ -1786,7 +2637,7 @@ void dumpRegisterMaps(DexFile* pDexFile)
     int idx;
 
     if (pClassPool == NULL) {
-        printf("No register maps found\n");
+        outPrintf("No register maps found\n");
         return;
     }
 
@@ -1795,8 +2646,8 @@ void dumpRegisterMaps(DexFile* pDexFile)
     ptr += sizeof(u4);
     classOffsets = (const u4*) ptr;
 
-    printf("RMAP begins at offset 0x%07x\n", baseFileOffset);
-    printf("Maps for %d classes\n", numClasses);
+    outPrintf("RMAP begins at offset 0x%07x\n", baseFileOffset);
+    outPrintf("Maps for %d classes\n", numClasses);
     for (idx = 0; idx < (int) numClasses; idx++) {
         const DexClassDef* pClassDef;
         const char* classDescriptor;
@@ -1804,7 +2655,7 @@ void dumpRegisterMaps(DexFile* pDexFile)
         pClassDef = dexGetClassDef(pDexFile, idx);
         classDescriptor = dexStringByTypeIdx(pDexFile, pClassDef->classIdx);
 
-        printf("%4d: +%d (0x%08x) %s\n", idx, classOffsets[idx],
+        outPrintf("%4d: +%d (0x%08x) %s\n", idx, classOffsets[idx],
             baseFileOffset + classOffsets[idx], classDescriptor);
 
         if (classOffsets[idx] == 0)
@@ -1833,19 +2684,19 @@ void dumpRegisterMaps(DexFile* pDexFile)
         if (methodCount != pClassData->header.directMethodsSize
                             + pClassData->header.virtualMethodsSize)
         {
-            printf("NOTE: method count discrepancy (%d != %d + %d)\n",
+            outPrintf("NOTE: method count discrepancy (%d != %d + %d)\n",
                 methodCount, pClassData->header.directMethodsSize,
                 pClassData->header.virtualMethodsSize);
             /* this is bad, but keep going anyway */
         }
 
-        printf("    direct methods: %d\n",
+        outPrintf("    direct methods: %d\n",
             pClassData->header.directMethodsSize);
         for (i = 0; i < (int) pClassData->header.directMethodsSize; i++) {
             dumpMethodMap(pDexFile, &pClassData->directMethods[i], i, &data);
         }
 
-        printf("    virtual methods: %d\n",
+        outPrintf("    virtual methods: %d\n",
             pClassData->header.virtualMethodsSize);
         for (i = 0; i < (int) pClassData->header.virtualMethodsSize; i++) {
             dumpMethodMap(pDexFile, &pClassData->virtualMethods[i], i, &data);
@@ -1925,19 +2776,19 @@ static void dumpMethodHandles(DexFile* pDexFile)
                 is_static = false;
                 break;
             default:
-                printf("Unknown method handle type 0x%02x, skipped.", mh.methodHandleType);
+                outPrintf("Unknown method handle type 0x%02x, skipped.", mh.methodHandleType);
                 continue;
         }
 
         FieldMethodInfo info;
         if (is_invoke) {
             if (!getMethodInfo(pDexFile, mh.fieldOrMethodIdx, &info)) {
-                printf("Unknown method handle target method@%04x, skipped.", mh.fieldOrMethodIdx);
+                outPrintf("Unknown method handle target method@%04x, skipped.", mh.fieldOrMethodIdx);
                 continue;
             }
         } else {
             if (!getFieldInfo(pDexFile, mh.fieldOrMethodIdx, &info)) {
-                printf("Unknown method handle target field@%04x, skipped.", mh.fieldOrMethodIdx);
+                outPrintf("Unknown method handle target field@%04x, skipped.", mh.fieldOrMethodIdx);
                 continue;
             }
         }
@@ -1945,18 +2796,18 @@ static void dumpMethodHandles(DexFile* pDexFile)
         const char* instance = is_static ? "" : info.classDescriptor;
 
         if (gOptions.outputFormat == OUTPUT_XML) {
-            printf("<method_handle index index=\"%u\"\n", i);
-            printf(" type=\"%s\"\n", type);
-            printf(" target_class=\"%s\"\n", info.classDescriptor);
-            printf(" target_member=\"%s\"\n", info.name);
-            printf(" target_member_type=\"%c%s%s\"\n",
+            outPrintf("<method_handle index index=\"%u\"\n", i);
+            outPrintf(" type=\"%s\"\n", type);
+            outPrintf(" target_class=\"%s\"\n", info.classDescriptor);
+            outPrintf(" target_member=\"%s\"\n", info.name);
+            outPrintf(" target_member_type=\"%c%s%s\"\n",
                    info.signature[0], instance, info.signature + 1);
-            printf("</method_handle>\n");
+            outPrintf("</method_handle>\n");
         } else {
-            printf("Method Handle #%u:\n", i);
-            printf("  type        : %s\n", type);
-            printf("  target      : %s %s\n", info.classDescriptor, info.name);
-            printf("  target_type : %c%s%s\n", info.signature[0], instance, info.signature + 1);
+            outPrintf("Method Handle #%u:\n", i);
+            outPrintf("  type        : %s\n", type);
+            outPrintf("  target      : %s %s\n", info.classDescriptor, info.name);
+            outPrintf("  target_type : %c%s%s\n", info.signature[0], instance, info.signature + 1);
         }
     }
 }
@@ -2003,195 +2854,1471 @@ static void dumpCallSites(DexFile* pDexFile)
     const DexCallSiteId* ids = (const DexCallSiteId*)(pDexFile->baseAddr + item->offset);
     for (u4 index = 0; index < item->size; ++index) {
         bool doXml = (gOptions.outputFormat == OUTPUT_XML);
-        printf(doXml ? "<call_site index=\"%u\" offset=\"%u\">\n" : "Call Site #%u // offset %u\n",
+        outPrintf(doXml ? "<call_site index=\"%u\" offset=\"%u\">\n" : "Call Site #%u // offset %u\n",
                index, ids[index].callSiteOff);
         const u1* data = pDexFile->baseAddr + ids[index].callSiteOff;
         u4 count = readUnsignedLeb128(&data);
         for (u4 i = 0; i < count; ++i) {
-            printf(doXml ? "<link_argument index=\"%u\" " : "  link_argument[%u] : ", i);
+            outPrintf(doXml ? "<link_argument index=\"%u\" " : "  link_argument[%u] : ", i);
             u1 headerByte = *data++;
             u4 valueType = headerByte & kDexAnnotationValueTypeMask;
             u4 valueArg = headerByte >> kDexAnnotationValueArgShift;
             switch (valueType) {
                 case kDexAnnotationByte: {
-                    printf(doXml ? "type=\"byte\" value=\"%d\"/>" : "%d (byte)", (int)*data++);
+                    outPrintf(doXml ? "type=\"byte\" value=\"%d\"/>" : "%d (byte)", (int)*data++);
                     break;
                 }
                 case kDexAnnotationShort: {
-                    printf(doXml ? "type=\"short\" value=\"%d\"/>" : "%d (short)",
+                    outPrintf(doXml ? "type=\"short\" value=\"%d\"/>" : "%d (short)",
                            (int) readSignedLittleEndian(&data, valueArg + 1));
                     break;
                 }
                 case kDexAnnotationChar: {
-                    printf(doXml ? "type=\"short\" value=\"%u\"/>" : "%u (char)",
+                    outPrintf(doXml ? "type=\"short\" value=\"%u\"/>" : "%u (char)",
                            (u2) readUnsignedLittleEndian(&data, valueArg + 1));
                     break;
                 }
                 case kDexAnnotationInt: {
-                    printf(doXml ? "type=\"int\" value=\"%d\"/>" : "%d (int)",
+                    outPrintf(doXml ? "type=\"int\" value=\"%d\"/>" : "%d (int)",
                            (int) readSignedLittleEndian(&data, valueArg + 1));
                     break;
                 }
                 case kDexAnnotationLong: {
-                    printf(doXml ? "type=\"long\" value=\"%" PRId64 "\"/>" : "%" PRId64 " (long)",
+                    outPrintf(doXml ? "type=\"long\" value=\"%" PRId64 "\"/>" : "%" PRId64 " (long)",
                            (int64_t) readSignedLittleEndian(&data, valueArg + 1));
                     break;
                 }
                 case kDexAnnotationFloat: {
                     u4 rawValue = (u4) (readUnsignedLittleEndian(&data, valueArg + 1, true) >> 32);
-                    printf(doXml ? "type=\"float\" value=\"%g\"/>" : "%g (float)",
+                    outPrintf(doXml ? "type=\"float\" value=\"%g\"/>" : "%g (float)",
                            *((float*) &rawValue));
                     break;
                 }
                 case kDexAnnotationDouble: {
                     u8 rawValue = readUnsignedLittleEndian(&data, valueArg + 1, true);
-                    printf(doXml ? "type=\"double\" value=\"%g\"/>" : "%g (double)",
+                    outPrintf(doXml ? "type=\"double\" value=\"%g\"/>" : "%g (double)",
                            *((double*) &rawValue));
                     break;
                 }
                 case kDexAnnotationMethodType: {
                     u4 idx = (u4) readUnsignedLittleEndian(&data, valueArg + 1);
-                    ProtoInfo protoInfo;
-                    memset(&protoInfo, 0, sizeof(protoInfo));
-                    getProtoInfo(pDexFile, idx, &protoInfo);
-                    printf(doXml ? "type=\"MethodType\" value=\"(%s)%s\"/>" : "(%s)%s (MethodType)",
-                           protoInfo.parameterTypes, protoInfo.returnType);
-                    free(protoInfo.parameterTypes);
+                    const char* protoDesc = getProtoDescriptor(pDexFile, idx,
+                           &getOperandScratch()->protoDesc);
+                    outPrintf(doXml ? "type=\"MethodType\" value=\"%s\"/>" : "%s (MethodType)",
+                           protoDesc != NULL ? protoDesc : "<proto?>");
                     break;
                 }
                 case kDexAnnotationMethodHandle: {
                     u4 idx = (u4) readUnsignedLittleEndian(&data, valueArg + 1);
-                    printf(doXml ? "type=\"MethodHandle\" value=\"%u\"/>" : "%u (MethodHandle)",
+                    outPrintf(doXml ? "type=\"MethodHandle\" value=\"%u\"/>" : "%u (MethodHandle)",
                            idx);
                     break;
                 }
                 case kDexAnnotationString: {
                     u4 idx = (u4) readUnsignedLittleEndian(&data, valueArg + 1);
-                    printf(doXml ? "type=\"String\" value=\"%s\"/>" : "%s (String)",
+                    outPrintf(doXml ? "type=\"String\" value=\"%s\"/>" : "%s (String)",
                            dexStringById(pDexFile, idx));
                     break;
                 }
                 case kDexAnnotationType: {
                     u4 idx = (u4) readUnsignedLittleEndian(&data, valueArg + 1);
-                    printf(doXml ? "type=\"Class\" value=\"%s\"/>" : "%s (Class)",
+                    outPrintf(doXml ? "type=\"Class\" value=\"%s\"/>" : "%s (Class)",
                            dexStringByTypeIdx(pDexFile, idx));
                     break;
                 }
                 case kDexAnnotationNull: {
-                    printf(doXml ? "type=\"null\" value=\"null\"/>" : "null (null)");
+                    outPrintf(doXml ? "type=\"null\" value=\"null\"/>" : "null (null)");
                     break;
                 }
                 case kDexAnnotationBoolean: {
-                    printf(doXml ? "type=\"boolean\" value=\"%s\"/>" : "%s (boolean)",
+                    outPrintf(doXml ? "type=\"boolean\" value=\"%s\"/>" : "%s (boolean)",
                            (valueArg & 1) == 0 ? "false" : "true");
                     break;
                 }
                 default:
                     // Other types are not anticipated being reached here.
-                    printf("Unexpected type found, bailing on call site info.\n");
+                    outPrintf("Unexpected type found, bailing on call site info.\n");
                     i = count;
                     break;
             }
-            printf("\n");
+            outPrintf("\n");
         }
 
         if (doXml) {
-            printf("</callsite>\n");
+            outPrintf("</callsite>\n");
         }
     }
 }
 
 /*
- * Dump the requested sections of the file.
+ * State shared by the threads that format classes in parallel.
+ *
+ * Workers claim classes in class_def order and format each one into the
+ * OutputBuffer slot for its index.  The writer (the calling thread)
+ * writes the buffers to stdout in order.  A worker may only claim a
+ * class that is less than "window" ahead of the writer, which bounds
+ * memory use and guarantees that its slot has already been written.
  */
-void processDexFile(const char* fileName, DexFile* pDexFile)
-{
-    char* package = NULL;
-    int i;
+struct ParallelDump {
+    DexFile*        pDexFile;
+    const u4*       classList;      /* class_def indices, or NULL for all */
+    int             numClasses;
+    DottedNames*    pDottedNames;
+    int             window;
+    OutputBuffer*   slots;          /* [window] */
+    bool*           slotReady;      /* [window] */
+
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;           /* class formatted, or slot written */
+    int             nextClass;      /* next class to claim */
+    int             nextWrite;      /* next class to write */
+};
 
-    if (gOptions.verbose) {
-        printf("Opened '%s', DEX version '%.3s'\n", fileName,
-            pDexFile->pHeader->magic +4);
-    }
+/*
+ * Worker thread: format classes until there aren't any left.
+ */
+static void* dumpClassThreadStart(void* arg)
+{
+    ParallelDump* pState = (ParallelDump*) arg;
 
-    if (gOptions.dumpRegisterMaps) {
-        dumpRegisterMaps(pDexFile);
-        return;
-    }
+    gDottedNames = pState->pDottedNames;
 
-    if (gOptions.showFileHeaders) {
-        dumpFileHeader(pDexFile);
-        dumpOptDirectory(pDexFile);
-    }
+    pthread_mutex_lock(&pState->lock);
+    while (true) {
+        while (pState->nextClass < pState->numClasses &&
+               pState->nextClass >= pState->nextWrite + pState->window)
+        {
+            pthread_cond_wait(&pState->cond, &pState->lock);
+        }
+        if (pState->nextClass >= pState->numClasses)
+            break;
 
-    if (gOptions.outputFormat == OUTPUT_XML)
-        printf("<api>\n");
+        int pos = pState->nextClass++;
+        int slot = pos % pState->window;
+        int idx = (pState->classList != NULL) ? pState->classList[pos] : pos;
+        pthread_mutex_unlock(&pState->lock);
 
-    for (i = 0; i < (int) pDexFile->pHeader->classDefsSize; i++) {
+        gOutBuf = &pState->slots[slot];
         if (gOptions.showSectionHeaders)
-            dumpClassDef(pDexFile, i);
+            dumpClassDef(pState->pDexFile, idx);
+        dumpClass(pState->pDexFile, idx, NULL);
+        gOutBuf = NULL;
 
-        dumpClass(pDexFile, i, &package);
+        pthread_mutex_lock(&pState->lock);
+        pState->slotReady[slot] = true;
+        pthread_cond_broadcast(&pState->cond);
     }
+    pthread_mutex_unlock(&pState->lock);
 
-    dumpMethodHandles(pDexFile);
-    dumpCallSites(pDexFile);
-
-    /* free the last one allocated */
-    if (package != NULL) {
-        printf("</package>\n");
-        free(package);
-    }
+    releaseOperandScratch();
 
-    if (gOptions.outputFormat == OUTPUT_XML)
-        printf("</api>\n");
+    return NULL;
 }
 
-
 /*
- * Process one file.
+ * Dump the "numClasses" classes in "classList" (or all of them, if it's
+ * NULL), formatting them on gOptions.numThreads threads.  The output is
+ * identical to dumping them one at a time.
  */
-int process(const char* fileName)
+void dumpClassesParallel(DexFile* pDexFile, const u4* classList,
+    int numClasses, char** pLastPackage)
 {
-    DexFile* pDexFile = NULL;
-    MemMapping map;
-    bool mapped = false;
-    int result = -1;
-
-    if (gOptions.verbose)
-        printf("Processing '%s'...\n", fileName);
+    ParallelDump state;
+    pthread_t* threads;
+    int numThreads = gOptions.numThreads;
+    int numStarted = 0;
+    int i;
 
-    if (dexOpenAndMap(fileName, gOptions.tempFileName, &map, false) != 0) {
-        return result;
+    state.pDexFile = pDexFile;
+    state.classList = classList;
+    state.numClasses = numClasses;
+    state.pDottedNames = gDottedNames;
+    state.window = numThreads * 4;
+    state.slots = (OutputBuffer*) calloc(state.window, sizeof(OutputBuffer));
+    state.slotReady = (bool*) calloc(state.window, sizeof(bool));
+    state.nextClass = state.nextWrite = 0;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+    threads = (pthread_t*) calloc(numThreads, sizeof(pthread_t));
+
+    if (state.slots == NULL || state.slotReady == NULL || threads == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        goto bail;
+    }
+    for (i = 0; i < state.window; i++) {
+        state.slots[i].flushAt = SIZE_MAX;
+        state.slots[i].parallelSlot = true;
     }
-    mapped = true;
 
-    int flags = kDexParseVerifyChecksum;
-    if (gOptions.ignoreBadChecksum)
-        flags |= kDexParseContinueOnError;
+    for (i = 0; i < numThreads; i++) {
+        if (pthread_create(&threads[i], NULL, dumpClassThreadStart,
+                &state) != 0)
+        {
+            break;
+        }
+        numStarted++;
+    }
 
-    pDexFile = dexFileParse((u1*)map.addr, map.length, flags);
-    if (pDexFile == NULL) {
-        fprintf(stderr, "ERROR: DEX parse failed\n");
+    if (numStarted == 0) {
+        /* couldn't start any threads; do it the slow way */
+        fprintf(stderr, "WARNING: unable to start threads\n");
+        for (i = 0; i < state.numClasses; i++) {
+            int idx = (classList != NULL) ? classList[i] : i;
+            if (gOptions.showSectionHeaders)
+                dumpClassDef(pDexFile, idx);
+            dumpClass(pDexFile, idx, pLastPackage);
+        }
         goto bail;
     }
 
-    if (gOptions.checksumOnly) {
-        printf("Checksum verified\n");
-    } else {
-        processDexFile(fileName, pDexFile);
-    }
+    for (i = 0; i < state.numClasses; i++) {
+        int slot = i % state.window;
+        OutputBuffer* pBuf = &state.slots[slot];
 
-    result = 0;
+        pthread_mutex_lock(&state.lock);
+        while (!state.slotReady[slot])
+            pthread_cond_wait(&state.cond, &state.lock);
+        pthread_mutex_unlock(&state.lock);
 
-bail:
-    if (mapped)
-        sysReleaseShmem(&map);
-    if (pDexFile != NULL)
-        dexFileFree(pDexFile);
-    return result;
+        if (pBuf->package != NULL) {
+            outWrite(pBuf->data, pBuf->packagePos);
+            changePackage(pLastPackage, pBuf->package);
+            outWrite(pBuf->data + pBuf->packagePos,
+                pBuf->len - pBuf->packagePos);
+        } else {
+            outWrite(pBuf->data, pBuf->len);
+        }
+        pBuf->len = 0;
+        pBuf->package = NULL;
+
+        pthread_mutex_lock(&state.lock);
+        state.slotReady[slot] = false;
+        state.nextWrite = i + 1;
+        pthread_cond_broadcast(&state.cond);
+        pthread_mutex_unlock(&state.lock);
+    }
+
+    for (i = 0; i < numStarted; i++)
+        pthread_join(threads[i], NULL);
+
+bail:
+    if (state.slots != NULL) {
+        for (i = 0; i < state.window; i++)
+            free(state.slots[i].data);
+    }
+    free(state.slots);
+    free(state.slotReady);
+    free(threads);
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.cond);
+}
+
+/*
+ * Class descriptor and class_def index, for the sorted indexes used to
+ * match -C prefixes and to order the classes for -s.
+ */
+struct ClassSortEntry {
+    const char* descriptor;
+    u4          classDefIdx;
+    u4          packageLen;     /* length of descriptor up to the last '/' */
+};
+
+static void initClassSortEntry(const DexFile* pDexFile, u4 classDefIdx,
+    ClassSortEntry* pEntry)
+{
+    const DexClassDef* pClassDef = dexGetClassDef(pDexFile, classDefIdx);
+    const char* descriptor = dexStringByTypeIdx(pDexFile, pClassDef->classIdx);
+    const char* lastSlash = strrchr(descriptor, '/');
+
+    pEntry->descriptor = descriptor;
+    pEntry->classDefIdx = classDefIdx;
+    pEntry->packageLen = (lastSlash != NULL) ? lastSlash - descriptor : 0;
+}
+
+static int compareClassSortEntries(const void* a, const void* b)
+{
+    return strcmp(((const ClassSortEntry*) a)->descriptor,
+        ((const ClassSortEntry*) b)->descriptor);
+}
+
+/*
+ * Build the descriptor-sorted index of all class_defs.  This only reads
+ * the class_def and string data, not the class data.
+ */
+static ClassSortEntry* createClassSortIndex(const DexFile* pDexFile)
+{
+    u4 count = pDexFile->pHeader->classDefsSize;
+    ClassSortEntry* index;
+    u4 i;
+
+    index = (ClassSortEntry*) malloc(count * sizeof(ClassSortEntry) + 1);
+    if (index == NULL)
+        return NULL;
+
+    for (i = 0; i < count; i++)
+        initClassSortEntry(pDexFile, i, &index[i]);
+    qsort(index, count, sizeof(ClassSortEntry), compareClassSortEntries);
+
+    return index;
 }
 
+/*
+ * Order classes by package, then by descriptor.  A package sorts before
+ * its subpackages, and each package's classes are contiguous.
+ */
+static int compareClassPackages(const void* a, const void* b)
+{
+    const ClassSortEntry* pA = (const ClassSortEntry*) a;
+    const ClassSortEntry* pB = (const ClassSortEntry*) b;
+    u4 len = (pA->packageLen < pB->packageLen) ? pA->packageLen : pB->packageLen;
+    int cmp;
+
+    cmp = memcmp(pA->descriptor, pB->descriptor, len);
+    if (cmp == 0 && pA->packageLen != pB->packageLen)
+        return (pA->packageLen < pB->packageLen) ? -1 : 1;
+    if (cmp == 0)
+        cmp = strcmp(pA->descriptor, pB->descriptor);
+    if (cmp == 0) {
+        /* duplicate definitions; keep the output deterministic */
+        cmp = (pA->classDefIdx < pB->classDefIdx) ? -1 : 1;
+    }
+    return cmp;
+}
+
+/*
+ * Sort the classes to dump for -s.  "*pList" holds the "count" class_def
+ * indices to dump, or is NULL for all of them; on success it's replaced
+ * with a newly-allocated list in package order.
+ *
+ * Only this index is held in memory; the classes are still formatted
+ * and written one at a time, so each XML <package> is opened only once
+ * without buffering the output.
+ */
+static bool sortClasses(const DexFile* pDexFile, u4** pList, u4 count)
+{
+    ClassSortEntry* index;
+    u4* list;
+    u4 i;
+
+    index = (ClassSortEntry*) malloc(count * sizeof(ClassSortEntry) + 1);
+    list = (u4*) malloc(count * sizeof(u4) + 1);
+    if (index == NULL || list == NULL) {
+        fprintf(stderr, "ERROR: unable to sort classes\n");
+        free(index);
+        free(list);
+        return false;
+    }
+
+    for (i = 0; i < count; i++) {
+        initClassSortEntry(pDexFile, (*pList != NULL) ? (*pList)[i] : i,
+            &index[i]);
+    }
+    qsort(index, count, sizeof(ClassSortEntry), compareClassPackages);
+
+    for (i = 0; i < count; i++)
+        list[i] = index[i].classDefIdx;
+    free(index);
+
+    free(*pList);
+    *pList = list;
+    return true;
+}
+
+/*
+ * Find the class_defs selected by the -C options.  A filter that ends in
+ * ';' is an exact descriptor, e.g. "Ljava/lang/Object;", and is looked up
+ * through the class lookup table.  Anything else is a descriptor prefix,
+ * e.g. "Ljava/lang/" for a package and its subpackages, and is matched
+ * with a binary search of a sorted index.
+ *
+ * On success, "*pList" is set to a newly-allocated array of the selected
+ * class_def indices in ascending order, and "*pCount" to its length.
+ */
+static bool selectClasses(DexFile* pDexFile, u4** pList, u4* pCount)
+{
+    u4 numClassDefs = pDexFile->pHeader->classDefsSize;
+    DexClassLookup* pOwnLookup = NULL;
+    ClassSortEntry* sortIndex = NULL;
+    bool* selected = NULL;
+    u4* list = NULL;
+    u4 count = 0;
+    bool result = false;
+    u4 i;
+    int f;
+
+    selected = (bool*) calloc(numClassDefs + 1, sizeof(bool));
+    if (selected == NULL)
+        goto bail;
+
+    for (f = 0; f < gOptions.numClassFilters; f++) {
+        const char* filter = gOptions.classFilters[f];
+        size_t len = strlen(filter);
+        bool found = false;
+
+        if (len > 0 && filter[len-1] == ';') {
+            /* odex files carry a lookup table; build one for plain dex */
+            if (pDexFile->pClassLookup == NULL) {
+                pOwnLookup = dexCreateClassLookup(pDexFile);
+                if (pOwnLookup == NULL)
+                    goto bail;
+                pDexFile->pClassLookup = pOwnLookup;
+            }
+
+            const DexClassDef* pClassDef = dexFindClass(pDexFile, filter);
+            if (pClassDef != NULL) {
+                selected[pClassDef - dexGetClassDef(pDexFile, 0)] = true;
+                found = true;
+            }
+        } else {
+            if (sortIndex == NULL) {
+                sortIndex = createClassSortIndex(pDexFile);
+                if (sortIndex == NULL)
+                    goto bail;
+            }
+
+            /* find the first descriptor >= the prefix */
+            u4 lo = 0, hi = numClassDefs;
+            while (lo < hi) {
+                u4 mid = lo + (hi - lo) / 2;
+                if (strcmp(sortIndex[mid].descriptor, filter) < 0)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+
+            for (i = lo; i < numClassDefs; i++) {
+                if (strncmp(sortIndex[i].descriptor, filter, len) != 0)
+                    break;
+                selected[sortIndex[i].classDefIdx] = true;
+                found = true;
+            }
+        }
+
+        if (!found)
+            fprintf(stderr, "WARNING: no class matches '%s'\n", filter);
+    }
+
+    list = (u4*) malloc(numClassDefs * sizeof(u4) + 1);
+    if (list == NULL)
+        goto bail;
+    for (i = 0; i < numClassDefs; i++) {
+        if (selected[i])
+            list[count++] = i;
+    }
+
+    *pList = list;
+    *pCount = count;
+    result = true;
+
+bail:
+    if (!result)
+        fprintf(stderr, "ERROR: unable to build class index\n");
+    if (pOwnLookup != NULL) {
+        pDexFile->pClassLookup = NULL;
+        free(pOwnLookup);
+    }
+    free(sortIndex);
+    free(selected);
+    return result;
+}
+
+/*
+ * Dump the requested sections of the file.
+ */
+void processDexFile(const char* fileName, DexFile* pDexFile)
+{
+    char* package = NULL;
+    u4* classList = NULL;
+    u4 numClasses;
+    DottedNames dottedNames;
+    int i;
+
+    if (gOptions.verbose) {
+        outPrintf("Opened '%s', DEX version '%.3s'\n", fileName,
+            pDexFile->pHeader->magic +4);
+    }
+
+    if (gOptions.dumpRegisterMaps) {
+        dumpRegisterMaps(pDexFile);
+        return;
+    }
+
+    if (gOptions.numClassFilters > 0) {
+        if (!selectClasses(pDexFile, &classList, &numClasses))
+            return;
+    } else {
+        numClasses = pDexFile->pHeader->classDefsSize;
+    }
+
+    if (gOptions.sortClasses && !sortClasses(pDexFile, &classList, numClasses)) {
+        free(classList);
+        return;
+    }
+
+    if (!dottedNamesInit(&dottedNames, pDexFile)) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        dottedNamesFree();
+        free(classList);
+        return;
+    }
+
+    if (gOptions.showFileHeaders) {
+        dumpFileHeader(pDexFile);
+        dumpOptDirectory(pDexFile);
+    }
+
+    if (gOptions.outputFormat == OUTPUT_XML) {
+        outPrintf("<api>\n");
+    } else if (gOptions.outputFormat == OUTPUT_JSONL) {
+        const DexHeader* pHeader = pDexFile->pHeader;
+
+        outJsonStart("file");
+        outJsonStr("name", fileName);
+        outJsonKey("version");
+        outPutc('"');
+        outWrite((const char*) pHeader->magic + 4, 3);
+        outPutc('"');
+        outJsonInt("file_size", pHeader->fileSize);
+        outJsonInt("string_ids", pHeader->stringIdsSize);
+        outJsonInt("type_ids", pHeader->typeIdsSize);
+        outJsonInt("proto_ids", pHeader->protoIdsSize);
+        outJsonInt("field_ids", pHeader->fieldIdsSize);
+        outJsonInt("method_ids", pHeader->methodIdsSize);
+        outJsonInt("class_defs", pHeader->classDefsSize);
+        outJsonEnd();
+    }
+
+    if (gOptions.numThreads > 1 && numClasses > 1) {
+        dumpClassesParallel(pDexFile, classList, numClasses, &package);
+    } else {
+        for (i = 0; i < (int) numClasses; i++) {
+            int idx = (classList != NULL) ? classList[i] : i;
+
+            if (gOptions.showSectionHeaders)
+                dumpClassDef(pDexFile, idx);
+
+            dumpClass(pDexFile, idx, &package);
+        }
+    }
+
+    /*
+     * These aren't owned by a class, so skip them when filtering.  There
+     * are no JSON-lines records for them (yet).
+     */
+    if (gOptions.numClassFilters == 0 &&
+        gOptions.outputFormat != OUTPUT_JSONL)
+    {
+        dumpMethodHandles(pDexFile);
+        dumpCallSites(pDexFile);
+    }
+
+    /* free the last one allocated */
+    if (package != NULL) {
+        outPrintf("</package>\n");
+        free(package);
+    }
+
+    if (gOptions.outputFormat == OUTPUT_XML)
+        outPrintf("</api>\n");
+
+    dottedNamesFree();
+    free(classList);
+}
+
+
+/*
+ * Start a group of counters in the statistics output.
+ */
+static void statsGroupStart(const char* group, bool* pFirst)
+{
+    if (gOptions.statsFormat == STATS_JSON)
+        outPrintf(",\n\"%s\":{", group);
+    *pFirst = true;
+}
+
+/*
+ * Finish a group of counters.
+ */
+static void statsGroupEnd(void)
+{
+    if (gOptions.statsFormat == STATS_JSON)
+        outPrintf("}");
+}
+
+/*
+ * Print one counter: a "group,key,count" row for CSV, or a member of the
+ * group object for JSON.
+ */
+static void statsPrint(const char* group, const char* key, u8 count,
+    bool* pFirst)
+{
+    if (gOptions.statsFormat == STATS_CSV) {
+        outPrintf("%s,%s,%" PRIu64 "\n", group, key, count);
+    } else {
+        outPrintf("%s\"%s\":%" PRIu64, *pFirst ? "" : ",", key, count);
+    }
+    *pFirst = false;
+}
+
+/*
+ * Print a register-count histogram, skipping empty buckets.
+ */
+static void statsPrintRegHist(const char* group, const u8* hist)
+{
+    bool first;
+    int i;
+
+    statsGroupStart(group, &first);
+    for (i = 0; i < kDexRegBucketCount; i++) {
+        char key[24];
+        u4 low, high;
+
+        if (hist[i] == 0)
+            continue;
+
+        dexGetRegBucketRange(i, &low, &high);
+        if (low == high)
+            sprintf(key, "%u", low);
+        else if (high == 0xffffffff)
+            sprintf(key, "%u+", low);
+        else
+            sprintf(key, "%u-%u", low, high);
+        statsPrint(group, key, hist[i], &first);
+    }
+    statsGroupEnd();
+}
+
+/*
+ * Dump the instruction statistics gathered from all files.  Histogram
+ * entries with a zero count are left out.
+ */
+void dumpCodeStats(const DexCodeStats* pStats)
+{
+    bool first;
+    int i;
+
+    if (gOptions.statsFormat == STATS_CSV) {
+        outPrintf("group,key,count\n");
+        first = true;
+    } else {
+        outPrintf("{\"summary\":{");
+        first = true;
+    }
+
+    statsPrint("summary", "files", pStats->numFiles, &first);
+    statsPrint("summary", "code_items", pStats->numCodeItems, &first);
+    statsPrint("summary", "bad_code_items", pStats->numBadCodeItems, &first);
+    statsPrint("summary", "code_units", pStats->numCodeUnits, &first);
+    statsPrint("summary", "insns", pStats->numInsns, &first);
+    statsPrint("summary", "tries", pStats->numTries, &first);
+    statsPrint("summary", "payloads", pStats->numPayloads, &first);
+    statsPrint("summary", "payload_units", pStats->numPayloadUnits, &first);
+    statsPrint("summary", "max_registers", pStats->maxRegisters, &first);
+    statsPrint("summary", "max_ins", pStats->maxIns, &first);
+    statsPrint("summary", "max_outs", pStats->maxOuts, &first);
+    statsGroupEnd();
+
+    statsGroupStart("opcode", &first);
+    for (i = 0; i < kNumPackedOpcodes; i++) {
+        if (pStats->opcodeCounts[i] != 0) {
+            statsPrint("opcode", dexGetOpcodeName((Opcode) i),
+                pStats->opcodeCounts[i], &first);
+        }
+    }
+    statsGroupEnd();
+
+    statsGroupStart("format", &first);
+    for (i = 0; i < kNumInstructionFormats; i++) {
+        if (pStats->formatCounts[i] != 0) {
+            statsPrint("format", dexGetFormatName((InstructionFormat) i),
+                pStats->formatCounts[i], &first);
+        }
+    }
+    statsGroupEnd();
+
+    statsGroupStart("width", &first);
+    for (i = 1; i <= kDexMaxInsnWidth; i++) {
+        char key[8];
+
+        if (pStats->widthCounts[i] != 0) {
+            sprintf(key, "%d", i);
+            statsPrint("width", key, pStats->widthCounts[i], &first);
+        }
+    }
+    statsGroupEnd();
+
+    statsGroupStart("invoke", &first);
+    for (i = 0; i < kDexInvokeKindCount; i++) {
+        if (pStats->invokeCounts[i] != 0) {
+            statsPrint("invoke", dexGetInvokeKindName((DexInvokeKind) i),
+                pStats->invokeCounts[i], &first);
+        }
+    }
+    statsGroupEnd();
+
+    statsPrintRegHist("registers", pStats->registersHist);
+    statsPrintRegHist("ins", pStats->insHist);
+    statsPrintRegHist("outs", pStats->outsHist);
+    statsPrintRegHist("invoke_args", pStats->invokeArgsHist);
+
+    if (gOptions.statsFormat == STATS_JSON)
+        outPrintf("}\n");
+}
+
+/*
+ * Set of item content hashes, used by -S to find duplicated items across
+ * all of the files dumped.  Only the hashes are kept, so two different
+ * items with the same 64-bit hash would be miscounted as duplicates.
+ */
+struct BlobSet {
+    u4      numSlots;               /* always power of 2 */
+    u4      count;
+    u8*     slots;                  /* hashes; 0 means empty */
+
+    u8      numItems;
+    u8      itemBytes;
+    u8      numDups;
+    u8      dupBytes;
+};
+
+static BlobSet gStringDataBlobs;
+static BlobSet gDebugInfoBlobs;
+static pthread_mutex_t gBlobLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* initial number of slots in a BlobSet */
+static const u4 kBlobSetInitialSlots = 4096;
+
+/*
+ * Compute the FNV-1a hash of an item, including its length.  Never
+ * returns 0.
+ */
+static u8 hashBlob(const u1* data, u4 size)
+{
+    u8 hash = 0xcbf29ce484222325ULL ^ size;
+    u4 i;
+
+    for (i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return (hash != 0) ? hash : 1;
+}
+
+/*
+ * Insert a hash into a set's table.  Returns false if it was already
+ * there.
+ */
+static bool blobSetInsert(BlobSet* pSet, u8 hash)
+{
+    u4 mask = pSet->numSlots - 1;
+    u4 idx = (u4) hash & mask;
+
+    while (pSet->slots[idx] != 0) {
+        if (pSet->slots[idx] == hash)
+            return false;
+        idx = (idx + 1) & mask;
+    }
+    pSet->slots[idx] = hash;
+    pSet->count++;
+    return true;
+}
+
+/*
+ * Record an item in a set, counting it as a duplicate if an item with
+ * the same contents was seen before.  Call with gBlobLock held.
+ */
+static void blobSetAdd(BlobSet* pSet, u8 hash, u4 size)
+{
+    if ((pSet->count + 1) * 2 > pSet->numSlots) {
+        u4 oldNumSlots = pSet->numSlots;
+        u8* oldSlots = pSet->slots;
+        u4 i;
+
+        pSet->numSlots = (oldNumSlots != 0) ?
+            oldNumSlots * 2 : kBlobSetInitialSlots;
+        pSet->slots = (u8*) calloc(pSet->numSlots, sizeof(u8));
+        if (pSet->slots == NULL) {
+            fprintf(stderr, "ERROR: out of memory\n");
+            exit(1);
+        }
+        pSet->count = 0;
+        for (i = 0; i < oldNumSlots; i++) {
+            if (oldSlots[i] != 0)
+                blobSetInsert(pSet, oldSlots[i]);
+        }
+        free(oldSlots);
+    }
+
+    pSet->numItems++;
+    pSet->itemBytes += size;
+    if (!blobSetInsert(pSet, hash)) {
+        pSet->numDups++;
+        pSet->dupBytes += size;
+    }
+}
+
+/*
+ * Callback for each item in the file; hashes the string_data_items and
+ * debug_info_items.
+ */
+static void sizeStatsItemCb(void* cnxt, u2 type, const u1* data, u4 size)
+{
+    BlobSet* pSet;
+
+    (void) cnxt;
+    if (type == kDexTypeStringDataItem)
+        pSet = &gStringDataBlobs;
+    else if (type == kDexTypeDebugInfoItem)
+        pSet = &gDebugInfoBlobs;
+    else
+        return;
+
+    u8 hash = hashBlob(data, size);
+
+    pthread_mutex_lock(&gBlobLock);
+    blobSetAdd(pSet, hash, size);
+    pthread_mutex_unlock(&gBlobLock);
+}
+
+/*
+ * Print one "kind,file,name,count,bytes" row of the -S output.
+ */
+static void sizeStatsPrint(const char* kind, const char* fileName,
+    const char* name, u8 count, u8 bytes)
+{
+    outPrintf("%s,%s,%s,%" PRIu64 ",%" PRIu64 "\n",
+        kind, fileName, name, count, bytes);
+}
+
+/*
+ * Dump the section and per-class sizes of a file, as CSV rows.  Rows
+ * with zero bytes are left out.
+ */
+bool dumpSizeStats(const char* fileName, const DexFile* pDexFile)
+{
+    DexSizeStats stats;
+    u8 numPaddings = 0;
+    u8 paddingBytes = 0;
+    u4 i;
+
+    if (!dexSizeStatsCompute(pDexFile, &stats, sizeStatsItemCb, NULL))
+        return false;
+
+    sizeStatsPrint("file", fileName, "total", 1, pDexFile->pHeader->fileSize);
+
+    for (i = 0; i < stats.numSections; i++) {
+        const DexSectionSize* pSection = &stats.sections[i];
+        const char* name = dexGetMapItemTypeName(pSection->type);
+        char nameBuf[16];
+
+        if (name == NULL) {
+            sprintf(nameBuf, "0x%04x", pSection->type);
+            name = nameBuf;
+        }
+
+        sizeStatsPrint("section", fileName, name, pSection->count,
+            pSection->itemBytes);
+        if (pSection->paddingBytes != 0) {
+            sizeStatsPrint("padding", fileName, name, pSection->numPaddings,
+                pSection->paddingBytes);
+        }
+        numPaddings += pSection->numPaddings;
+        paddingBytes += pSection->paddingBytes;
+    }
+    sizeStatsPrint("padding", fileName, "total", numPaddings, paddingBytes);
+
+    for (i = 0; i < stats.numClasses; i++) {
+        const DexClassSize* pSize = &stats.classes[i];
+        const char* descriptor = dexStringByTypeIdx(pDexFile,
+            dexGetClassDef(pDexFile, i)->classIdx);
+
+        if (pSize->classDataBytes != 0) {
+            sizeStatsPrint("class_data", fileName, descriptor, 1,
+                pSize->classDataBytes);
+        }
+        if (pSize->codeBytes != 0) {
+            sizeStatsPrint("code", fileName, descriptor,
+                pSize->numCodeItems, pSize->codeBytes);
+        }
+        if (pSize->debugInfoBytes != 0) {
+            sizeStatsPrint("debug_info", fileName, descriptor,
+                pSize->numDebugInfos, pSize->debugInfoBytes);
+        }
+        if (pSize->annotationBytes != 0) {
+            sizeStatsPrint("annotations", fileName, descriptor,
+                pSize->numAnnotations, pSize->annotationBytes);
+        }
+        if (pSize->staticValuesBytes != 0) {
+            sizeStatsPrint("static_values", fileName, descriptor, 1,
+                pSize->staticValuesBytes);
+        }
+    }
+
+    dexSizeStatsFree(&stats);
+    return true;
+}
+
+/*
+ * Dump the duplicate item counts gathered from all files, and free the
+ * hash sets.
+ */
+void dumpSizeStatsDups(void)
+{
+    static const struct {
+        BlobSet*    pSet;
+        const char* name;
+    } kSets[] = {
+        { &gStringDataBlobs, "string_data_item" },
+        { &gDebugInfoBlobs, "debug_info_item" },
+    };
+    size_t i;
+
+    for (i = 0; i < sizeof(kSets) / sizeof(kSets[0]); i++) {
+        BlobSet* pSet = kSets[i].pSet;
+
+        sizeStatsPrint("items", "*", kSets[i].name, pSet->numItems,
+            pSet->itemBytes);
+        sizeStatsPrint("dups", "*", kSets[i].name, pSet->numDups,
+            pSet->dupBytes);
+        free(pSet->slots);
+        memset(pSet, 0, sizeof(*pSet));
+    }
+}
+
+/*
+ * Map and parse a DEX file, which may be inside a Jar/APK or be an
+ * optimized DEX file.  On success the mapping is left in "pMap", and
+ * must be released after the DexFile is freed.
+ */
+static DexFile* openDexFile(const char* fileName, const char* tempFileName,
+    MemMapping* pMap)
+{
+    DexFile* pDexFile;
+
+    if (dexOpenAndMap(fileName, tempFileName, pMap, false) != 0)
+        return NULL;
+
+    int flags = kDexParseVerifyChecksum;
+    if (gOptions.ignoreBadChecksum)
+        flags |= kDexParseContinueOnError;
+    if (gOptions.sizeStats)
+        flags |= kDexParseCodeExtents;      /* -S sizes every code_item */
+
+    pDexFile = dexFileParse((u1*)pMap->addr, pMap->length, flags);
+    if (pDexFile == NULL) {
+        fprintf(stderr, "ERROR: DEX parse failed\n");
+        sysReleaseShmem(pMap);
+    }
+    return pDexFile;
+}
+
+/*
+ * Process one file.
+ */
+int process(const char* fileName, const char* tempFileName)
+{
+    DexFile* pDexFile = NULL;
+    MemMapping map;
+    int result = -1;
+
+    if (gOptions.verbose)
+        outPrintf("Processing '%s'...\n", fileName);
+
+    pDexFile = openDexFile(fileName, tempFileName, &map);
+    if (pDexFile == NULL)
+        return result;
+
+    if (gOptions.checksumOnly) {
+        outPrintf("Checksum verified\n");
+    } else if (gOptions.statsFormat != STATS_NONE) {
+        DexCodeStats stats;
+
+        dexCodeStatsInit(&stats);
+        if (!dexCodeStatsScan(pDexFile, gOptions.numThreads, &stats)) {
+            fprintf(stderr, "ERROR: unable to scan code in '%s'\n", fileName);
+            goto bail;
+        }
+
+        pthread_mutex_lock(&gCodeStatsLock);
+        dexCodeStatsMerge(&gCodeStats, &stats);
+        pthread_mutex_unlock(&gCodeStatsLock);
+    } else if (gOptions.sizeStats) {
+        if (!dumpSizeStats(fileName, pDexFile)) {
+            fprintf(stderr, "ERROR: unable to size sections of '%s'\n",
+                fileName);
+            goto bail;
+        }
+    } else {
+        processDexFile(fileName, pDexFile);
+    }
+
+    result = 0;
+
+bail:
+    dexFileFree(pDexFile);
+    sysReleaseShmem(&map);
+    return result;
+}
+
+/* longest file name accepted in a batch manifest */
+static const int kBatchMaxPath = 4096;
+
+/*
+ * State shared by the threads of a batch run (-B).
+ *
+ * Workers take file names from the manifest one at a time and dump each
+ * file into their own OutputBuffer.  With -o, the output for each file
+ * goes to its own file in that directory.  Otherwise it's written to
+ * stdout as a frame: a "#dexdump-batch" header line giving the sequence
+ * number, status, length and file name, followed by exactly that many
+ * bytes of output.  Frames appear in the order the files finish.
+ *
+ * A report line with the same sequence number is written to stderr for
+ * each file, and a summary line at the end.
+ */
+struct BatchState {
+    FILE*           manifest;
+
+    pthread_mutex_t lock;           /* guards everything below */
+    u4              nextSeq;
+    u4              numFiles;
+    u4              numFailed;
+    u8              bytesIn;
+    u8              bytesOut;
+};
+
+struct BatchWorker {
+    BatchState*     pState;
+    pthread_t       thread;
+    char            tempFileName[kBatchMaxPath];
+};
+
+/*
+ * Get a monotonic timestamp, in milliseconds.
+ */
+static double batchNowMs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Read the next file name from a manifest.  Blank lines and lines that
+ * start with '#' are skipped.  Returns 1 on success, 0 at end of file,
+ * or -1 if the line didn't fit in "buf" (in which case it's skipped).
+ */
+static int readManifestLine(FILE* fp, char* buf, int bufLen)
+{
+    while (fgets(buf, bufLen, fp) != NULL) {
+        size_t len = strlen(buf);
+
+        if (len > 0 && buf[len-1] != '\n' && !feof(fp)) {
+            int ic;
+            while ((ic = getc(fp)) != EOF && ic != '\n')
+                ;
+            return -1;
+        }
+
+        while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\r'))
+            buf[--len] = '\0';
+        if (len == 0 || buf[0] == '#')
+            continue;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Pick a temp file name for a batch worker.  Zip archives are extracted
+ * to a temp file, so each worker needs its own.
+ */
+static void makeBatchTempName(char* buf, size_t bufLen, int worker)
+{
+    if (gOptions.tempFileName != NULL) {
+        snprintf(buf, bufLen, "%s-%d", gOptions.tempFileName, worker);
+    } else {
+        const char* dir = ".";
+
+        if (access("/tmp", W_OK) == 0)
+            dir = "/tmp";
+        else if (access("/sdcard", W_OK) == 0)
+            dir = "/sdcard";
+        snprintf(buf, bufLen, "%s/dex-temp-%d-%d", dir, (int) getpid(),
+            worker);
+    }
+}
+
+/*
+ * Dump one file of a batch run, and report on it.  The output is
+ * formatted into "pBuf", which is this thread's gOutBuf.
+ */
+static void batchProcessFile(BatchWorker* pWorker, u4 seq,
+    const char* fileName, OutputBuffer* pBuf)
+{
+    BatchState* pState = pWorker->pState;
+    double startMs = batchNowMs();
+    u8 bytesIn = 0;
+    u8 bytesOut = 0;
+    struct stat sb;
+    int result = -1;
+
+    if (stat(fileName, &sb) == 0)
+        bytesIn = sb.st_size;
+
+    if (gOptions.batchOutDir != NULL) {
+        char outName[kBatchMaxPath];
+        const char* baseName = strrchr(fileName, '/');
+        FILE* fp;
+
+        baseName = (baseName != NULL) ? baseName + 1 : fileName;
+        int nameLen = snprintf(outName, sizeof(outName), "%s/%06u-%s.txt",
+            gOptions.batchOutDir, seq, baseName);
+
+        if (nameLen < 0 || (size_t) nameLen >= sizeof(outName)) {
+            fprintf(stderr, "ERROR: output file name for '%s' is too long\n",
+                fileName);
+        } else if ((fp = fopen(outName, "w")) == NULL) {
+            fprintf(stderr, "ERROR: unable to create '%s': %s\n",
+                outName, strerror(errno));
+        } else {
+            pBuf->fp = fp;
+            pBuf->flushAt = kStdoutBufferSize / 2;
+            result = process(fileName, pWorker->tempFileName);
+            outBufFlush(pBuf);
+            bytesOut = ftell(fp);
+            if (fclose(fp) != 0) {
+                fprintf(stderr, "ERROR: failed writing '%s'\n", outName);
+                result = -1;
+            }
+            pBuf->fp = NULL;
+            pBuf->flushAt = SIZE_MAX;
+        }
+    } else {
+        result = process(fileName, pWorker->tempFileName);
+        bytesOut = pBuf->len;
+    }
+
+    double elapsedMs = batchNowMs() - startMs;
+    const char* status = (result == 0) ? "ok" : "error";
+
+    pthread_mutex_lock(&pState->lock);
+    if (gOptions.batchOutDir == NULL) {
+        printf("#dexdump-batch seq=%u status=%s bytes=%zu file=%s\n",
+            seq, status, pBuf->len, fileName);
+        fwrite(pBuf->data, 1, pBuf->len, stdout);
+    }
+    fprintf(stderr, "dexdump-batch: seq=%u status=%s in=%" PRIu64
+        " out=%" PRIu64 " ms=%.1f file=%s\n",
+        seq, status, bytesIn, bytesOut, elapsedMs, fileName);
+
+    pState->numFiles++;
+    if (result != 0)
+        pState->numFailed++;
+    pState->bytesIn += bytesIn;
+    pState->bytesOut += bytesOut;
+    pthread_mutex_unlock(&pState->lock);
+
+    pBuf->len = 0;
+}
+
+/*
+ * Batch worker: dump files from the manifest until there aren't any left.
+ */
+static void* batchThreadStart(void* arg)
+{
+    BatchWorker* pWorker = (BatchWorker*) arg;
+    BatchState* pState = pWorker->pState;
+    OutputBuffer* pSavedBuf = gOutBuf;
+    OutputBuffer buf;
+    char fileName[kBatchMaxPath];
+
+    memset(&buf, 0, sizeof(buf));
+    buf.flushAt = SIZE_MAX;
+    gOutBuf = &buf;
+
+    while (true) {
+        pthread_mutex_lock(&pState->lock);
+        int status = readManifestLine(pState->manifest, fileName,
+            sizeof(fileName));
+        u4 seq = pState->nextSeq;
+        if (status != 0)
+            pState->nextSeq++;
+        pthread_mutex_unlock(&pState->lock);
+
+        if (status == 0)
+            break;
+        if (status < 0) {
+            fprintf(stderr, "dexdump-batch: seq=%u status=error"
+                " (manifest line too long)\n", seq);
+            pthread_mutex_lock(&pState->lock);
+            pState->numFiles++;
+            pState->numFailed++;
+            pthread_mutex_unlock(&pState->lock);
+            continue;
+        }
+
+        batchProcessFile(pWorker, seq, fileName, &buf);
+    }
+
+    free(buf.data);
+    gOutBuf = pSavedBuf;
+    releaseOperandScratch();
+
+    return NULL;
+}
+
+/*
+ * Dump all of the files listed in "manifestName" ("-" for stdin) on
+ * gOptions.numBatchThreads threads, including this one.
+ *
+ * Returns 0 if every file was dumped successfully.
+ */
+int processBatch(const char* manifestName)
+{
+    BatchState state;
+    BatchWorker* workers;
+    int numThreads = gOptions.numBatchThreads;
+    int numStarted = 0;
+    double startMs = batchNowMs();
+    int i;
+
+    memset(&state, 0, sizeof(state));
+    if (strcmp(manifestName, "-") == 0) {
+        state.manifest = stdin;
+    } else {
+        state.manifest = fopen(manifestName, "r");
+        if (state.manifest == NULL) {
+            fprintf(stderr, "ERROR: unable to open manifest '%s': %s\n",
+                manifestName, strerror(errno));
+            return -1;
+        }
+    }
+    pthread_mutex_init(&state.lock, NULL);
+
+    workers = (BatchWorker*) calloc(numThreads, sizeof(BatchWorker));
+    if (workers == NULL) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        state.numFailed = 1;
+        goto bail;
+    }
+    for (i = 0; i < numThreads; i++) {
+        workers[i].pState = &state;
+        makeBatchTempName(workers[i].tempFileName,
+            sizeof(workers[i].tempFileName), i);
+    }
+
+    /* worker 0 is this thread */
+    for (i = 1; i < numThreads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, batchThreadStart,
+                &workers[i]) != 0)
+        {
+            fprintf(stderr, "WARNING: unable to start threads\n");
+            break;
+        }
+        numStarted++;
+    }
+
+    batchThreadStart(&workers[0]);
+
+    for (i = 1; i <= numStarted; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    fflush(stdout);
+    fprintf(stderr, "dexdump-batch: files=%u failed=%u in=%" PRIu64
+        " out=%" PRIu64 " ms=%.1f\n",
+        state.numFiles, state.numFailed, state.bytesIn, state.bytesOut,
+        batchNowMs() - startMs);
+
+bail:
+    if (state.manifest != stdin)
+        fclose(state.manifest);
+    free(workers);
+    pthread_mutex_destroy(&state.lock);
+    return (state.numFailed != 0) ? -1 : 0;
+}
+
+/*
+ * One of the two files being compared by processApiDiff().
+ */
+struct ApiDiffSide {
+    const char* fileName;
+    char        tempFileName[kBatchMaxPath];
+    MemMapping  map;
+    DexFile*    pDexFile;
+    DexApi      api;
+    bool        ok;
+};
+
+/* differences found by processApiDiff() */
+struct ApiDiffCounts {
+    const DexApi*   pOld;
+    const DexApi*   pNew;
+    u4              added;
+    u4              removed;
+    u4              changed;
+};
+
+/*
+ * Open one side of the diff and collect its exported API.
+ */
+static void* apiDiffOpen(void* arg)
+{
+    ApiDiffSide* pSide = (ApiDiffSide*) arg;
+
+    pSide->pDexFile = openDexFile(pSide->fileName, pSide->tempFileName,
+        &pSide->map);
+    if (pSide->pDexFile == NULL)
+        return NULL;
+
+    if (!dexApiCreate(pSide->pDexFile, &pSide->api)) {
+        fprintf(stderr, "ERROR: unable to read the API of '%s'\n",
+            pSide->fileName);
+        return NULL;
+    }
+    pSide->ok = true;
+    return NULL;
+}
+
+/*
+ * Print an API entry's signature, e.g. "method Lfoo/Bar;.baz:(I)V".
+ */
+static void dumpApiEntry(const DexApi* pApi, const DexApiEntry* pEntry)
+{
+    const DexFile* pDexFile = pApi->pDexFile;
+    const DexClassDef* pClassDef = dexGetClassDef(pDexFile, pEntry->classDefIdx);
+
+    switch (pEntry->kind) {
+    case kDexApiClass:
+        outPuts("class ");
+        outPuts(dexStringByTypeIdx(pDexFile, pClassDef->classIdx));
+        break;
+    case kDexApiField:
+        {
+            const DexFieldId* pFieldId =
+                dexGetFieldId(pDexFile, pEntry->memberIdx);
+            outPuts("field ");
+            outPuts(dexStringByTypeIdx(pDexFile, pClassDef->classIdx));
+            outPutc('.');
+            outPuts(dexStringById(pDexFile, pFieldId->nameIdx));
+            outPutc(':');
+            outPuts(dexStringByTypeIdx(pDexFile, pFieldId->typeIdx));
+        }
+        break;
+    case kDexApiMethod:
+        {
+            OperandScratch* pScratch = getOperandScratch();
+            const DexMethodId* pMethodId =
+                dexGetMethodId(pDexFile, pEntry->memberIdx);
+            outPuts("method ");
+            outPuts(dexStringByTypeIdx(pDexFile, pClassDef->classIdx));
+            outPutc('.');
+            outPuts(dexStringById(pDexFile, pMethodId->nameIdx));
+            outPutc(':');
+            outPuts(dexGetDescriptorFromMethodId(pDexFile, pMethodId,
+                    &pScratch->methodDesc));
+        }
+        break;
+    }
+}
+
+/*
+ * Callback for dexApiDiff().  Prints one line per difference: "+" or
+ * "-" and the signature for additions and removals, and "*", the
+ * signature and the old and new access flags for flag changes.
+ */
+static void apiDiffCb(void* cnxt, DexApiChange change,
+    const DexApiEntry* pOldEntry, const DexApiEntry* pNewEntry)
+{
+    ApiDiffCounts* pCounts = (ApiDiffCounts*) cnxt;
+
+    switch (change) {
+    case kDexApiAdded:
+        outPuts("+ ");
+        dumpApiEntry(pCounts->pNew, pNewEntry);
+        pCounts->added++;
+        break;
+    case kDexApiRemoved:
+        outPuts("- ");
+        dumpApiEntry(pCounts->pOld, pOldEntry);
+        pCounts->removed++;
+        break;
+    case kDexApiFlagsChanged:
+        outPuts("* ");
+        dumpApiEntry(pCounts->pNew, pNewEntry);
+        outPuts(" 0x");
+        outHex(pOldEntry->accessFlags, 4);
+        outPuts(" -> 0x");
+        outHex(pNewEntry->accessFlags, 4);
+        pCounts->changed++;
+        break;
+    }
+    outPutc('\n');
+}
+
+/*
+ * Compare the exported APIs of two files: public classes, and their
+ * public and protected fields and methods (the same ones "-l xml" shows).
+ * The two files are opened and hashed in parallel, then joined on the
+ * signature hashes; nothing is formatted except the differences.
+ *
+ * Returns 0 if the APIs match, 1 if they differ, and -1 on failure.
+ */
+static int processApiDiff(const char* oldFileName, const char* newFileName)
+{
+    ApiDiffSide sides[2];
+    ApiDiffCounts counts;
+    pthread_t thread;
+    bool threaded;
+    int result = -1;
+    int i;
+
+    memset(sides, 0, sizeof(sides));
+    sides[0].fileName = oldFileName;
+    sides[1].fileName = newFileName;
+    for (i = 0; i < 2; i++) {
+        makeBatchTempName(sides[i].tempFileName,
+            sizeof(sides[i].tempFileName), i);
+    }
+
+    threaded = (pthread_create(&thread, NULL, apiDiffOpen, &sides[0]) == 0);
+    if (!threaded)
+        apiDiffOpen(&sides[0]);
+    apiDiffOpen(&sides[1]);
+    if (threaded)
+        pthread_join(thread, NULL);
+
+    if (!sides[0].ok || !sides[1].ok)
+        goto bail;
+
+    memset(&counts, 0, sizeof(counts));
+    counts.pOld = &sides[0].api;
+    counts.pNew = &sides[1].api;
+    if (!dexApiDiff(counts.pOld, counts.pNew, apiDiffCb, &counts)) {
+        fprintf(stderr, "ERROR: out of memory\n");
+        goto bail;
+    }
+
+    if (gOptions.verbose) {
+        outBufFlush(gOutBuf);
+        fflush(stdout);
+        fprintf(stderr, "%u added, %u removed, %u changed\n",
+            counts.added, counts.removed, counts.changed);
+    }
+    result = (counts.added + counts.removed + counts.changed != 0) ? 1 : 0;
+
+bail:
+    for (i = 0; i < 2; i++) {
+        if (sides[i].pDexFile != NULL) {
+            dexApiFree(&sides[i].api);
+            dexFileFree(sides[i].pDexFile);
+            sysReleaseShmem(&sides[i].map);
+        }
+    }
+    return result;
+}
 
 /*
  * Show usage.
@@ -2200,17 +4327,40 @@ void usage(void)
 {
     fprintf(stderr, "Copyright (C) 2007 The Android Open Source Project\n\n");
     fprintf(stderr,
-        "%s: [-c] [-d] [-f] [-h] [-i] [-l layout] [-m] [-t tempfile] dexfile...\n",
-        gProgName);
+        "%s: [-c] [-d] [-f] [-h] [-i] [-l layout] [-m] [-H format] [-s] [-S]\n"
+        "    [-j threads] [-C class]... [-M method] [-t tempfile] dexfile...\n"
+        "%s: [options] -B manifest [-o outdir]\n"
+        "%s: [-i] [-t tempfile] -a old-dexfile new-dexfile\n",
+        gProgName, gProgName, gProgName);
     fprintf(stderr, "\n");
+    fprintf(stderr, " -a : compare the public API of two files, printing '+', '-' or '*'\n"
+                    "      (access flags changed) and the signature for each difference\n");
     fprintf(stderr, " -c : verify checksum and exit\n");
     fprintf(stderr, " -d : disassemble code sections\n");
     fprintf(stderr, " -f : display summary information from file header\n");
     fprintf(stderr, " -h : display file header details\n");
     fprintf(stderr, " -i : ignore checksum failures\n");
-    fprintf(stderr, " -l : output layout, either 'plain' or 'xml'\n");
+    fprintf(stderr, " -l : output layout, either 'plain', 'xml' or 'jsonl' (one JSON record\n"
+                    "      per line, for each file, class, field, method and, with -d,\n"
+                    "      instruction)\n");
     fprintf(stderr, " -m : dump register maps (and nothing else)\n");
+    fprintf(stderr, " -H : dump instruction statistics for all files (and nothing else),\n"
+                    "      as either 'csv' or 'json'\n");
+    fprintf(stderr, " -s : dump classes sorted by package, then by descriptor, rather\n"
+                    "      than in the order they're defined\n");
+    fprintf(stderr, " -S : dump section sizes, per-class sizes and duplicate items as\n"
+                    "      'kind,file,name,count,bytes' CSV rows (and nothing else)\n");
+    fprintf(stderr, " -j : number of threads used to format classes, or to gather -H\n"
+                    "      statistics; with -B, the number of files dumped at once\n");
+    fprintf(stderr, " -C : only dump the class with this descriptor (e.g. 'Lcom/foo/Bar;'),\n"
+                    "      or, without the trailing ';', all classes whose descriptors start\n"
+                    "      with it (e.g. 'Lcom/foo/'); may be repeated\n");
+    fprintf(stderr, " -M : only dump methods with this name\n");
     fprintf(stderr, " -t : temp file name (defaults to /sdcard/dex-temp-*)\n");
+    fprintf(stderr, " -B : batch mode; dump the files named in the manifest, one per line\n"
+                    "      ('-' to read them from stdin), and report on each to stderr\n");
+    fprintf(stderr, " -o : with -B, write each file's output to its own file in this\n"
+                    "      directory, instead of as a framed stream on stdout\n");
 }
 
 /*
@@ -2224,14 +4374,24 @@ int main(int argc, char* const argv[])
     int ic;
 
     memset(&gOptions, 0, sizeof(gOptions));
+    outInit();
     gOptions.verbose = true;
+    gOptions.numThreads = 1;
+    gOptions.classFilters = (const char**) calloc(argc, sizeof(char*));
+    if (gOptions.classFilters == NULL) {
+        fprintf(stderr, "%s: out of memory\n", gProgName);
+        return 1;
+    }
 
     while (1) {
-        ic = getopt(argc, argv, "cdfhil:mt:");
+        ic = getopt(argc, argv, "acdfhil:mt:H:sSj:C:M:B:o:");
         if (ic < 0)
             break;
 
         switch (ic) {
+        case 'a':       // compare exported APIs
+            gOptions.apiDiff = true;
+            break;
         case 'c':       // verify the checksum then exit
             gOptions.checksumOnly = true;
             break;
@@ -2254,6 +4414,9 @@ int main(int argc, char* const argv[])
                 gOptions.outputFormat = OUTPUT_XML;
                 gOptions.verbose = false;
                 gOptions.exportsOnly = true;
+            } else if (strcmp(optarg, "jsonl") == 0) {
+                gOptions.outputFormat = OUTPUT_JSONL;
+                gOptions.verbose = false;
             } else {
                 wantUsage = true;
             }
@@ -2261,6 +4424,40 @@ int main(int argc, char* const argv[])
         case 'm':       // dump register maps only
             gOptions.dumpRegisterMaps = true;
             break;
+        case 'H':       // instruction statistics
+            if (strcmp(optarg, "csv") == 0) {
+                gOptions.statsFormat = STATS_CSV;
+            } else if (strcmp(optarg, "json") == 0) {
+                gOptions.statsFormat = STATS_JSON;
+            } else {
+                wantUsage = true;
+            }
+            gOptions.verbose = false;
+            break;
+        case 's':       // sort classes
+            gOptions.sortClasses = true;
+            break;
+        case 'S':       // section size statistics
+            gOptions.sizeStats = true;
+            gOptions.verbose = false;
+            break;
+        case 'j':       // worker threads
+            gOptions.numThreads = atoi(optarg);
+            if (gOptions.numThreads < 1)
+                wantUsage = true;
+            break;
+        case 'C':       // class filter
+            gOptions.classFilters[gOptions.numClassFilters++] = optarg;
+            break;
+        case 'M':       // method filter
+            gOptions.methodFilter = optarg;
+            break;
+        case 'B':       // batch mode
+            gOptions.batchManifest = optarg;
+            break;
+        case 'o':       // batch output directory
+            gOptions.batchOutDir = optarg;
+            break;
         case 't':       // temp file, used when opening compressed Jar
             gOptions.tempFileName = optarg;
             break;
@@ -2270,11 +4467,33 @@ int main(int argc, char* const argv[])
         }
     }
 
-    if (optind == argc) {
+    if (gOptions.apiDiff) {
+        if (argc - optind != 2 || gOptions.batchManifest != NULL) {
+            fprintf(stderr, "%s: -a takes two files\n", gProgName);
+            wantUsage = true;
+        }
+    } else if (gOptions.batchManifest != NULL) {
+        if (optind != argc) {
+            fprintf(stderr, "%s: can't give files with -B\n", gProgName);
+            wantUsage = true;
+        }
+    } else if (optind == argc) {
         fprintf(stderr, "%s: no file specified\n", gProgName);
         wantUsage = true;
     }
 
+    if (gOptions.batchOutDir != NULL && gOptions.batchManifest == NULL) {
+        fprintf(stderr, "%s: -o requires -B\n", gProgName);
+        wantUsage = true;
+    }
+
+    if (gOptions.outputFormat == OUTPUT_JSONL &&
+        (gOptions.showFileHeaders || gOptions.showSectionHeaders))
+    {
+        fprintf(stderr, "Can't specify -f or -h with -l jsonl\n");
+        wantUsage = true;
+    }
+
     if (gOptions.checksumOnly && gOptions.ignoreBadChecksum) {
         fprintf(stderr, "Can't specify both -c and -i\n");
         wantUsage = true;
@@ -2285,10 +4504,39 @@ int main(int argc, char* const argv[])
         return 2;
     }
 
+    dexCodeStatsInit(&gCodeStats);
+
+    if (gOptions.sizeStats) {
+        /* write the header now, so it comes before any batch frames */
+        outPrintf("kind,file,name,count,bytes\n");
+        outBufFlush(&gStdoutBuf);
+    }
+
     int result = 0;
-    while (optind < argc) {
-        result |= process(argv[optind++]);
+    if (gOptions.apiDiff) {
+        result = processApiDiff(argv[optind], argv[optind + 1]);
+    } else if (gOptions.batchManifest != NULL) {
+        /* -j applies to the files, each of which is dumped on one thread */
+        gOptions.numBatchThreads = gOptions.numThreads;
+        gOptions.numThreads = 1;
+        result = processBatch(gOptions.batchManifest);
+    } else {
+        while (optind < argc) {
+            result |= process(argv[optind++], gOptions.tempFileName);
+        }
     }
 
+    if (gOptions.statsFormat != STATS_NONE)
+        dumpCodeStats(&gCodeStats);
+    else if (gOptions.sizeStats)
+        dumpSizeStatsDups();
+
+    outBufFlush(&gStdoutBuf);
+    releaseOperandScratch();
+    free(gOptions.classFilters);
+
+    /* like diff(1): 0 if the same, 1 if different, 2 on trouble */
+    if (gOptions.apiDiff)
+        return (result < 0) ? 2 : result;
     return (result != 0);
 }
@@ -0,0 +1,341 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Exported API signature tables, and comparison of two of them.
+ */
+
+#include "DexApi.h"
+#include "DexClass.h"
+#include "DexProto.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* 64-bit FNV-1a */
+static const u8 kFnvOffsetBasis = 0xcbf29ce484222325ULL;
+static const u8 kFnvPrime = 0x100000001b3ULL;
+
+/* marks an unused slot in an ApiHashTable */
+static const u4 kEmptySlot = 0xffffffff;
+
+static inline u8 hashByte(u8 hash, u1 val)
+{
+    return (hash ^ val) * kFnvPrime;
+}
+
+/*
+ * Add a string, including its terminator so that consecutive strings
+ * can't run together.
+ */
+static u8 hashString(u8 hash, const char* str)
+{
+    while (*str != '\0')
+        hash = hashByte(hash, *str++);
+    return hashByte(hash, 0);
+}
+
+static u8 hashField(const DexFile* pDexFile, u8 classHash, u4 fieldIdx)
+{
+    const DexFieldId* pFieldId = dexGetFieldId(pDexFile, fieldIdx);
+    u8 hash = hashByte(classHash, kDexApiField);
+
+    hash = hashString(hash, dexStringById(pDexFile, pFieldId->nameIdx));
+    return hashString(hash, dexStringByTypeIdx(pDexFile, pFieldId->typeIdx));
+}
+
+static u8 hashMethod(const DexFile* pDexFile, u8 classHash, u4 methodIdx)
+{
+    const DexMethodId* pMethodId = dexGetMethodId(pDexFile, methodIdx);
+    const DexProtoId* pProtoId = dexGetProtoId(pDexFile, pMethodId->protoIdx);
+    const DexTypeList* pParams = dexGetProtoParameters(pDexFile, pProtoId);
+    u8 hash = hashByte(classHash, kDexApiMethod);
+
+    hash = hashString(hash, dexStringById(pDexFile, pMethodId->nameIdx));
+    if (pParams != NULL) {
+        for (u4 i = 0; i < pParams->size; i++) {
+            hash = hashString(hash,
+                dexStringByTypeIdx(pDexFile, dexTypeListGetIdx(pParams, i)));
+        }
+    }
+    hash = hashByte(hash, ')');
+    return hashString(hash,
+        dexStringByTypeIdx(pDexFile, pProtoId->returnTypeIdx));
+}
+
+/*
+ * Append an entry, growing the table as needed.
+ */
+static bool addEntry(DexApi* pApi, u4* pCapacity, u4 kind, u8 hash,
+    u4 accessFlags, u4 classDefIdx, u4 memberIdx)
+{
+    if (pApi->numEntries == *pCapacity) {
+        u4 newCapacity = (*pCapacity == 0) ? 256 : *pCapacity * 2;
+        DexApiEntry* newEntries = (DexApiEntry*) realloc(pApi->entries,
+            newCapacity * sizeof(DexApiEntry));
+        if (newEntries == NULL)
+            return false;
+        pApi->entries = newEntries;
+        *pCapacity = newCapacity;
+    }
+
+    DexApiEntry* pEntry = &pApi->entries[pApi->numEntries++];
+    pEntry->hash = hash;
+    pEntry->accessFlags = accessFlags;
+    pEntry->classDefIdx = classDefIdx;
+    pEntry->memberIdx = memberIdx;
+    pEntry->kind = kind;
+    return true;
+}
+
+/* (documented in header file) */
+bool dexApiCreate(const DexFile* pDexFile, DexApi* pApi)
+{
+    u4 capacity = 0;
+    u4 i, j;
+
+    memset(pApi, 0, sizeof(*pApi));
+    pApi->pDexFile = pDexFile;
+
+    for (i = 0; i < pDexFile->pHeader->classDefsSize; i++) {
+        const DexClassDef* pClassDef = dexGetClassDef(pDexFile, i);
+
+        if (!dexIsExportedClass(pClassDef->accessFlags))
+            continue;
+
+        u8 classHash = hashString(kFnvOffsetBasis,
+            dexStringByTypeIdx(pDexFile, pClassDef->classIdx));
+        classHash = hashByte(classHash, kDexApiClass);
+        if (!addEntry(pApi, &capacity, kDexApiClass, classHash,
+                pClassDef->accessFlags, i, kDexNoIndex))
+            goto fail;
+
+        const u1* pData = dexGetClassData(pDexFile, pClassDef);
+        if (pData == NULL)
+            continue;
+
+        DexClassDataHeader header;
+        DexField field;
+        DexMethod method;
+        u4 lastIndex;
+
+        dexReadClassDataHeader(&pData, &header);
+
+        u4 numFields = header.staticFieldsSize + header.instanceFieldsSize;
+        lastIndex = 0;
+        for (j = 0; j < numFields; j++) {
+            if (j == header.staticFieldsSize)
+                lastIndex = 0;
+            dexReadClassDataField(&pData, &field, &lastIndex);
+            if (!dexIsExportedMember(field.accessFlags))
+                continue;
+            if (!addEntry(pApi, &capacity, kDexApiField,
+                    hashField(pDexFile, classHash, field.fieldIdx),
+                    field.accessFlags, i, field.fieldIdx))
+                goto fail;
+        }
+
+        u4 numMethods = header.directMethodsSize + header.virtualMethodsSize;
+        lastIndex = 0;
+        for (j = 0; j < numMethods; j++) {
+            if (j == header.directMethodsSize)
+                lastIndex = 0;
+            dexReadClassDataMethod(&pData, &method, &lastIndex);
+            if (!dexIsExportedMember(method.accessFlags))
+                continue;
+            if (!addEntry(pApi, &capacity, kDexApiMethod,
+                    hashMethod(pDexFile, classHash, method.methodIdx),
+                    method.accessFlags, i, method.methodIdx))
+                goto fail;
+        }
+    }
+
+    return true;
+
+fail:
+    dexApiFree(pApi);
+    return false;
+}
+
+/* (documented in header file) */
+void dexApiFree(DexApi* pApi)
+{
+    free(pApi->entries);
+    pApi->entries = NULL;
+    pApi->numEntries = 0;
+}
+
+/*
+ * Do two entries, possibly from different files, have the same
+ * signature?
+ */
+static bool sameSignature(const DexApi* pApiA, const DexApiEntry* pA,
+    const DexApi* pApiB, const DexApiEntry* pB)
+{
+    const DexFile* pFileA = pApiA->pDexFile;
+    const DexFile* pFileB = pApiB->pDexFile;
+
+    if (pA->hash != pB->hash || pA->kind != pB->kind)
+        return false;
+
+    const DexClassDef* pClassA = dexGetClassDef(pFileA, pA->classDefIdx);
+    const DexClassDef* pClassB = dexGetClassDef(pFileB, pB->classDefIdx);
+    if (strcmp(dexStringByTypeIdx(pFileA, pClassA->classIdx),
+               dexStringByTypeIdx(pFileB, pClassB->classIdx)) != 0)
+        return false;
+
+    switch (pA->kind) {
+    case kDexApiField:
+        {
+            const DexFieldId* pFieldA = dexGetFieldId(pFileA, pA->memberIdx);
+            const DexFieldId* pFieldB = dexGetFieldId(pFileB, pB->memberIdx);
+            return strcmp(dexStringById(pFileA, pFieldA->nameIdx),
+                          dexStringById(pFileB, pFieldB->nameIdx)) == 0 &&
+                   strcmp(dexStringByTypeIdx(pFileA, pFieldA->typeIdx),
+                          dexStringByTypeIdx(pFileB, pFieldB->typeIdx)) == 0;
+        }
+    case kDexApiMethod:
+        {
+            const DexMethodId* pMethodA = dexGetMethodId(pFileA, pA->memberIdx);
+            const DexMethodId* pMethodB = dexGetMethodId(pFileB, pB->memberIdx);
+            DexProto protoA, protoB;
+
+            if (strcmp(dexStringById(pFileA, pMethodA->nameIdx),
+                       dexStringById(pFileB, pMethodB->nameIdx)) != 0)
+                return false;
+            dexProtoSetFromMethodId(&protoA, pFileA, pMethodA);
+            dexProtoSetFromMethodId(&protoB, pFileB, pMethodB);
+            return dexProtoCompare(&protoA, &protoB) == 0;
+        }
+    default:
+        return true;
+    }
+}
+
+/*
+ * Open-addressed table of the indices of a DexApi's entries, keyed by
+ * their hashes.
+ */
+struct ApiHashTable {
+    const DexApi*   pApi;
+    u4*             slots;
+    u4              mask;
+};
+
+static bool buildHashTable(const DexApi* pApi, ApiHashTable* pTable)
+{
+    u4 size = 16;
+    u4 i;
+
+    while (size < pApi->numEntries * 2)
+        size <<= 1;
+
+    pTable->pApi = pApi;
+    pTable->mask = size - 1;
+    pTable->slots = (u4*) malloc(size * sizeof(u4));
+    if (pTable->slots == NULL)
+        return false;
+    memset(pTable->slots, 0xff, size * sizeof(u4));
+
+    for (i = 0; i < pApi->numEntries; i++) {
+        u4 slot = (u4) pApi->entries[i].hash & pTable->mask;
+        while (pTable->slots[slot] != kEmptySlot)
+            slot = (slot + 1) & pTable->mask;
+        pTable->slots[slot] = i;
+    }
+    return true;
+}
+
+/*
+ * Find the entry in the table with the same signature as "pEntry", which
+ * belongs to "pApi".  Returns NULL if there isn't one.
+ */
+static const DexApiEntry* findEntry(const ApiHashTable* pTable,
+    const DexApi* pApi, const DexApiEntry* pEntry)
+{
+    u4 slot = (u4) pEntry->hash & pTable->mask;
+
+    for (; pTable->slots[slot] != kEmptySlot;
+        slot = (slot + 1) & pTable->mask)
+    {
+        const DexApiEntry* pCandidate =
+            &pTable->pApi->entries[pTable->slots[slot]];
+        if (sameSignature(pTable->pApi, pCandidate, pApi, pEntry))
+            return pCandidate;
+    }
+    return NULL;
+}
+
+/* (documented in header file) */
+bool dexApiDiff(const DexApi* pOld, const DexApi* pNew,
+    DexApiDiffCb callback, void* cnxt)
+{
+    ApiHashTable newTable;
+    bool* matched;
+    bool skipMembers;
+    u4 i;
+
+    if (!buildHashTable(pNew, &newTable))
+        return false;
+    matched = (bool*) calloc(pNew->numEntries + 1, sizeof(bool));
+    if (matched == NULL) {
+        free(newTable.slots);
+        return false;
+    }
+
+    /*
+     * Probe with the old entries.  Members follow their class, so once
+     * a class is found to be missing its members can be skipped.
+     */
+    skipMembers = false;
+    for (i = 0; i < pOld->numEntries; i++) {
+        const DexApiEntry* pOldEntry = &pOld->entries[i];
+        bool isClass = (pOldEntry->kind == kDexApiClass);
+
+        if (!isClass && skipMembers)
+            continue;
+
+        const DexApiEntry* pNewEntry = findEntry(&newTable, pOld, pOldEntry);
+        if (isClass)
+            skipMembers = (pNewEntry == NULL);
+
+        if (pNewEntry == NULL) {
+            callback(cnxt, kDexApiRemoved, pOldEntry, NULL);
+        } else {
+            matched[pNewEntry - pNew->entries] = true;
+            if (pNewEntry->accessFlags != pOldEntry->accessFlags)
+                callback(cnxt, kDexApiFlagsChanged, pOldEntry, pNewEntry);
+        }
+    }
+
+    /* whatever wasn't matched was added */
+    skipMembers = false;
+    for (i = 0; i < pNew->numEntries; i++) {
+        const DexApiEntry* pNewEntry = &pNew->entries[i];
+
+        if (pNewEntry->kind == kDexApiClass)
+            skipMembers = !matched[i];
+        else if (skipMembers)
+            continue;
+
+        if (!matched[i])
+            callback(cnxt, kDexApiAdded, NULL, pNewEntry);
+    }
+
+    free(matched);
+    free(newTable.slots);
+    return true;
+}
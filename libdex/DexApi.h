@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * The exported API of a DEX file -- its public classes, and their public
+ * and protected fields and methods -- reduced to a table of signature
+ * hashes, so the APIs of two files can be compared without formatting
+ * them.
+ */
+
+#ifndef LIBDEX_DEXAPI_H_
+#define LIBDEX_DEXAPI_H_
+
+#include "DexFile.h"
+
+/*
+ * Is a class with these access flags part of the exported API?
+ */
+DEX_INLINE bool dexIsExportedClass(u4 accessFlags) {
+    return (accessFlags & ACC_PUBLIC) != 0;
+}
+
+/*
+ * Is a field or method with these access flags part of the exported API?
+ * (Only meaningful if its class is.)
+ */
+DEX_INLINE bool dexIsExportedMember(u4 accessFlags) {
+    return (accessFlags & (ACC_PUBLIC | ACC_PROTECTED)) != 0;
+}
+
+enum DexApiKind {
+    kDexApiClass = 0,
+    kDexApiField,
+    kDexApiMethod,
+};
+
+/*
+ * One exported class or member.  "hash" covers the class descriptor, the
+ * kind, and for members the name and type (or method descriptor), so it
+ * identifies the same signature in any file.
+ */
+struct DexApiEntry {
+    u8  hash;
+    u4  accessFlags;
+    u4  classDefIdx;
+    u4  memberIdx;              /* field_idx or method_idx; unused for classes */
+    u4  kind;                   /* DexApiKind */
+};
+
+/*
+ * The exported API of a file.  Each class entry is followed by the
+ * entries for its members.
+ */
+struct DexApi {
+    const DexFile*  pDexFile;
+    u4              numEntries;
+    DexApiEntry*    entries;
+};
+
+enum DexApiChange {
+    kDexApiAdded = 0,
+    kDexApiRemoved,
+    kDexApiFlagsChanged,
+};
+
+/*
+ * Callback for each difference found by dexApiDiff().  "pOldEntry" is
+ * NULL for additions and "pNewEntry" is NULL for removals.
+ */
+typedef void (*DexApiDiffCb)(void* cnxt, DexApiChange change,
+    const DexApiEntry* pOldEntry, const DexApiEntry* pNewEntry);
+
+/*
+ * Collect the exported API of a verified DEX file into "pApi", which must
+ * be freed with dexApiFree().  Returns false on allocation failure or bad
+ * class data.
+ */
+bool dexApiCreate(const DexFile* pDexFile, DexApi* pApi);
+
+/*
+ * Free the storage allocated by dexApiCreate().
+ */
+void dexApiFree(DexApi* pApi);
+
+/*
+ * Compare two APIs with a hash join, calling "callback" for each removed
+ * entry and each entry whose access flags changed (in "pOld" order), and
+ * then for each added entry (in "pNew" order).  The members of an added
+ * or removed class aren't reported separately.
+ *
+ * Entries with equal hashes are also compared by signature, so a hash
+ * collision can't hide a difference.  Returns false on allocation failure.
+ */
+bool dexApiDiff(const DexApi* pOld, const DexApi* pNew,
+    DexApiDiffCb callback, void* cnxt);
+
+#endif  // LIBDEX_DEXAPI_H_
@@ -88,3 +88,85 @@ u4 dexCatchIteratorGetEndOffset(DexCatchIterator* pIterator,
 
     return (u4) (pIterator->pEncodedData - dexGetCatchHandlerData(pCode));
 }
+
+/* Helper for dexCatchTableGetSize() and dexCatchTableDecode(), which
+ * counts the handler lists and the total number of entries in them. */
+static void countCatchHandlers(const DexCode* pCode, u4* pNumLists,
+        u4* pNumHandlers) {
+    u4 numLists = dexGetHandlersSize(pCode);
+    u4 offset = dexGetFirstHandlerOffset(pCode);
+    u4 numHandlers = 0;
+    u4 i;
+
+    for (i = 0; i < numLists; i++) {
+        DexCatchIterator iterator;
+        dexCatchIteratorInit(&iterator, pCode, offset);
+
+        while (dexCatchIteratorNext(&iterator) != NULL) {
+            numHandlers++;
+        }
+
+        offset = dexCatchIteratorGetEndOffset(&iterator, pCode);
+    }
+
+    *pNumLists = numLists;
+    *pNumHandlers = numHandlers;
+}
+
+/* Compute the size of a DexCatchTable with the given counts. */
+static size_t catchTableSize(u4 numLists, u4 numHandlers) {
+    return sizeof(DexCatchTable) + numLists * sizeof(DexCatchHandlerList)
+            + numHandlers * sizeof(DexCatchHandler);
+}
+
+/* (documented in header file) */
+size_t dexCatchTableGetSize(const DexCode* pCode) {
+    u4 numLists, numHandlers;
+
+    countCatchHandlers(pCode, &numLists, &numHandlers);
+    return catchTableSize(numLists, numHandlers);
+}
+
+/* (documented in header file) */
+DexCatchTable* dexCatchTableDecode(const DexCode* pCode, void* buf,
+        size_t bufLen) {
+    DexCatchTable* pTable = (DexCatchTable*) buf;
+    u4 numLists, numHandlers;
+
+    countCatchHandlers(pCode, &numLists, &numHandlers);
+    if (bufLen < catchTableSize(numLists, numHandlers)) {
+        return NULL;
+    }
+
+    pTable->numLists = numLists;
+    pTable->numHandlers = numHandlers;
+    pTable->lists = (DexCatchHandlerList*) (pTable + 1);
+    pTable->handlers = (DexCatchHandler*) (pTable->lists + numLists);
+
+    u4 offset = dexGetFirstHandlerOffset(pCode);
+    u4 next = 0;
+    u4 i;
+
+    for (i = 0; i < numLists; i++) {
+        DexCatchHandlerList* pList = &pTable->lists[i];
+        DexCatchIterator iterator;
+        DexCatchHandler* pHandler;
+
+        dexCatchIteratorInit(&iterator, pCode, offset);
+        pList->handlerOff = offset;
+        pList->first = next;
+        pList->catchesAll = false;
+
+        while ((pHandler = dexCatchIteratorNext(&iterator)) != NULL) {
+            if (pHandler->typeIdx == kDexNoIndex) {
+                pList->catchesAll = true;
+            }
+            pTable->handlers[next++] = *pHandler;
+        }
+
+        pList->count = next - pList->first;
+        offset = dexCatchIteratorGetEndOffset(&iterator, pCode);
+    }
+
+    return pTable;
+}
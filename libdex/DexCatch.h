@@ -159,4 +159,82 @@ DEX_INLINE bool dexFindCatchHandler(DexCatchIterator *pIterator,
     }
 }
 
+/*
+ * One decoded handler list.  The entries are in the order they appear in
+ * the file, with the catch-all (typeIdx == kDexNoIndex), if any, last.
+ */
+struct DexCatchHandlerList {
+    u4          handlerOff; /* offset of the encoded list, as in DexTry */
+    u4          first;      /* index of the first entry in handlers[] */
+    u4          count;      /* number of entries, including any catch-all */
+    bool        catchesAll;
+};
+
+/*
+ * All of the handler lists of a DexCode, decoded into flat arrays.  The
+ * lists are sorted by handlerOff (that's the order they appear in the
+ * file).  The table and its arrays share one caller-supplied block; see
+ * dexCatchTableGetSize() and dexCatchTableDecode().
+ */
+struct DexCatchTable {
+    u4                      numLists;
+    u4                      numHandlers;
+    DexCatchHandlerList*    lists;
+    DexCatchHandler*        handlers;
+};
+
+/* Get the number of bytes needed to decode the handler lists of the
+ * given DexCode into a DexCatchTable. */
+size_t dexCatchTableGetSize(const DexCode* pCode);
+
+/* Decode all of the handler lists of the given DexCode into "buf", which
+ * must be suitably aligned for a pointer (as from malloc() or an arena)
+ * and at least dexCatchTableGetSize() bytes long. Returns a pointer to
+ * the table, which lives at the start of "buf", or NULL if "bufLen" is
+ * too small. */
+DexCatchTable* dexCatchTableDecode(const DexCode* pCode, void* buf,
+        size_t bufLen);
+
+/* Find the decoded list for a handler offset, such as the one returned
+ * by dexFindCatchHandlerOffset0(). Returns NULL if there isn't one. */
+DEX_INLINE const DexCatchHandlerList* dexCatchTableFindList(
+        const DexCatchTable* pTable, u4 handlerOff) {
+    // Note: Signed type is important for max and min.
+    int min = 0;
+    int max = pTable->numLists - 1;
+
+    while (max >= min) {
+        int guess = (min + max) >> 1;
+        const DexCatchHandlerList* pList = &pTable->lists[guess];
+
+        if (handlerOff < pList->handlerOff) {
+            max = guess - 1;
+        } else if (handlerOff > pList->handlerOff) {
+            min = guess + 1;
+        } else {
+            return pList;
+        }
+    }
+
+    return NULL;
+}
+
+/* Find the decoded handler list covering a given address, if any. This
+ * is the table-based equivalent of dexFindCatchHandler(). */
+DEX_INLINE const DexCatchHandlerList* dexCatchTableFindAddress(
+        const DexCatchTable* pTable, const DexCode* pCode, u4 address) {
+    if (pCode->triesSize == 0) {
+        return NULL;
+    }
+
+    int offset = dexFindCatchHandlerOffset0(pCode->triesSize,
+            dexGetTries(pCode), address);
+
+    if (offset < 0) {
+        return NULL;
+    }
+
+    return dexCatchTableFindList(pTable, (u4) offset);
+}
+
 #endif  // LIBDEX_DEXCATCH_H_
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Precomputed extents of the code_items in a DEX file.
+ */
+
+#include "DexCodeExtents.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hash a code_item offset.  Code items are 4-byte aligned, so drop the
+ * low bits before scrambling.
+ */
+static inline u4 codeOffHash(u4 codeOff)
+{
+    return (codeOff >> 2) * 2654435761U;
+}
+
+/*
+ * Find the code_item section in the map.  Returns NULL if there isn't
+ * one, which is legal if the file has no concrete methods.
+ */
+static const DexMapItem* findCodeItemSection(const DexMapList* pMap)
+{
+    u4 i;
+
+    for (i = 0; i < pMap->size; i++) {
+        if (pMap->list[i].type == kDexTypeCodeItem)
+            return &pMap->list[i];
+    }
+
+    return NULL;
+}
+
+/* (documented in header file) */
+DexCodeExtents* dexCreateCodeExtents(const DexFile* pDexFile)
+{
+    const DexMapList* pMap = dexGetMap(pDexFile);
+    const DexMapItem* pSection;
+    DexCodeExtents* pExtents;
+    u4 fileSize = pDexFile->pHeader->fileSize;
+    size_t numSlots, allocSize;
+    u4 count, offset, i;
+
+    if (pMap == NULL) {
+        ALOGE("No map in DEX file; can't index code items");
+        return NULL;
+    }
+
+    pSection = findCodeItemSection(pMap);
+    count = (pSection != NULL) ? pSection->size : 0;
+
+    /*
+     * The count comes from the file.  Every code_item takes at least its
+     * fixed header, so reject counts that couldn't fit before they're
+     * used to size anything.
+     */
+    if (count != 0 && (pSection->offset > fileSize ||
+            count > (fileSize - pSection->offset) / offsetof(DexCode, insns)))
+    {
+        ALOGE("Bad code_item count %u at 0x%x", count, pSection->offset);
+        return NULL;
+    }
+
+    numSlots = 1;
+    while (numSlots < (size_t) count * 2) {
+        if (numSlots > UINT32_MAX / 2)
+            return NULL;
+        numSlots <<= 1;
+    }
+
+    if (count > (SIZE_MAX - sizeof(DexCodeExtents)) / sizeof(DexCodeExtent))
+        return NULL;
+    allocSize = sizeof(DexCodeExtents) + count * sizeof(DexCodeExtent);
+    if (numSlots > (SIZE_MAX - allocSize) / sizeof(u4))
+        return NULL;
+    allocSize += numSlots * sizeof(u4);
+    if (allocSize > UINT32_MAX)     /* pExtents->size is a u4 */
+        return NULL;
+
+    pExtents = (DexCodeExtents*) calloc(1, allocSize);
+    if (pExtents == NULL)
+        return NULL;
+    pExtents->size = allocSize;
+    pExtents->count = count;
+    pExtents->numSlots = numSlots;
+    pExtents->items = (DexCodeExtent*) (pExtents + 1);
+    pExtents->slots = (u4*) (pExtents->items + count);
+
+    /*
+     * The code_items are laid out back to back, each one starting on
+     * the next 4-byte boundary after the end of the previous one.
+     */
+    offset = (pSection != NULL) ? pSection->offset : 0;
+    for (i = 0; i < count; i++) {
+        DexCodeExtent* pItem = &pExtents->items[i];
+        const DexCode* pCode;
+        u4 slot;
+
+        offset = (offset + 3) & ~3;
+        if (offset > fileSize || fileSize - offset < offsetof(DexCode, insns)) {
+            ALOGE("code_item %u at 0x%x runs off end of file", i, offset);
+            goto bail;
+        }
+
+        pCode = (const DexCode*) (pDexFile->baseAddr + offset);
+        pItem->codeOff = offset;
+        if (pCode->triesSize != 0) {
+            pItem->triesOff =
+                (const u1*) dexGetTries(pCode) - pDexFile->baseAddr;
+            pItem->handlersOff =
+                dexGetCatchHandlerData(pCode) - pDexFile->baseAddr;
+        }
+        pItem->endOff = offset + dexGetDexCodeSize(pCode);
+        if (pItem->endOff > fileSize || pItem->endOff < offset) {
+            ALOGE("code_item %u at 0x%x runs off end of file", i, offset);
+            goto bail;
+        }
+
+        slot = codeOffHash(offset) & (numSlots - 1);
+        while (pExtents->slots[slot] != 0)
+            slot = (slot + 1) & (numSlots - 1);
+        pExtents->slots[slot] = i + 1;
+
+        offset = pItem->endOff;
+    }
+
+    ALOGV("Code extents: items=%u slots=%zu alloc=%zu", count, numSlots,
+        allocSize);
+
+    return pExtents;
+
+bail:
+    dexCodeExtentsFree(pExtents);
+    return NULL;
+}
+
+/* (documented in header file) */
+void dexCodeExtentsFree(DexCodeExtents* pExtents)
+{
+    free(pExtents);
+}
+
+/* (documented in header file) */
+const DexCodeExtent* dexFindCodeExtent(const DexCodeExtents* pExtents,
+    u4 codeOff)
+{
+    u4 mask = pExtents->numSlots - 1;
+    u4 slot = codeOffHash(codeOff) & mask;
+
+    /*
+     * Search until we find a matching entry or an empty slot.
+     */
+    while (true) {
+        u4 entry = pExtents->slots[slot];
+        if (entry == 0)
+            return NULL;
+
+        const DexCodeExtent* pItem = &pExtents->items[entry - 1];
+        if (pItem->codeOff == codeOff)
+            return pItem;
+
+        slot = (slot + 1) & mask;
+    }
+}
+
+/* (documented in header file) */
+size_t dexGetCodeItemSize(const DexFile* pDexFile, const DexCode* pCode)
+{
+    if (pDexFile->pCodeExtents != NULL) {
+        u4 codeOff = (const u1*) pCode - pDexFile->baseAddr;
+        const DexCodeExtent* pItem =
+            dexFindCodeExtent(pDexFile->pCodeExtents, codeOff);
+        if (pItem != NULL)
+            return pItem->endOff - pItem->codeOff;
+    }
+
+    return dexGetDexCodeSize(pCode);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Precomputed extents of the code_items in a DEX file.
+ *
+ * Finding the end of a code_item means walking all of its catch handlers
+ * (see dexGetDexCodeSize()).  Tools that want the size of every method
+ * can instead build this index once, with a single pass over the
+ * code_item section, and then look up any code_item by its file offset.
+ */
+
+#ifndef LIBDEX_DEXCODEEXTENTS_H_
+#define LIBDEX_DEXCODEEXTENTS_H_
+
+#include "DexFile.h"
+
+/*
+ * Layout of one code_item.  All offsets are in bytes from the start of
+ * the DEX data (pDexFile->baseAddr).
+ */
+struct DexCodeExtent {
+    u4  codeOff;        /* start of the code_item */
+    u4  triesOff;       /* start of the try_item array, or 0 if none */
+    u4  handlersOff;    /* start of the encoded_catch_handler_list, or 0 */
+    u4  endOff;         /* just past the last byte of the code_item */
+};
+
+/*
+ * The index.  "items" holds one entry per code_item, in file order, so
+ * it can also be walked sequentially.  "slots" is an open-addressed hash
+ * table keyed on codeOff; each slot holds an index into "items" plus one,
+ * or zero if the slot is empty.
+ */
+struct DexCodeExtents {
+    u4              size;       /* total allocation, including this struct */
+    u4              count;      /* number of entries in items[] */
+    u4              numSlots;   /* size of slots[]; always power of 2 */
+    DexCodeExtent*  items;
+    u4*             slots;
+};
+
+/*
+ * Build the code_item index for a DEX file by walking the code_item
+ * section listed in the map.  The file must already have been verified.
+ *
+ * Returns newly-allocated storage, or NULL if the map is missing or a
+ * code_item runs past the end of the file.
+ */
+DexCodeExtents* dexCreateCodeExtents(const DexFile* pDexFile);
+
+/*
+ * Free an index created by dexCreateCodeExtents().
+ */
+void dexCodeExtentsFree(DexCodeExtents* pExtents);
+
+/*
+ * Find the entry for the code_item at file offset "codeOff".  Returns
+ * NULL if there isn't a code_item there.
+ */
+const DexCodeExtent* dexFindCodeExtent(const DexCodeExtents* pExtents,
+    u4 codeOff);
+
+/*
+ * Compute the size, in bytes, of a DexCode in the given file.  This uses
+ * the file's code_item index if it has one (see kDexParseCodeExtents),
+ * and falls back to dexGetDexCodeSize() otherwise.
+ */
+size_t dexGetCodeItemSize(const DexFile* pDexFile, const DexCode* pCode);
+
+#endif  // LIBDEX_DEXCODEEXTENTS_H_
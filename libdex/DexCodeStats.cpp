@@ -0,0 +1,317 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Instruction-mix statistics.
+ */
+
+#include "DexCodeStats.h"
+#include "DexCodeExtents.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+
+/* number of code_items a worker claims at a time */
+static const u4 kScanChunkSize = 64;
+
+/* (documented in header file) */
+void dexCodeStatsInit(DexCodeStats* pStats)
+{
+    memset(pStats, 0, sizeof(DexCodeStats));
+}
+
+/*
+ * Add "count" u8 counters from "pSrc" to "pDst".
+ */
+static void addCounters(u8* pDst, const u8* pSrc, size_t count)
+{
+    size_t i;
+
+    for (i = 0; i < count; i++)
+        pDst[i] += pSrc[i];
+}
+
+/* (documented in header file) */
+void dexCodeStatsMerge(DexCodeStats* pDst, const DexCodeStats* pSrc)
+{
+    /*
+     * Everything up to maxRegisters is a u8 counter.
+     */
+    addCounters((u8*) pDst, (const u8*) pSrc,
+        offsetof(DexCodeStats, maxRegisters) / sizeof(u8));
+
+    if (pSrc->maxRegisters > pDst->maxRegisters)
+        pDst->maxRegisters = pSrc->maxRegisters;
+    if (pSrc->maxIns > pDst->maxIns)
+        pDst->maxIns = pSrc->maxIns;
+    if (pSrc->maxOuts > pDst->maxOuts)
+        pDst->maxOuts = pSrc->maxOuts;
+}
+
+/*
+ * Map a register count to its histogram bucket.
+ */
+static int regBucket(u4 count)
+{
+    int bucket;
+
+    if (count < 16)
+        return count;
+
+    /* 16-31 -> 16, 32-63 -> 17, ..., 128-255 -> 19 */
+    for (bucket = 16; bucket < kDexRegBucketCount - 1; bucket++) {
+        count >>= 1;
+        if (count < 16)
+            return bucket;
+    }
+
+    return kDexRegBucketCount - 1;
+}
+
+/* (documented in header file) */
+void dexGetRegBucketRange(int bucket, u4* pLow, u4* pHigh)
+{
+    if (bucket < 16) {
+        *pLow = *pHigh = bucket;
+    } else if (bucket < kDexRegBucketCount - 1) {
+        *pLow = 1 << (bucket - 12);
+        *pHigh = (*pLow << 1) - 1;
+    } else {
+        *pLow = 1 << (bucket - 12);
+        *pHigh = 0xffffffff;
+    }
+}
+
+/*
+ * Classify an invoke opcode.
+ */
+static DexInvokeKind invokeKind(Opcode opcode)
+{
+    switch (opcode) {
+    case OP_INVOKE_VIRTUAL:
+    case OP_INVOKE_VIRTUAL_RANGE:
+        return kDexInvokeVirtual;
+    case OP_INVOKE_SUPER:
+    case OP_INVOKE_SUPER_RANGE:
+        return kDexInvokeSuper;
+    case OP_INVOKE_DIRECT:
+    case OP_INVOKE_DIRECT_RANGE:
+        return kDexInvokeDirect;
+    case OP_INVOKE_STATIC:
+    case OP_INVOKE_STATIC_RANGE:
+        return kDexInvokeStatic;
+    case OP_INVOKE_INTERFACE:
+    case OP_INVOKE_INTERFACE_RANGE:
+        return kDexInvokeInterface;
+    case OP_INVOKE_POLYMORPHIC:
+    case OP_INVOKE_POLYMORPHIC_RANGE:
+        return kDexInvokePolymorphic;
+    case OP_INVOKE_CUSTOM:
+    case OP_INVOKE_CUSTOM_RANGE:
+        return kDexInvokeCustom;
+    default:
+        return kDexInvokeOther;
+    }
+}
+
+/* (documented in header file) */
+const char* dexGetInvokeKindName(DexInvokeKind kind)
+{
+    static const char* const kNames[kDexInvokeKindCount] = {
+        "virtual", "super", "direct", "static", "interface",
+        "polymorphic", "custom", "other",
+    };
+
+    if ((u4) kind >= kDexInvokeKindCount)
+        return "???";
+    return kNames[kind];
+}
+
+/* (documented in header file) */
+void dexCodeStatsAddCode(DexCodeStats* pStats, const DexCode* pCode)
+{
+    const u2* insns = pCode->insns;
+    u4 insnsSize = pCode->insnsSize;
+    u4 offset = 0;
+
+    pStats->numCodeItems++;
+    pStats->numCodeUnits += insnsSize;
+    pStats->numTries += pCode->triesSize;
+
+    pStats->registersHist[regBucket(pCode->registersSize)]++;
+    pStats->insHist[regBucket(pCode->insSize)]++;
+    pStats->outsHist[regBucket(pCode->outsSize)]++;
+    if (pCode->registersSize > pStats->maxRegisters)
+        pStats->maxRegisters = pCode->registersSize;
+    if (pCode->insSize > pStats->maxIns)
+        pStats->maxIns = pCode->insSize;
+    if (pCode->outsSize > pStats->maxOuts)
+        pStats->maxOuts = pCode->outsSize;
+
+    while (offset < insnsSize) {
+        u2 codeUnit = insns[offset];
+        Opcode opcode = dexOpcodeFromCodeUnit(codeUnit);
+        size_t width = dexGetWidthFromInstruction(insns + offset);
+
+        if (width == 0 || width > insnsSize - offset) {
+            pStats->numBadCodeItems++;
+            return;
+        }
+
+        if (opcode == OP_NOP && codeUnit != OP_NOP) {
+            pStats->numPayloads++;
+            pStats->numPayloadUnits += width;
+        } else {
+            pStats->numInsns++;
+            pStats->opcodeCounts[opcode]++;
+            pStats->formatCounts[dexGetFormatFromOpcode(opcode)]++;
+            pStats->widthCounts[width]++;
+
+            if ((dexGetFlagsFromOpcode(opcode) & kInstrInvoke) != 0) {
+                DecodedInstruction decInsn;
+
+                dexDecodeInstruction(insns + offset, &decInsn);
+                pStats->invokeCounts[invokeKind(opcode)]++;
+                pStats->invokeArgsHist[regBucket(decInsn.vA)]++;
+            }
+        }
+
+        offset += width;
+    }
+}
+
+/*
+ * State shared by the scanning threads.
+ */
+struct ScanState {
+    const DexFile*          pDexFile;
+    const DexCodeExtents*   pExtents;
+
+    pthread_mutex_t         lock;
+    u4                      nextItem;   /* first unclaimed code_item */
+};
+
+/*
+ * Per-thread state.
+ */
+struct ScanWorker {
+    ScanState*      pState;
+    pthread_t       thread;
+    DexCodeStats    stats;
+};
+
+/*
+ * Claim chunks of code_items until they're all gone.
+ */
+static void* scanThreadStart(void* arg)
+{
+    ScanWorker* pWorker = (ScanWorker*) arg;
+    ScanState* pState = pWorker->pState;
+    const DexCodeExtents* pExtents = pState->pExtents;
+    const u1* baseAddr = pState->pDexFile->baseAddr;
+
+    while (true) {
+        u4 start, end, i;
+
+        pthread_mutex_lock(&pState->lock);
+        start = pState->nextItem;
+        end = start + kScanChunkSize;
+        if (end > pExtents->count || end < start)
+            end = pExtents->count;
+        pState->nextItem = end;
+        pthread_mutex_unlock(&pState->lock);
+
+        if (start >= end)
+            break;
+
+        for (i = start; i < end; i++) {
+            const DexCode* pCode =
+                (const DexCode*) (baseAddr + pExtents->items[i].codeOff);
+            dexCodeStatsAddCode(&pWorker->stats, pCode);
+        }
+    }
+
+    return NULL;
+}
+
+/* (documented in header file) */
+bool dexCodeStatsScan(const DexFile* pDexFile, int numThreads,
+    DexCodeStats* pStats)
+{
+    DexCodeExtents* pOwnExtents = NULL;
+    ScanWorker* pWorkers = NULL;
+    ScanState state;
+    int numStarted = 0;
+    bool result = false;
+    int i;
+
+    state.pDexFile = pDexFile;
+    state.pExtents = pDexFile->pCodeExtents;
+    state.nextItem = 0;
+    pthread_mutex_init(&state.lock, NULL);
+
+    if (state.pExtents == NULL) {
+        pOwnExtents = dexCreateCodeExtents(pDexFile);
+        if (pOwnExtents == NULL)
+            goto bail;
+        state.pExtents = pOwnExtents;
+    }
+
+    /* no point in having threads with nothing to do */
+    if (numThreads < 1)
+        numThreads = 1;
+    if ((u4) numThreads > state.pExtents->count / kScanChunkSize + 1)
+        numThreads = state.pExtents->count / kScanChunkSize + 1;
+
+    pWorkers = (ScanWorker*) calloc(numThreads, sizeof(ScanWorker));
+    if (pWorkers == NULL)
+        goto bail;
+
+    /*
+     * Worker 0 runs on the calling thread.  If a thread can't be
+     * started, the ones that did start (and the caller) pick up the
+     * slack.
+     */
+    for (i = 0; i < numThreads; i++)
+        pWorkers[i].pState = &state;
+    for (i = 1; i < numThreads; i++) {
+        if (pthread_create(&pWorkers[i].thread, NULL, scanThreadStart,
+                &pWorkers[i]) != 0)
+        {
+            ALOGW("Unable to start stats thread %d", i);
+            break;
+        }
+        numStarted++;
+    }
+
+    scanThreadStart(&pWorkers[0]);
+    for (i = 1; i <= numStarted; i++)
+        pthread_join(pWorkers[i].thread, NULL);
+
+    for (i = 0; i <= numStarted; i++)
+        dexCodeStatsMerge(pStats, &pWorkers[i].stats);
+    pStats->numFiles++;
+
+    result = true;
+
+bail:
+    free(pWorkers);
+    dexCodeExtentsFree(pOwnExtents);
+    pthread_mutex_destroy(&state.lock);
+    return result;
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Instruction-mix statistics for the code in one or more DEX files:
+ * opcode, format and width histograms, invoke kinds, and register
+ * pressure (registersSize / insSize / outsSize).
+ *
+ * Each distinct code_item is counted once, even if several methods share
+ * it.  Counters are cumulative, so a single DexCodeStats can be used to
+ * gather totals for a whole corpus.
+ */
+
+#ifndef LIBDEX_DEXCODESTATS_H_
+#define LIBDEX_DEXCODESTATS_H_
+
+#include "DexFile.h"
+#include "DexOpcodes.h"
+#include "InstrUtils.h"
+
+/*
+ * Invoke kinds.  The /range variants are folded into the plain ones.
+ */
+enum DexInvokeKind {
+    kDexInvokeVirtual = 0,
+    kDexInvokeSuper,
+    kDexInvokeDirect,
+    kDexInvokeStatic,
+    kDexInvokeInterface,
+    kDexInvokePolymorphic,
+    kDexInvokeCustom,
+    kDexInvokeOther,            /* optimized forms, e.g. execute-inline */
+
+    kDexInvokeKindCount
+};
+
+/*
+ * Register counts are collected into buckets: one per value from 0 to
+ * 15, then one per power of two up to 255, and one for everything
+ * larger.
+ */
+#define kDexRegBucketCount  21
+
+/* the largest instruction (const-wide) is five code units */
+#define kDexMaxInsnWidth    5
+
+struct DexCodeStats {
+    u8  numFiles;
+    u8  numCodeItems;
+    u8  numBadCodeItems;        /* undecodable; counted up to the problem */
+    u8  numCodeUnits;           /* total of insnsSize, including payloads */
+    u8  numInsns;               /* instructions, excluding payloads */
+    u8  numTries;
+
+    u8  numPayloads;            /* switch and array-data pseudo-instructions */
+    u8  numPayloadUnits;
+
+    u8  opcodeCounts[kNumPackedOpcodes];
+    u8  formatCounts[kNumInstructionFormats];
+    u8  widthCounts[kDexMaxInsnWidth + 1];  /* indexed by code units */
+    u8  invokeCounts[kDexInvokeKindCount];
+
+    u8  registersHist[kDexRegBucketCount];
+    u8  insHist[kDexRegBucketCount];
+    u8  outsHist[kDexRegBucketCount];
+    u8  invokeArgsHist[kDexRegBucketCount]; /* argument words per invoke */
+
+    u4  maxRegisters;
+    u4  maxIns;
+    u4  maxOuts;
+};
+
+/*
+ * Clear all counters.
+ */
+void dexCodeStatsInit(DexCodeStats* pStats);
+
+/*
+ * Add the counters in "pSrc" to "pDst".
+ */
+void dexCodeStatsMerge(DexCodeStats* pDst, const DexCodeStats* pSrc);
+
+/*
+ * Count the instructions in one code_item.
+ */
+void dexCodeStatsAddCode(DexCodeStats* pStats, const DexCode* pCode);
+
+/*
+ * Scan every code_item in a DEX file and add the results to "pStats".
+ * The work is split across "numThreads" threads (including the caller),
+ * each of which keeps private counters that are merged at the end.
+ *
+ * Uses pDexFile->pCodeExtents if it's there, otherwise builds a
+ * temporary index.  Returns false on failure, leaving "pStats"
+ * unchanged.
+ */
+bool dexCodeStatsScan(const DexFile* pDexFile, int numThreads,
+    DexCodeStats* pStats);
+
+/*
+ * Get the name of an invoke kind, e.g. "virtual".
+ */
+const char* dexGetInvokeKindName(DexInvokeKind kind);
+
+/*
+ * Get the range of register counts covered by a bucket.  "*pHigh" is
+ * set to 0xffffffff for the last, open-ended bucket.
+ */
+void dexGetRegBucketRange(int bucket, u4* pLow, u4* pHigh);
+
+#endif  // LIBDEX_DEXCODESTATS_H_
@@ -19,6 +19,7 @@
  */
 
 #include "DexFile.h"
+#include "DexCodeExtents.h"
 #include "DexOptData.h"
 #include "DexProto.h"
 #include "DexCatch.h"
@@ -404,6 +405,17 @@ DexFile* dexFileParse(const u1* data, size_t length, int flags)
         goto bail;
     }
 
+    if (flags & kDexParseCodeExtents) {
+        pDexFile->pCodeExtents = dexCreateCodeExtents(pDexFile);
+        if (pDexFile->pCodeExtents == NULL) {
+            ALOGE("ERROR: unable to index code items");
+            if (!(flags & kDexParseContinueOnError))
+                goto bail;
+        } else {
+            pDexFile->overhead += pDexFile->pCodeExtents->size;
+        }
+    }
+
     /*
      * Success!
      */
@@ -427,6 +439,7 @@ void dexFileFree(DexFile* pDexFile)
     if (pDexFile == NULL)
         return;
 
+    dexCodeExtentsFree(pDexFile->pCodeExtents);
     free(pDexFile);
 }
 
@@ -579,6 +579,8 @@ struct DexOptHeader {
 
 #define DEX_INTERFACE_CACHE_SIZE    128     /* must be power of 2 */
 
+struct DexCodeExtents;
+
 /*
  * Structure representing a DEX file.
  *
@@ -606,6 +608,9 @@ struct DexFile {
     const DexClassLookup* pClassLookup;
     const void*         pRegisterMapPool;       // RegisterMapClassPool
 
+    /* optional code_item index, built if kDexParseCodeExtents was set */
+    DexCodeExtents*     pCodeExtents;
+
     /* points to start of DEX file data */
     const u1*           baseAddr;
 
@@ -633,6 +638,7 @@ enum {
     kDexParseDefault            = 0,
     kDexParseVerifyChecksum     = 1,
     kDexParseContinueOnError    = (1 << 1),
+    kDexParseCodeExtents        = (1 << 2),     /* build pCodeExtents */
 };
 
 /*
@@ -22,12 +22,17 @@
 
 #include "DexFile.h"
 
+#include "DexApi.h"
 #include "DexCatch.h"
 #include "DexClass.h"
+#include "DexCodeExtents.h"
+#include "DexCodeStats.h"
 #include "DexDataMap.h"
 #include "DexUtf.h"
 #include "DexOpcodes.h"
 #include "DexProto.h"
+#include "DexRegisterMap.h"
+#include "DexSizeStats.h"
 #include "InstrUtils.h"
 #include "Leb128.h"
 #include "ZipArchive.h"
@@ -0,0 +1,295 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Read-only access to the register maps in optimized DEX files.
+ */
+
+#include "DexRegisterMap.h"
+#include "DexClass.h"
+#include "Leb128.h"
+
+#include <string.h>
+
+/* size of the format/regWidth/numEntries header */
+static const int kRegMapHeaderLen = 4;
+
+/*
+ * Get the number of bytes used for the address in each entry of a
+ * compact map, or 0 if the format isn't a compact one.
+ */
+static int compactAddrWidth(u1 format)
+{
+    switch (format) {
+    case kDexRegMapFormatCompact8:  return 1;
+    case kDexRegMapFormatCompact16: return 2;
+    default:                        return 0;
+    }
+}
+
+/* (documented in header file) */
+size_t dexRegisterMapGetSize(const u1* pMapData)
+{
+    u1 format = dexRegisterMapGetFormat(pMapData);
+    u1 regWidth = pMapData[1];
+    u2 numEntries = pMapData[2] | (pMapData[3] << 8);
+
+    switch (format) {
+    case kDexRegMapFormatNone:
+        return 1;
+    case kDexRegMapFormatCompact8:
+    case kDexRegMapFormatCompact16:
+        return kRegMapHeaderLen +
+            (compactAddrWidth(format) + regWidth) * numEntries;
+    case kDexRegMapFormatDifferential:
+        {
+            const u1* ptr = pMapData + kRegMapHeaderLen;
+            int len = readUnsignedLeb128(&ptr);
+            return len + (ptr - pMapData);
+        }
+    default:
+        ALOGE("Unknown register map format %d", format);
+        return 0;
+    }
+}
+
+/* (documented in header file) */
+bool dexRegisterMapParse(const u1* pMapData, DexRegisterMap* pMap)
+{
+    u1 format = dexRegisterMapGetFormat(pMapData);
+
+    pMap->format = format;
+    if (format == kDexRegMapFormatNone) {
+        pMap->regWidth = 0;
+        pMap->numEntries = 0;
+        pMap->data = NULL;
+        return true;
+    }
+
+    pMap->regWidth = pMapData[1];
+    pMap->numEntries = pMapData[2] | (pMapData[3] << 8);
+    pMap->data = pMapData + kRegMapHeaderLen;
+
+    switch (format) {
+    case kDexRegMapFormatCompact8:
+    case kDexRegMapFormatCompact16:
+        return true;
+    case kDexRegMapFormatDifferential:
+        readUnsignedLeb128(&pMap->data);        /* skip compressed length */
+        return true;
+    default:
+        ALOGE("Unknown register map format %d", format);
+        pMap->format = kDexRegMapFormatUnknown;
+        return false;
+    }
+}
+
+/* (documented in header file) */
+const u1* dexGetRegisterMapClassData(const DexFile* pDexFile, u4 classDefIdx,
+    u4* pMethodCount)
+{
+    const u1* pClassPool = (const u1*) pDexFile->pRegisterMapPool;
+
+    if (pClassPool == NULL)
+        return NULL;
+
+    const u4* pClassPoolU4 = (const u4*) pClassPool;
+    u4 numClasses = pClassPoolU4[0];
+    if (classDefIdx >= numClasses) {
+        ALOGW("Register map class index %u out of range (%u)",
+            classDefIdx, numClasses);
+        return NULL;
+    }
+
+    u4 classOffset = pClassPoolU4[1 + classDefIdx];
+    if (classOffset == 0)
+        return NULL;
+
+    const u1* data = pClassPool + classOffset;
+    if (pMethodCount != NULL)
+        *pMethodCount = data[0] | (data[1] << 8);
+
+    return data + 4;    /* skip methodCount and two pad bytes */
+}
+
+/* (documented in header file) */
+bool dexFindRegisterMap(const DexFile* pDexFile, u4 classDefIdx,
+    u4 methodIdx, DexRegisterMap* pMap)
+{
+    u4 methodCount;
+    const u1* pMapData =
+        dexGetRegisterMapClassData(pDexFile, classDefIdx, &methodCount);
+
+    if (pMapData == NULL)
+        return false;
+
+    /*
+     * The maps are stored in class_data_item order, so find the method's
+     * position in the direct+virtual lists.  Method indices restart from
+     * zero at the start of the virtual list.
+     */
+    const DexClassDef* pClassDef = dexGetClassDef(pDexFile, classDefIdx);
+    const u1* pEncodedData = dexGetClassData(pDexFile, pClassDef);
+    if (pEncodedData == NULL)
+        return false;
+
+    DexClassDataHeader header;
+    DexField field;
+    DexMethod method;
+    u4 lastIndex;
+    u4 i;
+
+    dexReadClassDataHeader(&pEncodedData, &header);
+
+    lastIndex = 0;
+    for (i = 0; i < header.staticFieldsSize; i++)
+        dexReadClassDataField(&pEncodedData, &field, &lastIndex);
+    lastIndex = 0;
+    for (i = 0; i < header.instanceFieldsSize; i++)
+        dexReadClassDataField(&pEncodedData, &field, &lastIndex);
+
+    u4 totalMethods = header.directMethodsSize + header.virtualMethodsSize;
+    u4 mapIdx = kDexNoIndex;
+
+    lastIndex = 0;
+    for (i = 0; i < totalMethods; i++) {
+        if (i == header.directMethodsSize)
+            lastIndex = 0;
+        dexReadClassDataMethod(&pEncodedData, &method, &lastIndex);
+        if (method.methodIdx == methodIdx) {
+            mapIdx = i;
+            break;
+        }
+    }
+
+    if (mapIdx == kDexNoIndex || mapIdx >= methodCount)
+        return false;
+
+    for (i = 0; i < mapIdx; i++) {
+        size_t size = dexRegisterMapGetSize(pMapData);
+        if (size == 0)
+            return false;
+        pMapData += size;
+    }
+
+    if (!dexRegisterMapParse(pMapData, pMap))
+        return false;
+
+    return pMap->format != kDexRegMapFormatNone;
+}
+
+/*
+ * Flip one bit in a register bit vector.
+ */
+static inline void toggleBit(u1* bits, int bitIndex)
+{
+    bits[bitIndex >> 3] ^= 1 << (bitIndex & 0x07);
+}
+
+/*
+ * Decode a differential-format map until we reach "addr".
+ *
+ * The first entry is the address followed by the full bit vector.  The
+ * address is one byte if it's under 128; otherwise the high bit of the
+ * first byte is set and the second byte supplies bits 7-14.  (This is
+ * not a uleb128; the second byte has no continuation bit.)
+ * Each following entry starts with a key byte:
+ *  - bits 0-2: address delta - 1, or 7 if a uleb128 delta follows
+ *  - bit 3: clear if exactly one bit changed, in which case bits 4-7 are
+ *    its index; set otherwise, with bits 4-7 giving the number of uleb128
+ *    bit indices that follow (0 = no change, 15 = full bit vector follows)
+ */
+static const u1* getDifferentialLine(const DexRegisterMap* pMap, u4 addr,
+    u1* lineBuf)
+{
+    const u1* data = pMap->data;
+    int regWidth = pMap->regWidth;
+    u4 lineAddr;
+    int entry;
+
+    if (pMap->numEntries == 0)
+        return NULL;
+
+    lineAddr = *data++;
+    if ((lineAddr & 0x80) != 0) {
+        lineAddr &= ~0x80;
+        lineAddr |= *data++ << 7;
+    }
+    memcpy(lineBuf, data, regWidth);
+    data += regWidth;
+
+    for (entry = 1; ; entry++) {
+        if (lineAddr == addr)
+            return lineBuf;
+        if (lineAddr > addr || entry == pMap->numEntries)
+            return NULL;
+
+        u1 key = *data++;
+
+        if ((key & 0x07) == 0x07)
+            lineAddr += readUnsignedLeb128(&data);
+        else
+            lineAddr += (key & 0x07) + 1;
+
+        int bitCount = key >> 4;
+        if ((key & 0x08) == 0) {
+            toggleBit(lineBuf, bitCount);
+        } else if (bitCount == 15) {
+            memcpy(lineBuf, data, regWidth);
+            data += regWidth;
+        } else {
+            while (bitCount--)
+                toggleBit(lineBuf, readUnsignedLeb128(&data));
+        }
+    }
+}
+
+/* (documented in header file) */
+const u1* dexRegisterMapGetLine(const DexRegisterMap* pMap, u4 addr,
+    u1* lineBuf)
+{
+    if (pMap->format == kDexRegMapFormatDifferential)
+        return getDifferentialLine(pMap, addr, lineBuf);
+
+    int addrWidth = compactAddrWidth(pMap->format);
+    if (addrWidth == 0)
+        return NULL;
+
+    int lineWidth = addrWidth + pMap->regWidth;
+
+    // Note: Signed type is important for max and min.
+    int min = 0;
+    int max = pMap->numEntries - 1;
+
+    while (max >= min) {
+        int guess = (min + max) >> 1;
+        const u1* data = pMap->data + lineWidth * guess;
+        u4 lineAddr = data[0];
+
+        if (addrWidth > 1)
+            lineAddr |= data[1] << 8;
+
+        if (addr < lineAddr) {
+            max = guess - 1;
+        } else if (addr > lineAddr) {
+            min = guess + 1;
+        } else {
+            return data + addrWidth;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Read-only access to the register maps stored in the "RMAP" chunk of
+ * an optimized DEX file.
+ *
+ * The chunk starts with a class count and a table of per-class offsets
+ * (indexed by class_def index, relative to the start of the chunk data).
+ * Each class entry holds a method count (u2, plus two pad bytes) followed
+ * by one map per direct method and then one per virtual method, in
+ * class_data_item order.  Maps are variable-length and unaligned.
+ */
+
+#ifndef LIBDEX_DEXREGISTERMAP_H_
+#define LIBDEX_DEXREGISTERMAP_H_
+
+#include "DexFile.h"
+
+/*
+ * Register map formats.  These match the values written by the VM.
+ */
+enum {
+    kDexRegMapFormatUnknown      = 0,
+    kDexRegMapFormatNone         = 1,   /* no map data follows */
+    kDexRegMapFormatCompact8     = 2,   /* compact layout, 8-bit addresses */
+    kDexRegMapFormatCompact16    = 3,   /* compact layout, 16-bit addresses */
+    kDexRegMapFormatDifferential = 4,   /* compressed, differential encoding */
+
+    kDexRegMapFormatOnHeap       = 0x80, /* flag; not present in files */
+};
+
+/*
+ * Expanded form of a register map header.  "data" points directly into
+ * the mapped file: at the first (address, bits) entry for the compact
+ * formats, or at the start of the encoded stream (just past the
+ * uleb128 length) for the differential format.
+ */
+struct DexRegisterMap {
+    u1          format;         /* kDexRegMapFormat* value */
+    u1          regWidth;       /* bytes per register bit vector */
+    u2          numEntries;     /* number of (address, bits) entries */
+    const u1*   data;
+};
+
+/*
+ * Get the format of the raw map at "pMapData".
+ */
+DEX_INLINE u1 dexRegisterMapGetFormat(const u1* pMapData) {
+    return pMapData[0] & ~kDexRegMapFormatOnHeap;
+}
+
+/*
+ * Compute the size, in bytes, of the raw map at "pMapData".  Returns 0
+ * if the format is not recognized, in which case the rest of the class'
+ * maps can't be located.
+ */
+size_t dexRegisterMapGetSize(const u1* pMapData);
+
+/*
+ * Expand the header of the raw map at "pMapData".  Returns false if the
+ * format is not recognized.  A kDexRegMapFormatNone map is expanded with
+ * zero entries.
+ */
+bool dexRegisterMapParse(const u1* pMapData, DexRegisterMap* pMap);
+
+/*
+ * Get the raw data of the first map for the given class_def index.
+ * Returns NULL if the file has no register maps, or there are none for
+ * this class.  If "pMethodCount" is non-NULL it receives the number of
+ * maps stored for the class.
+ */
+const u1* dexGetRegisterMapClassData(const DexFile* pDexFile, u4 classDefIdx,
+    u4* pMethodCount);
+
+/*
+ * Find the register map for a method, identified by its class_def index
+ * and method_id index.  Returns false if there's no map for the method
+ * (including native and abstract methods, which have format "none").
+ */
+bool dexFindRegisterMap(const DexFile* pDexFile, u4 classDefIdx,
+    u4 methodIdx, DexRegisterMap* pMap);
+
+/*
+ * Get the register bit vector for the instruction at "addr" (in 16-bit
+ * code units).  Bit N (LSB first within each byte) is set if register vN
+ * holds a reference.  Only GC points have entries; returns NULL if there
+ * isn't one for "addr".
+ *
+ * For the compact formats the result points directly into the map.  For
+ * the differential format, entries are decoded up to "addr" into
+ * "lineBuf", which must hold at least pMap->regWidth bytes, and the
+ * result points at "lineBuf".
+ */
+const u1* dexRegisterMapGetLine(const DexRegisterMap* pMap, u4 addr,
+    u1* lineBuf);
+
+#endif  // LIBDEX_DEXREGISTERMAP_H_
@@ -0,0 +1,484 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Byte-level accounting of the contents of a DEX file.
+ */
+
+#include "DexSizeStats.h"
+#include "DexClass.h"
+#include "DexCodeExtents.h"
+#include "Leb128.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const u1* skipEncodedValue(const u1* ptr);
+
+/*
+ * Skip over an encoded_array.
+ */
+static const u1* skipEncodedArray(const u1* ptr)
+{
+    u4 size = readUnsignedLeb128(&ptr);
+
+    while (size--)
+        ptr = skipEncodedValue(ptr);
+    return ptr;
+}
+
+/*
+ * Skip over an encoded_annotation.
+ */
+static const u1* skipEncodedAnnotation(const u1* ptr)
+{
+    readUnsignedLeb128(&ptr);               /* type_idx */
+    u4 size = readUnsignedLeb128(&ptr);
+
+    while (size--) {
+        readUnsignedLeb128(&ptr);           /* name_idx */
+        ptr = skipEncodedValue(ptr);
+    }
+    return ptr;
+}
+
+/*
+ * Skip over an encoded_value.
+ */
+static const u1* skipEncodedValue(const u1* ptr)
+{
+    u1 headerByte = *ptr++;
+    u1 valueType = headerByte & kDexAnnotationValueTypeMask;
+    u1 valueArg = headerByte >> kDexAnnotationValueArgShift;
+
+    switch (valueType) {
+    case kDexAnnotationArray:
+        return skipEncodedArray(ptr);
+    case kDexAnnotationAnnotation:
+        return skipEncodedAnnotation(ptr);
+    case kDexAnnotationNull:
+    case kDexAnnotationBoolean:
+        return ptr;
+    default:
+        return ptr + valueArg + 1;
+    }
+}
+
+/*
+ * Get the size of a class_data_item.
+ */
+static u4 getClassDataSize(const u1* pData)
+{
+    const u1* start = pData;
+    DexClassDataHeader header;
+    DexField field;
+    DexMethod method;
+    u4 lastIndex = 0;
+    u4 i;
+
+    dexReadClassDataHeader(&pData, &header);
+    for (i = 0; i < header.staticFieldsSize + header.instanceFieldsSize; i++)
+        dexReadClassDataField(&pData, &field, &lastIndex);
+    for (i = 0; i < header.directMethodsSize + header.virtualMethodsSize; i++)
+        dexReadClassDataMethod(&pData, &method, &lastIndex);
+
+    return pData - start;
+}
+
+/*
+ * Get the size of an annotations_directory_item.
+ */
+static u4 getAnnotationsDirectorySize(const DexAnnotationsDirectoryItem* pDir)
+{
+    return sizeof(DexAnnotationsDirectoryItem)
+        + pDir->fieldsSize * sizeof(DexFieldAnnotationsItem)
+        + pDir->methodsSize * sizeof(DexMethodAnnotationsItem)
+        + pDir->parametersSize * sizeof(DexParameterAnnotationsItem);
+}
+
+/* (documented in header file) */
+u4 dexGetDebugInfoSize(const u1* pStream)
+{
+    const u1* ptr = pStream;
+    u4 parametersSize;
+
+    readUnsignedLeb128(&ptr);               /* line_start */
+    parametersSize = readUnsignedLeb128(&ptr);
+    while (parametersSize--)
+        readUnsignedLeb128(&ptr);           /* parameter_names */
+
+    while (true) {
+        u1 opcode = *ptr++;
+
+        switch (opcode) {
+        case DBG_END_SEQUENCE:
+            return ptr - pStream;
+        case DBG_ADVANCE_PC:
+        case DBG_END_LOCAL:
+        case DBG_RESTART_LOCAL:
+        case DBG_SET_FILE:
+            readUnsignedLeb128(&ptr);
+            break;
+        case DBG_ADVANCE_LINE:
+            readSignedLeb128(&ptr);
+            break;
+        case DBG_START_LOCAL:
+            readUnsignedLeb128(&ptr);       /* register_num */
+            readUnsignedLeb128(&ptr);       /* name_idx */
+            readUnsignedLeb128(&ptr);       /* type_idx */
+            break;
+        case DBG_START_LOCAL_EXTENDED:
+            readUnsignedLeb128(&ptr);       /* register_num */
+            readUnsignedLeb128(&ptr);       /* name_idx */
+            readUnsignedLeb128(&ptr);       /* type_idx */
+            readUnsignedLeb128(&ptr);       /* sig_idx */
+            break;
+        default:
+            /* DBG_SET_PROLOGUE_END etc. and special opcodes */
+            break;
+        }
+    }
+}
+
+/* (documented in header file) */
+const char* dexGetMapItemTypeName(u2 type)
+{
+    switch (type) {
+    case kDexTypeHeaderItem:               return "header_item";
+    case kDexTypeStringIdItem:             return "string_id_item";
+    case kDexTypeTypeIdItem:               return "type_id_item";
+    case kDexTypeProtoIdItem:              return "proto_id_item";
+    case kDexTypeFieldIdItem:              return "field_id_item";
+    case kDexTypeMethodIdItem:             return "method_id_item";
+    case kDexTypeClassDefItem:             return "class_def_item";
+    case kDexTypeCallSiteIdItem:           return "call_site_id_item";
+    case kDexTypeMethodHandleItem:         return "method_handle_item";
+    case kDexTypeMapList:                  return "map_list";
+    case kDexTypeTypeList:                 return "type_list";
+    case kDexTypeAnnotationSetRefList:     return "annotation_set_ref_list";
+    case kDexTypeAnnotationSetItem:        return "annotation_set_item";
+    case kDexTypeClassDataItem:            return "class_data_item";
+    case kDexTypeCodeItem:                 return "code_item";
+    case kDexTypeStringDataItem:           return "string_data_item";
+    case kDexTypeDebugInfoItem:            return "debug_info_item";
+    case kDexTypeAnnotationItem:           return "annotation_item";
+    case kDexTypeEncodedArrayItem:         return "encoded_array_item";
+    case kDexTypeAnnotationsDirectoryItem: return "annotations_directory_item";
+    default:                               return NULL;
+    }
+}
+
+/*
+ * Get the required alignment of the items in a section.
+ */
+static u4 getItemAlignment(u2 type)
+{
+    switch (type) {
+    case kDexTypeClassDataItem:
+    case kDexTypeStringDataItem:
+    case kDexTypeDebugInfoItem:
+    case kDexTypeAnnotationItem:
+    case kDexTypeEncodedArrayItem:
+        return 1;
+    default:
+        return 4;
+    }
+}
+
+/*
+ * Get the size of the item of type "type" at "ptr".
+ */
+static u4 getItemSize(const DexFile* pDexFile, u2 type, const u1* ptr)
+{
+    switch (type) {
+    case kDexTypeHeaderItem:
+        return pDexFile->pHeader->headerSize;
+    case kDexTypeStringIdItem:
+        return sizeof(DexStringId);
+    case kDexTypeTypeIdItem:
+        return sizeof(DexTypeId);
+    case kDexTypeProtoIdItem:
+        return sizeof(DexProtoId);
+    case kDexTypeFieldIdItem:
+        return sizeof(DexFieldId);
+    case kDexTypeMethodIdItem:
+        return sizeof(DexMethodId);
+    case kDexTypeClassDefItem:
+        return sizeof(DexClassDef);
+    case kDexTypeCallSiteIdItem:
+        return sizeof(DexCallSiteId);
+    case kDexTypeMethodHandleItem:
+        return sizeof(DexMethodHandleItem);
+    case kDexTypeMapList:
+        return sizeof(u4)
+            + ((const DexMapList*) ptr)->size * sizeof(DexMapItem);
+    case kDexTypeTypeList:
+        return sizeof(u4)
+            + ((const DexTypeList*) ptr)->size * sizeof(DexTypeItem);
+    case kDexTypeAnnotationSetRefList:
+        return sizeof(u4) + ((const DexAnnotationSetRefList*) ptr)->size
+            * sizeof(DexAnnotationSetRefItem);
+    case kDexTypeAnnotationSetItem:
+        return sizeof(u4)
+            + ((const DexAnnotationSetItem*) ptr)->size * sizeof(u4);
+    case kDexTypeClassDataItem:
+        return getClassDataSize(ptr);
+    case kDexTypeCodeItem:
+        return dexGetCodeItemSize(pDexFile, (const DexCode*) ptr);
+    case kDexTypeStringDataItem:
+        {
+            const u1* data = ptr;
+            readUnsignedLeb128(&data);      /* utf16_size */
+            return (data - ptr) + strlen((const char*) data) + 1;
+        }
+    case kDexTypeDebugInfoItem:
+        return dexGetDebugInfoSize(ptr);
+    case kDexTypeAnnotationItem:
+        return skipEncodedAnnotation(ptr + 1) - ptr;
+    case kDexTypeEncodedArrayItem:
+        return skipEncodedArray(ptr) - ptr;
+    case kDexTypeAnnotationsDirectoryItem:
+        return getAnnotationsDirectorySize(
+            (const DexAnnotationsDirectoryItem*) ptr);
+    default:
+        return 0;
+    }
+}
+
+/*
+ * Walk the items of one section, which ends at file offset "limit".
+ */
+static bool walkSection(const DexFile* pDexFile, DexSectionSize* pSection,
+    u4 limit, DexSectionItemCb itemCb, void* cnxt)
+{
+    const char* typeName = dexGetMapItemTypeName(pSection->type);
+    u4 align = getItemAlignment(pSection->type);
+    u4 off = pSection->offset;
+    u4 i;
+
+    if (off > limit) {
+        ALOGE("Map item 0x%04x at 0x%x is past the end of the file",
+            pSection->type, off);
+        return false;
+    }
+
+    if (typeName == NULL) {
+        /* can't walk it, so count all of it */
+        pSection->itemBytes = limit - off;
+        return true;
+    }
+
+    for (i = 0; i < pSection->count; i++) {
+        u4 alignedOff = (off + align - 1) & ~(align - 1);
+        if (alignedOff != off) {
+            pSection->paddingBytes += alignedOff - off;
+            pSection->numPaddings++;
+            off = alignedOff;
+        }
+
+        const u1* ptr = pDexFile->baseAddr + off;
+        u4 size = (off < limit) ? getItemSize(pDexFile, pSection->type, ptr) : 0;
+        if (size == 0 || size > limit - off) {
+            ALOGE("%s %u at 0x%x runs past the end of its section",
+                typeName, i, off);
+            return false;
+        }
+
+        if (itemCb != NULL)
+            (*itemCb)(cnxt, pSection->type, ptr, size);
+        pSection->itemBytes += size;
+        off += size;
+    }
+
+    if (off < limit) {
+        pSection->paddingBytes += limit - off;
+        pSection->numPaddings++;
+    }
+    return true;
+}
+
+/*
+ * Add the size of an annotation set and its annotations to a class.
+ */
+static void addAnnotationSetSize(const DexFile* pDexFile,
+    const DexAnnotationSetItem* pSet, DexClassSize* pSize)
+{
+    u4 i;
+
+    if (pSet == NULL)
+        return;
+
+    pSize->annotationBytes += sizeof(u4) + pSet->size * sizeof(u4);
+    for (i = 0; i < pSet->size; i++) {
+        const DexAnnotationItem* pItem =
+            dexGetAnnotationItem(pDexFile, pSet, i);
+        if (pItem == NULL)
+            continue;
+
+        pSize->numAnnotations++;
+        pSize->annotationBytes +=
+            skipEncodedAnnotation(pItem->annotation) - (const u1*) pItem;
+    }
+}
+
+/*
+ * Add up the data section items used by a class.
+ */
+static void computeClassSize(const DexFile* pDexFile,
+    const DexClassDef* pClassDef, DexClassSize* pSize)
+{
+    const u1* pData = dexGetClassData(pDexFile, pClassDef);
+    int i, j;
+
+    if (pData != NULL) {
+        const u1* start = pData;
+        DexClassDataHeader header;
+        DexField field;
+        DexMethod method;
+        u4 lastIndex = 0;
+        u4 k;
+
+        dexReadClassDataHeader(&pData, &header);
+        for (k = 0; k < header.staticFieldsSize + header.instanceFieldsSize; k++)
+            dexReadClassDataField(&pData, &field, &lastIndex);
+        for (k = 0; k < header.directMethodsSize + header.virtualMethodsSize; k++) {
+            dexReadClassDataMethod(&pData, &method, &lastIndex);
+            if (method.codeOff == 0)
+                continue;
+
+            const DexCode* pCode =
+                (const DexCode*) (pDexFile->baseAddr + method.codeOff);
+            pSize->numCodeItems++;
+            pSize->codeBytes += dexGetCodeItemSize(pDexFile, pCode);
+            if (pCode->debugInfoOff != 0) {
+                pSize->numDebugInfos++;
+                pSize->debugInfoBytes += dexGetDebugInfoSize(
+                    pDexFile->baseAddr + pCode->debugInfoOff);
+            }
+        }
+        pSize->classDataBytes = pData - start;
+    }
+
+    const DexAnnotationsDirectoryItem* pDir =
+        dexGetAnnotationsDirectoryItem(pDexFile, pClassDef);
+    if (pDir != NULL) {
+        pSize->annotationBytes += getAnnotationsDirectorySize(pDir);
+        addAnnotationSetSize(pDexFile,
+            dexGetClassAnnotationSet(pDexFile, pDir), pSize);
+
+        const DexFieldAnnotationsItem* pFields =
+            dexGetFieldAnnotations(pDexFile, pDir);
+        for (i = 0; i < dexGetFieldAnnotationsSize(pDexFile, pDir); i++) {
+            addAnnotationSetSize(pDexFile,
+                dexGetFieldAnnotationSetItem(pDexFile, &pFields[i]), pSize);
+        }
+
+        const DexMethodAnnotationsItem* pMethods =
+            dexGetMethodAnnotations(pDexFile, pDir);
+        for (i = 0; i < dexGetMethodAnnotationsSize(pDexFile, pDir); i++) {
+            addAnnotationSetSize(pDexFile,
+                dexGetMethodAnnotationSetItem(pDexFile, &pMethods[i]), pSize);
+        }
+
+        const DexParameterAnnotationsItem* pParams =
+            dexGetParameterAnnotations(pDexFile, pDir);
+        for (i = 0; i < dexGetParameterAnnotationsSize(pDexFile, pDir); i++) {
+            const DexAnnotationSetRefList* pList =
+                dexGetParameterAnnotationSetRefList(pDexFile, &pParams[i]);
+            if (pList == NULL)
+                continue;
+
+            pSize->annotationBytes += sizeof(u4)
+                + pList->size * sizeof(DexAnnotationSetRefItem);
+            for (j = 0; j < (int) pList->size; j++) {
+                addAnnotationSetSize(pDexFile, dexGetSetRefItemItem(pDexFile,
+                    dexGetParameterAnnotationSetRef(pList, j)), pSize);
+            }
+        }
+    }
+
+    if (pClassDef->staticValuesOff != 0) {
+        const u1* pValues = pDexFile->baseAddr + pClassDef->staticValuesOff;
+        pSize->staticValuesBytes = skipEncodedArray(pValues) - pValues;
+    }
+}
+
+static int compareSectionOffsets(const void* a, const void* b)
+{
+    u4 offA = ((const DexSectionSize*) a)->offset;
+    u4 offB = ((const DexSectionSize*) b)->offset;
+
+    return (offA > offB) - (offA < offB);
+}
+
+/* (documented in header file) */
+bool dexSizeStatsCompute(const DexFile* pDexFile, DexSizeStats* pStats,
+    DexSectionItemCb itemCb, void* cnxt)
+{
+    const DexMapList* pMap = dexGetMap(pDexFile);
+    u4 fileSize = pDexFile->pHeader->fileSize;
+    u4 i;
+
+    memset(pStats, 0, sizeof(*pStats));
+
+    if (pMap == NULL) {
+        ALOGE("DEX file has no map");
+        return false;
+    }
+
+    pStats->numSections = pMap->size;
+    pStats->sections = (DexSectionSize*)
+        calloc(pMap->size + 1, sizeof(DexSectionSize));
+    pStats->numClasses = pDexFile->pHeader->classDefsSize;
+    pStats->classes = (DexClassSize*)
+        calloc(pStats->numClasses + 1, sizeof(DexClassSize));
+    if (pStats->sections == NULL || pStats->classes == NULL)
+        goto fail;
+
+    for (i = 0; i < pMap->size; i++) {
+        pStats->sections[i].type = pMap->list[i].type;
+        pStats->sections[i].offset = pMap->list[i].offset;
+        pStats->sections[i].count = pMap->list[i].size;
+    }
+    qsort(pStats->sections, pStats->numSections, sizeof(DexSectionSize),
+        compareSectionOffsets);
+
+    for (i = 0; i < pStats->numSections; i++) {
+        u4 limit = (i + 1 < pStats->numSections) ?
+            pStats->sections[i + 1].offset : fileSize;
+        if (!walkSection(pDexFile, &pStats->sections[i], limit, itemCb, cnxt))
+            goto fail;
+    }
+
+    for (i = 0; i < pStats->numClasses; i++) {
+        computeClassSize(pDexFile, dexGetClassDef(pDexFile, i),
+            &pStats->classes[i]);
+    }
+
+    return true;
+
+fail:
+    dexSizeStatsFree(pStats);
+    return false;
+}
+
+/* (documented in header file) */
+void dexSizeStatsFree(DexSizeStats* pStats)
+{
+    free(pStats->sections);
+    free(pStats->classes);
+    memset(pStats, 0, sizeof(*pStats));
+}
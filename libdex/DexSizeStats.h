@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2018 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Byte-level accounting of the contents of a DEX file: how much space
+ * each map section really uses, how much is lost to alignment padding,
+ * and how much of the data section each class is responsible for.
+ */
+
+#ifndef LIBDEX_DEXSIZESTATS_H_
+#define LIBDEX_DEXSIZESTATS_H_
+
+#include "DexFile.h"
+
+/*
+ * Sizes for one map_item.  "itemBytes" is the sum of the sizes of the
+ * items themselves; "paddingBytes" is the space between them, plus the
+ * space between the last item and the start of the next section.
+ *
+ * Items of unknown type can't be walked, so for those the whole section
+ * is counted as "itemBytes".
+ */
+struct DexSectionSize {
+    u2  type;                   /* kDexType* */
+    u4  offset;
+    u4  count;                  /* number of items, from the map */
+    u4  itemBytes;
+    u4  paddingBytes;
+    u4  numPaddings;            /* number of gaps that were padded */
+};
+
+/*
+ * Data section bytes used by one class.  Items that are shared (e.g. an
+ * annotation used by several classes) are counted for each user.
+ */
+struct DexClassSize {
+    u4  classDataBytes;         /* class_data_item */
+    u4  numCodeItems;
+    u4  codeBytes;              /* code_items of its methods */
+    u4  numDebugInfos;
+    u4  debugInfoBytes;         /* debug_info_items of its methods */
+    u4  numAnnotations;
+    u4  annotationBytes;        /* directory, sets, ref lists and items */
+    u4  staticValuesBytes;      /* encoded_array_item */
+};
+
+struct DexSizeStats {
+    u4              numSections;
+    DexSectionSize* sections;   /* [numSections], in file order */
+    u4              numClasses;
+    DexClassSize*   classes;    /* [numClasses], by class_def index */
+};
+
+/*
+ * Callback for each item found while walking the sections.
+ */
+typedef void (*DexSectionItemCb)(void* cnxt, u2 type, const u1* data,
+    u4 size);
+
+/*
+ * Compute the section and class sizes of a verified DEX file.  If
+ * "itemCb" is non-NULL it's called for every item in every section that
+ * can be walked, in file order.
+ *
+ * On success, fills in "pStats", which must be freed with
+ * dexSizeStatsFree().  Returns false if the map is missing or an item
+ * runs past the end of its section.
+ */
+bool dexSizeStatsCompute(const DexFile* pDexFile, DexSizeStats* pStats,
+    DexSectionItemCb itemCb, void* cnxt);
+
+/*
+ * Free the storage allocated by dexSizeStatsCompute().
+ */
+void dexSizeStatsFree(DexSizeStats* pStats);
+
+/*
+ * Get the size, in bytes, of the debug_info_item at "pStream".
+ */
+u4 dexGetDebugInfoSize(const u1* pStream);
+
+/*
+ * Get the name of a map item type, as used in the DEX format
+ * documentation (e.g. "string_data_item"), or NULL if it's unknown.
+ */
+const char* dexGetMapItemTypeName(u2 type);
+
+#endif  // LIBDEX_DEXSIZESTATS_H_
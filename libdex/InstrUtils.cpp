@@ -481,6 +481,25 @@ static inline u4 fetch_u4_impl(u4 offset, const u2* insns) {
     return insns[offset] | ((u4) insns[offset+1] << 16);
 }
 
+/*
+ * Table of format names, indexed by InstructionFormat.  The leading "k"
+ * and "Fmt" are dropped.
+ */
+static const char* const gFormatNames[kNumInstructionFormats] = {
+    "00x", "10x", "12x", "11n", "11x", "10t", "20bc", "20t", "22x", "21t",
+    "21s", "21h", "21c", "23x", "22b", "22t", "22s", "22c", "22cs", "30t",
+    "32x", "31i", "31t", "31c", "35c", "35ms", "3rc", "3rms", "51l", "35mi",
+    "3rmi", "45cc", "4rcc",
+};
+
+/* (documented in header file) */
+const char* dexGetFormatName(InstructionFormat format)
+{
+    if ((u4) format >= kNumInstructionFormats)
+        return "???";
+    return gFormatNames[format];
+}
+
 /*
  * Decode the instruction pointed to by "insns".
  *
@@ -675,6 +694,89 @@ bail:
     ;
 }
 
+/*
+ * Compute the width, in code units, of the switch or array-data payload
+ * at "insns". The caller has already checked the signature. The result
+ * is 64 bits wide so that a bogus array-data header can't overflow it.
+ */
+static u8 payloadWidth(const u2* insns)
+{
+    switch (*insns) {
+    case kPackedSwitchSignature:
+        return 4 + insns[1] * 2;
+    case kSparseSwitchSignature:
+        return 2 + insns[1] * 4;
+    default:
+        {
+            u8 elemWidth = insns[1];
+            u8 len = insns[2] | (((u4)insns[3]) << 16);
+            // The plus 1 is to round up for odd size and width.
+            return 4 + (elemWidth * len + 1) / 2;
+        }
+    }
+}
+
+/*
+ * Make sure there is a well-formed payload with the given signature at
+ * "insns": aligned, with a full header, and no longer than the remaining
+ * code.
+ */
+static bool checkPayload(const u2* insns, u4 insnsRemaining, u2 signature,
+    u4 headerWidth)
+{
+    if ((((uintptr_t) insns) & 3) != 0) {
+        return false;
+    }
+
+    if (insnsRemaining < headerWidth || *insns != signature) {
+        return false;
+    }
+
+    return payloadWidth(insns) <= insnsRemaining;
+}
+
+/* (documented in header file) */
+bool dexGetPackedSwitchPayload(const u2* insns, u4 insnsRemaining,
+    DexPackedSwitchPayload* pPayload)
+{
+    if (!checkPayload(insns, insnsRemaining, kPackedSwitchSignature, 4)) {
+        return false;
+    }
+
+    pPayload->size = insns[1];
+    pPayload->firstKey = insns[2] | (((u4)insns[3]) << 16);
+    pPayload->targets = (const s4*) &insns[4];
+    return true;
+}
+
+/* (documented in header file) */
+bool dexGetSparseSwitchPayload(const u2* insns, u4 insnsRemaining,
+    DexSparseSwitchPayload* pPayload)
+{
+    if (!checkPayload(insns, insnsRemaining, kSparseSwitchSignature, 2)) {
+        return false;
+    }
+
+    pPayload->size = insns[1];
+    pPayload->keys = (const s4*) &insns[2];
+    pPayload->targets = pPayload->keys + pPayload->size;
+    return true;
+}
+
+/* (documented in header file) */
+bool dexGetArrayDataPayload(const u2* insns, u4 insnsRemaining,
+    DexArrayDataPayload* pPayload)
+{
+    if (!checkPayload(insns, insnsRemaining, kArrayDataSignature, 4)) {
+        return false;
+    }
+
+    pPayload->elementWidth = insns[1];
+    pPayload->size = insns[2] | (((u4)insns[3]) << 16);
+    pPayload->data = (const u1*) &insns[4];
+    return true;
+}
+
 /*
  * Return the width of the specified instruction, or 0 if not defined.  Also
  * works for special OP_NOP entries, including switch statement data tables
@@ -682,20 +784,12 @@ bail:
  */
 size_t dexGetWidthFromInstruction(const u2* insns)
 {
-    size_t width;
-
-    if (*insns == kPackedSwitchSignature) {
-        width = 4 + insns[1] * 2;
-    } else if (*insns == kSparseSwitchSignature) {
-        width = 2 + insns[1] * 4;
-    } else if (*insns == kArrayDataSignature) {
-        u2 elemWidth = insns[1];
-        u4 len = insns[2] | (((u4)insns[3]) << 16);
-        // The plus 1 is to round up for odd size and width.
-        width = 4 + (elemWidth * len + 1) / 2;
-    } else {
-        width = dexGetWidthFromOpcode(dexOpcodeFromCodeUnit(insns[0]));
+    switch (*insns) {
+    case kPackedSwitchSignature:
+    case kSparseSwitchSignature:
+    case kArrayDataSignature:
+        return payloadWidth(insns);
+    default:
+        return dexGetWidthFromOpcode(dexOpcodeFromCodeUnit(insns[0]));
     }
-
-    return width;
 }
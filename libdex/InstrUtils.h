@@ -65,6 +65,9 @@ enum InstructionFormat {
     kFmt4rcc,       // op {VCCCC .. v(CCCC+AA-1)}, meth@BBBB, proto@HHHH
 };
 
+/* number of InstructionFormat values */
+#define kNumInstructionFormats (kFmt4rcc + 1)
+
 /*
  * Types of indexed reference that are associated with opcodes whose
  * formats include such an indexed reference (e.g., 21c and 35c).
@@ -193,9 +196,97 @@ DEX_INLINE InstructionIndexType dexGetIndexTypeFromOpcode(Opcode opcode)
     return (InstructionIndexType) gDexOpcodeInfo.indexTypes[opcode];
 }
 
+/*
+ * Return the name of an instruction format, e.g. "35c".
+ */
+const char* dexGetFormatName(InstructionFormat format);
+
 /*
  * Decode the instruction pointed to by "insns".
  */
 void dexDecodeInstruction(const u2* insns, DecodedInstruction* pDec);
 
+/*
+ * Views of the data tables used by packed-switch, sparse-switch, and
+ * fill-array-data. Nothing is copied; the pointers refer directly into
+ * the instruction stream. Switch targets are relative to the address of
+ * the switch instruction, not the address of the payload.
+ */
+struct DexPackedSwitchPayload {
+    u2          size;           /* number of entries in targets[] */
+    s4          firstKey;       /* key corresponding to targets[0] */
+    const s4*   targets;
+};
+
+struct DexSparseSwitchPayload {
+    u2          size;           /* number of entries in keys[] and targets[] */
+    const s4*   keys;           /* sorted low-to-high */
+    const s4*   targets;
+};
+
+struct DexArrayDataPayload {
+    u2          elementWidth;   /* bytes per element */
+    u4          size;           /* number of elements */
+    const u1*   data;
+};
+
+/*
+ * Set up a view of the payload at "insns". The payload must start with the
+ * right signature, be 32-bit aligned, and fit entirely within the
+ * "insnsRemaining" code units that follow "insns". Returns false if any of
+ * those checks fail.
+ */
+bool dexGetPackedSwitchPayload(const u2* insns, u4 insnsRemaining,
+    DexPackedSwitchPayload* pPayload);
+bool dexGetSparseSwitchPayload(const u2* insns, u4 insnsRemaining,
+    DexSparseSwitchPayload* pPayload);
+bool dexGetArrayDataPayload(const u2* insns, u4 insnsRemaining,
+    DexArrayDataPayload* pPayload);
+
+/*
+ * Find the branch target for "key" in a packed-switch table. Returns false
+ * if no case matches, in which case execution falls through.
+ */
+DEX_INLINE bool dexPackedSwitchFindTarget(
+    const DexPackedSwitchPayload* pPayload, s4 key, s4* pTarget)
+{
+    u4 index = (u4) key - (u4) pPayload->firstKey;
+
+    if (index >= pPayload->size)
+        return false;
+
+    *pTarget = pPayload->targets[index];
+    return true;
+}
+
+/*
+ * Find the branch target for "key" in a sparse-switch table, by binary
+ * search over the sorted keys. Returns false if no case matches.
+ */
+DEX_INLINE bool dexSparseSwitchFindTarget(
+    const DexSparseSwitchPayload* pPayload, s4 key, s4* pTarget)
+{
+    const s4* keys = pPayload->keys;
+
+    // Note: Signed type is important for max and min.
+    int min = 0;
+    int max = pPayload->size - 1;
+
+    while (max >= min) {
+        int guess = (min + max) >> 1;
+        s4 guessKey = keys[guess];
+
+        if (key < guessKey) {
+            max = guess - 1;
+        } else if (key > guessKey) {
+            min = guess + 1;
+        } else {
+            *pTarget = pPayload->targets[guess];
+            return true;
+        }
+    }
+
+    return false;
+}
+
 #endif  // LIBDEX_INSTRUTILS_H_
@@ -23,9 +23,23 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <zlib.h>
+
+#ifndef _WIN32
+# include <limits.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <sys/uio.h>
+# ifdef __linux__
+#  include <sys/syscall.h>
+# endif
+# define HAVE_MMAP_IO 1
+#endif
 
 //#define VERBOSE_DEBUG
 #ifdef VERBOSE_DEBUG
@@ -58,6 +72,8 @@ typedef enum HprofBasicType {
 
 typedef enum HprofTag {
     /* tags we must handle specially */
+    HPROF_TAG_STRING                    = 0x01,
+    HPROF_TAG_LOAD_CLASS                = 0x02,
     HPROF_TAG_HEAP_DUMP                 = 0x0c,
     HPROF_TAG_HEAP_DUMP_SEGMENT         = 0x1c,
 } HprofTag;
@@ -101,6 +117,82 @@ typedef enum HprofHeapId {
 #define kRecHdrLen  9
 
 #define kFlagAppOnly 1
+#define kFlagStats   2
+#define kFlagHistogram 4
+#define kFlagGzipOutput 8
+#define kFlagDiff    16
+#define kFlagRetained 32
+
+/* defined under "Streaming input and output" */
+typedef struct HprofReader HprofReader;
+typedef struct HprofWriter HprofWriter;
+static int64_t rdRead(HprofReader* pReader, void* buf, size_t count);
+static int wrWrite(HprofWriter* pWriter, const void* data, size_t count);
+
+/*
+ * ===========================================================================
+ *      Buffer accounting
+ * ===========================================================================
+ */
+
+/*
+ * Heap used for buffers, reported with -s.  (A mapped input isn't
+ * included.)
+ */
+typedef struct {
+    size_t curSize;
+    size_t peakSize;
+    unsigned int allocCount;    /* successful mallocs and reallocs */
+} BufferStats;
+
+static BufferStats gBufferStats;
+static pthread_mutex_t gBufferStatsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Resize a buffer from "oldSize" to "newSize" bytes, like realloc().
+ */
+static void bufNoteResize(size_t oldSize, size_t newSize)
+{
+    pthread_mutex_lock(&gBufferStatsLock);
+    gBufferStats.curSize += newSize - oldSize;
+    if (gBufferStats.curSize > gBufferStats.peakSize)
+        gBufferStats.peakSize = gBufferStats.curSize;
+    gBufferStats.allocCount++;
+    pthread_mutex_unlock(&gBufferStatsLock);
+}
+
+static void* bufRealloc(void* ptr, size_t oldSize, size_t newSize)
+{
+    void* newPtr = realloc(ptr, newSize);
+    if (newPtr == NULL)
+        return NULL;
+
+    bufNoteResize(oldSize, newSize);
+    return newPtr;
+}
+
+/*
+ * Allocate a zeroed buffer, like calloc().
+ */
+static void* bufCalloc(size_t size)
+{
+    void* ptr = calloc(1, size);
+    if (ptr == NULL)
+        return NULL;
+
+    bufNoteResize(0, size);
+    return ptr;
+}
+
+static void bufFree(void* ptr, size_t size)
+{
+    if (ptr != NULL) {
+        free(ptr);
+        pthread_mutex_lock(&gBufferStatsLock);
+        gBufferStats.curSize -= size;
+        pthread_mutex_unlock(&gBufferStatsLock);
+    }
+}
 
 /*
  * ===========================================================================
@@ -125,7 +217,11 @@ static ExpandBuf* ebAlloc(void)
     ExpandBuf* newBuf = (ExpandBuf*) malloc(sizeof(ExpandBuf));
     if (newBuf == NULL)
         return NULL;
-    newBuf->storage = (unsigned char*) malloc(kInitialSize);
+    newBuf->storage = (unsigned char*) bufRealloc(NULL, 0, kInitialSize);
+    if (newBuf->storage == NULL) {
+        free(newBuf);
+        return NULL;
+    }
     newBuf->curLen = 0;
     newBuf->maxLen = kInitialSize;
 
@@ -138,7 +234,7 @@ static ExpandBuf* ebAlloc(void)
 static void ebFree(ExpandBuf* pBuf)
 {
     if (pBuf != NULL) {
-        free(pBuf->storage);
+        bufFree(pBuf->storage, pBuf->maxLen);
         free(pBuf);
     }
 }
@@ -163,25 +259,23 @@ static inline size_t ebGetLength(ExpandBuf* pBuf)
 }
 
 /*
- * Empty the buffer.
- */
-static void ebClear(ExpandBuf* pBuf)
-{
-    pBuf->curLen = 0;
-}
-
-/*
- * Ensure that the buffer can hold at least "size" additional bytes.
+ * Ensure that the buffer can hold at least "size" additional bytes.  The
+ * storage is doubled as needed, so filling it a byte at a time is still
+ * linear.
  */
-static int ebEnsureCapacity(ExpandBuf* pBuf, int size)
+static int ebEnsureCapacity(ExpandBuf* pBuf, size_t size)
 {
     assert(size > 0);
 
     if (pBuf->curLen + size > pBuf->maxLen) {
-        int newSize = pBuf->curLen + size + 128;    /* oversize slightly */
-        unsigned char* newStorage = realloc(pBuf->storage, newSize);
+        size_t newSize = pBuf->maxLen;
+        while (newSize < pBuf->curLen + size)
+            newSize *= 2;
+
+        unsigned char* newStorage = bufRealloc(pBuf->storage, pBuf->maxLen,
+            newSize);
         if (newStorage == NULL) {
-            fprintf(stderr, "ERROR: realloc failed on size=%d\n", newSize);
+            fprintf(stderr, "ERROR: realloc failed on size=%zu\n", newSize);
             return -1;
         }
 
@@ -193,35 +287,24 @@ static int ebEnsureCapacity(ExpandBuf* pBuf, int size)
     return 0;
 }
 
-/*
- * Add data to the buffer after ensuring it can hold it.
- */
-static int ebAddData(ExpandBuf* pBuf, const void* data, size_t count)
-{
-    ebEnsureCapacity(pBuf, count);
-    memcpy(pBuf->storage + pBuf->curLen, data, count);
-    pBuf->curLen += count;
-    return 0;
-}
-
 /*
  * Read a NULL-terminated string from the input.
  */
-static int ebReadString(ExpandBuf* pBuf, FILE* in)
+static int ebReadString(ExpandBuf* pBuf, HprofReader* pReader)
 {
-    int ic;
+    unsigned char ch;
 
     do {
-        ebEnsureCapacity(pBuf, 1);
+        if (ebEnsureCapacity(pBuf, 1) != 0)
+            return -1;
 
-        ic = getc(in);
-        if (feof(in) || ferror(in)) {
+        if (rdRead(pReader, &ch, 1) != 1) {
             fprintf(stderr, "ERROR: failed reading input\n");
             return -1;
         }
 
-        pBuf->storage[pBuf->curLen++] = (unsigned char) ic;
-    } while (ic != 0);
+        pBuf->storage[pBuf->curLen++] = ch;
+    } while (ch != 0);
 
     return 0;
 }
@@ -232,19 +315,21 @@ static int ebReadString(ExpandBuf* pBuf, FILE* in)
  * This will ensure that the buffer has enough space to hold the new data
  * (plus the previous contents).
  */
-static int ebReadData(ExpandBuf* pBuf, FILE* in, size_t count, int eofExpected)
+static int ebReadData(ExpandBuf* pBuf, HprofReader* pReader, size_t count,
+    int eofExpected)
 {
-    size_t actual;
+    int64_t actual;
 
     assert(count > 0);
 
-    ebEnsureCapacity(pBuf, count);
-    actual = fread(pBuf->storage + pBuf->curLen, 1, count, in);
-    if (actual != count) {
-        if (eofExpected && feof(in) && !ferror(in)) {
+    if (ebEnsureCapacity(pBuf, count) != 0)
+        return -1;
+    actual = rdRead(pReader, pBuf->storage + pBuf->curLen, count);
+    if (actual != (int64_t) count) {
+        if (eofExpected && actual >= 0) {
             /* return without reporting an error */
         } else {
-            fprintf(stderr, "ERROR: read %zu of %zu bytes\n", actual, count);
+            fprintf(stderr, "ERROR: read %" PRId64 " of %zu bytes\n", actual, count);
             return -1;
         }
     }
@@ -258,18 +343,13 @@ static int ebReadData(ExpandBuf* pBuf, FILE* in, size_t count, int eofExpected)
 /*
  * Write the data from the buffer.  Resets the data count to zero.
  */
-static int ebWriteData(ExpandBuf* pBuf, FILE* out)
+static int ebWriteData(ExpandBuf* pBuf, HprofWriter* pWriter)
 {
-    size_t actual;
-
     assert(pBuf->curLen > 0);
     assert(pBuf->curLen <= pBuf->maxLen);
 
-    actual = fwrite(pBuf->storage, 1, pBuf->curLen, out);
-    if (actual != pBuf->curLen) {
-        fprintf(stderr, "ERROR: write %zu of %zu bytes\n", actual, pBuf->curLen);
+    if (wrWrite(pWriter, pBuf->storage, pBuf->curLen) != 0)
         return -1;
-    }
 
     pBuf->curLen = 0;
 
@@ -331,7 +411,9 @@ static int computeBasicLen(HprofBasicType basicType)
 }
 
 /*
- * Compute the length of a HPROF_CLASS_DUMP block.
+ * Compute the length of a HPROF_CLASS_DUMP block.  Nothing past
+ * origBuf[len] is read; if the block doesn't fit in "len" bytes the
+ * result is -1.
  */
 static int computeClassDumpLen(const unsigned char* origBuf, int len)
 {
@@ -343,7 +425,7 @@ static int computeClassDumpLen(const unsigned char* origBuf, int len)
     buf += blockLen;
     len -= blockLen;
 
-    if (len < 0)
+    if (len < 2)
         return -1;
 
     count = get2BE(buf);
@@ -354,6 +436,8 @@ static int computeClassDumpLen(const unsigned char* origBuf, int len)
         HprofBasicType basicType;
         int basicLen;
 
+        if (len < 2 + 1)
+            return -1;
         basicType = buf[2];
         basicLen = computeBasicLen(basicType);
         if (basicLen < 0) {
@@ -367,6 +451,8 @@ static int computeClassDumpLen(const unsigned char* origBuf, int len)
             return -1;
     }
 
+    if (len < 2)
+        return -1;
     count = get2BE(buf);
     buf += 2;
     len -= 2;
@@ -375,6 +461,8 @@ static int computeClassDumpLen(const unsigned char* origBuf, int len)
         HprofBasicType basicType;
         int basicLen;
 
+        if (len < kIdentSize + 1)
+            return -1;
         basicType = buf[kIdentSize];
         basicLen = computeBasicLen(basicType);
         if (basicLen < 0) {
@@ -388,6 +476,8 @@ static int computeClassDumpLen(const unsigned char* origBuf, int len)
             return -1;
     }
 
+    if (len < 2)
+        return -1;
     count = get2BE(buf);
     buf += 2;
     len -= 2;
@@ -406,302 +496,3783 @@ static int computeClassDumpLen(const unsigned char* origBuf, int len)
 /*
  * Compute the length of a HPROF_INSTANCE_DUMP block.
  */
-static int computeInstanceDumpLen(const unsigned char* origBuf, int len ATTRIBUTE_UNUSED)
+static int64_t computeInstanceDumpLen(const unsigned char* origBuf, int len ATTRIBUTE_UNUSED)
 {
-    int extraCount = get4BE(origBuf + kIdentSize * 2 + 4);
-    return kIdentSize * 2 + 8 + extraCount;
+    uint32_t extraCount = get4BE(origBuf + kIdentSize * 2 + 4);
+    return kIdentSize * 2 + 8 + (int64_t) extraCount;
 }
 
 /*
  * Compute the length of a HPROF_OBJECT_ARRAY_DUMP block.
  */
-static int computeObjectArrayDumpLen(const unsigned char* origBuf, int len ATTRIBUTE_UNUSED)
+static int64_t computeObjectArrayDumpLen(const unsigned char* origBuf, int len ATTRIBUTE_UNUSED)
 {
-    int arrayCount = get4BE(origBuf + kIdentSize + 4);
-    return kIdentSize * 2 + 8 + arrayCount * kIdentSize;
+    uint32_t arrayCount = get4BE(origBuf + kIdentSize + 4);
+    return kIdentSize * 2 + 8 + (int64_t) arrayCount * kIdentSize;
 }
 
 /*
  * Compute the length of a HPROF_PRIMITIVE_ARRAY_DUMP block.
  */
-static int computePrimitiveArrayDumpLen(const unsigned char* origBuf, int len ATTRIBUTE_UNUSED)
+static int64_t computePrimitiveArrayDumpLen(const unsigned char* origBuf, int len ATTRIBUTE_UNUSED)
 {
-    int arrayCount = get4BE(origBuf + kIdentSize + 4);
+    uint32_t arrayCount = get4BE(origBuf + kIdentSize + 4);
     HprofBasicType basicType = origBuf[kIdentSize + 8];
     int basicLen = computeBasicLen(basicType);
 
-    return kIdentSize + 9 + arrayCount * basicLen;
+    if (basicLen < 0)
+        return -1;
+    return kIdentSize + 9 + (int64_t) arrayCount * basicLen;
 }
 
+
 /*
- * Crunch through a heap dump record, writing the original or converted
- * data to "out".
+ * ===========================================================================
+ *      Class histogram
+ * ===========================================================================
  */
-static int processHeapDump(ExpandBuf* pBuf, FILE* out, int flags)
-{
-    ExpandBuf* pOutBuf = ebAlloc();
-    unsigned char* origBuf = ebGetBuffer(pBuf);
-    unsigned char* buf = origBuf;
-    int len = ebGetLength(pBuf);
-    int result = -1;
-    int heapType = HPROF_HEAP_DEFAULT;
-    int heapIgnore = FALSE;
 
-    pBuf = NULL;        /* we just use the raw pointer from here forward */
+/*
+ * With -H, nothing is converted.  Instead the instances and arrays in the
+ * heap dumps are totalled per class and heap, and printed as a table.
+ * Class names are found through the LOAD_CLASS and STRING records.
+ */
+enum {
+    kHeapDefault = 0,
+    kHeapApp,
+    kHeapZygote,
+    kHeapImage,
+    kNumHeaps
+};
 
-    /* copy the original header to the output buffer */
-    if (ebAddData(pOutBuf, buf, kRecHdrLen) != 0)
-        goto bail;
+static const char* const kHeapNames[kNumHeaps] = {
+    "default", "app", "zygote", "image"
+};
 
-    buf += kRecHdrLen;      /* skip past record header */
-    len -= kRecHdrLen;
+#define kMaxNameLen     1024    /* longer strings are truncated */
+#define kEmptyKey       UINT64_MAX
 
-    while (len > 0) {
-        unsigned char subType = buf[0];
-        int justCopy = TRUE;
-        int subLen;
+/*
+ * Open-addressed map from a 64-bit key to a 32-bit value.
+ */
+typedef struct {
+    uint64_t* keys;
+    uint32_t* values;
+    size_t mask;
+    size_t count;
+} IdMap;
 
-        DBUG("--- 0x%02x  ", subType);
-        switch (subType) {
-        /* 1.0.2 types */
-        case HPROF_ROOT_UNKNOWN:
-            subLen = kIdentSize;
-            break;
-        case HPROF_ROOT_JNI_GLOBAL:
-            subLen = kIdentSize * 2;
-            break;
-        case HPROF_ROOT_JNI_LOCAL:
-            subLen = kIdentSize + 8;
-            break;
-        case HPROF_ROOT_JAVA_FRAME:
-            subLen = kIdentSize + 8;
-            break;
-        case HPROF_ROOT_NATIVE_STACK:
-            subLen = kIdentSize + 4;
-            break;
-        case HPROF_ROOT_STICKY_CLASS:
-            subLen = kIdentSize;
-            break;
-        case HPROF_ROOT_THREAD_BLOCK:
-            subLen = kIdentSize + 4;
-            break;
-        case HPROF_ROOT_MONITOR_USED:
-            subLen = kIdentSize;
-            break;
-        case HPROF_ROOT_THREAD_OBJECT:
-            subLen = kIdentSize + 8;
-            break;
-        case HPROF_CLASS_DUMP:
-            subLen = computeClassDumpLen(buf+1, len-1);
-            break;
-        case HPROF_INSTANCE_DUMP:
-            subLen = computeInstanceDumpLen(buf+1, len-1);
-            if (heapIgnore) {
-                justCopy = FALSE;
-            }
-            break;
-        case HPROF_OBJECT_ARRAY_DUMP:
-            subLen = computeObjectArrayDumpLen(buf+1, len-1);
-            if (heapIgnore) {
-                justCopy = FALSE;
-            }
-            break;
-        case HPROF_PRIMITIVE_ARRAY_DUMP:
-            subLen = computePrimitiveArrayDumpLen(buf+1, len-1);
-            if (heapIgnore) {
-                justCopy = FALSE;
-            }
-            break;
-        /* these were added for Android in 1.0.3 */
-        case HPROF_HEAP_DUMP_INFO:
-            heapType = get4BE(buf+1);
-            if ((flags & kFlagAppOnly) != 0
-                    && (heapType == HPROF_HEAP_ZYGOTE || heapType == HPROF_HEAP_IMAGE)) {
-                heapIgnore = TRUE;
-            } else {
-                heapIgnore = FALSE;
-            }
-            justCopy = FALSE;
-            subLen = kIdentSize + 4;
-            // no 1.0.2 equivalent for this
-            break;
-        case HPROF_ROOT_INTERNED_STRING:
-            buf[0] = HPROF_ROOT_UNKNOWN;
-            subLen = kIdentSize;
-            break;
-        case HPROF_ROOT_FINALIZING:
-            buf[0] = HPROF_ROOT_UNKNOWN;
-            subLen = kIdentSize;
-            break;
-        case HPROF_ROOT_DEBUGGER:
-            buf[0] = HPROF_ROOT_UNKNOWN;
-            subLen = kIdentSize;
-            break;
-        case HPROF_ROOT_REFERENCE_CLEANUP:
-            buf[0] = HPROF_ROOT_UNKNOWN;
-            subLen = kIdentSize;
-            break;
-        case HPROF_ROOT_VM_INTERNAL:
-            buf[0] = HPROF_ROOT_UNKNOWN;
-            subLen = kIdentSize;
-            break;
-        case HPROF_ROOT_JNI_MONITOR:
-            /* keep the ident, drop the next 8 bytes */
-            buf[0] = HPROF_ROOT_UNKNOWN;
-            justCopy = FALSE;
-            ebAddData(pOutBuf, buf, 1 + kIdentSize);
-            subLen = kIdentSize + 8;
-            break;
-        case HPROF_UNREACHABLE:
-            buf[0] = HPROF_ROOT_UNKNOWN;
-            subLen = kIdentSize;
-            break;
-        case HPROF_PRIMITIVE_ARRAY_NODATA_DUMP:
-            buf[0] = HPROF_PRIMITIVE_ARRAY_DUMP;
-            buf[5] = buf[6] = buf[7] = buf[8] = 0;  /* set array len to 0 */
-            subLen = kIdentSize + 9;
-            break;
+static inline size_t idMapSlot(const IdMap* pMap, uint64_t key)
+{
+    key *= 0x9e3779b97f4a7c15ULL;
+    return (size_t) (key ^ (key >> 32)) & pMap->mask;
+}
 
-        /* shouldn't get here */
-        default:
-            fprintf(stderr, "ERROR: unexpected subtype 0x%02x at offset %zu\n",
-                subType, (size_t) (buf - origBuf));
-            goto bail;
-        }
+/*
+ * Look up "key".  Returns TRUE and sets "*pValue" if it's there.
+ */
+static int idMapGet(const IdMap* pMap, uint64_t key, uint32_t* pValue)
+{
+    if (pMap->keys == NULL)
+        return FALSE;
 
-        if (justCopy) {
-            /* copy source data */
-            DBUG("(%d)\n", 1 + subLen);
-            ebAddData(pOutBuf, buf, 1 + subLen);
-        } else {
-            /* other data has been written, or the sub-record omitted */
-            DBUG("(adv %d)\n", 1 + subLen);
+    size_t slot;
+    for (slot = idMapSlot(pMap, key); pMap->keys[slot] != kEmptyKey;
+            slot = (slot + 1) & pMap->mask) {
+        if (pMap->keys[slot] == key) {
+            *pValue = pMap->values[slot];
+            return TRUE;
         }
-
-        /* advance to next entry */
-        buf += 1 + subLen;
-        len -= 1 + subLen;
     }
-
-    /*
-     * Update the record length.
-     */
-    set4BE(ebGetBuffer(pOutBuf) + 5, ebGetLength(pOutBuf) - kRecHdrLen);
-
-    if (ebWriteData(pOutBuf, out) != 0)
-        goto bail;
-
-    result = 0;
-
-bail:
-    ebFree(pOutBuf);
-    return result;
+    return FALSE;
 }
 
 /*
- * Filter an hprof data file.
+ * Add or replace "key".  The table is kept at most half full.
  */
-static int filterData(FILE* in, FILE* out, int flags)
+static int idMapPut(IdMap* pMap, uint64_t key, uint32_t value)
 {
-    const char *magicString;
-    ExpandBuf* pBuf;
-    int result = -1;
+    size_t slot;
 
-    pBuf = ebAlloc();
-    if (pBuf == NULL)
-        goto bail;
+    if ((pMap->count + 1) * 2 > pMap->mask + 1 || pMap->keys == NULL) {
+        IdMap newMap;
+        size_t size = (pMap->keys == NULL) ? 256 : (pMap->mask + 1) * 2;
 
-    /*
-     * Start with the header.
-     */
-    if (ebReadString(pBuf, in) != 0)
-        goto bail;
+        newMap.keys = (uint64_t*) malloc(size * sizeof(uint64_t));
+        newMap.values = (uint32_t*) malloc(size * sizeof(uint32_t));
+        if (newMap.keys == NULL || newMap.values == NULL) {
+            free(newMap.keys);
+            free(newMap.values);
+            fprintf(stderr, "ERROR: unable to grow map to %zu entries\n", size);
+            return -1;
+        }
+        memset(newMap.keys, 0xff, size * sizeof(uint64_t));
+        newMap.mask = size - 1;
+        newMap.count = pMap->count;
 
-    magicString = (const char*)ebGetBuffer(pBuf);
-    if (strcmp(magicString, "JAVA PROFILE 1.0.3") != 0) {
-        if (strcmp(magicString, "JAVA PROFILE 1.0.2") == 0) {
-            fprintf(stderr, "ERROR: HPROF file already in 1.0.2 format.\n");
-        } else {
-            fprintf(stderr, "ERROR: expecting HPROF file format 1.0.3\n");
+        if (pMap->keys != NULL) {
+            for (slot = 0; slot <= pMap->mask; slot++) {
+                if (pMap->keys[slot] == kEmptyKey)
+                    continue;
+                size_t newSlot = idMapSlot(&newMap, pMap->keys[slot]);
+                while (newMap.keys[newSlot] != kEmptyKey)
+                    newSlot = (newSlot + 1) & newMap.mask;
+                newMap.keys[newSlot] = pMap->keys[slot];
+                newMap.values[newSlot] = pMap->values[slot];
+            }
+            free(pMap->keys);
+            free(pMap->values);
         }
-        goto bail;
+        *pMap = newMap;
     }
 
-    /* downgrade to 1.0.2 */
-    (ebGetBuffer(pBuf))[17] = '2';
-    if (ebWriteData(pBuf, out) != 0)
-        goto bail;
-
-    /*
-     * Copy:
-     * (4b) identifier size, always 4
-     * (8b) file creation date
-     */
-    if (ebReadData(pBuf, in, 12, FALSE) != 0)
-        goto bail;
-    if (ebWriteData(pBuf, out) != 0)
-        goto bail;
+    for (slot = idMapSlot(pMap, key); pMap->keys[slot] != kEmptyKey;
+            slot = (slot + 1) & pMap->mask) {
+        if (pMap->keys[slot] == key) {
+            pMap->values[slot] = value;
+            return 0;
+        }
+    }
+    pMap->keys[slot] = key;
+    pMap->values[slot] = value;
+    pMap->count++;
+    return 0;
+}
 
-    /*
-     * Read records until we hit EOF.  Each record begins with:
-     * (1b) type
-     * (4b) timestamp
-     * (4b) length of data that follows
-     */
-    while (1) {
-        assert(ebGetLength(pBuf) == 0);
+static void idMapFree(IdMap* pMap)
+{
+    free(pMap->keys);
+    free(pMap->values);
+    memset(pMap, 0, sizeof(*pMap));
+}
 
-        /* read type char */
-        if (ebReadData(pBuf, in, 1, TRUE) != 0)
-            goto bail;
-        if (feof(in))
-            break;
+/*
+ * Totals for one class in one heap.  The key holds the heap index, a
+ * flag for primitive arrays, and the class id or basic type.
+ */
+typedef struct {
+    uint64_t key;
+    uint64_t count;
+    uint64_t bytes;
+} HistoEntry;
 
-        /* read the rest of the header */
-        if (ebReadData(pBuf, in, kRecHdrLen-1, FALSE) != 0)
-            goto bail;
+#define kHistoPrimitive     (1ULL << 32)
+#define kHistoHeapShift     40
 
-        unsigned char* buf = ebGetBuffer(pBuf);
-        unsigned char type;
-        unsigned int timestamp, length;
+typedef struct {
+    IdMap strings;          /* string id -> index in names[] */
+    char** names;
+    size_t numNames;
+    size_t maxNames;
+    IdMap classes;          /* class id -> name string id */
+    IdMap entryMap;         /* key -> index in entries[] */
+    HistoEntry* entries;
+    size_t numEntries;
+    size_t maxEntries;
+} ClassHistogram;
 
-        type = buf[0];
-        timestamp = get4BE(buf + 1);
-        length = get4BE(buf + 5);
-        buf = NULL;     /* ptr invalid after next read op */
+static int heapIndex(int heapType)
+{
+    switch (heapType) {
+    case HPROF_HEAP_APP:    return kHeapApp;
+    case HPROF_HEAP_ZYGOTE: return kHeapZygote;
+    case HPROF_HEAP_IMAGE:  return kHeapImage;
+    default:                return kHeapDefault;
+    }
+}
 
-        /* read the record data */
-        if (length != 0) {
-            if (ebReadData(pBuf, in, length, FALSE) != 0)
-                goto bail;
-        }
+static const char* primitiveArrayName(HprofBasicType basicType)
+{
+    switch (basicType) {
+    case HPROF_BASIC_BOOLEAN:   return "boolean[]";
+    case HPROF_BASIC_CHAR:      return "char[]";
+    case HPROF_BASIC_FLOAT:     return "float[]";
+    case HPROF_BASIC_DOUBLE:    return "double[]";
+    case HPROF_BASIC_BYTE:      return "byte[]";
+    case HPROF_BASIC_SHORT:     return "short[]";
+    case HPROF_BASIC_INT:       return "int[]";
+    case HPROF_BASIC_LONG:      return "long[]";
+    default:                    return "?[]";
+    }
+}
 
-        if (type == HPROF_TAG_HEAP_DUMP
-                || type == HPROF_TAG_HEAP_DUMP_SEGMENT) {
-            DBUG("Processing heap dump 0x%02x (%d bytes)\n",
-                type, length);
-            if (processHeapDump(pBuf, out, flags) != 0)
-                goto bail;
-            ebClear(pBuf);
-        } else {
-            /* keep */
-            DBUG("Keeping 0x%02x (%d bytes)\n", type, length);
-            if (ebWriteData(pBuf, out) != 0)
-                goto bail;
+/*
+ * Remember the string with id "id".
+ */
+static int histoAddString(ClassHistogram* pHisto, uint32_t id,
+    const unsigned char* utf8, size_t len)
+{
+    if (pHisto->numNames == pHisto->maxNames) {
+        size_t newMax = (pHisto->maxNames == 0) ? 1024 : pHisto->maxNames * 2;
+        char** newNames = (char**) realloc(pHisto->names,
+            newMax * sizeof(char*));
+        if (newNames == NULL) {
+            fprintf(stderr, "ERROR: unable to allocate string table\n");
+            return -1;
         }
+        pHisto->names = newNames;
+        pHisto->maxNames = newMax;
     }
 
-    result = 0;
+    char* name = (char*) malloc(len + 1);
+    if (name == NULL) {
+        fprintf(stderr, "ERROR: unable to allocate string\n");
+        return -1;
+    }
+    memcpy(name, utf8, len);
+    name[len] = '\0';
 
-bail:
-    ebFree(pBuf);
-    return result;
+    pHisto->names[pHisto->numNames] = name;
+    return idMapPut(&pHisto->strings, id, pHisto->numNames++);
 }
 
-static FILE* fopen_or_default(const char* path, const char* mode, FILE* def) {
-    if (!strcmp(path, "-")) {
-        return def;
-    } else {
+/*
+ * Count an INSTANCE_DUMP, OBJECT_ARRAY_DUMP, PRIMITIVE_ARRAY_DUMP or
+ * PRIMITIVE_ARRAY_NODATA_DUMP sub-record; "buf" holds its fixed part.
+ * The bytes counted are those of the instance fields or elements.
+ */
+static int histoAddObject(ClassHistogram* pHisto, int heapType,
+    const unsigned char* buf)
+{
+    uint64_t key = (uint64_t) heapIndex(heapType) << kHistoHeapShift;
+    uint64_t bytes;
+    uint32_t count;
+
+    switch (buf[0]) {
+    case HPROF_INSTANCE_DUMP:
+        key |= get4BE(buf + 1 + kIdentSize + 4);
+        bytes = get4BE(buf + 1 + kIdentSize * 2 + 4);
+        break;
+    case HPROF_OBJECT_ARRAY_DUMP:
+        count = get4BE(buf + 1 + kIdentSize + 4);
+        key |= get4BE(buf + 1 + kIdentSize + 8);
+        bytes = (uint64_t) count * kIdentSize;
+        break;
+    case HPROF_PRIMITIVE_ARRAY_DUMP:
+    case HPROF_PRIMITIVE_ARRAY_NODATA_DUMP:
+        count = get4BE(buf + 1 + kIdentSize + 4);
+        key |= kHistoPrimitive | buf[1 + kIdentSize + 8];
+        bytes = (uint64_t) count
+            * computeBasicLen((HprofBasicType) buf[1 + kIdentSize + 8]);
+        break;
+    default:
+        return 0;
+    }
+
+    uint32_t idx;
+    if (!idMapGet(&pHisto->entryMap, key, &idx)) {
+        if (pHisto->numEntries == pHisto->maxEntries) {
+            size_t newMax = (pHisto->maxEntries == 0) ? 256 : pHisto->maxEntries * 2;
+            HistoEntry* newEntries = (HistoEntry*) realloc(pHisto->entries,
+                newMax * sizeof(HistoEntry));
+            if (newEntries == NULL) {
+                fprintf(stderr, "ERROR: unable to allocate histogram\n");
+                return -1;
+            }
+            pHisto->entries = newEntries;
+            pHisto->maxEntries = newMax;
+        }
+        idx = pHisto->numEntries++;
+        memset(&pHisto->entries[idx], 0, sizeof(HistoEntry));
+        pHisto->entries[idx].key = key;
+        if (idMapPut(&pHisto->entryMap, key, idx) != 0)
+            return -1;
+    }
+
+    pHisto->entries[idx].count++;
+    pHisto->entries[idx].bytes += bytes;
+    return 0;
+}
+
+/*
+ * Most bytes first, then most instances, within each heap.
+ */
+static int compareHistoEntries(const void* a, const void* b)
+{
+    const HistoEntry* pA = (const HistoEntry*) a;
+    const HistoEntry* pB = (const HistoEntry*) b;
+    uint64_t heapA = pA->key >> kHistoHeapShift;
+    uint64_t heapB = pB->key >> kHistoHeapShift;
+
+    if (heapA != heapB)
+        return heapA < heapB ? -1 : 1;
+    if (pA->bytes != pB->bytes)
+        return pA->bytes > pB->bytes ? -1 : 1;
+    if (pA->count != pB->count)
+        return pA->count > pB->count ? -1 : 1;
+    return (pA->key < pB->key) ? -1 : (pA->key > pB->key);
+}
+
+/*
+ * Get the name of class "classId", or NULL if it wasn't loaded.
+ */
+static const char* histoClassName(const ClassHistogram* pHisto,
+    uint32_t classId)
+{
+    uint32_t nameId, nameIdx;
+
+    if (idMapGet(&pHisto->classes, classId, &nameId)
+            && idMapGet(&pHisto->strings, nameId, &nameIdx))
+        return pHisto->names[nameIdx];
+    return NULL;
+}
+
+/*
+ * Get the class name of a histogram entry, or NULL if the class wasn't
+ * loaded.
+ */
+static const char* histoEntryName(const ClassHistogram* pHisto,
+    const HistoEntry* pEntry)
+{
+    uint32_t id = (uint32_t) pEntry->key;
+
+    if ((pEntry->key & kHistoPrimitive) != 0)
+        return primitiveArrayName((HprofBasicType) id);
+    return histoClassName(pHisto, id);
+}
+
+/*
+ * Print the histogram, one table per heap.
+ */
+static int histoPrint(ClassHistogram* pHisto, FILE* out)
+{
+    size_t i, j;
+
+    qsort(pHisto->entries, pHisto->numEntries, sizeof(HistoEntry),
+        compareHistoEntries);
+
+    for (i = 0; i < pHisto->numEntries; i = j) {
+        uint64_t heap = pHisto->entries[i].key >> kHistoHeapShift;
+        uint64_t totalCount = 0, totalBytes = 0;
+
+        for (j = i; j < pHisto->numEntries
+                && pHisto->entries[j].key >> kHistoHeapShift == heap; j++) {
+            totalCount += pHisto->entries[j].count;
+            totalBytes += pHisto->entries[j].bytes;
+        }
+
+        fprintf(out, "%sHeap %s: %" PRIu64 " objects, %" PRIu64 " bytes\n",
+            (i == 0) ? "" : "\n", kHeapNames[heap], totalCount, totalBytes);
+        fprintf(out, "%12s %14s  %s\n", "instances", "bytes", "class");
+
+        size_t k;
+        for (k = i; k < j; k++) {
+            const HistoEntry* pEntry = &pHisto->entries[k];
+            const char* name = histoEntryName(pHisto, pEntry);
+
+            fprintf(out, "%12" PRIu64 " %14" PRIu64 "  ",
+                pEntry->count, pEntry->bytes);
+            if (name != NULL)
+                fprintf(out, "%s\n", name);
+            else
+                fprintf(out, "class@0x%08x\n", (uint32_t) pEntry->key);
+        }
+    }
+
+    if (ferror(out)) {
+        fprintf(stderr, "ERROR: failed writing histogram\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void histoFree(ClassHistogram* pHisto)
+{
+    size_t i;
+
+    for (i = 0; i < pHisto->numNames; i++)
+        free(pHisto->names[i]);
+    free(pHisto->names);
+    free(pHisto->entries);
+    idMapFree(&pHisto->strings);
+    idMapFree(&pHisto->classes);
+    idMapFree(&pHisto->entryMap);
+}
+
+/*
+ * ===========================================================================
+ *      Compressed input
+ * ===========================================================================
+ */
+
+/*
+ * A gzip-compressed input is inflated on a thread of its own into a ring
+ * of chunks, which the converter reads from, so decompression overlaps
+ * with conversion.
+ */
+#define kGzInSize       (256 * 1024)
+#define kGzChunkSize    (1024 * 1024)
+#define kGzNumChunks    4
+
+typedef struct {
+    FILE* in;
+    z_stream strm;
+    unsigned char* inBuf;
+    unsigned char* chunks[kGzNumChunks];
+    size_t chunkLen[kGzNumChunks];
+    unsigned int filled;        /* chunks filled so far */
+    unsigned int consumed;      /* chunks read so far */
+    size_t readPos;             /* in the chunk being read */
+    int inMember;               /* a gzip member has started but not ended */
+    int done;                   /* no more chunks are coming */
+    int error;
+    int abort;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* chunk filled or consumed */
+    pthread_t thread;
+} GzInput;
+
+/*
+ * Does "in" start with the gzip magic?  Nothing is consumed.  (An hprof
+ * file starts with 'J'.)
+ */
+static int isGzipInput(FILE* in)
+{
+    int ic = getc(in);
+    if (ic == EOF)
+        return FALSE;
+    ungetc(ic, in);
+    return ic == 0x1f;
+}
+
+/*
+ * Inflate into "buf" until it's full or the input ends.  Concatenated
+ * gzip members are read as one stream.  Returns the length inflated, or
+ * -1 on failure, including input that ends partway through a member
+ * (whose trailer then can't be checked).
+ */
+static int64_t gzInflateChunk(GzInput* pGz, unsigned char* buf, size_t size)
+{
+    z_stream* pStrm = &pGz->strm;
+
+    pStrm->next_out = buf;
+    pStrm->avail_out = size;
+    while (pStrm->avail_out > 0) {
+        if (pStrm->avail_in == 0) {
+            size_t actual = fread(pGz->inBuf, 1, kGzInSize, pGz->in);
+            if (actual == 0) {
+                if (ferror(pGz->in)) {
+                    fprintf(stderr, "ERROR: failed reading input\n");
+                    return -1;
+                }
+                if (pGz->inMember) {
+                    fprintf(stderr, "ERROR: truncated compressed input\n");
+                    return -1;
+                }
+                break;
+            }
+            pStrm->next_in = pGz->inBuf;
+            pStrm->avail_in = actual;
+        }
+
+        int zerr = inflate(pStrm, Z_NO_FLUSH);
+        if (zerr == Z_STREAM_END) {
+            pGz->inMember = FALSE;
+            if (inflateReset(pStrm) != Z_OK)
+                return -1;
+        } else if (zerr == Z_OK) {
+            pGz->inMember = TRUE;
+        } else {
+            fprintf(stderr, "ERROR: bad compressed input: %s\n",
+                pStrm->msg != NULL ? pStrm->msg : "inflate failed");
+            return -1;
+        }
+    }
+
+    return size - pStrm->avail_out;
+}
+
+static void* gzThreadStart(void* arg)
+{
+    GzInput* pGz = (GzInput*) arg;
+
+    pthread_mutex_lock(&pGz->lock);
+    while (!pGz->abort) {
+        if (pGz->filled - pGz->consumed == kGzNumChunks) {
+            pthread_cond_wait(&pGz->cond, &pGz->lock);
+            continue;
+        }
+        unsigned int idx = pGz->filled % kGzNumChunks;
+        pthread_mutex_unlock(&pGz->lock);
+
+        int64_t actual = gzInflateChunk(pGz, pGz->chunks[idx], kGzChunkSize);
+
+        pthread_mutex_lock(&pGz->lock);
+        if (actual < 0) {
+            pGz->error = TRUE;
+            break;
+        }
+        if (actual == 0)
+            break;
+        pGz->chunkLen[idx] = actual;
+        pGz->filled++;
+        pthread_cond_broadcast(&pGz->cond);
+    }
+    pGz->done = TRUE;
+    pthread_cond_broadcast(&pGz->cond);
+    pthread_mutex_unlock(&pGz->lock);
+    return NULL;
+}
+
+static void gzFree(GzInput* pGz)
+{
+    int i;
+
+    for (i = 0; i < kGzNumChunks; i++)
+        bufFree(pGz->chunks[i], kGzChunkSize);
+    bufFree(pGz->inBuf, kGzInSize);
+    inflateEnd(&pGz->strm);
+    pthread_cond_destroy(&pGz->cond);
+    pthread_mutex_destroy(&pGz->lock);
+    free(pGz);
+}
+
+/*
+ * Start inflating "in".
+ */
+static GzInput* gzStart(FILE* in)
+{
+    GzInput* pGz = (GzInput*) calloc(1, sizeof(GzInput));
+    int i;
+
+    if (pGz == NULL)
+        return NULL;
+    pGz->in = in;
+    pthread_mutex_init(&pGz->lock, NULL);
+    pthread_cond_init(&pGz->cond, NULL);
+
+    /* 32 lets zlib accept either a gzip or a zlib header */
+    if (inflateInit2(&pGz->strm, MAX_WBITS + 32) != Z_OK) {
+        fprintf(stderr, "ERROR: unable to initialize zlib\n");
+        pthread_cond_destroy(&pGz->cond);
+        pthread_mutex_destroy(&pGz->lock);
+        free(pGz);
+        return NULL;
+    }
+
+    pGz->inBuf = (unsigned char*) bufRealloc(NULL, 0, kGzInSize);
+    for (i = 0; i < kGzNumChunks; i++)
+        pGz->chunks[i] = (unsigned char*) bufRealloc(NULL, 0, kGzChunkSize);
+    for (i = 0; i < kGzNumChunks; i++) {
+        if (pGz->chunks[i] == NULL)
+            break;
+    }
+    if (pGz->inBuf == NULL || i != kGzNumChunks) {
+        fprintf(stderr, "ERROR: unable to allocate decompression buffers\n");
+        gzFree(pGz);
+        return NULL;
+    }
+
+    if (pthread_create(&pGz->thread, NULL, gzThreadStart, pGz) != 0) {
+        fprintf(stderr, "ERROR: unable to start decompression thread\n");
+        gzFree(pGz);
+        return NULL;
+    }
+    return pGz;
+}
+
+/*
+ * Stop the thread and release everything.
+ */
+static void gzStop(GzInput* pGz)
+{
+    if (pGz == NULL)
+        return;
+
+    pthread_mutex_lock(&pGz->lock);
+    pGz->abort = TRUE;
+    pthread_cond_broadcast(&pGz->cond);
+    pthread_mutex_unlock(&pGz->lock);
+    pthread_join(pGz->thread, NULL);
+    gzFree(pGz);
+}
+
+/*
+ * Copy up to "count" inflated bytes to "buf".  Returns the number copied,
+ * which is short only at the end of the input, or -1 on failure.
+ */
+static int64_t gzRead(GzInput* pGz, unsigned char* buf, size_t count)
+{
+    size_t copied = 0;
+
+    while (copied < count) {
+        pthread_mutex_lock(&pGz->lock);
+        while (pGz->consumed == pGz->filled && !pGz->done)
+            pthread_cond_wait(&pGz->cond, &pGz->lock);
+        int empty = (pGz->consumed == pGz->filled);
+        int error = pGz->error;
+        pthread_mutex_unlock(&pGz->lock);
+
+        if (empty)
+            return error ? -1 : (int64_t) copied;
+
+        /* the chunk being read is ours until it's marked consumed */
+        unsigned int idx = pGz->consumed % kGzNumChunks;
+        size_t chunk = pGz->chunkLen[idx] - pGz->readPos;
+        if (chunk > count - copied)
+            chunk = count - copied;
+        memcpy(buf + copied, pGz->chunks[idx] + pGz->readPos, chunk);
+        copied += chunk;
+        pGz->readPos += chunk;
+
+        if (pGz->readPos == pGz->chunkLen[idx]) {
+            pGz->readPos = 0;
+            pthread_mutex_lock(&pGz->lock);
+            pGz->consumed++;
+            pthread_cond_broadcast(&pGz->cond);
+            pthread_mutex_unlock(&pGz->lock);
+        }
+    }
+    return copied;
+}
+
+/*
+ * ===========================================================================
+ *      Streaming input and output
+ * ===========================================================================
+ */
+
+/*
+ * Heap dump records can be several GB, so they're converted a piece at
+ * a time through a fixed-size window onto the input.  The window must be
+ * able to hold the largest sub-record that's parsed in one piece, which
+ * is a class dump (three lists of up to 65535 entries, just under 2MB);
+ * everything else is parsed from a short header and then copied or
+ * skipped in window-sized chunks.
+ */
+#define kWindowSize     (4 * 1024 * 1024)
+#define kWindowSlack    16      /* lets the length helpers overread */
+#define kOutBufSize     (256 * 1024)
+
+/*
+ * When the input is a regular file it's mapped instead, and the "window"
+ * is the whole record.  The output is then gathered as a list of spans
+ * of the mapping and written with writev(), so the bulk of the data --
+ * which is copied unchanged -- is never memcpy'd.  Anything that isn't
+ * in the mapping (record headers and rewritten sub-records) is staged in
+ * the output buffer.  So are short spans of the mapping, unless they
+ * extend the previous span: between rewritten sub-records the unchanged
+ * runs are often only a few bytes long, and an iovec apiece costs more
+ * than the memcpy.
+ *
+ * Spans of at least kCopyRangeMin bytes go through copy_file_range()
+ * when the output is a regular file, so the kernel can do the copy.
+ */
+#ifdef HAVE_MMAP_IO
+# ifdef IOV_MAX
+#  define kMaxIov       IOV_MAX
+# else
+#  define kMaxIov       16
+# endif
+# define kCopyRangeMin  (1024 * 1024)
+# define kZeroCopyMin   (8 * 1024)
+#endif
+
+#ifdef _WIN32
+# define hprofSeek _fseeki64
+# define hprofTell _ftelli64
+#else
+# define hprofSeek fseeko
+# define hprofTell ftello
+#endif
+
+/*
+ * Window onto the input.  buf[pos, end) has been read but not consumed;
+ * "recordLeft" is the number of bytes of the current record that haven't
+ * been read yet.  Reads never go past the end of the current record, so
+ * between records the file position is exactly at the next header.
+ *
+ * If "map" is set, the whole input is mapped and "buf" points at the
+ * current record in it.  If "pGz" is set, the input is read through it.
+ */
+struct HprofReader {
+    FILE* in;
+    GzInput* pGz;
+    int seekable;
+    unsigned char* buf;
+    size_t pos;
+    size_t end;
+    uint64_t recordLeft;
+
+    unsigned char* map;
+    uint64_t mapLen;
+    uint64_t mapPos;        /* offset of the next unread byte */
+};
+
+/*
+ * Buffered output.  "offset" is the file offset of buf[0], and "count"
+ * is the number of bytes written so far.  If "out" is NULL, bytes are
+ * only collected in "buf", up to "memSize" bytes, or if that's NULL
+ * just counted; that's used to convert or measure a record in memory.
+ * If "pDeflate" is set, the output is gzip-compressed.
+ */
+struct HprofWriter {
+    FILE* out;
+    z_stream* pDeflate;
+    unsigned char* zbuf;
+    int seekable;
+    unsigned char* buf;
+    size_t len;
+    uint64_t offset;
+    uint64_t count;
+    size_t memSize;
+
+#ifdef HAVE_MMAP_IO
+    /* gathered output, when the input is mapped */
+    int zeroCopy;
+    int fd;
+    const unsigned char* mapStart;
+    const unsigned char* mapEnd;
+    int inFd;               /* for copy_file_range(), or -1 */
+    struct iovec iov[kMaxIov];
+    int iovCount;
+    size_t pending;         /* total length of iov[] */
+#endif
+};
+
+/*
+ * Temp file for heap dumps that can't be converted in place.
+ */
+typedef struct {
+    FILE* file;
+    HprofWriter writer;
+} HprofSpool;
+
+/*
+ * Is it possible to seek in "fp"?  (It's not if it's a pipe.)
+ */
+static int isSeekable(FILE* fp)
+{
+    return hprofSeek(fp, 0, SEEK_CUR) == 0;
+}
+
+#ifdef HAVE_MMAP_IO
+/*
+ * Map the rest of the input, if it's a regular file.  Failure isn't an
+ * error; the input is just read through the window instead.
+ */
+static void rdMapInput(HprofReader* pReader)
+{
+    struct stat st;
+    int fd = fileno(pReader->in);
+    off_t start = hprofTell(pReader->in);
+
+    if (start < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+            || st.st_size <= start || (uint64_t) st.st_size != (size_t) st.st_size)
+        return;
+
+    /* the length helpers may overread a truncated record into the last page */
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pageSize <= 0
+            || (pageSize - st.st_size % pageSize) % pageSize < kWindowSlack)
+        return;
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+        fd, 0);
+    if (map == MAP_FAILED)
+        return;
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    pReader->map = (unsigned char*) map;
+    pReader->mapLen = st.st_size;
+    pReader->mapPos = start;
+}
+#endif
+
+/*
+ * Set up a reader for "in", or for what "pGz" inflates from it.
+ */
+static int rdInit(HprofReader* pReader, FILE* in, GzInput* pGz)
+{
+    memset(pReader, 0, sizeof(*pReader));
+    pReader->in = in;
+    pReader->pGz = pGz;
+    pReader->seekable = (pGz == NULL) && isSeekable(in);
+
+#ifdef HAVE_MMAP_IO
+    if (pGz == NULL)
+        rdMapInput(pReader);
+    if (pReader->map != NULL)
+        return 0;
+#endif
+
+    pReader->buf = (unsigned char*) bufRealloc(NULL, 0,
+        kWindowSize + kWindowSlack);
+    if (pReader->buf == NULL) {
+        fprintf(stderr, "ERROR: unable to allocate input window\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void rdFree(HprofReader* pReader)
+{
+#ifdef HAVE_MMAP_IO
+    if (pReader->map != NULL) {
+        munmap(pReader->map, pReader->mapLen);
+        return;
+    }
+#endif
+    bufFree(pReader->buf, kWindowSize + kWindowSlack);
+}
+
+/*
+ * Read up to "count" bytes from the input, bypassing the window.  Returns
+ * the number read, which is short only at the end of the input, or -1 on
+ * failure.
+ */
+static int64_t rdRead(HprofReader* pReader, void* buf, size_t count)
+{
+    if (pReader->map != NULL) {
+        uint64_t avail = pReader->mapLen - pReader->mapPos;
+        if (count > avail)
+            count = avail;
+        memcpy(buf, pReader->map + pReader->mapPos, count);
+        pReader->mapPos += count;
+        return count;
+    }
+
+    if (pReader->pGz != NULL)
+        return gzRead(pReader->pGz, (unsigned char*) buf, count);
+
+    size_t actual = fread(buf, 1, count, pReader->in);
+    if (actual != count && ferror(pReader->in)) {
+        fprintf(stderr, "ERROR: failed reading input\n");
+        return -1;
+    }
+    return actual;
+}
+
+/*
+ * Read the header of the next record into "hdr".  Returns 1 if there
+ * was one, 0 at the end of the file, and -1 on failure.
+ */
+static int rdReadHeader(HprofReader* pReader, unsigned char* hdr)
+{
+    int64_t actual = rdRead(pReader, hdr, kRecHdrLen);
+
+    if (actual == 0)
+        return 0;
+    if (actual != kRecHdrLen) {
+        fprintf(stderr, "ERROR: read %" PRId64 " of %d bytes\n", actual,
+            kRecHdrLen);
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Start reading a record with "length" bytes of data.  The window must
+ * be empty, i.e. the previous record must have been consumed.
+ */
+static int rdStartRecord(HprofReader* pReader, uint32_t length)
+{
+    assert(pReader->pos == pReader->end);
+
+    if (pReader->map != NULL) {
+        if (length > pReader->mapLen - pReader->mapPos) {
+            fprintf(stderr, "ERROR: read %" PRIu64 " of %u bytes\n",
+                pReader->mapLen - pReader->mapPos, length);
+            return -1;
+        }
+        pReader->buf = pReader->map + pReader->mapPos;
+        pReader->pos = 0;
+        pReader->end = length;
+        pReader->recordLeft = 0;
+        pReader->mapPos += length;
+        return 0;
+    }
+
+    pReader->pos = pReader->end = 0;
+    pReader->recordLeft = length;
+    return 0;
+}
+
+/*
+ * Get the input offset of the next record, or of the current record's
+ * data if called right after its header has been read.
+ */
+static int64_t rdTell(HprofReader* pReader)
+{
+    if (pReader->map != NULL)
+        return pReader->mapPos;
+    return hprofTell(pReader->in);
+}
+
+/*
+ * Go back to an offset returned by rdTell().
+ */
+static int rdSeek(HprofReader* pReader, int64_t where)
+{
+    if (pReader->map != NULL) {
+        pReader->mapPos = where;
+        pReader->pos = pReader->end;
+        return 0;
+    }
+    if (hprofSeek(pReader->in, where, SEEK_SET) != 0) {
+        fprintf(stderr, "ERROR: unable to rewind input: %s\n",
+            strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Get the number of bytes left in the current record.
+ */
+static inline uint64_t rdLeft(const HprofReader* pReader)
+{
+    return (pReader->end - pReader->pos) + pReader->recordLeft;
+}
+
+/*
+ * Make sure at least "count" bytes are in the window, and return a
+ * pointer to them.  Fills as much of the window as the record allows.
+ * Returns NULL if the record doesn't have that much data left or the
+ * read fails.
+ */
+static unsigned char* rdFill(HprofReader* pReader, size_t count)
+{
+    assert(count <= kWindowSize);
+
+    if (pReader->end - pReader->pos >= count)
+        return pReader->buf + pReader->pos;
+
+    if (count > rdLeft(pReader)) {
+        fprintf(stderr, "ERROR: sub-record runs past the end of the record\n");
+        return NULL;
+    }
+
+    if (pReader->pos + count > kWindowSize) {
+        /* slide the unconsumed data to the start */
+        memmove(pReader->buf, pReader->buf + pReader->pos,
+            pReader->end - pReader->pos);
+        pReader->end -= pReader->pos;
+        pReader->pos = 0;
+    }
+
+    size_t want = kWindowSize - pReader->end;
+    if (want > pReader->recordLeft)
+        want = pReader->recordLeft;
+
+    int64_t actual = rdRead(pReader, pReader->buf + pReader->end, want);
+    if (actual != (int64_t) want) {
+        fprintf(stderr, "ERROR: read %" PRId64 " of %zu bytes\n", actual, want);
+        return NULL;
+    }
+    pReader->end += actual;
+    pReader->recordLeft -= actual;
+
+    return pReader->buf + pReader->pos;
+}
+
+/*
+ * Get a whole class dump sub-record into the window, and return a
+ * pointer to its tag.  Its length, not counting the tag, is stored in
+ * "*pSubLen".
+ */
+static unsigned char* rdFillClassDump(HprofReader* pReader, int64_t* pSubLen)
+{
+    /* fill the window until the whole thing is in it */
+    uint64_t maxAvail = rdLeft(pReader);
+    size_t avail = pReader->end - pReader->pos;
+    unsigned char* buf = pReader->buf + pReader->pos;
+
+    /* (a mapped record is all in the "window" already) */
+    if (maxAvail > kWindowSize)
+        maxAvail = kWindowSize;
+    if (avail > maxAvail)
+        avail = maxAvail;
+    while (1) {
+        *pSubLen = computeClassDumpLen(buf+1, avail-1);
+        if (*pSubLen >= 0 && (size_t) *pSubLen <= avail-1)
+            return buf;
+        if (avail >= maxAvail) {
+            fprintf(stderr, "ERROR: bad class dump\n");
+            return NULL;
+        }
+        avail = (avail * 2 < maxAvail) ? avail * 2 : maxAvail;
+        if ((buf = rdFill(pReader, avail)) == NULL)
+            return NULL;
+        avail = pReader->end - pReader->pos;
+        if (avail > maxAvail)
+            avail = maxAvail;
+    }
+}
+
+/*
+ * Set up a writer for "out".  If "pReader" has mapped its input, the
+ * output is gathered from the mapping.
+ */
+static int wrInit(HprofWriter* pWriter, FILE* out, const HprofReader* pReader,
+    int compress)
+{
+    memset(pWriter, 0, sizeof(*pWriter));
+    pWriter->out = out;
+    pWriter->seekable = !compress && isSeekable(out);
+    if (pWriter->seekable)
+        pWriter->offset = hprofTell(out);
+    pWriter->buf = (unsigned char*) bufRealloc(NULL, 0, kOutBufSize);
+    if (pWriter->buf == NULL) {
+        fprintf(stderr, "ERROR: unable to allocate output buffer\n");
+        return -1;
+    }
+
+    if (compress) {
+        pWriter->pDeflate = (z_stream*) calloc(1, sizeof(z_stream));
+        pWriter->zbuf = (unsigned char*) bufRealloc(NULL, 0, kOutBufSize);
+        if (pWriter->pDeflate == NULL || pWriter->zbuf == NULL) {
+            fprintf(stderr, "ERROR: unable to allocate compression buffers\n");
+            return -1;
+        }
+        /* 16 asks for a gzip header */
+        if (deflateInit2(pWriter->pDeflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            fprintf(stderr, "ERROR: unable to initialize zlib\n");
+            free(pWriter->pDeflate);
+            pWriter->pDeflate = NULL;
+            return -1;
+        }
+        return 0;
+    }
+
+#ifdef HAVE_MMAP_IO
+    if (pReader != NULL && pReader->map != NULL) {
+        struct stat st;
+
+        /* from here on everything is written to the fd */
+        if (fflush(out) != 0) {
+            fprintf(stderr, "ERROR: write failed: %s\n", strerror(errno));
+            return -1;
+        }
+        pWriter->zeroCopy = TRUE;
+        pWriter->fd = fileno(out);
+        pWriter->mapStart = pReader->map;
+        pWriter->mapEnd = pReader->map + pReader->mapLen;
+        pWriter->inFd = -1;
+        if (fstat(pWriter->fd, &st) == 0 && S_ISREG(st.st_mode))
+            pWriter->inFd = fileno(pReader->in);
+    }
+#else
+    (void) pReader;
+#endif
+    return 0;
+}
+
+static void wrFree(HprofWriter* pWriter)
+{
+    bufFree(pWriter->buf, kOutBufSize);
+    pWriter->buf = NULL;
+    if (pWriter->pDeflate != NULL) {
+        deflateEnd(pWriter->pDeflate);
+        free(pWriter->pDeflate);
+        pWriter->pDeflate = NULL;
+    }
+    bufFree(pWriter->zbuf, kOutBufSize);
+    pWriter->zbuf = NULL;
+}
+
+/*
+ * Compress "count" bytes into the output.  With Z_FINISH, this ends the
+ * gzip stream.
+ */
+static int wrDeflate(HprofWriter* pWriter, const void* data, size_t count,
+    int flush)
+{
+    z_stream* pStrm = pWriter->pDeflate;
+    const unsigned char* next = (const unsigned char*) data;
+
+    do {
+        /* (avail_in is only 32 bits) */
+        size_t piece = count;
+        if (piece > (1U << 30))
+            piece = 1U << 30;
+        pStrm->next_in = (Bytef*) next;
+        pStrm->avail_in = piece;
+        next += piece;
+        count -= piece;
+
+        int pieceFlush = (count == 0) ? flush : Z_NO_FLUSH;
+        int zerr;
+        do {
+            pStrm->next_out = pWriter->zbuf;
+            pStrm->avail_out = kOutBufSize;
+            zerr = deflate(pStrm, pieceFlush);
+            if (zerr == Z_STREAM_ERROR) {
+                fprintf(stderr, "ERROR: compression failed\n");
+                return -1;
+            }
+
+            size_t have = kOutBufSize - pStrm->avail_out;
+            if (fwrite(pWriter->zbuf, 1, have, pWriter->out) != have) {
+                fprintf(stderr, "ERROR: write failed: %s\n", strerror(errno));
+                return -1;
+            }
+        } while (pStrm->avail_out == 0
+            || (pieceFlush == Z_FINISH && zerr != Z_STREAM_END));
+    } while (count > 0);
+
+    return 0;
+}
+
+/*
+ * Send "count" bytes to the output file, compressing them if asked to.
+ */
+static int wrEmit(HprofWriter* pWriter, const void* data, size_t count)
+{
+    if (pWriter->pDeflate != NULL)
+        return wrDeflate(pWriter, data, count, Z_NO_FLUSH);
+
+    size_t actual = fwrite(data, 1, count, pWriter->out);
+    if (actual != count) {
+        fprintf(stderr, "ERROR: write %zu of %zu bytes\n", actual, count);
+        return -1;
+    }
+    return 0;
+}
+
+#ifdef HAVE_MMAP_IO
+/*
+ * Write out the gathered spans.
+ */
+static int wrFlushSpans(HprofWriter* pWriter)
+{
+    struct iovec* iov = pWriter->iov;
+    int count = pWriter->iovCount;
+
+    while (count > 0) {
+        ssize_t actual = writev(pWriter->fd, iov, count);
+        if (actual < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERROR: write failed: %s\n", strerror(errno));
+            return -1;
+        }
+        pWriter->offset += actual;
+
+        /* skip what was written */
+        while (count > 0 && (size_t) actual >= iov->iov_len) {
+            actual -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*) iov->iov_base + actual;
+            iov->iov_len -= actual;
+        }
+    }
+
+    pWriter->iovCount = 0;
+    pWriter->pending = 0;
+    pWriter->len = 0;
+    return 0;
+}
+
+/*
+ * Copy "count" bytes at "inOffset" in the input file straight to the
+ * output with copy_file_range().  Returns the number of bytes that
+ * couldn't be copied, e.g. because the file systems don't support it, in
+ * which case copy_file_range() isn't tried again.
+ */
+static size_t copyFileRange(HprofWriter* pWriter, uint64_t inOffset,
+    size_t count)
+{
+#if defined(__linux__) && defined(__NR_copy_file_range)
+    loff_t offIn = inOffset;
+
+    while (count > 0) {
+        ssize_t actual = syscall(__NR_copy_file_range, pWriter->inFd, &offIn,
+            pWriter->fd, NULL, count, 0);
+        if (actual < 0 && errno == EINTR)
+            continue;
+        if (actual <= 0) {
+            pWriter->inFd = -1;
+            break;
+        }
+        pWriter->offset += actual;
+        count -= actual;
+    }
+#else
+    (void) inOffset;
+    pWriter->inFd = -1;
+#endif
+    return count;
+}
+
+/*
+ * Add "count" bytes at "data" to the gathered output.  Data in the
+ * mapping is referenced in place, unless the span is short; anything
+ * else is copied to the buffer.
+ */
+static int wrAddSpan(HprofWriter* pWriter, const unsigned char* data,
+    size_t count)
+{
+    if (pWriter->iovCount == kMaxIov && wrFlushSpans(pWriter) != 0)
+        return -1;
+
+    struct iovec* pLast = (pWriter->iovCount > 0) ?
+        &pWriter->iov[pWriter->iovCount - 1] : NULL;
+    int extendsLast = (pLast != NULL
+        && (const unsigned char*) pLast->iov_base + pLast->iov_len == data);
+    int inMap = (data >= pWriter->mapStart && data + count <= pWriter->mapEnd);
+
+    if (inMap && (count >= kZeroCopyMin || extendsLast)) {
+        if (count >= kCopyRangeMin && pWriter->inFd >= 0) {
+            if (wrFlushSpans(pWriter) != 0)
+                return -1;
+            size_t left = copyFileRange(pWriter, data - pWriter->mapStart, count);
+            data += count - left;
+            count = left;
+            if (count == 0)
+                return 0;
+        }
+    } else {
+        if (pWriter->len + count > kOutBufSize && wrFlushSpans(pWriter) != 0)
+            return -1;
+        if (count > kOutBufSize) {
+            /* too big to stage; write it now */
+            pWriter->iov[0].iov_base = (void*) data;
+            pWriter->iov[0].iov_len = count;
+            pWriter->iovCount = 1;
+            return wrFlushSpans(pWriter);
+        }
+        memcpy(pWriter->buf + pWriter->len, data, count);
+        data = pWriter->buf + pWriter->len;
+        pWriter->len += count;
+    }
+
+    pWriter->pending += count;
+    if (pWriter->iovCount > 0) {
+        pLast = &pWriter->iov[pWriter->iovCount - 1];
+        if ((const unsigned char*) pLast->iov_base + pLast->iov_len == data) {
+            pLast->iov_len += count;
+            return 0;
+        }
+    }
+    pWriter->iov[pWriter->iovCount].iov_base = (void*) data;
+    pWriter->iov[pWriter->iovCount].iov_len = count;
+    pWriter->iovCount++;
+    return 0;
+}
+#endif
+
+/*
+ * Write out whatever is buffered.
+ */
+static int wrFlush(HprofWriter* pWriter)
+{
+#ifdef HAVE_MMAP_IO
+    if (pWriter->zeroCopy)
+        return wrFlushSpans(pWriter);
+#endif
+
+    if (pWriter->len == 0)
+        return 0;
+
+    if (wrEmit(pWriter, pWriter->buf, pWriter->len) != 0)
+        return -1;
+    pWriter->offset += pWriter->len;
+    pWriter->len = 0;
+    return 0;
+}
+
+/*
+ * Write out whatever is buffered, and end the compressed stream.
+ */
+static int wrFinish(HprofWriter* pWriter)
+{
+    if (wrFlush(pWriter) != 0)
+        return -1;
+    if (pWriter->pDeflate != NULL)
+        return wrDeflate(pWriter, NULL, 0, Z_FINISH);
+    return 0;
+}
+
+static int wrWrite(HprofWriter* pWriter, const void* data, size_t count)
+{
+    pWriter->count += count;
+    if (pWriter->out == NULL) {
+        if (pWriter->buf == NULL)
+            return 0;
+        if (pWriter->len + count > pWriter->memSize) {
+            fprintf(stderr, "ERROR: converted record is too big\n");
+            return -1;
+        }
+        memcpy(pWriter->buf + pWriter->len, data, count);
+        pWriter->len += count;
+        return 0;
+    }
+
+#ifdef HAVE_MMAP_IO
+    if (pWriter->zeroCopy)
+        return wrAddSpan(pWriter, (const unsigned char*) data, count);
+#endif
+
+    if (pWriter->len + count > kOutBufSize) {
+        if (wrFlush(pWriter) != 0)
+            return -1;
+        if (count >= kOutBufSize) {
+            if (wrEmit(pWriter, data, count) != 0)
+                return -1;
+            pWriter->offset += count;
+            return 0;
+        }
+    }
+
+    memcpy(pWriter->buf + pWriter->len, data, count);
+    pWriter->len += count;
+    return 0;
+}
+
+/*
+ * Get the file offset of the next byte to be written.
+ */
+static inline uint64_t wrTell(const HprofWriter* pWriter)
+{
+#ifdef HAVE_MMAP_IO
+    if (pWriter->zeroCopy)
+        return pWriter->offset + pWriter->pending;
+#endif
+    return pWriter->offset + pWriter->len;
+}
+
+/*
+ * Can a value at "where" still be patched by wrPatch4BE() after
+ * another "count" bytes have been written?
+ */
+static int wrCanPatch(const HprofWriter* pWriter, uint64_t count)
+{
+#ifdef HAVE_MMAP_IO
+    if (pWriter->zeroCopy)
+        return pWriter->seekable;
+#endif
+    return pWriter->seekable || pWriter->len + count <= kOutBufSize;
+}
+
+/*
+ * Overwrite a 4-byte big-endian value at "where", which must already have
+ * been written.  If it's been flushed out of the buffer, the output must
+ * be seekable.
+ */
+static int wrPatch4BE(HprofWriter* pWriter, uint64_t where, uint32_t val)
+{
+    unsigned char tmp[4];
+
+#ifdef HAVE_MMAP_IO
+    if (pWriter->zeroCopy) {
+        assert(pWriter->seekable);
+        set4BE(tmp, val);
+        if (wrFlushSpans(pWriter) != 0)
+            return -1;
+        if (pwrite(pWriter->fd, tmp, sizeof(tmp), where) != sizeof(tmp)) {
+            fprintf(stderr, "ERROR: unable to update record length: %s\n",
+                strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+#endif
+
+    if (where >= pWriter->offset) {
+        set4BE(pWriter->buf + (where - pWriter->offset), val);
+        return 0;
+    }
+
+    assert(pWriter->seekable);
+    set4BE(tmp, val);
+    if (wrFlush(pWriter) != 0)
+        return -1;
+    if (hprofSeek(pWriter->out, where, SEEK_SET) != 0
+            || fwrite(tmp, 1, sizeof(tmp), pWriter->out) != sizeof(tmp)
+            || hprofSeek(pWriter->out, pWriter->offset, SEEK_SET) != 0) {
+        fprintf(stderr, "ERROR: unable to update record length: %s\n",
+            strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Consume "count" bytes of the current record, copying them to the
+ * output if "copy" is set.
+ */
+static int transferData(HprofReader* pReader, HprofWriter* pWriter,
+    uint64_t count, int copy)
+{
+    if (count > rdLeft(pReader)) {
+        fprintf(stderr, "ERROR: sub-record runs past the end of the record\n");
+        return -1;
+    }
+
+    while (count > 0) {
+        if (rdFill(pReader, 1) == NULL)
+            return -1;
+
+        size_t chunk = pReader->end - pReader->pos;
+        if (chunk > count)
+            chunk = count;
+        if (copy && wrWrite(pWriter, pReader->buf + pReader->pos, chunk) != 0)
+            return -1;
+        pReader->pos += chunk;
+        count -= chunk;
+    }
+    return 0;
+}
+
+
+/*
+ * ===========================================================================
+ *      Object filters
+ * ===========================================================================
+ */
+
+/*
+ * Filters from the command line, applied to the sub-records of heap
+ * dumps as they're converted.  An object is dropped if it's in a heap
+ * that isn't kept, or if there's a class allow-list and its class isn't
+ * on it.  Class ids are matched by watching the STRING and LOAD_CLASS
+ * records for the listed names, so the list is expected to be short.
+ */
+typedef struct {
+    unsigned int keepHeaps;     /* bit per heap index */
+    int stripPrimitives;        /* empty all primitive arrays */
+    int dropUnreachable;        /* drop HPROF_UNREACHABLE roots */
+
+    const char** classNames;    /* allow-list; empty keeps everything */
+    size_t numClassNames;
+    unsigned int keepPrimitiveTypes;    /* bit per listed basic type */
+    IdMap nameStrings;          /* ids of strings with listed names */
+    IdMap classIds;             /* ids of listed classes */
+} HprofFilter;
+
+static HprofFilter gFilter;
+
+/*
+ * Add a class to the allow-list.
+ */
+static int filterAddClass(const char* name)
+{
+    const char** newNames = (const char**) realloc(gFilter.classNames,
+        (gFilter.numClassNames + 1) * sizeof(const char*));
+    if (newNames == NULL)
+        return -1;
+    gFilter.classNames = newNames;
+    gFilter.classNames[gFilter.numClassNames++] = name;
+
+    /* primitive arrays don't have classes in the dump */
+    int type;
+    for (type = HPROF_BASIC_BOOLEAN; type <= HPROF_BASIC_LONG; type++) {
+        if (strcmp(name, primitiveArrayName((HprofBasicType) type)) == 0)
+            gFilter.keepPrimitiveTypes |= 1U << type;
+    }
+    return 0;
+}
+
+static inline int filterKeepHeap(int heapType)
+{
+    return (gFilter.keepHeaps & (1U << heapIndex(heapType))) != 0;
+}
+
+/*
+ * Watch for the STRING and LOAD_CLASS records that name listed classes.
+ * Call this at the start of each record; nothing is consumed.
+ */
+static int filterNoteRecord(HprofReader* pReader, unsigned char type,
+    uint32_t length)
+{
+    const unsigned char* buf;
+    uint32_t unused;
+    size_t i;
+
+    if (gFilter.numClassNames == 0)
+        return 0;
+
+    if (type == HPROF_TAG_STRING && length >= kIdentSize) {
+        /* (4b) string id, followed by the UTF-8 chars */
+        size_t nameLen = length - kIdentSize;
+        if (nameLen > kMaxNameLen)
+            return 0;
+        if ((buf = rdFill(pReader, length)) == NULL)
+            return -1;
+        for (i = 0; i < gFilter.numClassNames; i++) {
+            const char* name = gFilter.classNames[i];
+            if (strlen(name) == nameLen
+                    && memcmp(name, buf + kIdentSize, nameLen) == 0)
+                return idMapPut(&gFilter.nameStrings, get4BE(buf), 0);
+        }
+    } else if (type == HPROF_TAG_LOAD_CLASS && length >= 8 + kIdentSize * 2) {
+        /* (4b) serial, (4b) class id, (4b) stack serial, (4b) name id */
+        if ((buf = rdFill(pReader, 8 + kIdentSize * 2)) == NULL)
+            return -1;
+        if (idMapGet(&gFilter.nameStrings, get4BE(buf + 8 + kIdentSize), &unused))
+            return idMapPut(&gFilter.classIds, get4BE(buf + 4), 0);
+    }
+    return 0;
+}
+
+/*
+ * Is the class of an instance or array sub-record on the allow-list?
+ * "buf" holds its fixed part.
+ */
+static int filterKeepClass(const unsigned char* buf)
+{
+    uint32_t unused;
+
+    if (gFilter.numClassNames == 0)
+        return TRUE;
+
+    switch (buf[0]) {
+    case HPROF_INSTANCE_DUMP:
+        return idMapGet(&gFilter.classIds, get4BE(buf + 1 + kIdentSize + 4),
+            &unused);
+    case HPROF_OBJECT_ARRAY_DUMP:
+        return idMapGet(&gFilter.classIds, get4BE(buf + 1 + kIdentSize + 8),
+            &unused);
+    case HPROF_PRIMITIVE_ARRAY_DUMP:
+    case HPROF_PRIMITIVE_ARRAY_NODATA_DUMP:
+        return buf[1 + kIdentSize + 8] < 32
+            && (gFilter.keepPrimitiveTypes & (1U << buf[1 + kIdentSize + 8])) != 0;
+    default:
+        return TRUE;
+    }
+}
+
+/*
+ * Parse a comma-separated list of heap names for -k.
+ */
+static int filterParseHeaps(char* list)
+{
+    char* name;
+
+    gFilter.keepHeaps = 0;
+    for (name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+        int heap;
+        for (heap = 0; heap < kNumHeaps; heap++) {
+            if (strcmp(name, kHeapNames[heap]) == 0)
+                break;
+        }
+        if (heap == kNumHeaps) {
+            fprintf(stderr, "ERROR: unknown heap '%s'\n", name);
+            return -1;
+        }
+        gFilter.keepHeaps |= 1U << heap;
+    }
+    return (gFilter.keepHeaps != 0) ? 0 : -1;
+}
+
+/*
+ * Forget the class ids found so far, before reading another file.
+ */
+static void filterForgetIds(void)
+{
+    idMapFree(&gFilter.nameStrings);
+    idMapFree(&gFilter.classIds);
+}
+
+static void filterFree(void)
+{
+    free(gFilter.classNames);
+    filterForgetIds();
+}
+
+/*
+ * ===========================================================================
+ *      Object index
+ * ===========================================================================
+ */
+
+/*
+ * With -i, the offset in the output of every class, instance and array
+ * dump is recorded, and written to a sidecar file sorted by object id so
+ * that a reader can map it and find an object with a binary search.
+ *
+ * The index file is big-endian, like hprof:
+ *   (8b) "HPROFIDX"
+ *   (4b) size of each entry, currently kIndexEntrySize
+ *   (4b) number of entries
+ * followed by the entries, in increasing id order:
+ *   (4b) object id
+ *   (4b) class id; the superclass for a class dump, and the basic type
+ *        for a primitive array
+ *   (8b) offset of the sub-record in the (uncompressed) output
+ *   (1b) sub-record tag, always a 1.0.2 one
+ *   (3b) zero
+ */
+#define kIndexMagic         "HPROFIDX"
+#define kIndexHeaderSize    16
+#define kIndexEntrySize     20
+
+typedef struct {
+    uint64_t offset;
+    uint32_t id;
+    uint32_t classId;
+    unsigned char tag;
+} IndexEntry;
+
+typedef struct {
+    IndexEntry* entries;
+    size_t count;
+    size_t capacity;
+} ObjectIndex;
+
+static int idxAdd(ObjectIndex* pIndex, uint64_t offset, unsigned char tag,
+    uint32_t id, uint32_t classId)
+{
+    if (pIndex->count == pIndex->capacity) {
+        size_t newCapacity = (pIndex->capacity == 0)
+            ? 1024 : pIndex->capacity * 2;
+        IndexEntry* newEntries = (IndexEntry*) bufRealloc(pIndex->entries,
+            pIndex->capacity * sizeof(IndexEntry),
+            newCapacity * sizeof(IndexEntry));
+        if (newEntries == NULL) {
+            fprintf(stderr, "ERROR: unable to grow object index\n");
+            return -1;
+        }
+        pIndex->entries = newEntries;
+        pIndex->capacity = newCapacity;
+    }
+
+    IndexEntry* pEntry = &pIndex->entries[pIndex->count++];
+    pEntry->offset = offset;
+    pEntry->id = id;
+    pEntry->classId = classId;
+    pEntry->tag = tag;
+    return 0;
+}
+
+/*
+ * Move the entries from "first" on by "base", after the output they
+ * refer to has been copied to that offset in another writer.
+ */
+static void idxRebase(ObjectIndex* pIndex, size_t first, uint64_t base)
+{
+    size_t i;
+
+    for (i = first; i < pIndex->count; i++)
+        pIndex->entries[i].offset += base;
+}
+
+/*
+ * Append the entries of "pOther", moved by "base".
+ */
+static int idxAppend(ObjectIndex* pIndex, const ObjectIndex* pOther,
+    uint64_t base)
+{
+    size_t i;
+
+    for (i = 0; i < pOther->count; i++) {
+        const IndexEntry* pEntry = &pOther->entries[i];
+        if (idxAdd(pIndex, pEntry->offset + base, pEntry->tag, pEntry->id,
+                pEntry->classId) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int compareIndexEntries(const void* a, const void* b)
+{
+    const IndexEntry* pA = (const IndexEntry*) a;
+    const IndexEntry* pB = (const IndexEntry*) b;
+
+    if (pA->id != pB->id)
+        return (pA->id < pB->id) ? -1 : 1;
+    if (pA->offset != pB->offset)
+        return (pA->offset < pB->offset) ? -1 : 1;
+    return 0;
+}
+
+/*
+ * Sort the index and write it to "out".
+ */
+static int idxWrite(ObjectIndex* pIndex, FILE* out)
+{
+    unsigned char buf[kIndexEntrySize * 256];
+    size_t len, i;
+
+    if (pIndex->count > UINT32_MAX) {
+        fprintf(stderr, "ERROR: too many objects to index\n");
+        return -1;
+    }
+    qsort(pIndex->entries, pIndex->count, sizeof(IndexEntry),
+        compareIndexEntries);
+
+    memcpy(buf, kIndexMagic, 8);
+    set4BE(buf + 8, kIndexEntrySize);
+    set4BE(buf + 12, (uint32_t) pIndex->count);
+    len = kIndexHeaderSize;
+
+    for (i = 0; i < pIndex->count; i++) {
+        const IndexEntry* pEntry = &pIndex->entries[i];
+
+        if (len + kIndexEntrySize > sizeof(buf)) {
+            if (fwrite(buf, 1, len, out) != len)
+                goto write_fail;
+            len = 0;
+        }
+        unsigned char* pOut = buf + len;
+        set4BE(pOut, pEntry->id);
+        set4BE(pOut + 4, pEntry->classId);
+        set4BE(pOut + 8, (uint32_t) (pEntry->offset >> 32));
+        set4BE(pOut + 12, (uint32_t) pEntry->offset);
+        pOut[16] = pEntry->tag;
+        pOut[17] = pOut[18] = pOut[19] = 0;
+        len += kIndexEntrySize;
+    }
+    if (fwrite(buf, 1, len, out) != len || fflush(out) != 0)
+        goto write_fail;
+    return 0;
+
+write_fail:
+    fprintf(stderr, "ERROR: write to index file failed: %s\n",
+        strerror(errno));
+    return -1;
+}
+
+/*
+ * Get the id and class id of a class, instance or array dump, from the
+ * fixed part of the sub-record in "buf".  Returns the tag to index it
+ * under, or 0 if it isn't one.
+ */
+static unsigned char idxDescribe(const unsigned char* buf, uint32_t* pId,
+    uint32_t* pClassId)
+{
+    *pId = get4BE(buf + 1);
+    switch (buf[0]) {
+    case HPROF_CLASS_DUMP:
+    case HPROF_INSTANCE_DUMP:
+        *pClassId = get4BE(buf + 1 + kIdentSize + 4);
+        return buf[0];
+    case HPROF_OBJECT_ARRAY_DUMP:
+        *pClassId = get4BE(buf + 1 + kIdentSize + 8);
+        return buf[0];
+    case HPROF_PRIMITIVE_ARRAY_DUMP:
+    case HPROF_PRIMITIVE_ARRAY_NODATA_DUMP:
+        *pClassId = buf[1 + kIdentSize + 8];
+        return HPROF_PRIMITIVE_ARRAY_DUMP;
+    default:
+        return 0;
+    }
+}
+
+static void idxFree(ObjectIndex* pIndex)
+{
+    bufFree(pIndex->entries, pIndex->capacity * sizeof(IndexEntry));
+    memset(pIndex, 0, sizeof(*pIndex));
+}
+
+/*
+ * Crunch through the data of a heap dump record, writing the original or
+ * converted sub-records to "pWriter".
+ *
+ * Rewritten sub-records are built in "rewrite" rather than in the window,
+ * since a mapped input is read-only and may be converted twice.
+ *
+ * If "pHisto" is set, the objects that are kept are also counted there.
+ * If "pIndex" is set, the objects that are written are added to it, at
+ * their offsets in "pWriter".
+ */
+static int convertHeapDump(HprofReader* pReader, HprofWriter* pWriter, int flags,
+    ClassHistogram* pHisto, ObjectIndex* pIndex)
+{
+    unsigned char rewrite[1 + kIdentSize + 9];
+    int heapType = HPROF_HEAP_DEFAULT;
+    int heapIgnore = FALSE;
+
+    while (rdLeft(pReader) > 0) {
+        unsigned char* buf = rdFill(pReader, 1);
+        if (buf == NULL)
+            return -1;
+
+        unsigned char subType = buf[0];
+        int justCopy = TRUE;
+        int dropped = heapIgnore;
+        uint64_t subStart = pWriter->count;
+        int64_t subLen;
+
+        /*
+         * Get the fixed part of the sub-record into the window, then
+         * work out the full length.  Anything that's rewritten is
+         * changed in the window before it's copied.
+         */
+        DBUG("--- 0x%02x  ", subType);
+        switch (subType) {
+        /* 1.0.2 types */
+        case HPROF_ROOT_UNKNOWN:
+            subLen = kIdentSize;
+            break;
+        case HPROF_ROOT_JNI_GLOBAL:
+            subLen = kIdentSize * 2;
+            break;
+        case HPROF_ROOT_JNI_LOCAL:
+            subLen = kIdentSize + 8;
+            break;
+        case HPROF_ROOT_JAVA_FRAME:
+            subLen = kIdentSize + 8;
+            break;
+        case HPROF_ROOT_NATIVE_STACK:
+            subLen = kIdentSize + 4;
+            break;
+        case HPROF_ROOT_STICKY_CLASS:
+            subLen = kIdentSize;
+            break;
+        case HPROF_ROOT_THREAD_BLOCK:
+            subLen = kIdentSize + 4;
+            break;
+        case HPROF_ROOT_MONITOR_USED:
+            subLen = kIdentSize;
+            break;
+        case HPROF_ROOT_THREAD_OBJECT:
+            subLen = kIdentSize + 8;
+            break;
+        case HPROF_CLASS_DUMP:
+            if ((buf = rdFillClassDump(pReader, &subLen)) == NULL)
+                return -1;
+            break;
+        case HPROF_INSTANCE_DUMP:
+            if ((buf = rdFill(pReader, 1 + kIdentSize * 2 + 8)) == NULL)
+                return -1;
+            subLen = computeInstanceDumpLen(buf+1, 0);
+            dropped = dropped || !filterKeepClass(buf);
+            if (dropped) {
+                justCopy = FALSE;
+            }
+            break;
+        case HPROF_OBJECT_ARRAY_DUMP:
+            if ((buf = rdFill(pReader, 1 + kIdentSize * 2 + 8)) == NULL)
+                return -1;
+            subLen = computeObjectArrayDumpLen(buf+1, 0);
+            dropped = dropped || !filterKeepClass(buf);
+            if (dropped) {
+                justCopy = FALSE;
+            }
+            break;
+        case HPROF_PRIMITIVE_ARRAY_DUMP:
+            if ((buf = rdFill(pReader, 1 + kIdentSize + 9)) == NULL)
+                return -1;
+            subLen = computePrimitiveArrayDumpLen(buf+1, 0);
+            if (subLen < 0) {
+                fprintf(stderr, "ERROR: invalid basicType %d\n",
+                    buf[1 + kIdentSize + 8]);
+                return -1;
+            }
+            dropped = dropped || !filterKeepClass(buf);
+            if (dropped) {
+                justCopy = FALSE;
+            } else if (gFilter.stripPrimitives) {
+                /* keep the header, with the element count set to 0 */
+                memcpy(rewrite, buf, 1 + kIdentSize + 9);
+                set4BE(rewrite + 1 + kIdentSize + 4, 0);
+                justCopy = FALSE;
+                if (wrWrite(pWriter, rewrite, 1 + kIdentSize + 9) != 0)
+                    return -1;
+            }
+            break;
+        /* these were added for Android in 1.0.3 */
+        case HPROF_HEAP_DUMP_INFO:
+            if ((buf = rdFill(pReader, 1 + kIdentSize + 4)) == NULL)
+                return -1;
+            heapType = get4BE(buf+1);
+            if ((flags & kFlagAppOnly) != 0
+                    && (heapType == HPROF_HEAP_ZYGOTE || heapType == HPROF_HEAP_IMAGE)) {
+                heapIgnore = TRUE;
+            } else {
+                heapIgnore = !filterKeepHeap(heapType);
+            }
+            justCopy = FALSE;
+            subLen = kIdentSize + 4;
+            // no 1.0.2 equivalent for this
+            break;
+        case HPROF_ROOT_INTERNED_STRING:
+        case HPROF_ROOT_FINALIZING:
+        case HPROF_ROOT_DEBUGGER:
+        case HPROF_ROOT_REFERENCE_CLEANUP:
+        case HPROF_ROOT_VM_INTERNAL:
+        case HPROF_UNREACHABLE:
+            if ((buf = rdFill(pReader, 1 + kIdentSize)) == NULL)
+                return -1;
+            justCopy = FALSE;
+            subLen = kIdentSize;
+            if (subType == HPROF_UNREACHABLE && gFilter.dropUnreachable)
+                break;
+            rewrite[0] = HPROF_ROOT_UNKNOWN;
+            memcpy(rewrite + 1, buf + 1, kIdentSize);
+            if (wrWrite(pWriter, rewrite, 1 + kIdentSize) != 0)
+                return -1;
+            break;
+        case HPROF_ROOT_JNI_MONITOR:
+            /* keep the ident, drop the next 8 bytes */
+            if ((buf = rdFill(pReader, 1 + kIdentSize + 8)) == NULL)
+                return -1;
+            rewrite[0] = HPROF_ROOT_UNKNOWN;
+            memcpy(rewrite + 1, buf + 1, kIdentSize);
+            justCopy = FALSE;
+            if (wrWrite(pWriter, rewrite, 1 + kIdentSize) != 0)
+                return -1;
+            subLen = kIdentSize + 8;
+            break;
+        case HPROF_PRIMITIVE_ARRAY_NODATA_DUMP:
+            if ((buf = rdFill(pReader, 1 + kIdentSize + 9)) == NULL)
+                return -1;
+            subLen = kIdentSize + 9;
+            justCopy = FALSE;
+            /* (-z has always kept these) */
+            if (!filterKeepHeap(heapType) || !filterKeepClass(buf)) {
+                dropped = TRUE;
+                break;
+            }
+            memcpy(rewrite, buf, 1 + kIdentSize + 9);
+            rewrite[0] = HPROF_PRIMITIVE_ARRAY_DUMP;
+            /* set array len to 0 */
+            rewrite[5] = rewrite[6] = rewrite[7] = rewrite[8] = 0;
+            if (wrWrite(pWriter, rewrite, 1 + kIdentSize + 9) != 0)
+                return -1;
+            break;
+
+        /* shouldn't get here */
+        default:
+            fprintf(stderr, "ERROR: unexpected subtype 0x%02x with %" PRIu64
+                " bytes left in record\n", subType, rdLeft(pReader));
+            return -1;
+        }
+
+        if (pHisto != NULL && !dropped
+                && histoAddObject(pHisto, heapType, buf) != 0)
+            return -1;
+
+        /* (the window may move before we know whether it was written) */
+        uint32_t objId, objClassId;
+        unsigned char indexTag = 0;
+        if (pIndex != NULL)
+            indexTag = idxDescribe(buf, &objId, &objClassId);
+
+        /*
+         * Copy the source data, or skip it if other data has been written
+         * or the sub-record is being omitted.
+         */
+        DBUG("(%s %" PRId64 ")\n", justCopy ? "copy" : "adv", 1 + subLen);
+        if (transferData(pReader, pWriter, 1 + subLen, justCopy) != 0)
+            return -1;
+
+        if (indexTag != 0 && pWriter->count != subStart
+                && idxAdd(pIndex, subStart, indexTag, objId, objClassId) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Convert a heap dump record, whose header is in "hdr", and write it out
+ * with its length updated.
+ *
+ * The converted length isn't known until the end, so it's patched into
+ * the header afterward: in the output buffer if the record fits there,
+ * otherwise by seeking back in the output.  If the output is a pipe, the
+ * length is computed in a first pass over the input instead, and if
+ * neither can seek the converted record is spooled to a temp file.
+ *
+ * "pSpool" holds the temp file, which is created on first use and reused
+ * for later records.  "pIndex", if set, gets the converted objects.
+ */
+static int processHeapDump(HprofReader* pReader, HprofWriter* pWriter,
+    HprofSpool* pSpool, unsigned char* hdr, int flags, ObjectIndex* pIndex)
+{
+    uint32_t length = get4BE(hdr + 5);
+    uint64_t startCount;
+    uint64_t hdrPos;
+
+    /* converting never makes a record bigger */
+    if (wrCanPatch(pWriter, kRecHdrLen + (uint64_t) length)) {
+        hdrPos = wrTell(pWriter);
+        if (wrWrite(pWriter, hdr, kRecHdrLen) != 0)
+            return -1;
+        startCount = pWriter->count;
+        if (rdStartRecord(pReader, length) != 0
+                || convertHeapDump(pReader, pWriter, flags, NULL, pIndex) != 0)
+            return -1;
+        return wrPatch4BE(pWriter, hdrPos + 5, pWriter->count - startCount);
+    }
+
+    if (pReader->map != NULL || pReader->seekable) {
+        HprofWriter counter;
+        int64_t dataPos = rdTell(pReader);
+
+        memset(&counter, 0, sizeof(counter));
+        if (rdStartRecord(pReader, length) != 0
+                || convertHeapDump(pReader, &counter, flags, NULL, NULL) != 0)
+            return -1;
+
+        if (rdSeek(pReader, dataPos) != 0)
+            return -1;
+        set4BE(hdr + 5, counter.count);
+        if (wrWrite(pWriter, hdr, kRecHdrLen) != 0)
+            return -1;
+        if (rdStartRecord(pReader, length) != 0)
+            return -1;
+        return convertHeapDump(pReader, pWriter, flags, NULL, pIndex);
+    }
+
+    /* spool to a temp file, then copy it out */
+    assert(pSpool != NULL);
+    HprofWriter* pSpoolWriter = &pSpool->writer;
+
+    if (pSpool->file == NULL) {
+        pSpool->file = tmpfile();
+        if (pSpool->file == NULL) {
+            fprintf(stderr, "ERROR: unable to create temp file: %s\n",
+                strerror(errno));
+            return -1;
+        }
+        if (wrInit(pSpoolWriter, pSpool->file, NULL, FALSE) != 0)
+            return -1;
+    } else {
+        /* anything past the new record's end is ignored */
+        if (hprofSeek(pSpool->file, 0, SEEK_SET) != 0) {
+            fprintf(stderr, "ERROR: unable to rewind temp file: %s\n",
+                strerror(errno));
+            return -1;
+        }
+        pSpoolWriter->offset = 0;
+        pSpoolWriter->count = 0;
+    }
+
+    /* (the temp file is seekable, so this doesn't recurse further) */
+    size_t firstEntry = (pIndex != NULL) ? pIndex->count : 0;
+    if (processHeapDump(pReader, pSpoolWriter, NULL, hdr, flags, pIndex) != 0
+            || wrFlush(pSpoolWriter) != 0)
+        return -1;
+    if (pIndex != NULL)
+        idxRebase(pIndex, firstEntry, pWriter->count);
+
+    if (hprofSeek(pSpool->file, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "ERROR: unable to rewind temp file: %s\n",
+            strerror(errno));
+        return -1;
+    }
+
+    /* the spool writer has been flushed, so copy through its buffer */
+    uint64_t left = pSpoolWriter->count;
+    while (left > 0) {
+        size_t want = left < kOutBufSize ? left : kOutBufSize;
+        size_t actual = fread(pSpoolWriter->buf, 1, want, pSpool->file);
+        if (actual != want) {
+            fprintf(stderr, "ERROR: failed reading temp file\n");
+            return -1;
+        }
+        if (wrWrite(pWriter, pSpoolWriter->buf, actual) != 0)
+            return -1;
+        left -= actual;
+    }
+    return 0;
+}
+
+/*
+ * Convert the records that follow the file header, one at a time.
+ */
+static int convertRecords(HprofReader* pReader, HprofWriter* pWriter,
+    HprofSpool* pSpool, int flags, ObjectIndex* pIndex)
+{
+    /*
+     * Read records until we hit EOF.  Each record begins with:
+     * (1b) type
+     * (4b) timestamp
+     * (4b) length of data that follows
+     */
+    while (1) {
+        unsigned char hdr[kRecHdrLen];
+        int status = rdReadHeader(pReader, hdr);
+
+        if (status < 0)
+            return -1;
+        if (status == 0)
+            break;
+
+        unsigned char type = hdr[0];
+        uint32_t length = get4BE(hdr + 5);
+
+        if (type == HPROF_TAG_HEAP_DUMP
+                || type == HPROF_TAG_HEAP_DUMP_SEGMENT) {
+            DBUG("Processing heap dump 0x%02x (%u bytes)\n", type, length);
+            if (processHeapDump(pReader, pWriter, pSpool, hdr, flags,
+                    pIndex) != 0)
+                return -1;
+        } else {
+            /* keep */
+            DBUG("Keeping 0x%02x (%u bytes)\n", type, length);
+            if (wrWrite(pWriter, hdr, kRecHdrLen) != 0)
+                return -1;
+            if (rdStartRecord(pReader, length) != 0
+                    || filterNoteRecord(pReader, type, length) != 0
+                    || transferData(pReader, pWriter, length, TRUE) != 0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * ===========================================================================
+ *      Parallel conversion
+ * ===========================================================================
+ */
+
+/*
+ * With -j, the heap dump records of a mapped input are converted by a
+ * pool of threads, each record into a buffer of its own, while the main
+ * thread writes everything out in the original order.  Workers stay at
+ * most kJobsPerThread records per thread ahead of the writer, which
+ * bounds the memory used.
+ */
+#define kJobsPerThread  2
+
+typedef enum {
+    kJobPending = 0,
+    kJobDone,
+    kJobFailed,
+} JobState;
+
+typedef struct {
+    uint64_t offset;            /* of the record's data in the mapping */
+    uint32_t length;
+    JobState state;
+    unsigned char* buf;         /* converted data, "length" bytes */
+    uint64_t count;             /* converted length */
+    ObjectIndex index;          /* objects in "buf", with -i */
+} HeapDumpJob;
+
+typedef struct {
+    const HprofReader* pReader;
+    int flags;
+    int indexing;
+    HeapDumpJob* jobs;
+    size_t numJobs;
+    size_t nextJob;             /* next to be claimed by a worker */
+    size_t nextWrite;           /* next to be written out */
+    size_t maxAhead;
+    int abort;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* job finished, or written out */
+} ParallelState;
+
+static inline int isHeapDump(unsigned char type)
+{
+    return type == HPROF_TAG_HEAP_DUMP || type == HPROF_TAG_HEAP_DUMP_SEGMENT;
+}
+
+/*
+ * Convert one heap dump record into a buffer.
+ */
+static int convertJob(const HprofReader* pMapped, HeapDumpJob* pJob, int flags,
+    int indexing)
+{
+    HprofReader reader;
+    HprofWriter writer;
+
+    memset(&reader, 0, sizeof(reader));
+    reader.map = pMapped->map;
+    reader.mapLen = pMapped->mapLen;
+    reader.mapPos = pJob->offset;
+
+    /* converting never makes a record bigger */
+    memset(&writer, 0, sizeof(writer));
+    writer.memSize = pJob->length;
+    writer.buf = (unsigned char*) bufRealloc(NULL, 0, pJob->length + 1);
+    if (writer.buf == NULL) {
+        fprintf(stderr, "ERROR: unable to allocate %u bytes\n", pJob->length);
+        return -1;
+    }
+
+    if (rdStartRecord(&reader, pJob->length) != 0
+            || convertHeapDump(&reader, &writer, flags, NULL,
+                indexing ? &pJob->index : NULL) != 0) {
+        bufFree(writer.buf, pJob->length + 1);
+        return -1;
+    }
+
+    pJob->buf = writer.buf;
+    pJob->count = writer.count;
+    return 0;
+}
+
+static void* convertThreadStart(void* arg)
+{
+    ParallelState* pState = (ParallelState*) arg;
+
+    pthread_mutex_lock(&pState->lock);
+    while (!pState->abort && pState->nextJob < pState->numJobs) {
+        if (pState->nextJob >= pState->nextWrite + pState->maxAhead) {
+            pthread_cond_wait(&pState->cond, &pState->lock);
+            continue;
+        }
+
+        HeapDumpJob* pJob = &pState->jobs[pState->nextJob++];
+        pthread_mutex_unlock(&pState->lock);
+
+        JobState state = kJobDone;
+        if (convertJob(pState->pReader, pJob, pState->flags,
+                pState->indexing) != 0)
+            state = kJobFailed;
+
+        pthread_mutex_lock(&pState->lock);
+        pJob->state = state;
+        pthread_cond_broadcast(&pState->cond);
+    }
+    pthread_mutex_unlock(&pState->lock);
+    return NULL;
+}
+
+/*
+ * Find the heap dump records in the rest of the mapped input.  The read
+ * position is left where it was.
+ */
+static int indexHeapDumps(HprofReader* pReader, ParallelState* pState)
+{
+    int64_t start = rdTell(pReader);
+    size_t capacity = 0;
+
+    while (1) {
+        unsigned char hdr[kRecHdrLen];
+        int status = rdReadHeader(pReader, hdr);
+
+        if (status < 0)
+            return -1;
+        if (status == 0)
+            break;
+
+        uint32_t length = get4BE(hdr + 5);
+        if (isHeapDump(hdr[0])) {
+            if (pState->numJobs == capacity) {
+                size_t newCapacity = (capacity == 0) ? 64 : capacity * 2;
+                HeapDumpJob* newJobs = (HeapDumpJob*) realloc(pState->jobs,
+                    newCapacity * sizeof(HeapDumpJob));
+                if (newJobs == NULL) {
+                    fprintf(stderr, "ERROR: unable to allocate job list\n");
+                    return -1;
+                }
+                pState->jobs = newJobs;
+                capacity = newCapacity;
+            }
+
+            HeapDumpJob* pJob = &pState->jobs[pState->numJobs++];
+            memset(pJob, 0, sizeof(*pJob));
+            pJob->offset = rdTell(pReader);
+            pJob->length = length;
+        }
+
+        /* (the workers rely on every listed class being known up front) */
+        if (rdStartRecord(pReader, length) != 0
+                || filterNoteRecord(pReader, hdr[0], length) != 0
+                || transferData(pReader, NULL, length, FALSE) != 0)
+            return -1;
+    }
+
+    return rdSeek(pReader, start);
+}
+
+/*
+ * Convert the records that follow the file header of a mapped input,
+ * converting heap dumps on "numThreads" threads.
+ */
+static int convertRecordsParallel(HprofReader* pReader, HprofWriter* pWriter,
+    int flags, int numThreads, ObjectIndex* pIndex)
+{
+    ParallelState state;
+    pthread_t* threads = NULL;
+    int numStarted = 0;
+    size_t jobIdx = 0;
+    int result = -1;
+    size_t i;
+
+    memset(&state, 0, sizeof(state));
+    state.pReader = pReader;
+    state.flags = flags;
+    state.indexing = (pIndex != NULL);
+    state.maxAhead = (size_t) numThreads * kJobsPerThread;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.cond, NULL);
+
+    if (indexHeapDumps(pReader, &state) != 0)
+        goto bail;
+
+    threads = (pthread_t*) calloc(numThreads, sizeof(pthread_t));
+    if (threads == NULL)
+        goto bail;
+    for (numStarted = 0; numStarted < numThreads; numStarted++) {
+        if (pthread_create(&threads[numStarted], NULL, convertThreadStart,
+                &state) != 0)
+            break;
+    }
+    if (numStarted == 0) {
+        fprintf(stderr, "ERROR: unable to start conversion threads\n");
+        goto bail;
+    }
+
+    while (1) {
+        unsigned char hdr[kRecHdrLen];
+        int status = rdReadHeader(pReader, hdr);
+
+        if (status < 0)
+            goto bail;
+        if (status == 0)
+            break;
+
+        uint32_t length = get4BE(hdr + 5);
+
+        if (rdStartRecord(pReader, length) != 0)
+            goto bail;
+        if (!isHeapDump(hdr[0])) {
+            if (wrWrite(pWriter, hdr, kRecHdrLen) != 0
+                    || transferData(pReader, pWriter, length, TRUE) != 0)
+                goto bail;
+            continue;
+        }
+
+        HeapDumpJob* pJob = &state.jobs[jobIdx];
+        pthread_mutex_lock(&state.lock);
+        while (pJob->state == kJobPending)
+            pthread_cond_wait(&state.cond, &state.lock);
+        pthread_mutex_unlock(&state.lock);
+        if (pJob->state == kJobFailed)
+            goto bail;
+
+        set4BE(hdr + 5, pJob->count);
+        if (wrWrite(pWriter, hdr, kRecHdrLen) != 0)
+            goto bail;
+        if (pIndex != NULL
+                && idxAppend(pIndex, &pJob->index, pWriter->count) != 0)
+            goto bail;
+        if (wrWrite(pWriter, pJob->buf, pJob->count) != 0
+                || transferData(pReader, pWriter, length, FALSE) != 0)
+            goto bail;
+        bufFree(pJob->buf, pJob->length + 1);
+        pJob->buf = NULL;
+        idxFree(&pJob->index);
+
+        pthread_mutex_lock(&state.lock);
+        state.nextWrite = ++jobIdx;
+        pthread_cond_broadcast(&state.cond);
+        pthread_mutex_unlock(&state.lock);
+    }
+
+    result = 0;
+
+bail:
+    pthread_mutex_lock(&state.lock);
+    state.abort = TRUE;
+    pthread_cond_broadcast(&state.cond);
+    pthread_mutex_unlock(&state.lock);
+    for (i = 0; i < (size_t) numStarted; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+
+    for (i = 0; i < state.numJobs; i++) {
+        if (state.jobs[i].buf != NULL)
+            bufFree(state.jobs[i].buf, state.jobs[i].length + 1);
+        idxFree(&state.jobs[i].index);
+    }
+    free(state.jobs);
+    pthread_cond_destroy(&state.cond);
+    pthread_mutex_destroy(&state.lock);
+    return result;
+}
+
+/*
+ * Read the records that follow the file header, collecting a class
+ * histogram in "pHisto".  The caller frees it, even on failure.
+ */
+static int histogramRecords(HprofReader* pReader, ClassHistogram* pHisto,
+    int flags)
+{
+    HprofWriter counter;
+    unsigned char* buf;
+
+    memset(pHisto, 0, sizeof(*pHisto));
+    memset(&counter, 0, sizeof(counter));
+
+    while (1) {
+        unsigned char hdr[kRecHdrLen];
+        int status = rdReadHeader(pReader, hdr);
+
+        if (status < 0)
+            return -1;
+        if (status == 0)
+            break;
+
+        unsigned char type = hdr[0];
+        uint32_t length = get4BE(hdr + 5);
+
+        if (rdStartRecord(pReader, length) != 0
+                || filterNoteRecord(pReader, type, length) != 0)
+            return -1;
+
+        if (type == HPROF_TAG_STRING) {
+            /* (4b) string id, followed by the UTF-8 chars */
+            size_t nameLen = length - kIdentSize;
+            if (length < kIdentSize) {
+                fprintf(stderr, "ERROR: bad STRING record\n");
+                return -1;
+            }
+            if (nameLen > kMaxNameLen)
+                nameLen = kMaxNameLen;
+            if ((buf = rdFill(pReader, kIdentSize + nameLen)) == NULL
+                    || histoAddString(pHisto, get4BE(buf), buf + kIdentSize,
+                        nameLen) != 0)
+                return -1;
+        } else if (type == HPROF_TAG_LOAD_CLASS) {
+            /* (4b) serial, (4b) class id, (4b) stack serial, (4b) name id */
+            if (length < 8 + kIdentSize * 2) {
+                fprintf(stderr, "ERROR: bad LOAD_CLASS record\n");
+                return -1;
+            }
+            if ((buf = rdFill(pReader, 8 + kIdentSize * 2)) == NULL
+                    || idMapPut(&pHisto->classes, get4BE(buf + 4),
+                        get4BE(buf + 8 + kIdentSize)) != 0)
+                return -1;
+        } else if (isHeapDump(type)) {
+            if (convertHeapDump(pReader, &counter, flags, pHisto, NULL) != 0)
+                return -1;
+        }
+
+        if (transferData(pReader, NULL, rdLeft(pReader), FALSE) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Set up "pReader" for "in", decompressing it if it's gzipped, and read
+ * the file header into "pBuf".  On return "*ppGz" is set if a gzip
+ * thread was started, even on failure.
+ */
+static int startInput(FILE* in, HprofReader* pReader, GzInput** ppGz,
+    ExpandBuf* pBuf)
+{
+    const char *magicString;
+
+    if (isGzipInput(in) && (*ppGz = gzStart(in)) == NULL)
+        return -1;
+    if (rdInit(pReader, in, *ppGz) != 0)
+        return -1;
+
+    /*
+     * Start with the header.
+     */
+    if (ebReadString(pBuf, pReader) != 0)
+        return -1;
+
+    magicString = (const char*)ebGetBuffer(pBuf);
+    if (strcmp(magicString, "JAVA PROFILE 1.0.3") != 0) {
+        if (strcmp(magicString, "JAVA PROFILE 1.0.2") == 0) {
+            fprintf(stderr, "ERROR: HPROF file already in 1.0.2 format.\n");
+        } else {
+            fprintf(stderr, "ERROR: expecting HPROF file format 1.0.3\n");
+        }
+        return -1;
+    }
+
+    /* downgrade to 1.0.2 */
+    (ebGetBuffer(pBuf))[17] = '2';
+
+    /*
+     * Copy:
+     * (4b) identifier size, always 4
+     * (8b) file creation date
+     */
+    return ebReadData(pBuf, pReader, 12, FALSE);
+}
+
+/*
+ * Filter an hprof data file.  If "indexOut" is set, an index of the
+ * objects in the output is written to it.
+ */
+static int filterData(FILE* in, FILE* out, FILE* indexOut, int flags,
+    int numThreads)
+{
+    ExpandBuf* pBuf;
+    HprofReader reader;
+    HprofWriter writer;
+    HprofSpool spool;
+    ObjectIndex index;
+    ObjectIndex* pIndex = (indexOut != NULL) ? &index : NULL;
+    GzInput* pGz = NULL;
+    int histogram = (flags & kFlagHistogram) != 0;
+    int status;
+    int result = -1;
+
+    memset(&reader, 0, sizeof(reader));
+    memset(&writer, 0, sizeof(writer));
+    memset(&spool, 0, sizeof(spool));
+    memset(&index, 0, sizeof(index));
+
+    pBuf = ebAlloc();
+    if (pBuf == NULL || startInput(in, &reader, &pGz, pBuf) != 0)
+        goto bail;
+
+    if (histogram) {
+        ClassHistogram histo;
+        status = histogramRecords(&reader, &histo, flags);
+        if (status == 0)
+            status = histoPrint(&histo, out);
+        histoFree(&histo);
+    } else {
+        if (wrInit(&writer, out, &reader, (flags & kFlagGzipOutput) != 0) != 0
+                || ebWriteData(pBuf, &writer) != 0)
+            goto bail;
+        if (numThreads > 1 && reader.map != NULL) {
+            status = convertRecordsParallel(&reader, &writer, flags,
+                numThreads, pIndex);
+        } else {
+            status = convertRecords(&reader, &writer, &spool, flags, pIndex);
+        }
+        if (status == 0)
+            status = wrFinish(&writer);
+        if (status == 0 && pIndex != NULL)
+            status = idxWrite(pIndex, indexOut);
+    }
+    if (status != 0)
+        goto bail;
+
+    result = 0;
+
+bail:
+    if ((flags & kFlagStats) != 0) {
+        fprintf(stderr, "hprof-conv: peak buffer size %zu bytes, %u allocations\n",
+            gBufferStats.peakSize, gBufferStats.allocCount);
+    }
+
+    rdFree(&reader);
+    gzStop(pGz);
+    wrFree(&writer);
+    wrFree(&spool.writer);
+    if (spool.file != NULL)
+        fclose(spool.file);
+    idxFree(&index);
+    ebFree(pBuf);
+    return result;
+}
+
+/*
+ * ===========================================================================
+ *      Heap dump diff
+ * ===========================================================================
+ */
+
+/*
+ * With -d, class histograms of two dumps are joined by class name, and
+ * the changes printed with the biggest growth first.  Only the
+ * histograms are kept, so memory use depends on the number of classes
+ * rather than the number of objects.  A class's objects in different
+ * heaps, or from different class loaders, are added together.
+ */
+typedef struct {
+    const char* name;
+    uint64_t count[2];          /* in the old and new dumps */
+    uint64_t bytes[2];
+} DiffEntry;
+
+typedef struct {
+    DiffEntry* entries;
+    size_t numEntries;
+    size_t maxEntries;
+} HeapDiff;
+
+static const char kUnknownClass[] = "(unknown class)";
+
+static inline int64_t diffDelta(const uint64_t* vals)
+{
+    return (int64_t) (vals[1] - vals[0]);
+}
+
+static int compareDiffNames(const void* a, const void* b)
+{
+    return strcmp(((const DiffEntry*) a)->name, ((const DiffEntry*) b)->name);
+}
+
+/*
+ * Most growth in bytes first, then in instances.
+ */
+static int compareDiffGrowth(const void* a, const void* b)
+{
+    const DiffEntry* pA = (const DiffEntry*) a;
+    const DiffEntry* pB = (const DiffEntry*) b;
+    int64_t deltaA = diffDelta(pA->bytes);
+    int64_t deltaB = diffDelta(pB->bytes);
+
+    if (deltaA != deltaB)
+        return deltaA > deltaB ? -1 : 1;
+    deltaA = diffDelta(pA->count);
+    deltaB = diffDelta(pB->count);
+    if (deltaA != deltaB)
+        return deltaA > deltaB ? -1 : 1;
+    return strcmp(pA->name, pB->name);
+}
+
+/*
+ * Add the entries of one side's histogram.  The names point into
+ * "pHisto", which must outlive "pDiff".
+ */
+static int diffAddHistogram(HeapDiff* pDiff, const ClassHistogram* pHisto,
+    int side)
+{
+    size_t i;
+
+    for (i = 0; i < pHisto->numEntries; i++) {
+        const HistoEntry* pEntry = &pHisto->entries[i];
+
+        if (pDiff->numEntries == pDiff->maxEntries) {
+            size_t newMax = (pDiff->maxEntries == 0) ? 256 : pDiff->maxEntries * 2;
+            DiffEntry* newEntries = (DiffEntry*) realloc(pDiff->entries,
+                newMax * sizeof(DiffEntry));
+            if (newEntries == NULL) {
+                fprintf(stderr, "ERROR: unable to allocate diff\n");
+                return -1;
+            }
+            pDiff->entries = newEntries;
+            pDiff->maxEntries = newMax;
+        }
+
+        DiffEntry* pDiffEntry = &pDiff->entries[pDiff->numEntries++];
+        memset(pDiffEntry, 0, sizeof(*pDiffEntry));
+        pDiffEntry->name = histoEntryName(pHisto, pEntry);
+        if (pDiffEntry->name == NULL)
+            pDiffEntry->name = kUnknownClass;
+        pDiffEntry->count[side] = pEntry->count;
+        pDiffEntry->bytes[side] = pEntry->bytes;
+    }
+    return 0;
+}
+
+/*
+ * Join the entries by name, leaving one per class.
+ */
+static void diffJoin(HeapDiff* pDiff)
+{
+    size_t i, j;
+
+    qsort(pDiff->entries, pDiff->numEntries, sizeof(DiffEntry),
+        compareDiffNames);
+
+    for (i = j = 0; i < pDiff->numEntries; i++) {
+        DiffEntry* pEntry = &pDiff->entries[i];
+
+        if (j > 0 && strcmp(pDiff->entries[j - 1].name, pEntry->name) == 0) {
+            DiffEntry* pJoined = &pDiff->entries[j - 1];
+            pJoined->count[0] += pEntry->count[0];
+            pJoined->count[1] += pEntry->count[1];
+            pJoined->bytes[0] += pEntry->bytes[0];
+            pJoined->bytes[1] += pEntry->bytes[1];
+        } else {
+            pDiff->entries[j++] = *pEntry;
+        }
+    }
+    pDiff->numEntries = j;
+}
+
+/*
+ * Print the classes that changed, biggest growth first.
+ */
+static int diffPrint(HeapDiff* pDiff, FILE* out)
+{
+    uint64_t totalCount[2] = { 0, 0 };
+    uint64_t totalBytes[2] = { 0, 0 };
+    size_t i;
+
+    qsort(pDiff->entries, pDiff->numEntries, sizeof(DiffEntry),
+        compareDiffGrowth);
+
+    for (i = 0; i < pDiff->numEntries; i++) {
+        totalCount[0] += pDiff->entries[i].count[0];
+        totalCount[1] += pDiff->entries[i].count[1];
+        totalBytes[0] += pDiff->entries[i].bytes[0];
+        totalBytes[1] += pDiff->entries[i].bytes[1];
+    }
+
+    fprintf(out, "Objects: %" PRIu64 " -> %" PRIu64 " (%+" PRId64 "), "
+        "bytes: %" PRIu64 " -> %" PRIu64 " (%+" PRId64 ")\n",
+        totalCount[0], totalCount[1], diffDelta(totalCount),
+        totalBytes[0], totalBytes[1], diffDelta(totalBytes));
+    fprintf(out, "%12s %15s %12s %14s  %s\n",
+        "+instances", "+bytes", "instances", "bytes", "class");
+
+    for (i = 0; i < pDiff->numEntries; i++) {
+        const DiffEntry* pEntry = &pDiff->entries[i];
+
+        if (pEntry->count[0] == pEntry->count[1]
+                && pEntry->bytes[0] == pEntry->bytes[1])
+            continue;
+        fprintf(out, "%+12" PRId64 " %+15" PRId64 " %12" PRIu64 " %14" PRIu64
+            "  %s\n", diffDelta(pEntry->count), diffDelta(pEntry->bytes),
+            pEntry->count[1], pEntry->bytes[1], pEntry->name);
+    }
+
+    if (ferror(out)) {
+        fprintf(stderr, "ERROR: failed writing diff\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Compare the heaps of two hprof data files, reading each once.
+ */
+static int diffData(FILE* oldIn, FILE* newIn, FILE* out, int flags)
+{
+    FILE* ins[2] = { oldIn, newIn };
+    ClassHistogram histos[2];
+    HeapDiff diff;
+    int result = -1;
+    int side;
+
+    memset(histos, 0, sizeof(histos));
+    memset(&diff, 0, sizeof(diff));
+
+    for (side = 0; side < 2; side++) {
+        HprofReader reader;
+        GzInput* pGz = NULL;
+        ExpandBuf* pBuf = ebAlloc();
+        int status = -1;
+
+        memset(&reader, 0, sizeof(reader));
+        if (pBuf != NULL && startInput(ins[side], &reader, &pGz, pBuf) == 0)
+            status = histogramRecords(&reader, &histos[side], flags);
+        rdFree(&reader);
+        gzStop(pGz);
+        ebFree(pBuf);
+
+        /* object ids mean nothing in the other dump */
+        filterForgetIds();
+
+        if (status != 0 || diffAddHistogram(&diff, &histos[side], side) != 0)
+            goto bail;
+    }
+
+    diffJoin(&diff);
+    result = diffPrint(&diff, out);
+
+bail:
+    free(diff.entries);
+    histoFree(&histos[0]);
+    histoFree(&histos[1]);
+    return result;
+}
+
+/*
+ * ===========================================================================
+ *      Retained sizes
+ * ===========================================================================
+ */
+
+/*
+ * With -r, the object graph is loaded and its dominator tree computed,
+ * and the objects that retain the most memory are listed.  An object's
+ * retained size is its own size plus the size of everything that's only
+ * reachable through it.
+ *
+ * The input is read twice.  The first pass collects the class names and
+ * layouts and the GC roots, and counts the objects and bounds the number
+ * of references; the second records each object and its references into
+ * arrays of exactly that size.  Objects are numbered from 1 in file
+ * order, and node 0 is a synthetic root that refers to the GC roots and
+ * to every class.  References are held in CSR form: those of node "n"
+ * are refs[refStart[n] .. refStart[n+1]).
+ *
+ * Dominators are found with semi-NCA: the semidominator pass of
+ * Lengauer-Tarjan, followed by a walk up the DFS tree in place of the
+ * second pass.  Everything is iterative, since heaps hold lists that are
+ * millions of objects deep.
+ *
+ * The big arrays come from graphAlloc(), which maps temp files instead
+ * of allocating once the memory budget (-M) has been used, so a graph
+ * bigger than the budget is paged by the kernel instead of failing.
+ */
+#define kNoNode             UINT32_MAX
+#define kMaxGraphArrays     24
+
+/*
+ * The instance fields a class declares (not its superclass's), as
+ * indices into HeapGraph.fieldTypes.
+ */
+typedef struct {
+    uint32_t superId;
+    uint32_t fieldStart;
+    uint16_t numFields;
+} ClassLayout;
+
+typedef struct {
+    void* ptr;
+    size_t size;
+    int mapped;
+} GraphArray;
+
+typedef struct {
+    /* memory */
+    size_t budget;
+    size_t allocated;           /* not counting mapped arrays */
+    GraphArray arrays[kMaxGraphArrays];
+
+    /* from the first pass */
+    ClassHistogram names;       /* (only the strings and classes) */
+    IdMap layoutMap;            /* class id -> index in layouts[] */
+    ClassLayout* layouts;
+    size_t numLayouts;
+    size_t maxLayouts;
+    unsigned char* fieldTypes;
+    size_t numFieldTypes;
+    size_t maxFieldTypes;
+    uint32_t* roots;            /* object ids */
+    size_t numRoots;
+    size_t maxRoots;
+    uint64_t maxNodes;          /* including node 0 */
+    uint64_t maxRefs;
+
+    /* from the second pass, indexed by node */
+    uint32_t numNodes;
+    uint32_t* nodeIds;
+    uint32_t* nodeClass;        /* class id, or basic type of an array */
+    unsigned char* nodeKind;    /* 1.0.2 sub-record tag */
+    uint32_t* shallow;
+    uint32_t* refStart;
+    uint32_t* refs;             /* ids until graphResolve(), then nodes */
+} HeapGraph;
+
+/*
+ * Allocate a zeroed array.  Past the budget, the array is a mapping of
+ * an unlinked temp file.
+ */
+static void* graphAlloc(HeapGraph* pGraph, size_t size)
+{
+    GraphArray* pArray = NULL;
+    int i;
+
+    for (i = 0; i < kMaxGraphArrays; i++) {
+        if (pGraph->arrays[i].ptr == NULL) {
+            pArray = &pGraph->arrays[i];
+            break;
+        }
+    }
+    assert(pArray != NULL);
+    if (size == 0)
+        size = 1;
+
+#ifdef HAVE_MMAP_IO
+    int inBudget = (pGraph->allocated + size <= pGraph->budget);
+#else
+    int inBudget = TRUE;        /* (there's nothing to page to) */
+#endif
+    if (inBudget) {
+        pArray->ptr = bufCalloc(size);
+        if (pArray->ptr != NULL) {
+            pArray->size = size;
+            pArray->mapped = FALSE;
+            pGraph->allocated += size;
+            return pArray->ptr;
+        }
+    }
+
+#ifdef HAVE_MMAP_IO
+    FILE* fp = tmpfile();
+    if (fp != NULL) {
+        void* ptr = MAP_FAILED;
+        if (ftruncate(fileno(fp), size) == 0) {
+            ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fileno(fp), 0);
+        }
+        fclose(fp);
+        if (ptr != MAP_FAILED) {
+            pArray->ptr = ptr;
+            pArray->size = size;
+            pArray->mapped = TRUE;
+            return ptr;
+        }
+    }
+#endif
+
+    fprintf(stderr, "ERROR: unable to allocate %zu bytes for the graph\n",
+        size);
+    return NULL;
+}
+
+static void graphFreeArray(HeapGraph* pGraph, void* ptr)
+{
+    int i;
+
+    if (ptr == NULL)
+        return;
+    for (i = 0; i < kMaxGraphArrays; i++) {
+        GraphArray* pArray = &pGraph->arrays[i];
+        if (pArray->ptr != ptr)
+            continue;
+#ifdef HAVE_MMAP_IO
+        if (pArray->mapped) {
+            munmap(pArray->ptr, pArray->size);
+        } else
+#endif
+        {
+            bufFree(pArray->ptr, pArray->size);
+            pGraph->allocated -= pArray->size;
+        }
+        memset(pArray, 0, sizeof(*pArray));
+        return;
+    }
+    assert(FALSE);
+}
+
+/*
+ * Default budget: half of physical memory, if we can tell.
+ */
+static size_t graphDefaultBudget(void)
+{
+#if defined(_SC_PHYS_PAGES) && defined(_SC_PAGESIZE)
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pages > 0 && pageSize > 0
+            && (uint64_t) pages * pageSize / 2 < SIZE_MAX)
+        return (size_t) ((uint64_t) pages * pageSize / 2);
+#endif
+    return SIZE_MAX;
+}
+
+static int graphAddRoot(HeapGraph* pGraph, uint32_t id)
+{
+    if (pGraph->numRoots == pGraph->maxRoots) {
+        size_t newMax = (pGraph->maxRoots == 0) ? 1024 : pGraph->maxRoots * 2;
+        uint32_t* newRoots = (uint32_t*) realloc(pGraph->roots,
+            newMax * sizeof(uint32_t));
+        if (newRoots == NULL) {
+            fprintf(stderr, "ERROR: unable to allocate root list\n");
+            return -1;
+        }
+        pGraph->roots = newRoots;
+        pGraph->maxRoots = newMax;
+    }
+    pGraph->roots[pGraph->numRoots++] = id;
+    return 0;
+}
+
+/*
+ * Record the layout of the class dump in "buf", and count the
+ * references it holds in static fields.
+ */
+static int graphAddLayout(HeapGraph* pGraph, const unsigned char* buf)
+{
+    const unsigned char* ptr = buf + 1 + kIdentSize * 7 + 8;
+    uint32_t classId = get4BE(buf + 1);
+    uint16_t count;
+    int i;
+
+    /* constant pool */
+    count = get2BE(ptr);
+    ptr += 2;
+    for (i = 0; i < count; i++)
+        ptr += 2 + 1 + computeBasicLen((HprofBasicType) ptr[2]);
+
+    /* static fields, plus the class loader */
+    count = get2BE(ptr);
+    ptr += 2;
+    for (i = 0; i < count; i++) {
+        if (ptr[kIdentSize] == HPROF_BASIC_OBJECT)
+            pGraph->maxRefs++;
+        ptr += kIdentSize + 1
+            + computeBasicLen((HprofBasicType) ptr[kIdentSize]);
+    }
+    pGraph->maxRefs++;
+
+    /* instance fields */
+    count = get2BE(ptr);
+    ptr += 2;
+    if (pGraph->numFieldTypes + count > pGraph->maxFieldTypes) {
+        size_t newMax = (pGraph->maxFieldTypes == 0)
+            ? 4096 : pGraph->maxFieldTypes * 2;
+        while (newMax < pGraph->numFieldTypes + count)
+            newMax *= 2;
+        unsigned char* newTypes = (unsigned char*) realloc(pGraph->fieldTypes,
+            newMax);
+        if (newTypes == NULL) {
+            fprintf(stderr, "ERROR: unable to allocate field list\n");
+            return -1;
+        }
+        pGraph->fieldTypes = newTypes;
+        pGraph->maxFieldTypes = newMax;
+    }
+    if (pGraph->numLayouts == pGraph->maxLayouts) {
+        size_t newMax = (pGraph->maxLayouts == 0) ? 1024 : pGraph->maxLayouts * 2;
+        ClassLayout* newLayouts = (ClassLayout*) realloc(pGraph->layouts,
+            newMax * sizeof(ClassLayout));
+        if (newLayouts == NULL) {
+            fprintf(stderr, "ERROR: unable to allocate class list\n");
+            return -1;
+        }
+        pGraph->layouts = newLayouts;
+        pGraph->maxLayouts = newMax;
+    }
+
+    ClassLayout* pLayout = &pGraph->layouts[pGraph->numLayouts];
+    pLayout->superId = get4BE(buf + 1 + kIdentSize + 4);
+    pLayout->fieldStart = pGraph->numFieldTypes;
+    pLayout->numFields = count;
+    for (i = 0; i < count; i++) {
+        pGraph->fieldTypes[pGraph->numFieldTypes++] = ptr[kIdentSize];
+        ptr += kIdentSize + 1;
+    }
+    return idMapPut(&pGraph->layoutMap, classId, pGraph->numLayouts++);
+}
+
+static inline void graphAddRef(HeapGraph* pGraph, uint32_t id)
+{
+    /* (the first pass bounded the count) */
+    if (id != 0)
+        pGraph->refs[pGraph->refStart[pGraph->numNodes]++] = id;
+}
+
+/*
+ * Start the next node.  Its references are added after it, and
+ * refStart[] is shifted into place once they've all been added.
+ */
+static int graphAddNode(HeapGraph* pGraph, unsigned char kind, uint32_t id,
+    uint32_t classId, uint64_t shallow)
+{
+    uint32_t node = pGraph->numNodes + 1;
+
+    if (node >= pGraph->maxNodes) {
+        fprintf(stderr, "ERROR: heap dump changed between passes\n");
+        return -1;
+    }
+    pGraph->refStart[node] = pGraph->refStart[node - 1];
+    pGraph->numNodes = node;
+    pGraph->nodeIds[node] = id;
+    pGraph->nodeClass[node] = classId;
+    pGraph->nodeKind[node] = kind;
+    pGraph->shallow[node] = (shallow > UINT32_MAX) ? UINT32_MAX : shallow;
+    return 0;
+}
+
+/*
+ * Add the references of the class dump in "buf": the static fields
+ * that hold objects, and the class loader.  Returns the size of the
+ * static field values.
+ */
+static uint64_t graphAddClassRefs(HeapGraph* pGraph, const unsigned char* buf)
+{
+    const unsigned char* ptr = buf + 1 + kIdentSize * 7 + 8;
+    uint64_t size = 0;
+    uint16_t count;
+    int i;
+
+    graphAddRef(pGraph, get4BE(buf + 1 + kIdentSize * 2 + 4));
+
+    count = get2BE(ptr);
+    ptr += 2;
+    for (i = 0; i < count; i++)
+        ptr += 2 + 1 + computeBasicLen((HprofBasicType) ptr[2]);
+
+    count = get2BE(ptr);
+    ptr += 2;
+    for (i = 0; i < count; i++) {
+        int len = computeBasicLen((HprofBasicType) ptr[kIdentSize]);
+        if (ptr[kIdentSize] == HPROF_BASIC_OBJECT)
+            graphAddRef(pGraph, get4BE(ptr + kIdentSize + 1));
+        size += len;
+        ptr += kIdentSize + 1 + len;
+    }
+    return size;
+}
+
+/*
+ * Add the references in the field values of an instance of "classId",
+ * walking up through its superclasses.
+ */
+static void graphAddInstanceRefs(HeapGraph* pGraph, uint32_t classId,
+    const unsigned char* data, uint32_t dataLen)
+{
+    uint32_t pos = 0;
+    size_t depth = 0;
+    uint32_t idx;
+
+    while (classId != 0 && depth++ <= pGraph->numLayouts
+            && idMapGet(&pGraph->layoutMap, classId, &idx)) {
+        const ClassLayout* pLayout = &pGraph->layouts[idx];
+        const unsigned char* types = pGraph->fieldTypes + pLayout->fieldStart;
+        int i;
+
+        for (i = 0; i < pLayout->numFields; i++) {
+            int len = computeBasicLen((HprofBasicType) types[i]);
+            if (len < 0 || pos + len > dataLen)
+                return;
+            if (types[i] == HPROF_BASIC_OBJECT)
+                graphAddRef(pGraph, get4BE(data + pos));
+            pos += len;
+        }
+        classId = pLayout->superId;
+    }
+}
+
+/*
+ * Get the length of a GC root sub-record, not counting the tag, or -1 if
+ * "subType" isn't a root.
+ */
+static int64_t graphRootLen(unsigned char subType)
+{
+    switch (subType) {
+    case HPROF_ROOT_UNKNOWN:
+    case HPROF_ROOT_STICKY_CLASS:
+    case HPROF_ROOT_MONITOR_USED:
+    case HPROF_ROOT_INTERNED_STRING:
+    case HPROF_ROOT_FINALIZING:
+    case HPROF_ROOT_DEBUGGER:
+    case HPROF_ROOT_REFERENCE_CLEANUP:
+    case HPROF_ROOT_VM_INTERNAL:
+        return kIdentSize;
+    case HPROF_ROOT_JNI_GLOBAL:
+        return kIdentSize * 2;
+    case HPROF_ROOT_NATIVE_STACK:
+    case HPROF_ROOT_THREAD_BLOCK:
+        return kIdentSize + 4;
+    case HPROF_ROOT_JNI_LOCAL:
+    case HPROF_ROOT_JAVA_FRAME:
+    case HPROF_ROOT_THREAD_OBJECT:
+    case HPROF_ROOT_JNI_MONITOR:
+        return kIdentSize + 8;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * Walk the sub-records of a heap dump record.  The first pass notes
+ * layouts and roots and counts; the second adds nodes and references.
+ */
+static int graphScanHeapDump(HprofReader* pReader, HeapGraph* pGraph,
+    int pass)
+{
+    while (rdLeft(pReader) > 0) {
+        unsigned char* buf = rdFill(pReader, 1);
+        if (buf == NULL)
+            return -1;
+
+        unsigned char subType = buf[0];
+        int64_t subLen;
+        uint32_t count;
+
+        switch (subType) {
+        case HPROF_UNREACHABLE:
+            subLen = kIdentSize;
+            break;
+        case HPROF_HEAP_DUMP_INFO:
+            subLen = kIdentSize + 4;
+            break;
+
+        case HPROF_CLASS_DUMP:
+            if ((buf = rdFillClassDump(pReader, &subLen)) == NULL)
+                return -1;
+            if (pass == 1) {
+                pGraph->maxNodes++;
+                if (graphAddLayout(pGraph, buf) != 0
+                        || graphAddRoot(pGraph, get4BE(buf + 1)) != 0)
+                    return -1;
+            } else {
+                if (graphAddNode(pGraph, subType, get4BE(buf + 1), 0, 0) != 0)
+                    return -1;
+                pGraph->shallow[pGraph->numNodes] =
+                    graphAddClassRefs(pGraph, buf);
+            }
+            break;
+
+        case HPROF_INSTANCE_DUMP:
+            if ((buf = rdFill(pReader, 1 + kIdentSize * 2 + 8)) == NULL)
+                return -1;
+            subLen = computeInstanceDumpLen(buf+1, 0);
+            count = get4BE(buf + 1 + kIdentSize * 2 + 4);
+            if (pass == 1) {
+                pGraph->maxNodes++;
+                pGraph->maxRefs += count / kIdentSize;
+                break;
+            }
+            if (1 + subLen > kWindowSize) {
+                fprintf(stderr, "ERROR: instance with %u bytes of fields\n",
+                    count);
+                return -1;
+            }
+            if ((buf = rdFill(pReader, 1 + subLen)) == NULL
+                    || graphAddNode(pGraph, subType, get4BE(buf + 1),
+                        get4BE(buf + 1 + kIdentSize + 4), count) != 0)
+                return -1;
+            graphAddInstanceRefs(pGraph, get4BE(buf + 1 + kIdentSize + 4),
+                buf + 1 + kIdentSize * 2 + 8, count);
+            break;
+
+        case HPROF_OBJECT_ARRAY_DUMP:
+            if ((buf = rdFill(pReader, 1 + kIdentSize * 2 + 8)) == NULL)
+                return -1;
+            subLen = computeObjectArrayDumpLen(buf+1, 0);
+            count = get4BE(buf + 1 + kIdentSize + 4);
+            if (pass == 1) {
+                pGraph->maxNodes++;
+                pGraph->maxRefs += count;
+                break;
+            }
+            if (graphAddNode(pGraph, subType, get4BE(buf + 1),
+                    get4BE(buf + 1 + kIdentSize + 8),
+                    (uint64_t) count * kIdentSize) != 0)
+                return -1;
+
+            /* the elements can be far bigger than the window */
+            pReader->pos += 1 + kIdentSize * 2 + 8;
+            while (count > 0) {
+                uint32_t chunk = kWindowSize / kIdentSize;
+                uint32_t i;
+                if (chunk > count)
+                    chunk = count;
+                if ((buf = rdFill(pReader, chunk * kIdentSize)) == NULL)
+                    return -1;
+                for (i = 0; i < chunk; i++)
+                    graphAddRef(pGraph, get4BE(buf + i * kIdentSize));
+                pReader->pos += chunk * kIdentSize;
+                count -= chunk;
+            }
+            continue;
+
+        case HPROF_PRIMITIVE_ARRAY_DUMP:
+        case HPROF_PRIMITIVE_ARRAY_NODATA_DUMP:
+            if ((buf = rdFill(pReader, 1 + kIdentSize + 9)) == NULL)
+                return -1;
+            if (subType == HPROF_PRIMITIVE_ARRAY_DUMP)
+                subLen = computePrimitiveArrayDumpLen(buf+1, 0);
+            else
+                subLen = kIdentSize + 9;
+            count = get4BE(buf + 1 + kIdentSize + 4);
+            if (subLen < 0) {
+                fprintf(stderr, "ERROR: invalid basicType %d\n",
+                    buf[1 + kIdentSize + 8]);
+                return -1;
+            }
+            if (pass == 1) {
+                pGraph->maxNodes++;
+            } else if (graphAddNode(pGraph, HPROF_PRIMITIVE_ARRAY_DUMP,
+                    get4BE(buf + 1), buf[1 + kIdentSize + 8],
+                    (uint64_t) count
+                        * computeBasicLen((HprofBasicType) buf[1 + kIdentSize + 8]))
+                    != 0) {
+                return -1;
+            }
+            break;
+
+        default:
+            subLen = graphRootLen(subType);
+            if (subLen < 0) {
+                fprintf(stderr, "ERROR: unexpected subtype 0x%02x with %"
+                    PRIu64 " bytes left in record\n", subType, rdLeft(pReader));
+                return -1;
+            }
+            if ((buf = rdFill(pReader, 1 + kIdentSize)) == NULL)
+                return -1;
+            if (pass == 1 && graphAddRoot(pGraph, get4BE(buf + 1)) != 0)
+                return -1;
+            break;
+        }
+
+        if (transferData(pReader, NULL, 1 + subLen, FALSE) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read the records that follow the file header, for one pass.
+ */
+static int graphScanRecords(HprofReader* pReader, HeapGraph* pGraph, int pass)
+{
+    ClassHistogram* pNames = &pGraph->names;
+    unsigned char* buf;
+
+    while (1) {
+        unsigned char hdr[kRecHdrLen];
+        int status = rdReadHeader(pReader, hdr);
+
+        if (status < 0)
+            return -1;
+        if (status == 0)
+            break;
+
+        unsigned char type = hdr[0];
+        uint32_t length = get4BE(hdr + 5);
+
+        if (rdStartRecord(pReader, length) != 0)
+            return -1;
+
+        if (pass == 1 && type == HPROF_TAG_STRING) {
+            size_t nameLen = length - kIdentSize;
+            if (length < kIdentSize) {
+                fprintf(stderr, "ERROR: bad STRING record\n");
+                return -1;
+            }
+            if (nameLen > kMaxNameLen)
+                nameLen = kMaxNameLen;
+            if ((buf = rdFill(pReader, kIdentSize + nameLen)) == NULL
+                    || histoAddString(pNames, get4BE(buf), buf + kIdentSize,
+                        nameLen) != 0)
+                return -1;
+        } else if (pass == 1 && type == HPROF_TAG_LOAD_CLASS) {
+            if (length < 8 + kIdentSize * 2) {
+                fprintf(stderr, "ERROR: bad LOAD_CLASS record\n");
+                return -1;
+            }
+            if ((buf = rdFill(pReader, 8 + kIdentSize * 2)) == NULL
+                    || idMapPut(&pNames->classes, get4BE(buf + 4),
+                        get4BE(buf + 8 + kIdentSize)) != 0)
+                return -1;
+        } else if (isHeapDump(type)) {
+            if (graphScanHeapDump(pReader, pGraph, pass) != 0)
+                return -1;
+        }
+
+        if (transferData(pReader, NULL, rdLeft(pReader), FALSE) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Size the node and reference arrays from the first pass, and make the
+ * roots the references of node 0.
+ */
+static int graphAllocNodes(HeapGraph* pGraph)
+{
+    uint64_t maxRefs = pGraph->maxRefs + pGraph->numRoots;
+    size_t i;
+
+    pGraph->maxNodes++;
+    if (pGraph->maxNodes >= kNoNode || maxRefs >= UINT32_MAX) {
+        fprintf(stderr, "ERROR: too many objects (%" PRIu64
+            ") or references (%" PRIu64 ")\n", pGraph->maxNodes, maxRefs);
+        return -1;
+    }
+
+    pGraph->nodeIds = (uint32_t*) graphAlloc(pGraph,
+        pGraph->maxNodes * sizeof(uint32_t));
+    pGraph->nodeClass = (uint32_t*) graphAlloc(pGraph,
+        pGraph->maxNodes * sizeof(uint32_t));
+    pGraph->nodeKind = (unsigned char*) graphAlloc(pGraph, pGraph->maxNodes);
+    pGraph->shallow = (uint32_t*) graphAlloc(pGraph,
+        pGraph->maxNodes * sizeof(uint32_t));
+    pGraph->refStart = (uint32_t*) graphAlloc(pGraph,
+        (pGraph->maxNodes + 1) * sizeof(uint32_t));
+    pGraph->refs = (uint32_t*) graphAlloc(pGraph, maxRefs * sizeof(uint32_t));
+    if (pGraph->nodeIds == NULL || pGraph->nodeClass == NULL
+            || pGraph->nodeKind == NULL || pGraph->shallow == NULL
+            || pGraph->refStart == NULL || pGraph->refs == NULL)
+        return -1;
+
+    pGraph->numNodes = 0;
+    for (i = 0; i < pGraph->numRoots; i++)
+        graphAddRef(pGraph, pGraph->roots[i]);
+    return 0;
+}
+
+static int compareU64(const void* a, const void* b)
+{
+    uint64_t valA = *(const uint64_t*) a;
+    uint64_t valB = *(const uint64_t*) b;
+    return (valA < valB) ? -1 : (valA > valB);
+}
+
+/*
+ * Turn the references from object ids into node numbers, dropping any
+ * to objects that aren't in the dump.
+ */
+static int graphResolve(HeapGraph* pGraph)
+{
+    uint32_t numNodes = pGraph->numNodes + 1;
+    uint64_t* lookup;
+    uint32_t node, out = 0;
+
+    /* shift refStart[] so it holds starts rather than ends */
+    memmove(pGraph->refStart + 1, pGraph->refStart,
+        numNodes * sizeof(uint32_t));
+    pGraph->refStart[0] = 0;
+
+    /* (id << 32 | node), sorted */
+    lookup = (uint64_t*) graphAlloc(pGraph, numNodes * sizeof(uint64_t));
+    if (lookup == NULL)
+        return -1;
+    for (node = 1; node < numNodes; node++)
+        lookup[node - 1] = (uint64_t) pGraph->nodeIds[node] << 32 | node;
+    qsort(lookup, numNodes - 1, sizeof(uint64_t), compareU64);
+
+    for (node = 0; node < numNodes; node++) {
+        uint32_t start = pGraph->refStart[node];
+        uint32_t end = pGraph->refStart[node + 1];
+        uint32_t i;
+
+        pGraph->refStart[node] = out;
+        for (i = start; i < end; i++) {
+            uint64_t key = (uint64_t) pGraph->refs[i] << 32;
+            size_t lo = 0, hi = numNodes - 1;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (lookup[mid] < key)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if (lo < numNodes - 1 && (lookup[lo] >> 32) == pGraph->refs[i])
+                pGraph->refs[out++] = (uint32_t) lookup[lo];
+        }
+    }
+    pGraph->refStart[numNodes] = out;
+
+    graphFreeArray(pGraph, lookup);
+    return 0;
+}
+
+/*
+ * Find each reachable node's immediate dominator.  On success "*pOrder"
+ * lists the "*pNumReached" reachable nodes in DFS preorder, starting
+ * with node 0, and "*pIdom" holds, for each position in that order, the
+ * position of its immediate dominator.  The references are freed.
+ */
+static int graphDominators(HeapGraph* pGraph, uint32_t** pOrder,
+    uint32_t** pIdom, uint32_t* pNumReached)
+{
+    uint32_t numNodes = pGraph->numNodes + 1;
+    uint32_t numRefs = pGraph->refStart[numNodes];
+    uint32_t *predStart = NULL, *preds = NULL, *dfn = NULL, *order = NULL;
+    uint32_t *parent = NULL, *work = NULL, *cursor = NULL;
+    uint32_t *semi = NULL, *label = NULL, *ancestor = NULL;
+    uint32_t node, n, i;
+    int result = -1;
+
+    /* predecessors, by counting sort on the target */
+    predStart = (uint32_t*) graphAlloc(pGraph,
+        (numNodes + 1) * sizeof(uint32_t));
+    preds = (uint32_t*) graphAlloc(pGraph, numRefs * sizeof(uint32_t));
+    if (predStart == NULL || preds == NULL)
+        goto bail;
+    for (i = 0; i < numRefs; i++)
+        predStart[pGraph->refs[i] + 1]++;
+    for (node = 0; node < numNodes; node++)
+        predStart[node + 1] += predStart[node];
+    for (node = 0; node < numNodes; node++) {
+        for (i = pGraph->refStart[node]; i < pGraph->refStart[node + 1]; i++)
+            preds[predStart[pGraph->refs[i]]++] = node;
+    }
+    memmove(predStart + 1, predStart, numNodes * sizeof(uint32_t));
+    predStart[0] = 0;
+
+    /* depth-first search from node 0 */
+    dfn = (uint32_t*) graphAlloc(pGraph, numNodes * sizeof(uint32_t));
+    order = (uint32_t*) graphAlloc(pGraph, numNodes * sizeof(uint32_t));
+    parent = (uint32_t*) graphAlloc(pGraph, numNodes * sizeof(uint32_t));
+    work = (uint32_t*) graphAlloc(pGraph, numNodes * sizeof(uint32_t));
+    cursor = (uint32_t*) graphAlloc(pGraph, numNodes * sizeof(uint32_t));
+    if (dfn == NULL || order == NULL || parent == NULL || work == NULL
+            || cursor == NULL)
+        goto bail;
+    memset(dfn, 0xff, numNodes * sizeof(uint32_t));
+
+    uint32_t depth = 1;
+    dfn[0] = 0;
+    order[0] = 0;
+    work[0] = 0;
+    cursor[0] = pGraph->refStart[0];
+    n = 1;
+    while (depth > 0) {
+        uint32_t v = work[depth - 1];
+        if (cursor[depth - 1] == pGraph->refStart[v + 1]) {
+            depth--;
+            continue;
+        }
+        uint32_t w = pGraph->refs[cursor[depth - 1]++];
+        if (dfn[w] != kNoNode)
+            continue;
+        dfn[w] = n;
+        order[n] = w;
+        parent[n] = dfn[v];
+        n++;
+        work[depth] = w;
+        cursor[depth] = pGraph->refStart[w];
+        depth++;
+    }
+
+    graphFreeArray(pGraph, cursor);
+    cursor = NULL;
+    graphFreeArray(pGraph, pGraph->refs);
+    pGraph->refs = NULL;
+    graphFreeArray(pGraph, pGraph->refStart);
+    pGraph->refStart = NULL;
+
+    /*
+     * Semidominators, in reverse preorder.  The link-eval forest is
+     * kept in "ancestor" and "label" with path compression; everything
+     * here is indexed by preorder number.
+     */
+    semi = (uint32_t*) graphAlloc(pGraph, n * sizeof(uint32_t));
+    label = (uint32_t*) graphAlloc(pGraph, n * sizeof(uint32_t));
+    ancestor = (uint32_t*) graphAlloc(pGraph, n * sizeof(uint32_t));
+    if (semi == NULL || label == NULL || ancestor == NULL)
+        goto bail;
+    for (i = 0; i < n; i++) {
+        semi[i] = label[i] = i;
+        ancestor[i] = kNoNode;
+    }
+
+    for (i = n - 1; i > 0; i--) {
+        uint32_t v = order[i];
+        uint32_t p;
+
+        for (p = predStart[v]; p < predStart[v + 1]; p++) {
+            uint32_t u = dfn[preds[p]];
+            if (u == kNoNode)
+                continue;
+
+            /* eval(u) */
+            if (ancestor[u] != kNoNode) {
+                uint32_t x = u;
+                depth = 0;
+                while (ancestor[ancestor[x]] != kNoNode) {
+                    work[depth++] = x;
+                    x = ancestor[x];
+                }
+                while (depth > 0) {
+                    x = work[--depth];
+                    uint32_t a = ancestor[x];
+                    if (semi[label[a]] < semi[label[x]])
+                        label[x] = label[a];
+                    ancestor[x] = ancestor[a];
+                }
+                u = label[u];
+            }
+            if (semi[u] < semi[i])
+                semi[i] = semi[u];
+        }
+        ancestor[i] = parent[i];
+    }
+
+    /* the immediate dominator is the nearest ancestor at or above "semi" */
+    uint32_t* idom = parent;
+    for (i = 1; i < n; i++) {
+        uint32_t j = idom[i];
+        while (j > semi[i])
+            j = idom[j];
+        idom[i] = j;
+    }
+
+    *pOrder = order;
+    *pIdom = idom;
+    *pNumReached = n;
+    order = parent = NULL;
+    result = 0;
+
+bail:
+    graphFreeArray(pGraph, predStart);
+    graphFreeArray(pGraph, preds);
+    graphFreeArray(pGraph, dfn);
+    graphFreeArray(pGraph, order);
+    graphFreeArray(pGraph, parent);
+    graphFreeArray(pGraph, work);
+    graphFreeArray(pGraph, cursor);
+    graphFreeArray(pGraph, semi);
+    graphFreeArray(pGraph, label);
+    graphFreeArray(pGraph, ancestor);
+    return result;
+}
+
+/*
+ * Print the name of a node, e.g. "java.lang.String@0x12c04d38".
+ */
+static void graphPrintNode(const HeapGraph* pGraph, uint32_t node, FILE* out)
+{
+    const char* name;
+
+    switch (pGraph->nodeKind[node]) {
+    case HPROF_CLASS_DUMP:
+        name = histoClassName(&pGraph->names, pGraph->nodeIds[node]);
+        fprintf(out, "class %s", (name != NULL) ? name : "?");
+        break;
+    case HPROF_PRIMITIVE_ARRAY_DUMP:
+        fprintf(out, "%s",
+            primitiveArrayName((HprofBasicType) pGraph->nodeClass[node]));
+        break;
+    default:
+        name = histoClassName(&pGraph->names, pGraph->nodeClass[node]);
+        if (name != NULL)
+            fprintf(out, "%s", name);
+        else
+            fprintf(out, "class@0x%08x", pGraph->nodeClass[node]);
+        break;
+    }
+    fprintf(out, "@0x%08x\n", pGraph->nodeIds[node]);
+}
+
+/*
+ * Compute the retained sizes and print the "topCount" biggest.
+ */
+static int graphPrintRetained(HeapGraph* pGraph, uint32_t* order,
+    uint32_t* idom, uint32_t numReached, uint32_t topCount, FILE* out)
+{
+    uint64_t* retained;
+    uint32_t* top;
+    uint32_t numTop = 0;
+    uint64_t totalShallow = 0;
+    uint32_t i;
+
+    retained = (uint64_t*) graphAlloc(pGraph, numReached * sizeof(uint64_t));
+    top = (uint32_t*) graphAlloc(pGraph,
+        (topCount + 1) * sizeof(uint32_t));
+    if (retained == NULL || top == NULL)
+        return -1;
+
+    /* dominators come before what they dominate in preorder */
+    for (i = 0; i < numReached; i++)
+        retained[i] = pGraph->shallow[order[i]];
+    for (i = numReached - 1; i > 0; i--)
+        retained[idom[i]] += retained[i];
+    for (i = 1; i <= pGraph->numNodes; i++)
+        totalShallow += pGraph->shallow[i];
+
+    /* keep the biggest in a min-heap */
+    for (i = 1; i < numReached && topCount > 0; i++) {
+        uint32_t pos;
+        if (numTop == topCount) {
+            if (retained[i] <= retained[top[0]])
+                continue;
+            pos = 0;
+            while (1) {
+                uint32_t child = pos * 2 + 1;
+                if (child >= numTop)
+                    break;
+                if (child + 1 < numTop
+                        && retained[top[child + 1]] < retained[top[child]])
+                    child++;
+                if (retained[top[child]] >= retained[i])
+                    break;
+                top[pos] = top[child];
+                pos = child;
+            }
+        } else {
+            pos = numTop++;
+            while (pos > 0 && retained[top[(pos - 1) / 2]] > retained[i]) {
+                top[pos] = top[(pos - 1) / 2];
+                pos = (pos - 1) / 2;
+            }
+        }
+        top[pos] = i;
+    }
+
+    /* heapsort them, biggest first */
+    uint32_t count = numTop;
+    while (numTop > 0) {
+        uint32_t last = top[--numTop];
+        uint32_t smallest = top[0];
+        uint32_t pos = 0;
+        while (1) {
+            uint32_t child = pos * 2 + 1;
+            if (child >= numTop)
+                break;
+            if (child + 1 < numTop
+                    && retained[top[child + 1]] < retained[top[child]])
+                child++;
+            if (retained[top[child]] >= retained[last])
+                break;
+            top[pos] = top[child];
+            pos = child;
+        }
+        top[pos] = last;
+        top[numTop] = smallest;
+    }
+
+    fprintf(out, "Objects: %u (%u reachable), bytes: %" PRIu64 " (%" PRIu64
+        " reachable)\n", pGraph->numNodes, numReached - 1, totalShallow,
+        retained[0]);
+    fprintf(out, "%14s %14s  %s\n", "retained", "shallow", "object");
+    for (i = 0; i < count; i++) {
+        uint32_t node = order[top[i]];
+        fprintf(out, "%14" PRIu64 " %14u  ", retained[top[i]],
+            pGraph->shallow[node]);
+        graphPrintNode(pGraph, node, out);
+    }
+
+    graphFreeArray(pGraph, retained);
+    graphFreeArray(pGraph, top);
+    if (ferror(out)) {
+        fprintf(stderr, "ERROR: failed writing retained sizes\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void graphFree(HeapGraph* pGraph)
+{
+    int i;
+
+    for (i = 0; i < kMaxGraphArrays; i++)
+        graphFreeArray(pGraph, pGraph->arrays[i].ptr);
+    histoFree(&pGraph->names);
+    idMapFree(&pGraph->layoutMap);
+    free(pGraph->layouts);
+    free(pGraph->fieldTypes);
+    free(pGraph->roots);
+}
+
+/*
+ * Print the "topCount" objects of an hprof data file with the biggest
+ * retained sizes.  The input must be seekable, since it's read twice.
+ */
+static int retainedData(FILE* in, FILE* out, int flags, uint32_t topCount,
+    size_t budget)
+{
+    ExpandBuf* pBuf;
+    HprofReader reader;
+    GzInput* pGz = NULL;
+    HeapGraph graph;
+    uint32_t* order = NULL;
+    uint32_t* idom = NULL;
+    uint32_t numReached;
+    int64_t start;
+    int result = -1;
+
+    memset(&reader, 0, sizeof(reader));
+    memset(&graph, 0, sizeof(graph));
+    graph.budget = budget;
+
+    pBuf = ebAlloc();
+    if (pBuf == NULL || startInput(in, &reader, &pGz, pBuf) != 0)
+        goto bail;
+    if (reader.map == NULL && !reader.seekable) {
+        fprintf(stderr, "ERROR: -r reads the input twice, so it must be an uncompressed file\n");
+        goto bail;
+    }
+
+    start = rdTell(&reader);
+    if (graphScanRecords(&reader, &graph, 1) != 0
+            || graphAllocNodes(&graph) != 0
+            || rdSeek(&reader, start) != 0
+            || graphScanRecords(&reader, &graph, 2) != 0
+            || graphResolve(&graph) != 0
+            || graphDominators(&graph, &order, &idom, &numReached) != 0)
+        goto bail;
+
+    result = graphPrintRetained(&graph, order, idom, numReached, topCount,
+        out);
+
+bail:
+    if ((flags & kFlagStats) != 0) {
+        fprintf(stderr, "hprof-conv: peak buffer size %zu bytes, %u allocations\n",
+            gBufferStats.peakSize, gBufferStats.allocCount);
+    }
+
+    graphFree(&graph);
+    rdFree(&reader);
+    gzStop(pGz);
+    ebFree(pBuf);
+    return result;
+}
+
+static FILE* fopen_or_default(const char* path, const char* mode, FILE* def) {
+    if (!strcmp(path, "-")) {
+        return def;
+    } else {
         return fopen(path, mode);
     }
 }
@@ -709,16 +4280,71 @@ static FILE* fopen_or_default(const char* path, const char* mode, FILE* def) {
 int main(int argc, char** argv)
 {
     FILE* in = NULL;
+    FILE* newIn = NULL;
     FILE* out = NULL;
+    FILE* indexOut = NULL;
+    const char* indexPath = NULL;
+    uint32_t topCount = 0;
+    size_t budget = 0;
     int flags = 0;
+    int numThreads = 1;
+    int gzipSuffix = FALSE;
     int res = 1;
 
+    gFilter.keepHeaps = (1U << kNumHeaps) - 1;
+
     int opt;
-    while ((opt = getopt(argc, argv, "z")) != -1) {
+    while ((opt = getopt(argc, argv, "c:dHi:j:k:M:Pr:szuZ")) != -1) {
         switch (opt) {
+            case 'c':
+                if (strlen(optarg) > kMaxNameLen || filterAddClass(optarg) != 0)
+                    goto usage;
+                break;
+            case 'd':
+                flags |= kFlagDiff;
+                break;
+            case 'H':
+                flags |= kFlagHistogram;
+                break;
+            case 'i':
+                indexPath = optarg;
+                break;
+            case 'j':
+                numThreads = atoi(optarg);
+                if (numThreads < 1)
+                    goto usage;
+                break;
+            case 'k':
+                if (filterParseHeaps(optarg) != 0)
+                    goto usage;
+                break;
+            case 'M':
+                budget = strtoul(optarg, NULL, 10);
+                if (budget == 0 || budget > SIZE_MAX / (1024 * 1024))
+                    goto usage;
+                budget *= 1024 * 1024;
+                break;
+            case 'P':
+                gFilter.stripPrimitives = TRUE;
+                break;
+            case 'r':
+                topCount = strtoul(optarg, NULL, 10);
+                if (topCount == 0)
+                    goto usage;
+                flags |= kFlagRetained;
+                break;
+            case 's':
+                flags |= kFlagStats;
+                break;
+            case 'u':
+                gFilter.dropUnreachable = TRUE;
+                break;
             case 'z':
                 flags |= kFlagAppOnly;
                 break;
+            case 'Z':
+                flags |= kFlagGzipOutput;
+                break;
             case '?':
             default:
                 goto usage;
@@ -730,25 +4356,94 @@ int main(int argc, char** argv)
         char* arg = argv[i];
         if (!in) {
             in = fopen_or_default(arg, "rb", stdin);
+        } else if ((flags & kFlagDiff) != 0 && !newIn) {
+            newIn = fopen_or_default(arg, "rb", stdin);
         } else if (!out) {
             out = fopen_or_default(arg, "wb", stdout);
+            size_t len = strlen(arg);
+            gzipSuffix = (len > 3 && strcmp(arg + len - 3, ".gz") == 0);
         } else {
             goto usage;
         }
     }
 
+    /* the reports go to stdout by default */
+    if (out == NULL
+            && (flags & (kFlagHistogram | kFlagDiff | kFlagRetained)) != 0) {
+        out = stdout;
+    }
+
     if (in == NULL || out == NULL) {
         goto usage;
     }
 
-    res = filterData(in, out, flags);
+    /* the reports are always plain text */
+    if ((flags & (kFlagHistogram | kFlagDiff | kFlagRetained)) != 0) {
+        if ((flags & kFlagGzipOutput) != 0)
+            goto usage;
+    } else if (gzipSuffix) {
+        flags |= kFlagGzipOutput;
+    }
+    if ((flags & kFlagDiff) != 0) {
+        if (newIn == NULL || (flags & kFlagHistogram) != 0
+                || indexPath != NULL)
+            goto usage;
+        res = diffData(in, newIn, out, flags);
+        goto finish;
+    }
+    if ((flags & kFlagRetained) != 0) {
+        if ((flags & kFlagHistogram) != 0 || indexPath != NULL)
+            goto usage;
+        if (budget == 0)
+            budget = graphDefaultBudget();
+        res = retainedData(in, out, flags, topCount, budget);
+        goto finish;
+    }
+    if (indexPath != NULL) {
+        if ((flags & kFlagHistogram) != 0)
+            goto usage;
+        indexOut = fopen(indexPath, "wb");
+        if (indexOut == NULL) {
+            fprintf(stderr, "ERROR: unable to open %s: %s\n", indexPath,
+                strerror(errno));
+            goto finish;
+        }
+    }
+
+    res = filterData(in, out, indexOut, flags, numThreads);
     goto finish;
 
 usage:
-    fprintf(stderr, "Usage: hprof-conf [-z] infile outfile\n");
+    fprintf(stderr, "Usage: hprof-conf [-i indexfile] [-j threads] [-s] [-z] [-Z] [filters]\n");
+    fprintf(stderr, "           infile outfile\n");
+    fprintf(stderr, "       hprof-conf -H [-z] [filters] infile [outfile]\n");
+    fprintf(stderr, "       hprof-conf -d [-z] [filters] oldfile newfile [outfile]\n");
+    fprintf(stderr, "       hprof-conf -r count [-M megabytes] infile [outfile]\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "  -c: keep only instances and arrays of this class, e.g.\n");
+    fprintf(stderr, "      java.lang.String or int[] (may be repeated)\n");
+    fprintf(stderr, "  -d: print the change in instance counts and sizes per class\n");
+    fprintf(stderr, "      from oldfile to newfile, instead of converting\n");
+    fprintf(stderr, "  -H: print instance counts and sizes per class and heap\n");
+    fprintf(stderr, "      instead of converting\n");
+    fprintf(stderr, "  -i: also write an index of the objects in outfile, sorted\n");
+    fprintf(stderr, "      by id, to indexfile\n");
+    fprintf(stderr, "  -j: convert heap dump segments on this many threads\n");
+    fprintf(stderr, "      (when infile is a regular file)\n");
+    fprintf(stderr, "  -k: keep only objects in these heaps, a comma-separated\n");
+    fprintf(stderr, "      list of default, app, zygote and image\n");
+    fprintf(stderr, "  -M: memory budget for -r; bigger arrays are mapped from temp\n");
+    fprintf(stderr, "      files (default: half of physical memory)\n");
+    fprintf(stderr, "  -P: strip the contents of primitive arrays\n");
+    fprintf(stderr, "  -r: print the objects with the biggest retained sizes,\n");
+    fprintf(stderr, "      instead of converting\n");
+    fprintf(stderr, "  -s: report peak buffer usage when done\n");
+    fprintf(stderr, "  -u: drop unreachable-object roots\n");
     fprintf(stderr, "  -z: exclude non-app heaps, such as Zygote\n");
+    fprintf(stderr, "  -Z: gzip the converted output (the default if outfile ends\n");
+    fprintf(stderr, "      in .gz)\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "A gzipped infile is decompressed on the fly.\n");
     fprintf(stderr, "Specify '-' for either or both files to use stdin/stdout.\n");
     fprintf(stderr, "\n");
 
@@ -764,9 +4459,14 @@ usage:
     res = 2;
 
 finish:
-    if (in != stdin)
+    filterFree();
+    if (indexOut != NULL)
+        fclose(indexOut);
+    if (newIn != NULL && newIn != stdin)
+        fclose(newIn);
+    if (in != NULL && in != stdin)
         fclose(in);
-    if (out != stdout)
+    if (out != NULL && out != stdout)
         fclose(out);
     return res;
 }